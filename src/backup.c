@@ -0,0 +1,487 @@
+/** @file
+ *
+ * Incremental hot backups.
+ *
+ * Every change to a record stamps its block with the file's generation
+ * (see `blocks_stamp_block`).  A backup advances the generation, then
+ * streams each block of the file's table that was stamped with the
+ * generation it is given or a later one, along with every other block:
+ * the file head, indexes, relations and logs are not stamped, and are
+ * small next to the table.  Passing the generation one backup returns to
+ * the next gets the blocks changed since, so a backup's cost follows the
+ * writes made since the last one rather than the size of the file.
+ *
+ * Writers carry on during a backup.  The records of a table block are
+ * read a piece at a time under a lock of the piece, so a record is never
+ * copied half-written, and the only writers kept waiting are those of the
+ * piece being read.  The blocks of indexes, relations and logs are read
+ * whole, with the locks their writers hold to change them (see
+ * `backup_hold_structures`), so they are never copied half-changed
+ * either; an index operation that finds its head held meanwhile fails
+ * with RND_LOCK_FAILED, as it would against any other writer.  A backup
+ * is not a snapshot of one moment, though: a change made while it runs
+ * may or may not be in it, but it will be in the next one.
+ *
+ * The stream is a BACKUP_HEAD followed by runs of bytes, each with its
+ * offset in the file, which `backup_apply` writes over a copy of the file
+ * made from the earlier backups.
+ */
+
+#include "backup.h"
+#include "blocks.h"
+#include "chains.h"
+#include "extra.h"
+#include "locks.h"
+#include "txn.h"
+#include "snapshot.h"
+#include "changes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>   // for offsetof()
+#include <string.h>
+#include <unistd.h>   // for read(), write(), pwrite(), ftruncate()
+
+/** Bytes of a block read under one lock and written to the stream at once. */
+#define BACKUP_PIECE (1024 * 1024)
+
+/** Times a block whose layout changes while it is read is read again. */
+#define BACKUP_TRIES 3
+
+typedef struct backup_closure {
+   RNDH     *handle;
+   int      out_fd;
+   char     pad[4];
+   char     *buffer;     /**< BACKUP_PIECE bytes                                   */
+   off_t    *table;      /**< Offsets of the blocks of the file's table, sorted    */
+   uint32_t count;
+   uint32_t allocated;
+   BLOCK_LOC *locks;     /**< Locks held to read the blocks of other structures    */
+   uint32_t lock_count;
+   char     pad2[4];
+} BACKUP_CLO;
+
+static RND_ERROR backup_write_all(RNDH *handle, int fd, const void *bytes, size_t len)
+{
+   const char *at = (const char*)bytes;
+
+   while (len)
+   {
+      ssize_t wrote = write(fd, at, len);
+      if (wrote < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         handle->sys_errno = errno;
+         return RND_SYSTEM_ERROR;
+      }
+
+      at += wrote;
+      len -= (size_t)wrote;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Reads exactly *len* bytes, failing with RND_INVALID_RECNODB_FILE if the
+ * stream ends first.
+ */
+static RND_ERROR backup_read_all(int fd, void *bytes, size_t len)
+{
+   char *at = (char*)bytes;
+
+   while (len)
+   {
+      ssize_t got = read(fd, at, len);
+      if (got < 0 && errno == EINTR)
+         continue;
+      if (got < 0)
+         return RND_SYSTEM_ERROR;
+      if (got == 0)
+         return RND_INVALID_RECNODB_FILE;
+
+      at += got;
+      len -= (size_t)got;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * `chains_walk` viewer that collects the offsets of the blocks of a table.
+ */
+static bool backup_note_table_block(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   BACKUP_CLO *clo = (BACKUP_CLO*)closure;
+
+   if (clo->count == clo->allocated)
+   {
+      uint32_t allocated = clo->allocated ? clo->allocated * 2 : 64;
+      off_t *grown = (off_t*)realloc(clo->table, allocated * sizeof(off_t));
+      if (!grown)
+         return 0;
+
+      clo->table = grown;
+      clo->allocated = allocated;
+   }
+
+   clo->table[clo->count++] = offset_to_ib;
+   return 1;
+}
+
+static int backup_compare_offsets(const void *left, const void *right)
+{
+   off_t l = *(const off_t*)left, r = *(const off_t*)right;
+   return l < r ? -1 : l > r;
+}
+
+static bool backup_in_table(const BACKUP_CLO *clo, off_t offset)
+{
+   return bsearch(&offset, clo->table, clo->count, sizeof(off_t), backup_compare_offsets) != NULL;
+}
+
+static RND_ERROR backup_add_lock(RNDH *handle, BACKUP_CLO *clo, off_t offset, off_t size)
+{
+   BLOCK_LOC *grown = (BLOCK_LOC*)realloc(clo->locks, (clo->lock_count + 1) * sizeof(BLOCK_LOC));
+   if (!grown)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   clo->locks = grown;
+   clo->locks[clo->lock_count].offset = offset;
+   clo->locks[clo->lock_count].size = size;
+   ++clo->lock_count;
+   return RND_SUCCESS;
+}
+
+/**
+ * Lists the locks under which the blocks of the file's other structures
+ * change: the heads of the key index, the relationships and each field
+ * index, then the locks of the undo, snapshot and change logs.
+ *
+ * Writers take the heads without waiting and may wait for the log locks
+ * while they hold one, so the heads come first.  A structure added after
+ * the backup starts is past the end of the file it copies.
+ */
+static RND_ERROR backup_note_structures(RNDH *handle, BACKUP_CLO *clo)
+{
+   INFO_FILE fhead;
+   RND_ERROR rval;
+   off_t btree;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if ((rval = blocks_read_at(handle, offsetof(RND_HEAD_FILE, fhead), &fhead, sizeof(fhead))))
+      return rval;
+
+   if (fhead.index_head
+       && (rval = backup_add_lock(handle, clo, fhead.index_head, sizeof(RND_HEAD_INDEX))))
+      return rval;
+
+   if (fhead.relation_head
+       && (rval = backup_add_lock(handle, clo, fhead.relation_head, sizeof(RND_HEAD_RELATION))))
+      return rval;
+
+   for (btree = fhead.btree_head; btree; )
+   {
+      INFO_BTREE bt;
+
+      if ((rval = backup_add_lock(handle, clo, btree, sizeof(RND_HEAD_BTREE)))
+          || (rval = blocks_read_at(handle, btree + (off_t)offsetof(RND_HEAD_BTREE, bthead), &bt, sizeof(bt))))
+         return rval;
+
+      btree = bt.next_btree;
+   }
+
+   if ((rval = backup_add_lock(handle, clo, TXN_COMMIT_LOCK_OFFSET, 1))
+       || (rval = backup_add_lock(handle, clo, SNAPSHOT_LOG_LOCK_OFFSET, 1)))
+      return rval;
+
+   return backup_add_lock(handle, clo, CHANGES_LOG_LOCK_OFFSET, 1);
+}
+
+/**
+ * Takes, or with *hold* FALSE releases, the locks listed by
+ * `backup_note_structures`, waiting for writers that hold them.
+ */
+static RND_ERROR backup_hold_structures(BACKUP_CLO *clo, bool hold)
+{
+   RNDH *handle = clo->handle;
+   RND_ERROR rval;
+   uint32_t i;
+
+   if (!hold)
+   {
+      for (i = clo->lock_count; i-- > 0; )
+         rnd_lock_remove(handle, &clo->locks[i]);
+      return RND_SUCCESS;
+   }
+
+   for (i = 0; i < clo->lock_count; ++i)
+   {
+      if ((rval = rnd_lock_place(handle, &clo->locks[i], 1)))
+      {
+         while (i-- > 0)
+            rnd_lock_remove(handle, &clo->locks[i]);
+         return rval;
+      }
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Streams *length* bytes of the file from *offset*.  The bytes from
+ * *lock_from* on are read a piece at a time, each under a lock.
+ */
+static RND_ERROR backup_copy(BACKUP_CLO *clo, off_t offset, uint64_t length, uint64_t lock_from)
+{
+   RNDH *handle = clo->handle;
+   BACKUP_EXTENT extent = { offset, length };
+   uint64_t done = 0;
+   RND_ERROR rval;
+
+   if ((rval = backup_write_all(handle, clo->out_fd, &extent, sizeof(extent))))
+      return rval;
+
+   while (done < length)
+   {
+      uint64_t piece = length - done;
+      if (piece > BACKUP_PIECE)
+         piece = BACKUP_PIECE;
+
+      // The unlocked head of the block stops at the records:
+      if (done < lock_from && done + piece > lock_from)
+         piece = lock_from - done;
+
+      BLOCK_LOC bl = { offset + (off_t)done, (off_t)piece };
+      bool locked = done >= lock_from;
+
+      if (locked && (rval = rnd_lock_place(handle, &bl, 1)))
+         return rval;
+
+      if (fflush(handle->file))
+      {
+         handle->sys_errno = errno;
+         rval = RND_SYSTEM_ERROR;
+      }
+      else
+         rval = blocks_read_at(handle, bl.offset, clo->buffer, piece);
+
+      if (locked)
+         rnd_lock_remove(handle, &bl);
+
+      if (rval || (rval = backup_write_all(handle, clo->out_fd, clo->buffer, piece)))
+         return rval;
+
+      done += piece;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Streams the blocks of a file that changed since generation *since*.
+ *
+ * @param handle  handle to an open recno database
+ * @param since   generation returned by the previous backup, or 0 for a full backup
+ * @param out_fd  file descriptor to write the stream to
+ * @param next    [out] generation to pass to the next backup
+ */
+RND_ERROR backup_incremental(RNDH *handle, uint64_t since, int out_fd, uint64_t *next)
+{
+   prime_handle(handle);
+
+   BACKUP_CLO clo = { handle, out_fd };
+   BACKUP_HEAD head;
+   RND_ERROR rval;
+   off_t offset;
+
+   if (!(clo.buffer = (char*)malloc(BACKUP_PIECE)))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   memset(&head, 0, sizeof(head));
+   memcpy(head.magic, "RNDI", 4);
+
+   // Changes from here on are stamped with the new generation:
+   if ((rval = blocks_advance_generation(handle, &head.generation))
+       || (rval = blocks_file_size(handle, &head.file_size)))
+      goto abandon_backup;
+
+   head.since = since;
+
+   if ((rval = chains_walk(handle, 0, backup_note_table_block, &clo))
+       || (rval = backup_note_structures(handle, &clo)))
+      goto abandon_backup;
+
+   qsort(clo.table, clo.count, sizeof(off_t), backup_compare_offsets);
+
+   if ((rval = backup_write_all(handle, out_fd, &head, sizeof(head))))
+      goto abandon_backup;
+
+   // The file head, with the table's last_recno, goes first, so records
+   // appended while the rest is copied are past the end of the table:
+   for (offset = 0; offset < head.file_size; )
+   {
+      INFO_BLOCK ib, after;
+      int tries = BACKUP_TRIES;
+
+      if (fflush(handle->file))
+      {
+         handle->sys_errno = errno;
+         rval = RND_SYSTEM_ERROR;
+         goto abandon_backup;
+      }
+
+      if ((rval = blocks_read_block_head(handle, offset, &ib, sizeof(ib))))
+         goto abandon_backup;
+
+      if (ib.block_size == 0 || ib.bytes_to_data < sizeof(INFO_BLOCK))
+      {
+         rval = RND_INVALID_RECNODB_FILE;
+         goto abandon_backup;
+      }
+
+      bool tracked = offset != 0 && backup_in_table(&clo, offset);
+
+      while (!tracked || ib.generation >= since)
+      {
+         uint64_t length = ib.block_flags & RBF_COMPRESSED
+            ? (uint64_t)ib.bytes_to_data + ib.stored_size
+            : ib.block_size;
+
+         // A block grown at the end of the file since the backup started
+         // is copied whole by the next backup:
+         if ((off_t)length > head.file_size - offset)
+            length = head.file_size - offset;
+
+         // The records of the table are locked a piece at a time as they
+         // are read, the blocks of other structures under their writers' locks:
+         bool structure = !tracked && offset != 0;
+         uint64_t lock_from = structure ? length
+            : ib.bytes_to_records ? ib.bytes_to_records : ib.bytes_to_data;
+
+         if (structure && (rval = backup_hold_structures(&clo, 1)))
+            goto abandon_backup;
+
+         rval = backup_copy(&clo, offset, length, lock_from);
+
+         if (structure)
+            backup_hold_structures(&clo, 0);
+
+         if (rval)
+            goto abandon_backup;
+
+         if (!tracked || !--tries)
+            break;
+
+         // Copy a block again if it was compressed or expanded meanwhile:
+         if (fflush(handle->file))
+         {
+            handle->sys_errno = errno;
+            rval = RND_SYSTEM_ERROR;
+            goto abandon_backup;
+         }
+
+         if ((rval = blocks_read_block_head(handle, offset, &after, sizeof(after))))
+            goto abandon_backup;
+
+         if (after.block_flags == ib.block_flags
+             && after.rewrites == ib.rewrites
+             && after.stored_size == ib.stored_size
+             && !(after.block_flags & RBF_CHANGING))
+            break;
+
+         ib = after;
+      }
+
+      offset += ib.block_size;
+   }
+
+   BACKUP_EXTENT end = { 0, 0 };
+   if (!(rval = backup_write_all(handle, out_fd, &end, sizeof(end))))
+      *next = head.generation;
+
+  abandon_backup:
+   free(clo.locks);
+   free(clo.table);
+   free(clo.buffer);
+   return rval;
+}
+
+/**
+ * Writes a backup stream over the copy of a file at *path*.
+ *
+ * A full backup creates the copy.  An incremental one must be applied to
+ * a copy made from the full backup and every incremental one after it, in
+ * order.
+ *
+ * @param path   path to the copy of the file
+ * @param in_fd  file descriptor to read the stream from
+ */
+RND_ERROR backup_apply(const char *path, int in_fd)
+{
+   BACKUP_HEAD head;
+   BACKUP_EXTENT extent;
+   RND_ERROR rval;
+   char *buffer;
+   int fd;
+
+   if ((rval = backup_read_all(in_fd, &head, sizeof(head))))
+      return rval;
+
+   if (memcmp(head.magic, "RNDI", 4))
+      return RND_INVALID_RECNODB_FILE;
+
+   if ((fd = open(path, head.since ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+      return RND_SYSTEM_ERROR;
+
+   if (!(buffer = (char*)malloc(BACKUP_PIECE)))
+   {
+      rval = RND_SYSTEM_ERROR;
+      goto abandon_file;
+   }
+
+   while (!(rval = backup_read_all(in_fd, &extent, sizeof(extent))) && extent.length)
+   {
+      uint64_t done = 0;
+
+      while (done < extent.length)
+      {
+         size_t piece = extent.length - done > BACKUP_PIECE ? BACKUP_PIECE : (size_t)(extent.length - done);
+
+         if ((rval = backup_read_all(in_fd, buffer, piece)))
+            goto abandon_buffer;
+
+         if (pwrite(fd, buffer, piece, extent.offset + (off_t)done) != (ssize_t)piece)
+         {
+            rval = RND_SYSTEM_ERROR;
+            goto abandon_buffer;
+         }
+
+         done += piece;
+      }
+   }
+
+   if (!rval && (ftruncate(fd, head.file_size) || fsync(fd)))
+      rval = RND_SYSTEM_ERROR;
+
+  abandon_buffer:
+   free(buffer);
+
+  abandon_file:
+   if (close(fd) && !rval)
+      rval = RND_SYSTEM_ERROR;
+
+   return rval;
+}
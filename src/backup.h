@@ -0,0 +1,27 @@
+#ifndef RECNODB_BACKUP_H
+#define RECNODB_BACKUP_H
+
+#include "recnodb.h"
+
+#include <stdint.h>
+#include <sys/types.h>   // for off_t
+
+/** Start of a backup stream. */
+typedef struct backup_stream_head {
+   char     magic[4];      /**< "RNDI"                                                  */
+   char     pad[4];
+   uint64_t since;         /**< Table blocks last changed before this are left out      */
+   uint64_t generation;    /**< Generation the backup started, *since* for the next one */
+   off_t    file_size;     /**< Size of the file when the backup started                */
+} BACKUP_HEAD;
+
+/** Precedes each run of bytes of the file in a backup stream.  A zero *length* ends the stream. */
+typedef struct backup_extent {
+   off_t    offset;
+   uint64_t length;
+} BACKUP_EXTENT;
+
+RND_ERROR backup_incremental(RNDH *handle, uint64_t since, int out_fd, uint64_t *next);
+RND_ERROR backup_apply(const char *path, int in_fd);
+
+#endif
@@ -0,0 +1,245 @@
+/** @file */
+
+#include "bitmap.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BITMAP_X86 1
+#include <immintrin.h>
+#endif
+
+typedef uint64_t (*bitmap_popcount_words)(const uint64_t *words, size_t nwords);
+typedef size_t   (*bitmap_skip_words)(const uint64_t *words, size_t nwords, size_t start, uint64_t skip);
+
+/**
+ * Number of 64-bit words needed to hold *nbits* bits.
+ */
+size_t bitmap_words_for_bits(uint64_t nbits)
+{
+   return (nbits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+bool bitmap_test(const uint64_t *words, uint64_t bit)
+{
+   return (words[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+void bitmap_set(uint64_t *words, uint64_t bit)
+{
+   words[bit / BITMAP_WORD_BITS] |= (uint64_t)1 << (bit % BITMAP_WORD_BITS);
+}
+
+void bitmap_clear(uint64_t *words, uint64_t bit)
+{
+   words[bit / BITMAP_WORD_BITS] &= ~((uint64_t)1 << (bit % BITMAP_WORD_BITS));
+}
+
+/**
+ * Mask of the valid bits of the last word of an *nbits*-long map.
+ */
+static uint64_t bitmap_tail_mask(uint64_t nbits)
+{
+   unsigned tail_bits = nbits % BITMAP_WORD_BITS;
+   return tail_bits ? ((uint64_t)1 << tail_bits) - 1 : ~(uint64_t)0;
+}
+
+/*******************************
+ * Word-counting implementations
+ ******************************/
+
+static uint64_t bitmap_popcount_words_portable(const uint64_t *words, size_t nwords)
+{
+   uint64_t count = 0;
+   for (size_t i = 0; i < nwords; ++i)
+      count += __builtin_popcountll(words[i]);
+   return count;
+}
+
+static size_t bitmap_skip_words_portable(const uint64_t *words, size_t nwords, size_t start, uint64_t skip)
+{
+   while (start < nwords && words[start] == skip)
+      ++start;
+   return start;
+}
+
+#ifdef BITMAP_X86
+
+/**
+ * Counts with the POPCNT instruction, unrolled so the four
+ * accumulators don't serialize on one register.
+ */
+__attribute__((target("popcnt")))
+static uint64_t bitmap_popcount_words_popcnt(const uint64_t *words, size_t nwords)
+{
+   uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+   size_t i = 0;
+
+   for (; i + 4 <= nwords; i += 4)
+   {
+      c0 += __builtin_popcountll(words[i]);
+      c1 += __builtin_popcountll(words[i+1]);
+      c2 += __builtin_popcountll(words[i+2]);
+      c3 += __builtin_popcountll(words[i+3]);
+   }
+
+   for (; i < nwords; ++i)
+      c0 += __builtin_popcountll(words[i]);
+
+   return c0 + c1 + c2 + c3;
+}
+
+/**
+ * Counts 256 bits per iteration using the nibble-lookup method:
+ * PSHUFB looks up the bit count of each nibble, and PSADBW sums
+ * the byte counts into four 64-bit lanes.
+ */
+__attribute__((target("avx2")))
+static uint64_t bitmap_popcount_words_avx2(const uint64_t *words, size_t nwords)
+{
+   const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+   const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+   __m256i total = _mm256_setzero_si256();
+   size_t i = 0;
+
+   for (; i + 4 <= nwords; i += 4)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i*)&words[i]);
+      __m256i lo = _mm256_and_si256(v, low_nibbles);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+      __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                      _mm256_shuffle_epi8(lookup, hi));
+      total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+   }
+
+   uint64_t count = (uint64_t)_mm256_extract_epi64(total, 0)
+      + (uint64_t)_mm256_extract_epi64(total, 1)
+      + (uint64_t)_mm256_extract_epi64(total, 2)
+      + (uint64_t)_mm256_extract_epi64(total, 3);
+
+   for (; i < nwords; ++i)
+      count += __builtin_popcountll(words[i]);
+
+   return count;
+}
+
+/**
+ * Skips 256-bit runs of words equal to *skip* (all zeros or all ones)
+ * with one test per run.
+ */
+__attribute__((target("avx2")))
+static size_t bitmap_skip_words_avx2(const uint64_t *words, size_t nwords, size_t start, uint64_t skip)
+{
+   const __m256i pattern = _mm256_set1_epi64x((long long)skip);
+
+   for (; start + 4 <= nwords; start += 4)
+   {
+      __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&words[start]), pattern);
+      if (!_mm256_testz_si256(v, v))
+         break;
+   }
+
+   return bitmap_skip_words_portable(words, nwords, start, skip);
+}
+
+#endif  // BITMAP_X86
+
+static bitmap_popcount_words bitmap_popcount_impl = NULL;
+static bitmap_skip_words     bitmap_skip_impl = NULL;
+
+/**
+ * Chooses the word-counting and word-skipping implementations for
+ * the running CPU.  Racing threads all arrive at the same choice,
+ * so no synchronization is needed.
+ */
+static void bitmap_select_impl(void)
+{
+   bitmap_popcount_words popcount = bitmap_popcount_words_portable;
+   bitmap_skip_words     skip = bitmap_skip_words_portable;
+
+#ifdef BITMAP_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+   {
+      popcount = bitmap_popcount_words_avx2;
+      skip = bitmap_skip_words_avx2;
+   }
+   else if (__builtin_cpu_supports("popcnt"))
+      popcount = bitmap_popcount_words_popcnt;
+#endif
+
+   bitmap_skip_impl = skip;
+   bitmap_popcount_impl = popcount;
+}
+
+/**
+ * Counts the set bits among the first *nbits* bits of the map.
+ *
+ * @param words   map memory, at least `bitmap_words_for_bits(nbits)` words
+ * @param nbits   number of bits to consider
+ *
+ * @return number of set bits
+ */
+uint64_t bitmap_popcount(const uint64_t *words, uint64_t nbits)
+{
+   if (!bitmap_popcount_impl)
+      bitmap_select_impl();
+
+   size_t full_words = nbits / BITMAP_WORD_BITS;
+   uint64_t count = (*bitmap_popcount_impl)(words, full_words);
+
+   if (nbits % BITMAP_WORD_BITS)
+      count += __builtin_popcountll(words[full_words] & bitmap_tail_mask(nbits));
+
+   return count;
+}
+
+/**
+ * Common search for `bitmap_next_set` and `bitmap_next_clear`.
+ *
+ * @param invert  0 to find a set bit, ~0 to find a clear bit
+ */
+static int64_t bitmap_next(const uint64_t *words, uint64_t nbits, uint64_t from, uint64_t invert)
+{
+   if (from >= nbits)
+      return -1;
+
+   if (!bitmap_skip_impl)
+      bitmap_select_impl();
+
+   size_t nwords = bitmap_words_for_bits(nbits);
+   size_t index = from / BITMAP_WORD_BITS;
+
+   // Mask out bits before *from* in the first word:
+   uint64_t word = (words[index] ^ invert) & (~(uint64_t)0 << (from % BITMAP_WORD_BITS));
+
+   while (!word)
+   {
+      index = (*bitmap_skip_impl)(words, nwords, index + 1, invert);
+      if (index >= nwords)
+         return -1;
+      word = words[index] ^ invert;
+   }
+
+   uint64_t bit = (uint64_t)index * BITMAP_WORD_BITS + __builtin_ctzll(word);
+   return bit < nbits ? (int64_t)bit : -1;
+}
+
+/**
+ * Finds the first set bit at or after *from*.
+ *
+ * @return index of the bit, or -1 if there are no set bits before *nbits*.
+ */
+int64_t bitmap_next_set(const uint64_t *words, uint64_t nbits, uint64_t from)
+{
+   return bitmap_next(words, nbits, from, 0);
+}
+
+/**
+ * Finds the first clear bit at or after *from*.
+ *
+ * @return index of the bit, or -1 if there are no clear bits before *nbits*.
+ */
+int64_t bitmap_next_clear(const uint64_t *words, uint64_t nbits, uint64_t from)
+{
+   return bitmap_next(words, nbits, from, ~(uint64_t)0);
+}
@@ -0,0 +1,22 @@
+#ifndef RECNODB_BITMAP_H
+#define RECNODB_BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>   // for size_t
+
+#include "recnodb.h"
+
+/** Bits are stored least-significant-first in 64-bit words. */
+#define BITMAP_WORD_BITS 64
+
+size_t   bitmap_words_for_bits(uint64_t nbits);
+
+bool     bitmap_test(const uint64_t *words, uint64_t bit);
+void     bitmap_set(uint64_t *words, uint64_t bit);
+void     bitmap_clear(uint64_t *words, uint64_t bit);
+
+uint64_t bitmap_popcount(const uint64_t *words, uint64_t nbits);
+int64_t  bitmap_next_set(const uint64_t *words, uint64_t nbits, uint64_t from);
+int64_t  bitmap_next_clear(const uint64_t *words, uint64_t nbits, uint64_t from);
+
+#endif
@@ -2,11 +2,32 @@
 
 #include "recnodb.h"
 #include "extra.h"
+#include "cache.h"
+#include "bufpool.h"
+#include "mapping.h"
+#include "locks.h"
+#include "stats.h"
+#include "probes.h"
 
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>   // for memset()
 #include <assert.h>
+#include <stddef.h>   // for offsetof()
+#include <unistd.h>   // for pread(), pwrite(), ftruncate()
+#include <sys/stat.h> // for fstat()
+#include <sys/mman.h> // for mmap()
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> // for BLKSSZGET
+#endif
+
+/**
+ * Number of chunks reserved past the end of file whenever the file is
+ * extended.  See `blocks_reserve`.
+ */
+#define BLOCKS_RESERVE_CHUNKS 16
 
 /**
  * Ensure that a file header is not blatently corrupt
@@ -91,10 +112,387 @@ uint32_t blocks_handle_chunk_size(const RNDH *handle)
  **********************************************************************************/
 bool blocks_validate_new_block_location(RNDH *handle, off_t new_block_location)
 {
-   
+   if (handle && handle->io_align && new_block_location % handle->io_align)
+      return 0;
+
    return 0 == (new_block_location % blocks_handle_chunk_size(handle));
 }
 
+/**
+ * Base of the locks that serialize RND_DIRECT writes of aligned units.
+ * The unit at offset *n* is locked at BLOCKS_DIRECT_LOCK_BASE + *n*, past
+ * any data, so these locks neither collide with nor release the record
+ * and header locks a handle holds over the same bytes of the file.
+ */
+#define BLOCKS_DIRECT_LOCK_BASE (INT64_MAX / 2)
+
+/**
+ * Moves data between memory and an RND_DIRECT file through the handle's
+ * aligned buffers.
+ *
+ * The transfer is broken into pieces that each fit in a pool buffer with
+ * their leading and trailing alignment slack.  A write that doesn't cover
+ * whole aligned units reads them first, so the bytes around the write are
+ * preserved.  Records of other processes may share those units, so every
+ * write holds a lock over its units, see BLOCKS_DIRECT_LOCK_BASE, from
+ * the read to the write.  The lock waits, being taken last and held only
+ * for the two transfers.
+ *
+ * @param handle   handle opened with RND_DIRECT
+ * @param offset   file offset of the transfer
+ * @param buffer   memory to write from or read into
+ * @param len      number of bytes to transfer
+ * @param writing  TRUE to write *buffer* to the file, FALSE to read into *buffer*
+ **********************************************************************************/
+static RND_ERROR blocks_direct_transfer(RNDH *handle, off_t offset, char *buffer, size_t len, bool writing)
+{
+   RND_ERROR rval = RND_SUCCESS;
+   int    fd = fileno(handle->file);
+   size_t align = handle->io_align;
+   size_t bounce_size = bufpool_buffer_size(handle);
+   char   *bounce = (char*)bufpool_acquire(handle);
+
+   if (!bounce)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   while (len)
+   {
+      off_t  span_start = offset - (offset % align);
+      size_t lead = offset - span_start;
+      size_t piece = bounce_size - lead;
+      if (piece > len)
+         piece = len;
+
+      size_t span_len = (lead + piece + align - 1) / align * align;
+      BLOCK_LOC units = { BLOCKS_DIRECT_LOCK_BASE + span_start, (off_t)span_len };
+
+      if (writing && (rval = rnd_lock_place(handle, &units, 1)))
+         break;
+
+      // Unless writing whole units, get the surrounding bytes:
+      if (!writing || lead || piece % align)
+      {
+         STATS_ADD(handle, reads, 1);
+         ssize_t bytes_read = pread(fd, bounce, span_len, span_start);
+         if (bytes_read < 0)
+         {
+            handle->sys_errno = errno;
+            rval = RND_SYSTEM_ERROR;
+         }
+         else if ((size_t)bytes_read < lead + piece)
+         {
+            if (!writing)
+               rval = RND_INCOMPLETE_READ;
+            else // Writing past the end of the file
+               memset(bounce + bytes_read, 0, span_len - bytes_read);
+         }
+      }
+
+      if (writing && !rval)
+      {
+         memcpy(bounce + lead, buffer, piece);
+         STATS_ADD(handle, writes, 1);
+         ssize_t bytes_written = pwrite(fd, bounce, span_len, span_start);
+         if (bytes_written < 0)
+         {
+            handle->sys_errno = errno;
+            rval = RND_SYSTEM_ERROR;
+         }
+         else if ((size_t)bytes_written < span_len)
+            rval = RND_INCOMPLETE_WRITE;
+      }
+      else if (!rval)
+         memcpy(buffer, bounce + lead, piece);
+
+      if (writing)
+      {
+         RND_ERROR unlock_rval = rnd_lock_remove(handle, &units);
+         if (!rval)
+            rval = unlock_rval;
+      }
+
+      if (rval)
+         break;
+
+      offset += piece;
+      buffer += piece;
+      len -= piece;
+   }
+
+   bufpool_release(handle, bounce);
+   return rval;
+}
+
+/**
+ * Reads with pread() rather than through the FILE stream, so that threads
+ * sharing the file can read without disturbing each other's position.
+ *
+ * Data written through the stream must be flushed before reading this way.
+ **********************************************************************************/
+static RND_ERROR blocks_positional_read(RNDH *handle, off_t offset, char *buffer, size_t len)
+{
+   int fd = fileno(handle->file);
+
+   while (len)
+   {
+      STATS_ADD(handle, reads, 1);
+      ssize_t bytes_read = pread(fd, buffer, len, offset);
+      if (bytes_read < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         handle->sys_errno = errno;
+         return RND_SYSTEM_ERROR;
+      }
+      else if (bytes_read == 0)
+         return RND_INCOMPLETE_READ;
+
+      offset += bytes_read;
+      buffer += bytes_read;
+      len -= bytes_read;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Reads from the handle's shared mapping of the file, for handles opened
+ * RND_READONLY.  Readers share the page cache and make no system calls
+ * unless a read reaches past the mapping, as it will once the file grows,
+ * when the file is mapped again to its new size.
+ **********************************************************************************/
+static RND_ERROR blocks_mapped_read(RNDH *handle, off_t offset, char *buffer, size_t len)
+{
+   struct rnd_mapping *mapping;
+   RND_ERROR rval;
+
+   if ((rval = mapping_reach(handle, offset + (off_t)len, &mapping)))
+      return rval;
+
+   memcpy(buffer, mapping->base + offset, len);
+   return RND_SUCCESS;
+}
+
+/**
+ * Reads *len* bytes from the database file at *offset*.
+ *
+ * All reads of the database file should come through here, so that
+ * files opened with RND_DIRECT get aligned transfers.
+ *
+ * @param handle   handle to open recnodb database
+ * @param offset   file offset from which to read
+ * @param buffer   [out] memory to receive the data
+ * @param len      number of bytes to read
+ *
+ * @return RND_SUCCESS if it works, RND_SYSTEM_ERROR and handle::sys_errno set on failure.
+ **********************************************************************************/
+RND_ERROR blocks_read_at(RNDH *handle, off_t offset, void *buffer, size_t len)
+{
+   if (len == 0)
+      return RND_SUCCESS;
+
+   STATS_ADD(handle, bytes_read, len);
+
+   if (handle->readonly)
+      return blocks_mapped_read(handle, offset, (char*)buffer, len);
+   else if (handle->io_align)
+      return blocks_direct_transfer(handle, offset, (char*)buffer, len, 0);
+   else if (handle->positional)
+      return blocks_positional_read(handle, offset, (char*)buffer, len);
+
+   STATS_ADD(handle, seeks, 1);
+   STATS_ADD(handle, reads, 1);
+
+   if (fseek(handle->file, offset, SEEK_SET)
+       || !fread(buffer, len, 1, handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+   else
+      return RND_SUCCESS;
+}
+
+/**
+ * Writes *len* bytes to the database file at *offset*.
+ *
+ * All writes to the database file should come through here, so that
+ * files opened with RND_DIRECT get aligned transfers.  Once the handle
+ * has a mapping (see mapping.c), writes are flushed so it sees them.
+ *
+ * @param handle   handle to open recnodb database
+ * @param offset   file offset at which to write
+ * @param buffer   data to write
+ * @param len      number of bytes to write
+ *
+ * @return RND_SUCCESS if it works, RND_SYSTEM_ERROR and handle::sys_errno set on
+ *         failure, RND_READ_ONLY_HANDLE for a handle opened RND_READONLY.
+ **********************************************************************************/
+RND_ERROR blocks_write_at(RNDH *handle, off_t offset, const void *buffer, size_t len)
+{
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+
+   cache_forget_written(handle, offset, len);
+
+   if (len == 0)
+      return RND_SUCCESS;
+
+   STATS_ADD(handle, bytes_written, len);
+
+   if (handle->io_align)
+      return blocks_direct_transfer(handle, offset, (char*)buffer, len, 1);
+
+   STATS_ADD(handle, seeks, 1);
+   STATS_ADD(handle, writes, 1);
+
+   if (fseek(handle->file, offset, SEEK_SET)
+       || !fwrite(buffer, len, 1, handle->file)
+       || (handle->mapping && fflush(handle->file)))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+   else
+      return RND_SUCCESS;
+}
+
+/**
+ * Gets the current size of the database file.
+ *
+ * @param handle   handle to open recnodb database
+ * @param size     [out] file size in bytes
+ **********************************************************************************/
+RND_ERROR blocks_file_size(RNDH *handle, off_t *size)
+{
+   if (handle->io_align)
+   {
+      struct stat st;
+      if (fstat(fileno(handle->file), &st))
+         goto system_error;
+
+      *size = st.st_size;
+   }
+   else if (fseek(handle->file, 0, SEEK_END)
+            || -1 == (*size = ftell(handle->file)))
+      goto system_error;
+
+   return RND_SUCCESS;
+
+  system_error:
+   handle->sys_errno = errno;
+   return RND_SYSTEM_ERROR;
+}
+
+/**
+ * Allocates disk space for a range of the file.
+ *
+ * With *keep_size*, the space is reserved past the end of file without
+ * changing the file size, so later extensions land in extents that are
+ * already allocated and, as far as the filesystem can manage, contiguous.
+ * A reservation is only advice, so filesystems that can't make one are
+ * quietly ignored.
+ *
+ * Without *keep_size*, the file grows to cover the range.  This is never
+ * done by writing a trailing byte, which would leave a sparse file whose
+ * blocks are allocated (and fragmented) as they are first written.
+ *
+ * @param handle     handle to open recnodb database
+ * @param offset     start of the range
+ * @param len        length of the range
+ * @param keep_size  TRUE to reserve space without changing the file size
+ **********************************************************************************/
+static RND_ERROR blocks_allocate(RNDH *handle, off_t offset, off_t len, bool keep_size)
+{
+   int fd = fileno(handle->file);
+
+   // Don't let buffered writes land after the allocation
+   if (fflush(handle->file))
+      goto system_error;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+   if (fallocate(fd, keep_size ? FALLOC_FL_KEEP_SIZE : 0, offset, len) == 0)
+      return RND_SUCCESS;
+   else if (errno != EOPNOTSUPP && errno != ENOSYS)
+      goto system_error;
+#endif
+
+   if (keep_size)
+      return RND_SUCCESS;
+
+   // posix_fallocate reports errors by return value rather than errno
+   int err = posix_fallocate(fd, offset, len);
+   if (err == 0)
+      return RND_SUCCESS;
+   else if (err != EINVAL && err != EOPNOTSUPP)
+   {
+      handle->sys_errno = err;
+      return RND_SYSTEM_ERROR;
+   }
+
+   // Last resort for filesystems that can't allocate at all:
+   if (ftruncate(fd, offset + len) == 0)
+      return RND_SUCCESS;
+
+  system_error:
+   handle->sys_errno = errno;
+   return RND_SYSTEM_ERROR;
+}
+
+/**
+ * Reserves disk space for *bytes* past the current end of file.
+ *
+ * The file size doesn't change, so the reservation is invisible to the
+ * chains, but blocks later appended into the reserved range need no
+ * allocation.
+ *
+ * @param handle   handle to open recnodb database
+ * @param bytes    number of bytes to reserve
+ **********************************************************************************/
+RND_ERROR blocks_reserve(RNDH *handle, off_t bytes)
+{
+   RND_ERROR rval;
+   off_t eof;
+
+   if (bytes <= 0)
+      return RND_SUCCESS;
+   else if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   else if ((rval = blocks_file_size(handle, &eof)))
+      return rval;
+   else
+      return blocks_allocate(handle, eof, bytes, 1);
+}
+
+/**
+ * Cuts the file to *size* bytes, releasing any space reserved past it.
+ *
+ * Only for a file open to a single writer, like one being bulk-loaded,
+ * since blocks appended by others past *size* would be lost.
+ *
+ * @param handle   handle to open recnodb database
+ * @param size     new size of the file, a multiple of the chunk size
+ **********************************************************************************/
+RND_ERROR blocks_truncate_file(RNDH *handle, off_t size)
+{
+   if (!blocks_validate_new_block_location(handle, size))
+      return RND_INVALID_BLOCK_LOCATION;
+   else if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+
+   if (fflush(handle->file) || ftruncate(fileno(handle->file), size))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   return RND_SUCCESS;
+}
+
 /**
  * Calculate the bytes_to_data value for the given block type.
  *
@@ -111,6 +509,18 @@ uint16_t blocks_bytes_to_data(uint16_t block_type)
          return sizeof(RND_HEAD_TABLE);
       case RBT_FILE:
          return sizeof(RND_HEAD_FILE);
+      case RBT_INDEX:
+         return sizeof(RND_HEAD_INDEX);
+      case RBT_RELATION:
+         return sizeof(RND_HEAD_RELATION);
+      case RBT_BTREE:
+         return sizeof(RND_HEAD_BTREE);
+      case RBT_UNDO:
+         return sizeof(RND_HEAD_UNDO);
+      case RBT_SNAPSHOT:
+         return sizeof(RND_HEAD_SNAPSHOT);
+      case RBT_CHANGES:
+         return sizeof(RND_HEAD_CHANGES);
       default:
          return sizeof(RND_HEAD_BLOCK);
    }
@@ -124,6 +534,74 @@ uint32_t blocks_block_payload_size(const INFO_BLOCK *block)
    return block->block_size - block->bytes_to_data;
 }
 
+/**
+ * Sets the record-layout members of a block that holds fixed-length records.
+ *
+ * The liveness map, one bit per record, follows the block header, and the
+ * records start at the next RND_RECORD_ALIGN boundary past the map.  Records
+ * thus keep their natural alignment, and the liveness of every record in the
+ * block can be read from a few cache lines.  Any alignment slack is added to
+ * the map so the block can later grow without moving its records.
+ *
+ * @param ib        [in/out] block header with *block_size* and *bytes_to_data* set
+ * @param rec_size  size of fixed-length records.  0 (variable-length records)
+ *                  leaves the block without a map.
+ **********************************************************************************/
+void blocks_set_record_layout(INFO_BLOCK *ib, uint32_t rec_size)
+{
+   uint32_t bytes_to_records = ib->bytes_to_data;
+   uint32_t map_bits = 0;
+
+   if (rec_size && ib->block_size > ib->bytes_to_data)
+   {
+      uint64_t payload = blocks_block_payload_size(ib);
+
+      // Each record costs rec_size bytes plus one bit; start from that
+      // estimate and back off until the map, alignment and records fit.
+      uint64_t recs = (payload * 8) / ((uint64_t)rec_size * 8 + 1);
+      uint64_t start;
+
+      while (1)
+      {
+         uint64_t map_bytes = ((recs + 63) / 64) * 8;
+         start = ib->bytes_to_data + map_bytes;
+         start = (start + RND_RECORD_ALIGN - 1) / RND_RECORD_ALIGN * RND_RECORD_ALIGN;
+
+         if (recs == 0 || start + recs * rec_size <= ib->block_size)
+            break;
+
+         --recs;
+      }
+
+      bytes_to_records = start;
+      map_bits = (start - ib->bytes_to_data) * 8;
+   }
+
+   ib->bytes_to_records = bytes_to_records;
+   ib->map_bits = map_bits;
+}
+
+
+/**
+ * Sets the record layout of a block that may later grow in place.
+ *
+ * The liveness map is sized for a block of *max_size* bytes, so the block
+ * can grow to that size without moving its records.
+ *
+ * @param ib        [in/out] header with *block_size* and *bytes_to_data* set
+ * @param rec_size  size of the fixed-length records
+ * @param max_size  size to which the block may grow
+ **********************************************************************************/
+void blocks_set_growable_record_layout(INFO_BLOCK *ib, uint32_t rec_size, uint32_t max_size)
+{
+   uint32_t block_size = ib->block_size;
+
+   if (max_size > block_size)
+      ib->block_size = max_size;
+
+   blocks_set_record_layout(ib, rec_size);
+   ib->block_size = block_size;
+}
 
 /**
  * Simple error-checking, block-reading function.
@@ -145,14 +623,11 @@ RND_ERROR blocks_read_block_head(RNDH *handle, off_t offset, INFO_BLOCK *block,
    if (bytes_to_read > info_len)
       bytes_to_read = info_len;
 
-   if (fseek(handle->file, offset, SEEK_SET)
-       || !fread(block, bytes_to_read, 1, handle->file))
-   {
-      handle->sys_errno = errno;
-      return RND_SYSTEM_ERROR;
-   }
-   else
-      return RND_SUCCESS;
+   RND_PROBE2(read_block_head_entry, offset, bytes_to_read);
+   RND_ERROR rval = blocks_read_at(handle, offset, block, bytes_to_read);
+   RND_PROBE2(read_block_head_return, offset, rval);
+
+   return rval;
 }
 
 /**
@@ -175,20 +650,11 @@ RND_ERROR blocks_get_next_block_head(RNDH *handle,
 
    if (block->next_block.offset)
    {
-      // Save value before fread overwrites *block*
+      // Save value before the read overwrites *block*
       off_t saved_nextblock_offset = block->next_block.offset;
 
-      if (fseek(handle->file, block->next_block.offset, SEEK_SET)
-          || !fread(nextblock, sizeof(INFO_BLOCK), 1, handle->file))
-      {
-         handle->sys_errno = errno;
-         rval = RND_SYSTEM_ERROR;
-      }
-      else
-      {
+      if (!(rval = blocks_read_at(handle, saved_nextblock_offset, nextblock, sizeof(INFO_BLOCK))))
          *nextblock_offset = saved_nextblock_offset;
-         rval = RND_SUCCESS;
-      }
    }
 
    return rval;
@@ -214,17 +680,164 @@ RND_ERROR blocks_get_next_block_head(RNDH *handle,
 RND_ERROR blocks_write_block_head(RNDH *handle, off_t offset, INFO_BLOCK *block, int info_len)
 {
    int len_to_write = blocks_bytes_to_data(block->block_type);
-   if (len_to_write < info_len)
+   if (len_to_write > info_len)
       len_to_write = info_len;
-   
-   if (fseek(handle->file, offset, SEEK_SET)
-       || !fwrite(block, len_to_write, 1, handle->file))
+
+   // The generation is left to `blocks_stamp_block`, which only ever raises it:
+   int stamp_at = offsetof(INFO_BLOCK, generation);
+   int past_stamp = stamp_at + sizeof(block->generation);
+   RND_ERROR rval;
+
+   RND_PROBE2(write_block_head_entry, offset, len_to_write);
+
+   if (!(rval = blocks_write_at(handle, offset, block, len_to_write < stamp_at ? len_to_write : stamp_at))
+       && !(len_to_write > past_stamp
+            && (rval = blocks_write_at(handle, offset + past_stamp, (char*)block + past_stamp, len_to_write - past_stamp))))
+      rval = blocks_stamp_block(handle, offset, block->generation);
+
+   RND_PROBE2(write_block_head_return, offset, rval);
+   return rval;
+}
+
+/** Offset of INFO_FILE::generation in the file. */
+#define BLOCKS_GENERATION_OFFSET (offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, generation))
+
+/**
+ * Maps the file head on first use, for fields that are read on every
+ * change or read, such as INFO_FILE::generation.  The mapping is shared,
+ * so it sees a field change as soon as another handle writes it.
+ *
+ * @param handle  handle to open recnodb database
+ * @param head    [out] the mapped file head
+ */
+RND_ERROR blocks_map_head(RNDH *handle, const RND_HEAD_FILE **head)
+{
+   if (!handle->mapped_head)
+   {
+      void *base = mmap(NULL, sizeof(RND_HEAD_FILE), PROT_READ, MAP_SHARED, fileno(handle->file), 0);
+      if (base == MAP_FAILED)
+      {
+         handle->sys_errno = errno;
+         return RND_SYSTEM_ERROR;
+      }
+
+      handle->mapped_head = (const RND_HEAD_FILE*)base;
+   }
+
+   *head = handle->mapped_head;
+   return RND_SUCCESS;
+}
+
+/**
+ * Reads the file's current generation, after writing out anything
+ * buffered, so the writes come before the read.
+ *
+ * Writers read it on every change, so it is read from the mapped file
+ * head (see `blocks_map_head`), with no system call beyond the flush,
+ * which writes nothing if nothing is buffered.  The mapping sees a
+ * backup advance the generation as soon as the backup writes it.
+ */
+RND_ERROR blocks_read_generation(RNDH *handle, uint64_t *generation)
+{
+   const RND_HEAD_FILE *head;
+   RND_ERROR rval;
+
+   if (fflush(handle->file))
    {
       handle->sys_errno = errno;
       return RND_SYSTEM_ERROR;
    }
-   else
-      return RND_SUCCESS;
+
+   if ((rval = blocks_map_head(handle, &head)))
+      return rval;
+
+   // The writes above must be visible before the read, as the backup's
+   // advance is before its reads of the blocks:
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   *generation = __atomic_load_n(&head->fhead.generation, __ATOMIC_ACQUIRE);
+   return RND_SUCCESS;
+}
+
+/**
+ * Unmaps the file head mapped by `blocks_map_head`.
+ */
+static void blocks_unmap_head(RNDH *handle)
+{
+   if (handle->mapped_head)
+   {
+      munmap((void*)handle->mapped_head, sizeof(RND_HEAD_FILE));
+      handle->mapped_head = NULL;
+   }
+}
+
+/**
+ * Starts a new generation, as a backup does before it copies anything.
+ *
+ * @param handle      handle to open recnodb database
+ * @param generation  [out] the new generation
+ **********************************************************************************/
+RND_ERROR blocks_advance_generation(RNDH *handle, uint64_t *generation)
+{
+   BLOCK_LOC bl = { BLOCKS_GENERATION_OFFSET, sizeof(*generation) };
+   RND_ERROR rval;
+
+   if ((rval = rnd_lock_place(handle, &bl, 1)))
+      return rval;
+
+   if (!(rval = blocks_read_generation(handle, generation)))
+   {
+      ++*generation;
+      if (!(rval = blocks_write_at(handle, BLOCKS_GENERATION_OFFSET, generation, sizeof(*generation)))
+          && fflush(handle->file))
+      {
+         handle->sys_errno = errno;
+         rval = RND_SYSTEM_ERROR;
+      }
+   }
+
+   rnd_lock_remove(handle, &bl);
+   return rval;
+}
+
+/**
+ * Marks a block as changed in the current generation.  Call it after the
+ * change is written.
+ *
+ * A change that reads the generation before a backup advances it was
+ * written before the backup started, so the backup copies it; one that
+ * reads it after is stamped with the new generation, so the next backup
+ * copies it.  The stamp only ever goes up, so a slow writer with an older
+ * generation can't hide a newer change from the next backup.
+ *
+ * @param handle   handle to open recnodb database
+ * @param offset   offset to the block that changed
+ * @param stamped  a generation the block is known to be stamped with
+ *                 already, to skip the lock in the common case, or 0
+ **********************************************************************************/
+RND_ERROR blocks_stamp_block(RNDH *handle, off_t offset, uint64_t stamped)
+{
+   uint64_t generation, current;
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_generation(handle, &generation)) || stamped >= generation)
+      return rval;
+
+   BLOCK_LOC bl = { offset + offsetof(INFO_BLOCK, generation), sizeof(generation) };
+   if ((rval = rnd_lock_place(handle, &bl, 1)))
+      return rval;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+   }
+   else if (!(rval = blocks_read_at(handle, bl.offset, &current, sizeof(current)))
+            && current < generation)
+      rval = blocks_write_at(handle, bl.offset, &generation, sizeof(generation));
+
+   fflush(handle->file);
+   rnd_lock_remove(handle, &bl);
+   return rval;
 }
 /**
  * @brief Prepares a block header
@@ -257,13 +870,18 @@ void blocks_set_info_block(INFO_BLOCK *ib,
    ib->bytes_to_data = bytes_to_data;
    ib->block_size = block_size;
 
+   // Blocks that hold fixed-length records get a liveness map:
+   if (block_type == RBT_TABLE || block_type == RBT_FILE
+       || block_type == RBT_RELATION || block_type == RBT_DATA)
+      blocks_set_record_layout(ib, rec_size);
+
    // If includes INFO_TABLE:
-   if (bytes_to_data > sizeof(INFO_BLOCK))
+   if (block_type == RBT_TABLE || block_type == RBT_FILE || block_type == RBT_RELATION)
    {
       ((RND_HEAD_TABLE*)ib)->thead.rec_size = rec_size;
 
-      // If includes INFO_FILExs
-      if (bytes_to_data > sizeof(INFO_TABLE))
+      // If includes INFO_FILE
+      if (block_type == RBT_FILE)
       {
          assert(chunk_size);
 
@@ -289,8 +907,53 @@ void blocks_set_info_block_struct(INFO_BLOCK *ib,
                          bdef->block_size,
                          bdef->rec_size,
                          bdef->chunk_size);
+
+   if (bdef->max_size && bdef->block_type == RBT_DATA)
+      blocks_set_growable_record_layout(ib, bdef->rec_size, bdef->max_size);
+
+   ib->first_recno = bdef->first_recno;
 }
                            
+/**
+ * Offset of the byte that is locked while a block is added to the end of
+ * the file.  It's far past any data, so it never collides with the record
+ * and header locks.
+ */
+#define BLOCKS_EXTEND_LOCK_OFFSET (INT64_MAX - 1)
+
+/**
+ * Takes or releases the lock that serializes additions to the end of the file.
+ *
+ * Different chains are extended under the locks of their own heads, so
+ * without this lock, two processes extending different chains could both
+ * claim the same end of file.  Unlike the record locks, this one waits,
+ * since it is only held for the few calls it takes to add a block.
+ *
+ * @param handle  handle to open recnodb database
+ * @param lock    TRUE to take the lock, FALSE to release it
+ **********************************************************************************/
+static RND_ERROR blocks_extension_lock(RNDH *handle, bool lock)
+{
+   if (handle->readonly)
+      return lock ? RND_READ_ONLY_HANDLE : RND_SUCCESS;
+
+   struct flock fl;
+   memset(&fl, 0, sizeof(fl));
+
+   fl.l_type = lock ? F_WRLCK : F_UNLCK;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = BLOCKS_EXTEND_LOCK_OFFSET;
+   fl.l_len = 1;
+
+   if (fcntl(fileno(handle->file), LOCK_SETW, &fl) == -1)
+   {
+      handle->sys_errno = errno;
+      return lock ? RND_LOCK_FAILED : RND_UNLOCK_FAILED;
+   }
+
+   return RND_SUCCESS;
+}
+
 /**
  * Prepares block head
  *
@@ -314,12 +977,15 @@ void blocks_set_info_block_struct(INFO_BLOCK *ib,
    ((INFO_BLOCK*)hf)->block_size = block_size;
    ((INFO_BLOCK*)hf)->bytes_to_data = sizeof(RND_HEAD_FILE);
 
+   blocks_set_record_layout((INFO_BLOCK*)hf, rec_size);
+
    // INFO_TABLE
    hf->thead.rec_size = rec_size;
 
    // INFO_FILE
    memcpy(&hf->fhead.magic, "RNDB", 4);
    hf->fhead.chunk_size = chunk_size;
+   hf->fhead.generation = 1;
 }
 
 /**
@@ -330,6 +996,9 @@ void blocks_set_info_block_struct(INFO_BLOCK *ib,
  *
  * @return 0 (RND_SUCCESS) if no errors, otherwise error index.
  * 
+ * The new space is allocated rather than left sparse, and a further
+ * BLOCKS_RESERVE_CHUNKS chunks are reserved past the new end of file.
+ *
  * This function makes no effort to ensure exclusive access.
  * That must be done by the calling function to ensure that
  * two processes don't simultaneously attempt to extend the file.
@@ -342,34 +1011,36 @@ RND_ERROR blocks_extend_file(RNDH *handle, size_t bytes_to_add)
 
    RND_ERROR rval = RND_FAIL;
 
-   if (fseek(handle->file, 0, SEEK_END))
-   {
-      handle->sys_errno = errno;
-      rval = RND_SYSTEM_ERROR;
+   RND_PROBE1(extend_file_entry, bytes_to_add);
+   uint64_t started = LATENCY_START();
+
+   // Find end of file, confirming previous blocks are well-placed
+   off_t  new_block_location;
+   if ((rval = blocks_file_size(handle, &new_block_location)))
       goto abandon_function;
-   }
 
-   // Move to end of file, confirming previous blocks are well-placed
-   off_t  new_block_location = ftell(handle->file);
    if (!blocks_validate_new_block_location(handle, new_block_location))
    {
       rval = RND_INVALID_BLOCK_LOCATION;
       goto abandon_function;
    }
 
-   // Write the end-of-block to ensure no problems
-   if (fseek(handle->file, bytes_to_add-1, SEEK_END)
-       || !fwrite("\0", 1, 1, handle->file)
-       || fseek(handle->file, new_block_location, SEEK_SET))
-   {
-      handle->sys_errno = errno;
-      rval = RND_SYSTEM_ERROR;
+   if ((rval = blocks_allocate(handle, new_block_location, bytes_to_add, 0)))
+      goto abandon_function;
+
+   // Stay ahead of a growing file so successive blocks are contiguous:
+   off_t ahead = (off_t)handle->head_file.fhead.chunk_size * BLOCKS_RESERVE_CHUNKS;
+   if (ahead < (off_t)bytes_to_add)
+      ahead = bytes_to_add;
+
+   if ((rval = blocks_allocate(handle, new_block_location + bytes_to_add, ahead, 1)))
       goto abandon_function;
-   }
 
    rval = RND_SUCCESS;
 
   abandon_function:
+   LATENCY_RECORD(RND_LATENCY_EXTEND, started);
+   RND_PROBE2(extend_file_return, bytes_to_add, rval);
    return rval;
 }
 
@@ -397,26 +1068,18 @@ RND_ERROR blocks_append_block(RNDH *handle, RND_BLOCK_DEF *bdef)
    
    RND_ERROR rval = RND_FAIL;
 
-   // Saving file positions at start and EOF
-   off_t original_file_position = 0, new_block_position;
-   
-   if (-1 == (original_file_position = ftell(handle->file))
-       || fseek(handle->file, 0, SEEK_END)
-       || -1 == (new_block_position = ftell(handle->file)))
-   {
-      handle->sys_errno = errno;
-      rval = RND_SYSTEM_ERROR;
+   if ((rval = blocks_extension_lock(handle, 1)))
+      goto abandon_function;
 
-      if (original_file_position)
-         goto restore_file_position;
-      else
-         goto abandon_function;
-   }
+   // The new block starts at the current end of file
+   off_t new_block_position;
+   if ((rval = blocks_file_size(handle, &new_block_position)))
+      goto abandon_lock;
 
    // Extend file
    size_t bytes_to_add = bdef->block_size;
    if ((rval = blocks_extend_file(handle, bytes_to_add)))
-      goto restore_file_position;
+      goto abandon_lock;
 
    // Prepare and write block head of new block.
    // create scope to manage lifetime of blockbuff VLA
@@ -427,16 +1090,17 @@ RND_ERROR blocks_append_block(RNDH *handle, RND_BLOCK_DEF *bdef)
       blocks_set_info_block_struct((INFO_BLOCK*)blockbuff, head_size, bdef);
 
       if ((rval = blocks_write_block_head(handle, new_block_position, (INFO_BLOCK*)blockbuff, head_size)))
-         goto restore_file_position;
+         goto abandon_lock;
    }
 
    // Everything has worked, prepare return values (rval and [out] data member):
    bdef->new_block.offset = new_block_position;
    bdef->new_block.size = bytes_to_add;
    rval = RND_SUCCESS;
-         
-  restore_file_position:
-   fseek(handle->file, original_file_position, SEEK_SET);
+   STATS_ADD(handle, blocks_appended, 1);
+
+  abandon_lock:
+   blocks_extension_lock(handle, 0);
 
   abandon_function:
    return rval;
@@ -464,10 +1128,14 @@ void blocks_update_link_with_child(INFO_BLOCK *ib, BLOCK_LOC *new_block)
  * @param handle     handle to an open recno database
  * @param chain_end  offset to the current terminating link of this chain
  * @param bdef       parameters for block request
+ * @param chain      [in/out] optional chain information of the chain's head
+ *                   block.  If not NULL, it must describe *chain_end* as the
+ *                   last block, and it is updated to describe the new block.
+ *                   The caller is responsible for writing it back.
  *
  * @return standard library return value
  **********************************************************************************/
-RND_ERROR blocks_extend_chain(RNDH *handle, off_t chain_end, RND_BLOCK_DEF *bdef)
+RND_ERROR blocks_extend_chain(RNDH *handle, off_t chain_end, RND_BLOCK_DEF *bdef, INFO_CHAIN *chain)
 {
    prime_handle(handle);
 
@@ -499,15 +1167,193 @@ RND_ERROR blocks_extend_chain(RNDH *handle, off_t chain_end, RND_BLOCK_DEF *bdef
 
       if ((rval = blocks_write_block_head(handle, chain_end, ib, head_size)))
          goto abandon_function;
+
+      if (chain)
+      {
+         chain->chain_offset += ib->block_size;
+         chain->block_penultimate = chain_end;
+         chain->block_last = bdef->new_block.offset;
+      }
+   }
+
+  abandon_function:
+   return rval;
+}
+
+/**
+ * Grows a block in place, which is possible only for the last block in the file.
+ *
+ * The block's header and the link to it from its parent are updated with
+ * the new size.  The record layout of the block is unchanged, so the
+ * block must have been created with a liveness map large enough for the
+ * records of the new size (see `blocks_set_growable_record_layout`).
+ *
+ * As with `blocks_extend_file`, the caller must ensure exclusive access.
+ *
+ * @param handle    handle to an open recno database
+ * @param offset    offset to the block to grow
+ * @param parent    offset to the block that links to the block to grow
+ * @param new_size  new size of the block, a multiple of the file's chunk size
+ *
+ * @return RND_INVALID_BLOCK_LOCATION if the block doesn't end the file,
+ *         RND_INVALID_BLOCK_SIZE if *new_size* wouldn't grow the block.
+ **********************************************************************************/
+RND_ERROR blocks_grow_block(RNDH *handle, off_t offset, off_t parent, uint32_t new_size)
+{
+   prime_handle(handle);
+
+   RND_ERROR rval;
+   INFO_BLOCK ib, ib_parent;
+   off_t eof;
+
+   if ((rval = blocks_extension_lock(handle, 1)))
+      goto abandon_function;
+
+   if ((rval = blocks_read_block_head(handle, offset, &ib, sizeof(ib)))
+       || (rval = blocks_read_block_head(handle, parent, &ib_parent, sizeof(ib_parent)))
+       || (rval = blocks_file_size(handle, &eof)))
+      goto abandon_lock;
+
+   if (offset + ib.block_size != eof || ib_parent.next_block.offset != offset)
+   {
+      rval = RND_INVALID_BLOCK_LOCATION;
+      goto abandon_lock;
    }
 
+   if (new_size <= ib.block_size)
+   {
+      rval = RND_INVALID_BLOCK_SIZE;
+      goto abandon_lock;
+   }
+
+   if ((rval = blocks_extend_file(handle, new_size - ib.block_size)))
+      goto abandon_lock;
+
+   ib.block_size = new_size;
+   ib_parent.next_block.size = new_size;
+
+   if ((rval = blocks_write_block_head(handle, offset, &ib, sizeof(ib))))
+      goto abandon_lock;
+
+   rval = blocks_write_block_head(handle, parent, &ib_parent, sizeof(ib_parent));
+
+  abandon_lock:
+   blocks_extension_lock(handle, 0);
+
   abandon_function:
    return rval;
 }
 
+#ifdef O_DIRECT
+/**
+ * Gets the alignment O_DIRECT transfers of an open file need, of both
+ * their offsets and their buffers.
+ *
+ * Linux reports it for a file with statx(STATX_DIOALIGN), and for a
+ * block device, the logical sector size, with BLKSSZGET.  Elsewhere, or
+ * on older kernels, the preferred I/O block size stands in; it is a
+ * multiple of the logical block size, only larger than needed.
+ *
+ * @return 0, or an errno value: EINVAL if the file can't do direct I/O.
+ **********************************************************************************/
+static int blocks_direct_alignment(int fd, const struct stat *st, uint32_t *align)
+{
+#ifdef __linux__
+   if (S_ISBLK(st->st_mode))
+   {
+      int sector_size;
+      if (ioctl(fd, BLKSSZGET, &sector_size) == -1)
+         return errno;
+
+      *align = (uint32_t)sector_size;
+      return 0;
+   }
+
+#ifdef STATX_DIOALIGN
+   struct statx stx;
+   if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN))
+   {
+      if (stx.stx_dio_offset_align == 0)
+         return EINVAL;
+
+      // Both are powers of two, so the larger is a multiple of the other:
+      *align = stx.stx_dio_offset_align > stx.stx_dio_mem_align
+         ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+      return 0;
+   }
+#endif
+#endif
+
+   *align = (uint32_t)st->st_blksize;
+   return 0;
+}
+#endif
+
+/**
+ * Opens the database file with O_DIRECT and prepares the handle's
+ * aligned buffer pool, aligned as `blocks_direct_alignment` finds.
+ *
+ * @param path         path to database to open
+ * @param create_mode  TRUE to create or truncate the file
+ * @param handle       [out] handle to receive the alignment and buffer pool
+ *
+ * @return opened stream, used only for its descriptor, or NULL with
+ *         handle::sys_errno set.
+ **********************************************************************************/
+static FILE *blocks_open_direct(const char *path, bool create_mode, RNDH *handle)
+{
+#ifdef O_DIRECT
+   int oflags = O_RDWR | O_DIRECT | (create_mode ? O_CREAT | O_TRUNC : 0);
+   struct stat st;
+   FILE *f = NULL;
+
+   int fd = open(path, oflags, 0666);
+   if (fd == -1)
+      goto system_error;
+
+   if (fstat(fd, &st) || !(f = fdopen(fd, "r+b")))
+   {
+      close(fd);
+      goto system_error;
+   }
+
+   int align_errno = blocks_direct_alignment(fd, &st, &handle->io_align);
+   if (align_errno)
+   {
+      fclose(f);
+      handle->sys_errno = align_errno;
+      return NULL;
+   }
+
+   if (bufpool_create(handle, handle->io_align))
+   {
+      fclose(f);
+      return NULL;
+   }
+
+   return f;
+
+  system_error:
+   handle->sys_errno = errno;
+   return NULL;
+#else
+   handle->sys_errno = EINVAL;
+   return NULL;
+#endif
+}
+
 /** *******************************************************************************
  * Open file, preparing supplied RNDH handle.
  *
+ * With RND_DIRECT in *flags*, the file is opened with O_DIRECT so blocks
+ * are not also cached by the kernel, and all transfers are made through
+ * a fixed pool of aligned buffers.  The file's *chunk_size* must then be
+ * a multiple of the device's logical block size.
+ *
+ * With RND_READONLY, the file is opened O_RDONLY and read through a
+ * shared read-only mapping (see `blocks_mapped_read`), and the handle
+ * takes no locks.  Writes through it fail with RND_READ_ONLY_HANDLE.
+ *
  * @param path       path to database to open
  * @param flags      options for opening database
  * @param chunk_size minimum length for which a file is extended
@@ -521,8 +1367,6 @@ RND_ERROR blocks_file_open(const char *path,
                            uint32_t rec_size,
                            RNDH *handle)
 {
-   prime_handle(handle);
-   
    RND_ERROR rval;
 
    if (!handle)
@@ -537,60 +1381,73 @@ RND_ERROR blocks_file_open(const char *path,
    memset(handle, 0, sizeof(RNDH));
 
    bool create_mode = (flags & RND_CREATE) != 0;
-   const char *fopen_mode = create_mode ? "w+b" : "r+b";
-   FILE *f = fopen(path, fopen_mode);
+   bool direct_mode = (flags & RND_DIRECT) != 0;
+   bool readonly = (flags & RND_READONLY) != 0;
+   const char *fopen_mode = create_mode ? "w+b" : readonly ? "rb" : "r+b";
+
+   // A read-only handle reads through the page cache, by way of its mapping:
+   if (readonly && (create_mode || direct_mode))
+   {
+      rval = RND_BAD_PARAMETER;
+      goto abandon_function;
+   }
+
+   FILE *f = direct_mode
+      ? blocks_open_direct(path, create_mode, handle)
+      : fopen(path, fopen_mode);
+
    if (!f)
    {
-      handle->sys_errno = errno;
+      if (!handle->sys_errno)
+         handle->sys_errno = errno;
       rval = RND_SYSTEM_ERROR;
       goto abandon_function;
    }
 
+   handle->file = f;
+   handle->readonly = readonly;
+   stats_open(handle);
+
    if (create_mode)
    {
-      // Establish first empty block and leave file stream
-      // pointer at the beginning of the file
-      if (fseek(f, chunk_size-1, SEEK_SET)
-          || !fwrite("0", 1, 1, f)
-          || fseek(f, 0, SEEK_SET))
+      if (handle->io_align && chunk_size % handle->io_align)
       {
-         handle->sys_errno = errno;
-         rval = RND_SYSTEM_ERROR;
+         rval = RND_INVALID_BLOCK_SIZE;
          goto abandon_file;
       }
 
+      // Establish first empty block
+      if ((rval = blocks_allocate(handle, 0, chunk_size, 0)))
+         goto abandon_file;
+
       // Prepare and write the file header
       blocks_prep_head_file(&handle->head_file, chunk_size, chunk_size, rec_size);
-      if (!fwrite(&handle->head_file, sizeof(RND_HEAD_FILE), 1, f))
-      {
-         handle->sys_errno = errno;
-         rval = RND_SYSTEM_ERROR;
+      if ((rval = blocks_write_at(handle, 0, &handle->head_file, sizeof(RND_HEAD_FILE))))
          goto abandon_file;
-      }
    }
    else
    {
-      if (!fread(&handle->head_file, sizeof(RND_HEAD_FILE), 1, f))
-      {
-         handle->sys_errno = errno; 
-         rval = RND_SYSTEM_ERROR;
+      if ((rval = blocks_read_at(handle, 0, &handle->head_file, sizeof(RND_HEAD_FILE))))
          goto abandon_file;
-      }
    }
 
-   handle->file = f;
-
    if ((rval = blocks_validate_handle(handle)))
    {
       // rval = RND_INVALID_RECNODB_FILE;
       goto abandon_file;
    }
 
+   if (handle->io_align && handle->head_file.fhead.chunk_size % handle->io_align)
+   {
+      rval = RND_INVALID_BLOCK_SIZE;
+      goto abandon_file;
+   }
+
    assert(rval == RND_SUCCESS);
    goto exit_function;
 
   abandon_file:
-   fclose(f);
+   blocks_file_close(handle);
 
   exit_function:
   abandon_function:
@@ -604,6 +1461,15 @@ void blocks_file_close(RNDH *handle)
       fclose(handle->file);
       handle->file = NULL;
    }
+
+   if (handle)
+   {
+      cache_free(handle);
+      bufpool_free(handle);
+      mapping_free(handle);
+      blocks_unmap_head(handle);
+      stats_close(handle);
+   }
 }
 
 
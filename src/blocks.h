@@ -13,7 +13,14 @@ typedef enum {
    RBT_GENERIC,      /**< Unspecified block type                                */
    RBT_DATA,         /**< Block with unspecified contents, determined by parent */
    RBT_TABLE,        /**< Block with fixed-length records                       */
-   RBT_FILE          /**< First block in file, includes INFO_TABLE members      */
+   RBT_FILE,         /**< First block in file, includes INFO_TABLE members      */
+   RBT_INDEX,        /**< Head of a key index, see hashindex.h                  */
+   RBT_RELATION,     /**< Head of many-to-one relationships, see relations.h    */
+   RBT_BTREE,        /**< Head of an ordered field index, see btree.h           */
+   RBT_BTREE_NODE,   /**< Node of an ordered field index                        */
+   RBT_UNDO,         /**< Undo log of the transaction being committed, see txn.h */
+   RBT_SNAPSHOT,     /**< Head of the log of records copied for snapshots, see snapshot.h */
+   RBT_CHANGES       /**< Head of the log of changes to records, see changes.h */
 } BTYPE;
 
 /*************************
@@ -24,14 +31,40 @@ typedef struct rnd_block_location {
    off_t size;               /**< Size, in bytes, of referenced block */
 } BLOCK_LOC;
 
+typedef enum {
+   RBF_COMPRESSED = 1,  /**< Payload is stored compressed, see INFO_BLOCK::stored_size */
+   RBF_CHANGING = 2     /**< Payload is being compressed or expanded, see compress.c */
+} BFLAGS;
+
+typedef enum {
+   RFF_COMPRESSED = 1   /**< Some block has been compressed, see `compress_check_read` */
+} FFLAGS;
+
+/** Alignment of the first record in a block of fixed-length records. */
+#define RND_RECORD_ALIGN 64
+
 struct rnd_info_block {
-   uint16_t   block_type;    /**< BTYPE enum from above                                 */
-   uint16_t   bytes_to_data; /**< Offset to data from top of block                      */
-   uint32_t   block_size;    /**< Size, in bytes, of block                              */
-   uint64_t   first_recno;   /**< Record number of first record in this block           */
-   BLOCK_LOC  next_block;    /**< Reference to following block (0s if this is the tail) */
+   uint16_t   block_type;       /**< BTYPE enum from above                                 */
+   uint16_t   bytes_to_data;    /**< Offset to data from top of block                      */
+   uint32_t   block_size;       /**< Size, in bytes, of block                              */
+   uint32_t   bytes_to_records; /**< Offset to first record, past the liveness map         */
+   uint32_t   map_bits;         /**< Number of records the liveness map can track          */
+   uint16_t   block_flags;      /**< BFLAGS values                                         */
+   uint16_t   rewrites;         /**< Times the payload was compressed or expanded, wrapping */
+   uint32_t   stored_size;      /**< Bytes of compressed payload if RBF_COMPRESSED         */
+   uint64_t   first_recno;      /**< Record number of first record in this block           */
+   BLOCK_LOC  next_block;       /**< Reference to following block (0s if this is the tail) */
+   uint64_t   generation;       /**< INFO_FILE::generation when last changed, see `blocks_stamp_block` */
 };
 
+/**
+ * Shortcut to the end of a chain, kept in the chain's head block.
+ *
+ * The members are maintained by `blocks_extend_chain` and are only hints:
+ * *block_last* is trusted only while the block it names is still the
+ * end of the chain, and a chain whose head has a *next_block* and a zero
+ * *block_last* (a file from before the hints) is walked instead.
+ */
 struct rnd_info_chain {
    off_t chain_offset;        /**< sum of the lengths of all the previous links in this chain   */
                               /**< This value, along with this::block_size, this::rec_size, and */
@@ -51,12 +84,94 @@ struct rnd_info_table {
 struct rnd_info_file {
    char     magic[4];        /**< "RCNO"                                               */
    uint32_t chunk_size;      /**< Minimum-divisible size of newly-allocated file space */
+   off_t    index_head;      /**< Offset to the head of the key index, 0 if none       */
+   off_t    relation_head;   /**< Offset to the head of the relationships, 0 if none   */
+   off_t    btree_head;      /**< Offset to the head of the first field index, 0 if none */
+   off_t    undo_head;       /**< Offset to the transaction undo log block, 0 if none  */
+   off_t    snapshot_head;   /**< Offset to the head of the snapshot log, 0 if none    */
+   uint64_t generation;      /**< Stamped on blocks as they change, advanced by backups */
+   off_t    changes_head;    /**< Offset to the head of the change log, 0 if not kept  */
+   uint32_t file_flags;      /**< FFLAGS values                                        */
+   char     pad[4];
+};
+
+/** Number of bucket segments an index can have, see hashindex.c */
+#define RND_INDEX_SEGMENTS 28
+
+struct rnd_info_index {
+   uint32_t page_size;        /**< Size of a bucket page, the chunk size at creation  */
+   uint32_t base_buckets;     /**< Number of buckets before the first split           */
+   uint32_t level;            /**< Number of times the bucket count has doubled       */
+   uint32_t split;            /**< Next bucket to split in this level                 */
+   uint64_t key_count;        /**< Number of keys in the index                        */
+   uint64_t bytes_used;       /**< Bytes of entries in all buckets                    */
+   off_t    free_pages;       /**< First of a list of released overflow pages         */
+   off_t    spare_next;       /**< Next never-used overflow page                      */
+   off_t    spare_end;        /**< End of the block that holds *spare_next*           */
+   off_t    segments[RND_INDEX_SEGMENTS]; /**< Offsets to the first page of each segment */
+};
+
+struct rnd_info_relation {
+   uint32_t segment_size;     /**< Size of a segment of a child list                  */
+   char     pad[4];
+   uint64_t children;         /**< Number of parent-child pairs                       */
+   off_t    segment_chain;    /**< First block of the chain of segment blocks         */
+   off_t    segment_last;     /**< Last block of the chain of segment blocks          */
+   off_t    spare_next;       /**< Next never-used segment                            */
+   off_t    spare_end;        /**< End of the block that holds *spare_next*           */
+   off_t    free_segments;    /**< First of a list of released segments               */
+};
+
+struct rnd_info_btree {
+   off_t    table_head;       /**< Head block of the indexed table                    */
+   off_t    next_btree;       /**< Head of the file's next field index, 0 if last     */
+   off_t    root;             /**< Root node of the tree                              */
+   uint64_t entries;          /**< Number of (value, recno) entries                   */
+   uint32_t field_offset;     /**< Offset of the indexed field in each record         */
+   uint32_t field_width;      /**< Bytes in the indexed field                         */
+   uint32_t field_type;       /**< RND_FIELD_TYPE of the indexed field                */
+   uint32_t node_size;        /**< Size of each node block                            */
+   uint32_t height;           /**< Levels of nodes, 1 while the root is a leaf        */
+   char     pad[4];
+};
+
+/** INFO_UNDO::state values */
+typedef enum {
+   RND_UNDO_EMPTY = 0,   /**< No commit is under way                                */
+   RND_UNDO_PENDING      /**< A commit is writing records, roll them back if found  */
+} RND_UNDO_STATE;
+
+struct rnd_info_undo {
+   uint32_t state;            /**< RND_UNDO_STATE value                               */
+   uint32_t entries;          /**< Number of records in the log                       */
+   uint64_t bytes;            /**< Bytes of log entries after the block head          */
+   uint64_t checksum;         /**< Of the entries, to tell a whole log from a torn one */
+};
+
+struct rnd_info_snapshot {
+   uint64_t epoch;            /**< Snapshots ever opened, and so the newest one's epoch */
+   uint64_t resets;           /**< Times the log was emptied                            */
+   uint64_t entries;          /**< Records copied into the log since it was emptied     */
+   off_t    tail;             /**< Block of the log that takes the next copy            */
+   uint32_t tail_used;        /**< Bytes of the tail block's payload in use             */
+   char     pad[4];
+};
+
+struct rnd_info_changes {
+   uint64_t entries;          /**< Changes ever logged, and so the position of the next */
+   off_t    tail;             /**< Block of the log that takes the next entry           */
 };
 
 typedef struct rnd_info_block INFO_BLOCK;
 typedef struct rnd_info_chain INFO_CHAIN;
 typedef struct rnd_info_table INFO_TABLE;
 typedef struct rnd_info_file  INFO_FILE;
+typedef struct rnd_info_index INFO_INDEX;
+typedef struct rnd_info_relation INFO_RELATION;
+typedef struct rnd_info_btree INFO_BTREE;
+typedef struct rnd_info_undo INFO_UNDO;
+typedef struct rnd_info_snapshot INFO_SNAPSHOT;
+typedef struct rnd_info_changes INFO_CHANGES;
 
 typedef struct rnd_info_block RND_HEAD_BLOCK;
 
@@ -73,6 +188,39 @@ typedef struct rnd_head_file {
    INFO_FILE   fhead;   /**< Only one file head per file, it's the rarest and thus last element */
 } RND_HEAD_FILE;
 
+typedef struct rnd_head_index {
+   INFO_BLOCK  bhead;
+   INFO_CHAIN  chead;   /**< Segment and overflow blocks are chained from the head */
+   INFO_INDEX  ihead;
+} RND_HEAD_INDEX;
+
+typedef struct rnd_head_relation {
+   INFO_BLOCK    bhead;
+   INFO_CHAIN    chead;
+   INFO_TABLE    thead;   /**< The head starts a table of child lists, by parent recno */
+   INFO_RELATION rhead;
+} RND_HEAD_RELATION;
+
+typedef struct rnd_head_btree {
+   INFO_BLOCK  bhead;
+   INFO_BTREE  bthead;
+} RND_HEAD_BTREE;
+
+typedef struct rnd_head_undo {
+   INFO_BLOCK  bhead;
+   INFO_UNDO   uhead;
+} RND_HEAD_UNDO;
+
+typedef struct rnd_head_snapshot {
+   INFO_BLOCK     bhead;
+   INFO_SNAPSHOT  shead;
+} RND_HEAD_SNAPSHOT;
+
+typedef struct rnd_head_changes {
+   INFO_BLOCK     bhead;
+   INFO_CHANGES   chhead;
+} RND_HEAD_CHANGES;
+
 /** *********************
  * Block creation structs
  ***********************/
@@ -82,15 +230,30 @@ typedef struct rnd_new_block_definition {
    uint32_t  rec_size;        /**< Number of bytes in fixed-length records       */
    uint32_t  chunk_size;      /**< Minimum allocation multiplier (RBT_FILE only) */
    BLOCK_LOC new_block;       /**< [out] where new block can be found            */
+   uint64_t  first_recno;     /**< Record number of first record in new block    */
+   uint32_t  max_size;        /**< Size to which the block may grow in place     */
+   char      pad[4];
 } RND_BLOCK_DEF;
 
 RND_ERROR blocks_validate_head_file(const RND_HEAD_FILE *head_file);
 RND_ERROR blocks_validate_handle(const RNDH *handle);
 
+RND_ERROR blocks_read_at(RNDH *handle, off_t offset, void *buffer, size_t len);
+RND_ERROR blocks_write_at(RNDH *handle, off_t offset, const void *buffer, size_t len);
+RND_ERROR blocks_file_size(RNDH *handle, off_t *size);
+RND_ERROR blocks_reserve(RNDH *handle, off_t bytes);
+RND_ERROR blocks_truncate_file(RNDH *handle, off_t size);
+
 uint16_t blocks_bytes_to_data(uint16_t block_type);
 uint32_t blocks_block_payload_size(const INFO_BLOCK *block);
+void blocks_set_record_layout(INFO_BLOCK *ib, uint32_t rec_size);
+void blocks_set_growable_record_layout(INFO_BLOCK *ib, uint32_t rec_size, uint32_t max_size);
 RND_ERROR blocks_read_block_head(RNDH *handle, off_t offset, INFO_BLOCK *block, int info_len);
 RND_ERROR blocks_write_block_head(RNDH *handle, off_t offset, INFO_BLOCK *block, int info_len);
+RND_ERROR blocks_map_head(RNDH *handle, const RND_HEAD_FILE **head);
+RND_ERROR blocks_read_generation(RNDH *handle, uint64_t *generation);
+RND_ERROR blocks_advance_generation(RNDH *handle, uint64_t *generation);
+RND_ERROR blocks_stamp_block(RNDH *handle, off_t offset, uint64_t stamped);
 RND_ERROR blocks_get_next_block_head(RNDH *handle,
                                      const INFO_BLOCK *block,
                                      INFO_BLOCK *nextblock,
@@ -127,7 +290,8 @@ RND_ERROR blocks_file_use(const char *path,
 RND_ERROR blocks_extend_file(RNDH *handle, size_t bytes_to_add);
 RND_ERROR blocks_append_block(RNDH *handle, RND_BLOCK_DEF *bdef);
 
-RND_ERROR blocks_extend_chain(RNDH *handle, off_t parent, RND_BLOCK_DEF *bref);
+RND_ERROR blocks_extend_chain(RNDH *handle, off_t parent, RND_BLOCK_DEF *bref, INFO_CHAIN *chain);
+RND_ERROR blocks_grow_block(RNDH *handle, off_t offset, off_t parent, uint32_t new_size);
 
 
 #endif
@@ -0,0 +1,965 @@
+/** @file
+ *
+ * Ordered secondary indexes: B+trees of (field value, recno) over a
+ * fixed-offset field of the records of a table.
+ *
+ * Each index starts at an RBT_BTREE head block.  The heads of a file's
+ * indexes form a list that starts at INFO_FILE::btree_head, which the
+ * `flatrecs` functions consult to keep the indexes of a table current
+ * as its records are appended, replaced and deleted.
+ *
+ * Every node is an RBT_BTREE_NODE block of *node_size* bytes.  Field
+ * values are stored as order-preserving 64-bit keys (see
+ * `btree_field_key`), and entries are ordered by key, then by recno, so
+ * every entry is unique.  A branch entry holds the smallest (key, recno)
+ * of its child, except that the first entry of a branch stands for every
+ * smaller key.  Leaves are linked in order for range iteration.
+ *
+ * An index built over an existing table (see `btree_create`) fills its
+ * nodes to BTREE_BULK_PERCENT and writes them in order, so the leaves are
+ * contiguous in the file.  Inserts split full nodes in half; deletes
+ * don't merge nodes, and an emptied leaf stays in the chain of leaves.
+ *
+ * Every operation holds the lock on the index head, so, like other
+ * locks in the library, a busy index fails with RND_LOCK_FAILED rather
+ * than wait.  Ranges hold it shared, so only changes make it busy for
+ * them.
+ */
+
+#include "btree.h"
+#include "extra.h"
+#include "locks.h"
+#include "flatrecs.h"
+#include "scan.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <stdlib.h>   // for malloc(), qsort()
+#include <string.h>
+
+#define BTREE_NODE_BYTES    4096   /**< Size of a node, rounded up to whole chunks */
+#define BTREE_MAX_HEIGHT    16
+#define BTREE_BULK_PERCENT  90     /**< Fill level of the nodes of a bulk build    */
+
+/** Header of a node, following its INFO_BLOCK. */
+typedef struct btree_node {
+   uint32_t level;     /**< 0 for leaves, the height above the leaves for branches */
+   uint32_t count;     /**< Number of entries                                     */
+   off_t    next;      /**< Next leaf, 0 if last (leaves only)                    */
+} BT_NODE;
+
+/** An entry of a node. */
+typedef struct btree_entry {
+   uint64_t key;
+   uint32_t recno;
+   char     pad[4];
+   off_t    child;     /**< Child node (branches only) */
+} BT_ENTRY;
+
+typedef enum {
+   BTA_CHANGE,
+   BTA_RANGE
+} BT_ACTION;
+
+typedef struct btree_closure {
+   rnd_range_view viewer;
+   void           *caller_closure;
+   uint64_t       old_key;     /**< Key to remove, or low key of a range  */
+   uint64_t       new_key;     /**< Key to add, or high key of a range    */
+   uint32_t       recno;
+   BT_ACTION      action;
+   bool           has_old;
+   bool           has_new;
+   RND_ERROR      rval;
+   char           pad[4];
+} BT_CLO;
+
+/**
+ * Converts a field value to a 64-bit key whose unsigned order is the
+ * order of the values.
+ *
+ * @param type   interpretation of the field
+ * @param width  bytes in the field: 1, 2, 4 or 8, and only 4 or 8 for RND_FIELD_FLOAT
+ * @param field  the value, in native byte order
+ */
+uint64_t btree_field_key(RND_FIELD_TYPE type, uint32_t width, const void *field)
+{
+   uint64_t key = 0;
+   int64_t skey = 0;
+   double dkey = 0;
+
+   switch(width)
+   {
+      case 1:
+      {
+         uint8_t u; int8_t s;
+         memcpy(&u, field, 1); memcpy(&s, field, 1);
+         key = u; skey = s;
+         break;
+      }
+      case 2:
+      {
+         uint16_t u; int16_t s;
+         memcpy(&u, field, 2); memcpy(&s, field, 2);
+         key = u; skey = s;
+         break;
+      }
+      case 4:
+      {
+         uint32_t u; int32_t s; float f;
+         memcpy(&u, field, 4); memcpy(&s, field, 4); memcpy(&f, field, 4);
+         key = u; skey = s; dkey = f;
+         break;
+      }
+      default:
+         memcpy(&key, field, 8); memcpy(&skey, field, 8); memcpy(&dkey, field, 8);
+         break;
+   }
+
+   switch(type)
+   {
+      case RND_FIELD_INT:
+         return (uint64_t)skey ^ ((uint64_t)1 << 63);
+
+      case RND_FIELD_FLOAT:
+         // -0.0 and 0.0 are equal:
+         if (dkey == 0)
+            dkey = 0;
+
+         memcpy(&key, &dkey, sizeof(key));
+         return (key & (uint64_t)1 << 63) ? ~key : key | (uint64_t)1 << 63;
+
+      default:
+         return key;
+   }
+}
+
+/**
+ * Key of the indexed field of a record of *size* bytes, which is
+ * zero-filled to the record size as `flatrecs_write_slot` does.
+ */
+static uint64_t btree_record_key(const INFO_BTREE *bt, const void *record, uint32_t size)
+{
+   unsigned char field[8] = { 0 };
+
+   if (bt->field_offset < size)
+   {
+      uint32_t available = size - bt->field_offset;
+      memcpy(field,
+             (const char*)record + bt->field_offset,
+             available < bt->field_width ? available : bt->field_width);
+   }
+
+   return btree_field_key((RND_FIELD_TYPE)bt->field_type, bt->field_width, field);
+}
+
+static BT_NODE *btree_node_head(char *node)
+{
+   return (BT_NODE*)(node + sizeof(INFO_BLOCK));
+}
+
+static BT_ENTRY *btree_entries(char *node)
+{
+   return (BT_ENTRY*)(node + sizeof(INFO_BLOCK) + sizeof(BT_NODE));
+}
+
+/**
+ * Number of entries that fit in a node.
+ */
+static uint32_t btree_capacity(uint32_t node_size)
+{
+   return (node_size - sizeof(INFO_BLOCK) - sizeof(BT_NODE)) / sizeof(BT_ENTRY);
+}
+
+/**
+ * Allocates a node buffer with room for one entry past capacity, the
+ * overflow that triggers a split.
+ */
+static char *btree_alloc_node(RNDH *handle, uint32_t node_size)
+{
+   char *node = (char*)malloc(node_size + sizeof(BT_ENTRY));
+   if (!node)
+      handle->sys_errno = errno;
+
+   return node;
+}
+
+static int btree_compare(uint64_t key, uint32_t recno, const BT_ENTRY *entry)
+{
+   if (key != entry->key)
+      return key < entry->key ? -1 : 1;
+
+   return recno < entry->recno ? -1 : recno > entry->recno;
+}
+
+/**
+ * Index of the first entry at or past (key, recno), searching from *from*.
+ */
+static uint32_t btree_lower_bound(const BT_ENTRY *entries, uint32_t from, uint32_t count, uint64_t key, uint32_t recno)
+{
+   uint32_t low = from, high = count;
+
+   while (low < high)
+   {
+      uint32_t mid = low + (high - low) / 2;
+      if (btree_compare(key, recno, &entries[mid]) > 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+
+   return low;
+}
+
+/**
+ * Index of the entry of a branch whose child holds (key, recno).
+ */
+static uint32_t btree_child_index(char *node, uint64_t key, uint32_t recno)
+{
+   BT_ENTRY *entries = btree_entries(node);
+   uint32_t count = btree_node_head(node)->count;
+
+   // The first entry covers every smaller key, so search past it:
+   uint32_t pos = btree_lower_bound(entries, 1, count, key, recno);
+   if (pos < count && btree_compare(key, recno, &entries[pos]) == 0)
+      return pos;
+
+   return pos - 1;
+}
+
+static RND_ERROR btree_read_node(RNDH *handle, const INFO_BTREE *bt, off_t offset, char *node)
+{
+   return blocks_read_at(handle, offset, node, bt->node_size);
+}
+
+static RND_ERROR btree_write_node(RNDH *handle, const INFO_BTREE *bt, off_t offset, char *node)
+{
+   return blocks_write_at(handle, offset, node, bt->node_size);
+}
+
+/**
+ * Appends a node block to the file and prepares an empty node for it.
+ */
+static RND_ERROR btree_new_node(RNDH *handle, const INFO_BTREE *bt, uint32_t level, char *node, off_t *offset)
+{
+   RND_BLOCK_DEF bdef = { RBT_BTREE_NODE, bt->node_size };
+   RND_ERROR rval;
+
+   if ((rval = blocks_append_block(handle, &bdef)))
+      return rval;
+
+   memset(node, 0, bt->node_size);
+   blocks_set_info_block((INFO_BLOCK*)node, sizeof(INFO_BLOCK), RBT_BTREE_NODE, bt->node_size, 0, 0);
+   btree_node_head(node)->level = level;
+
+   *offset = bdef.new_block.offset;
+   return RND_SUCCESS;
+}
+
+/**
+ * Reads the nodes from the root to the leaf that holds (key, recno).
+ *
+ * @param path   [out] offsets to the nodes, root first
+ * @param depth  [out] index in *path* of the leaf, which is left in *node*
+ */
+static RND_ERROR btree_descend(RNDH *handle,
+                               const INFO_BTREE *bt,
+                               uint64_t key,
+                               uint32_t recno,
+                               char *node,
+                               off_t *path,
+                               uint32_t *depth)
+{
+   off_t offset = bt->root;
+   RND_ERROR rval;
+
+   for (*depth = 0; ; ++*depth)
+   {
+      if (*depth >= BTREE_MAX_HEIGHT)
+         return RND_INVALID_RECNODB_FILE;
+
+      path[*depth] = offset;
+      if ((rval = btree_read_node(handle, bt, offset, node)))
+         return rval;
+
+      if (btree_node_head(node)->level == 0)
+         return RND_SUCCESS;
+
+      offset = btree_entries(node)[btree_child_index(node, key, recno)].child;
+   }
+}
+
+/**
+ * Adds (key, recno) to the tree, splitting full nodes on the way back
+ * up.  Adding an entry that already exists does nothing.
+ */
+static RND_ERROR btree_insert(RNDH *handle, INFO_BTREE *bt, uint64_t key, uint32_t recno)
+{
+   uint32_t capacity = btree_capacity(bt->node_size);
+   off_t path[BTREE_MAX_HEIGHT];
+   uint32_t depth;
+   RND_ERROR rval = RND_SYSTEM_ERROR;
+
+   char *node = btree_alloc_node(handle, bt->node_size);
+   char *sibling = btree_alloc_node(handle, bt->node_size);
+   if (!node || !sibling)
+      goto abandon_function;
+
+   if ((rval = btree_descend(handle, bt, key, recno, node, path, &depth)))
+      goto abandon_function;
+
+   BT_NODE *nh = btree_node_head(node);
+   BT_ENTRY *entries = btree_entries(node);
+   uint32_t pos = btree_lower_bound(entries, 0, nh->count, key, recno);
+
+   if (pos < nh->count && btree_compare(key, recno, &entries[pos]) == 0)
+      goto abandon_function;
+
+   BT_ENTRY item = { key, recno };
+
+   while (1)
+   {
+      memmove(&entries[pos + 1], &entries[pos], (nh->count - pos) * sizeof(BT_ENTRY));
+      entries[pos] = item;
+      ++nh->count;
+
+      if (nh->count <= capacity)
+      {
+         rval = btree_write_node(handle, bt, path[depth], node);
+         break;
+      }
+
+      // Move the upper half of the full node to a new sibling:
+      off_t sibling_offset;
+      if ((rval = btree_new_node(handle, bt, nh->level, sibling, &sibling_offset)))
+         break;
+
+      BT_NODE *sh = btree_node_head(sibling);
+      uint32_t keep = nh->count / 2;
+
+      sh->count = nh->count - keep;
+      memcpy(btree_entries(sibling), &entries[keep], sh->count * sizeof(BT_ENTRY));
+      nh->count = keep;
+
+      if (nh->level == 0)
+      {
+         sh->next = nh->next;
+         nh->next = sibling_offset;
+      }
+
+      // Write the sibling before the node that links to it:
+      if ((rval = btree_write_node(handle, bt, sibling_offset, sibling))
+          || (rval = btree_write_node(handle, bt, path[depth], node)))
+         break;
+
+      item = btree_entries(sibling)[0];
+      item.child = sibling_offset;
+
+      if (depth == 0)
+      {
+         // The root split, so grow the tree with a new root:
+         off_t root_offset;
+         uint32_t level = nh->level + 1;
+
+         if (bt->height >= BTREE_MAX_HEIGHT
+             || (rval = btree_new_node(handle, bt, level, sibling, &root_offset)))
+            break;
+
+         BT_ENTRY *re = btree_entries(sibling);
+         re[0].child = path[0];
+         re[1] = item;
+         btree_node_head(sibling)->count = 2;
+
+         if ((rval = btree_write_node(handle, bt, root_offset, sibling)))
+            break;
+
+         bt->root = root_offset;
+         ++bt->height;
+         break;
+      }
+
+      // Add the sibling to the parent, after the child that split:
+      --depth;
+      if ((rval = btree_read_node(handle, bt, path[depth], node)))
+         break;
+
+      pos = btree_child_index(node, key, recno) + 1;
+   }
+
+   if (!rval)
+      ++bt->entries;
+
+  abandon_function:
+   free(node);
+   free(sibling);
+   return rval;
+}
+
+/**
+ * Removes (key, recno) from the tree.
+ *
+ * @return RND_KEY_NOT_FOUND if the tree has no such entry.
+ */
+static RND_ERROR btree_remove(RNDH *handle, INFO_BTREE *bt, uint64_t key, uint32_t recno)
+{
+   off_t path[BTREE_MAX_HEIGHT];
+   uint32_t depth;
+   RND_ERROR rval = RND_SYSTEM_ERROR;
+
+   char *node = btree_alloc_node(handle, bt->node_size);
+   if (!node)
+      goto abandon_function;
+
+   if ((rval = btree_descend(handle, bt, key, recno, node, path, &depth)))
+      goto abandon_function;
+
+   BT_NODE *nh = btree_node_head(node);
+   BT_ENTRY *entries = btree_entries(node);
+   uint32_t pos = btree_lower_bound(entries, 0, nh->count, key, recno);
+
+   if (pos == nh->count || btree_compare(key, recno, &entries[pos]) != 0)
+   {
+      rval = RND_KEY_NOT_FOUND;
+      goto abandon_function;
+   }
+
+   memmove(&entries[pos], &entries[pos + 1], (nh->count - pos - 1) * sizeof(BT_ENTRY));
+   --nh->count;
+
+   if (!(rval = btree_write_node(handle, bt, path[depth], node)))
+      --bt->entries;
+
+  abandon_function:
+   free(node);
+   return rval;
+}
+
+/**
+ * Sends the recnos of the entries from *low* to *high* keys to the viewer.
+ */
+static RND_ERROR btree_scan(RNDH *handle, const INFO_BTREE *bt, BT_CLO *clo)
+{
+   off_t path[BTREE_MAX_HEIGHT];
+   uint32_t depth;
+   RND_ERROR rval = RND_SYSTEM_ERROR;
+
+   char *node = btree_alloc_node(handle, bt->node_size);
+   if (!node)
+      goto abandon_function;
+
+   if ((rval = btree_descend(handle, bt, clo->old_key, 0, node, path, &depth)))
+      goto abandon_function;
+
+   BT_NODE *nh = btree_node_head(node);
+   BT_ENTRY *entries = btree_entries(node);
+   uint32_t pos = btree_lower_bound(entries, 0, nh->count, clo->old_key, 0);
+
+   while (1)
+   {
+      for (; pos < nh->count; ++pos)
+      {
+         if (entries[pos].key > clo->new_key
+             || !(*clo->viewer)(entries[pos].recno, clo->caller_closure))
+            goto abandon_function;
+      }
+
+      if (!nh->next)
+         break;
+
+      if ((rval = btree_read_node(handle, bt, nh->next, node)))
+         break;
+
+      pos = 0;
+   }
+
+  abandon_function:
+   free(node);
+   return rval;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the index head locked.
+ */
+bool btree_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   BT_CLO *clo = (BT_CLO*)closure;
+   RND_HEAD_BTREE *hb = (RND_HEAD_BTREE*)locked_buffer;
+   RND_HEAD_BTREE original;
+   memcpy(&original, hb, sizeof(original));
+
+   if (hb->bhead.block_type != RBT_BTREE)
+   {
+      clo->rval = RND_BAD_PARAMETER;
+      return 0;
+   }
+
+   switch(clo->action)
+   {
+      case BTA_CHANGE:
+         // An unchanged field leaves the index as it is:
+         if (clo->has_old && clo->has_new && clo->old_key == clo->new_key)
+            break;
+
+         // A missing entry is no obstacle to its replacement:
+         if (clo->has_old
+             && (clo->rval = btree_remove(handle, &hb->bthead, clo->old_key, clo->recno)) == RND_KEY_NOT_FOUND)
+            clo->rval = RND_SUCCESS;
+
+         if (!clo->rval && clo->has_new
+             && (clo->rval = btree_insert(handle, &hb->bthead, clo->new_key, clo->recno))
+             && clo->has_old)
+            // Put back the old entry rather than lose it:
+            btree_insert(handle, &hb->bthead, clo->old_key, clo->recno);
+         break;
+
+      case BTA_RANGE:
+         clo->rval = btree_scan(handle, &hb->bthead, clo);
+         break;
+   }
+
+   return memcmp(&original, hb, sizeof(original)) != 0;
+}
+
+/**
+ * Runs an index operation with the index head locked, shared for a
+ * range, so ranges run alongside each other.
+ */
+static RND_ERROR btree_run(RNDH *handle, off_t btree, BT_CLO *clo)
+{
+   BLOCK_LOC bl = { btree, sizeof(RND_HEAD_BTREE) };
+   RND_ERROR rval;
+
+   if ((rval = clo->action == BTA_RANGE
+        ? rnd_lock_area_shared(handle, &bl, 1, btree_lock_callback, clo)
+        : rnd_lock_area(handle, &bl, 1, btree_lock_callback, clo)))
+      return rval;
+
+   return clo->rval;
+}
+
+/**
+ * Reads the offset to the head of the file's first index from the file,
+ * rather than from the handle, so that indexes added by other processes
+ * are maintained.
+ */
+static RND_ERROR btree_first(RNDH *handle, off_t *head)
+{
+   return blocks_read_at(handle,
+                         offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, btree_head),
+                         head,
+                         sizeof(*head));
+}
+
+/**
+ * Reports whether a table has any indexes, so that callers only read the
+ * old contents of a record that an index will need.
+ */
+RND_ERROR btree_table_indexed(RNDH *handle, off_t table_head, bool *indexed)
+{
+   return btree_bytes_indexed(handle, table_head, 0, UINT32_MAX, indexed);
+}
+
+/**
+ * Reports whether an index of a table covers any of *len* bytes at
+ * *offset* in its records, so that a change to only those bytes can
+ * leave the indexes alone when none does.
+ */
+RND_ERROR btree_bytes_indexed(RNDH *handle, off_t table_head, uint32_t offset, uint32_t len, bool *indexed)
+{
+   RND_HEAD_BTREE hb;
+   RND_ERROR rval;
+   off_t head;
+
+   *indexed = 0;
+
+   if ((rval = btree_first(handle, &head)))
+      return rval;
+
+   for (; head; head = hb.bthead.next_btree)
+   {
+      if ((rval = blocks_read_at(handle, head, &hb, sizeof(hb))))
+         return rval;
+
+      if (hb.bthead.table_head == table_head
+          && hb.bthead.field_offset < (uint64_t)offset + len
+          && offset < (uint64_t)hb.bthead.field_offset + hb.bthead.field_width)
+      {
+         *indexed = 1;
+         break;
+      }
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Updates the indexes of a table for a changed record.
+ *
+ * If an index can't be updated, the indexes already updated are restored
+ * so the caller can abandon the change.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param recno       record that changed
+ * @param old_record  previous contents of the record, NULL if it wasn't live
+ * @param old_size    bytes in *old_record*
+ * @param new_record  new contents of the record, NULL if it was deleted
+ * @param new_size    bytes in *new_record*
+ */
+RND_ERROR btree_record_changed(RNDH *handle,
+                               off_t table_head,
+                               uint32_t recno,
+                               const void *old_record,
+                               uint32_t old_size,
+                               const void *new_record,
+                               uint32_t new_size)
+{
+   RND_HEAD_BTREE hb;
+   RND_ERROR rval;
+   off_t first, head;
+
+   if ((rval = btree_first(handle, &first)))
+      return rval;
+
+   for (head = first; head; head = hb.bthead.next_btree)
+   {
+      if ((rval = blocks_read_at(handle, head, &hb, sizeof(hb))))
+         break;
+
+      if (hb.bthead.table_head != table_head)
+         continue;
+
+      BT_CLO clo = { NULL, NULL,
+                     old_record ? btree_record_key(&hb.bthead, old_record, old_size) : 0,
+                     new_record ? btree_record_key(&hb.bthead, new_record, new_size) : 0,
+                     recno, BTA_CHANGE, old_record != NULL, new_record != NULL };
+
+      if ((rval = btree_run(handle, head, &clo)))
+         break;
+   }
+
+   // Restore the indexes that were changed before the failure:
+   if (rval)
+   {
+      off_t failed = head, undo;
+
+      for (undo = first; undo && undo != failed; undo = hb.bthead.next_btree)
+      {
+         if (blocks_read_at(handle, undo, &hb, sizeof(hb)))
+            break;
+
+         if (hb.bthead.table_head != table_head)
+            continue;
+
+         BT_CLO clo = { NULL, NULL,
+                        new_record ? btree_record_key(&hb.bthead, new_record, new_size) : 0,
+                        old_record ? btree_record_key(&hb.bthead, old_record, old_size) : 0,
+                        recno, BTA_CHANGE, new_record != NULL, old_record != NULL };
+
+         btree_run(handle, undo, &clo);
+      }
+   }
+
+   return rval;
+}
+
+/** Collects the entries of a bulk build. */
+typedef struct btree_build_closure {
+   const INFO_BTREE *bt;
+   BT_ENTRY         *entries;
+   size_t           count;
+   size_t           allocated;
+   RND_ERROR        rval;
+   char             pad[4];
+} BT_BUILD;
+
+/**
+ * `flatrecs_walk_records` viewer that collects the key of every live record.
+ */
+bool btree_build_viewer(const uint64_t *map,
+                        const char *records,
+                        uint32_t nbits,
+                        uint32_t first_recno,
+                        uint32_t rec_size,
+                        void *closure)
+{
+   BT_BUILD *build = (BT_BUILD*)closure;
+   uint32_t i;
+
+   if (build->count + nbits > build->allocated)
+   {
+      size_t allocated = build->allocated ? build->allocated * 2 : 1024;
+      while (allocated < build->count + nbits)
+         allocated *= 2;
+
+      BT_ENTRY *entries = (BT_ENTRY*)realloc(build->entries, allocated * sizeof(BT_ENTRY));
+      if (!entries)
+      {
+         build->rval = RND_SYSTEM_ERROR;
+         return 0;
+      }
+
+      build->entries = entries;
+      build->allocated = allocated;
+   }
+
+   for (i = 0; i < nbits; ++i)
+   {
+      if (map[i / 64] & (uint64_t)1 << (i % 64))
+      {
+         BT_ENTRY *entry = &build->entries[build->count++];
+         memset(entry, 0, sizeof(*entry));
+         entry->key = btree_record_key(build->bt, records + (size_t)i * rec_size, rec_size);
+         entry->recno = first_recno + i;
+      }
+   }
+
+   return 1;
+}
+
+int btree_entry_order(const void *left, const void *right)
+{
+   const BT_ENTRY *entry = (const BT_ENTRY*)right;
+   return btree_compare(((const BT_ENTRY*)left)->key, ((const BT_ENTRY*)left)->recno, entry);
+}
+
+/**
+ * Writes sorted entries as one level of nodes, in order, replacing the
+ * entries with one branch entry per node for the level above.
+ *
+ * @param entries  [in/out] entries of the level, then of the level above
+ * @param count    [in/out] number of entries
+ */
+static RND_ERROR btree_build_level(RNDH *handle, const INFO_BTREE *bt, uint32_t level, BT_ENTRY *entries, size_t *count)
+{
+   uint32_t per_node = btree_capacity(bt->node_size) * BTREE_BULK_PERCENT / 100;
+   size_t done = 0, nodes = 0;
+   off_t offset = 0, next_offset;
+   RND_ERROR rval = RND_SYSTEM_ERROR;
+
+   char *node = btree_alloc_node(handle, bt->node_size);
+   char *next = btree_alloc_node(handle, bt->node_size);
+   if (!node || !next)
+      goto abandon_function;
+
+   if (per_node < 2)
+      per_node = 2;
+
+   // Each node is written once the next is allocated, to link the leaves:
+   do
+   {
+      uint32_t take = *count - done < per_node ? (uint32_t)(*count - done) : per_node;
+
+      if ((rval = btree_new_node(handle, bt, level, next, &next_offset)))
+         goto abandon_function;
+
+      memcpy(btree_entries(next), &entries[done], take * sizeof(BT_ENTRY));
+      btree_node_head(next)->count = take;
+
+      if (offset)
+      {
+         if (level == 0)
+            btree_node_head(node)->next = next_offset;
+
+         if ((rval = btree_write_node(handle, bt, offset, node)))
+            goto abandon_function;
+      }
+
+      // The node's first entry represents it in the level above:
+      entries[nodes] = entries[done];
+      entries[nodes].child = next_offset;
+      ++nodes;
+
+      done += take;
+      offset = next_offset;
+
+      char *swap = node;
+      node = next;
+      next = swap;
+   }
+   while (done < *count);
+
+   rval = btree_write_node(handle, bt, offset, node);
+   *count = nodes;
+
+  abandon_function:
+   free(node);
+   free(next);
+   return rval;
+}
+
+/**
+ * Builds the nodes of an index over the live records of its table.
+ */
+static RND_ERROR btree_build(RNDH *handle, INFO_BTREE *bt)
+{
+   BT_BUILD build = { bt };
+   RND_ERROR rval;
+
+   if ((rval = flatrecs_walk_records(handle, bt->table_head, btree_build_viewer, &build))
+       || (rval = build.rval))
+      goto abandon_function;
+
+   qsort(build.entries, build.count, sizeof(BT_ENTRY), btree_entry_order);
+   bt->entries = build.count;
+
+   // An empty table still gets an (empty) leaf:
+   if (build.count == 0)
+   {
+      BT_ENTRY *empty = (BT_ENTRY*)realloc(build.entries, sizeof(BT_ENTRY));
+      if (!empty)
+      {
+         rval = RND_SYSTEM_ERROR;
+         goto abandon_function;
+      }
+      memset(empty, 0, sizeof(BT_ENTRY));
+      build.entries = empty;
+   }
+
+   bt->height = 0;
+   do
+   {
+      if ((rval = btree_build_level(handle, bt, bt->height, build.entries, &build.count)))
+         goto abandon_function;
+
+      ++bt->height;
+   }
+   while (build.count > 1 && bt->height < BTREE_MAX_HEIGHT);
+
+   bt->root = build.entries[0].child;
+
+  abandon_function:
+   if (rval == RND_SYSTEM_ERROR && !handle->sys_errno)
+      handle->sys_errno = errno;
+
+   free(build.entries);
+   return rval;
+}
+
+typedef struct btree_register_closure {
+   off_t     head;
+   RND_ERROR rval;
+   char      pad[4];
+} BT_REG;
+
+/**
+ * Callback for `rnd_lock_area`, called with the file head's INFO_FILE
+ * locked, that adds an index to the file's list of indexes.
+ */
+bool btree_register_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   BT_REG *reg = (BT_REG*)closure;
+   INFO_FILE *fhead = (INFO_FILE*)locked_buffer;
+
+   if ((reg->rval = blocks_write_at(handle,
+                                    reg->head + offsetof(RND_HEAD_BTREE, bthead) + offsetof(INFO_BTREE, next_btree),
+                                    &fhead->btree_head,
+                                    sizeof(off_t))))
+      return 0;
+
+   fhead->btree_head = reg->head;
+   return 1;
+}
+
+/**
+ * Creates an index over a field of the records of a table, building it
+ * from the table's live records.  From then on, appending, replacing and
+ * deleting records of the table keeps the index current.
+ *
+ * The build reads the table a block at a time without a lock, so changes
+ * made to the table by other processes during the build may be missed.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table, 0 for the file's table
+ * @param field       the field to index
+ * @param btree       [out] offset to the index head, to pass to `btree_range`
+ */
+RND_ERROR btree_create(RNDH *handle, off_t table_head, const RND_FIELD *field, off_t *btree)
+{
+   prime_handle(handle);
+
+   RND_HEAD_TABLE htable;
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_at(handle, table_head, &htable, sizeof(htable))))
+      return rval;
+
+   if ((htable.bhead.block_type != RBT_TABLE && htable.bhead.block_type != RBT_FILE)
+       || !scan_field_is_valid(field, htable.thead.rec_size))
+      return RND_BAD_PARAMETER;
+
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   RND_BLOCK_DEF bdef = { RBT_BTREE,
+                          (sizeof(RND_HEAD_BTREE) + chunk_size - 1) / chunk_size * chunk_size };
+
+   if ((rval = blocks_append_block(handle, &bdef)))
+      return rval;
+
+   RND_HEAD_BTREE hb;
+   if ((rval = blocks_read_at(handle, bdef.new_block.offset, &hb, sizeof(hb))))
+      return rval;
+
+   INFO_BTREE *bt = &hb.bthead;
+   bt->table_head = table_head;
+   bt->field_offset = field->offset;
+   bt->field_width = field->width;
+   bt->field_type = field->type;
+   bt->node_size = (BTREE_NODE_BYTES + chunk_size - 1) / chunk_size * chunk_size;
+
+   if ((rval = btree_build(handle, bt))
+       || (rval = blocks_write_at(handle, bdef.new_block.offset, &hb, sizeof(hb))))
+      return rval;
+
+   BLOCK_LOC bl = { offsetof(RND_HEAD_FILE, fhead), sizeof(INFO_FILE) };
+   BT_REG reg = { bdef.new_block.offset, RND_SUCCESS };
+
+   if ((rval = rnd_lock_area(handle, &bl, 1, btree_register_lock_callback, &reg))
+       || (rval = reg.rval))
+      return rval;
+
+   *btree = bdef.new_block.offset;
+   return RND_SUCCESS;
+}
+
+/**
+ * Sends the recnos of the records whose field is from *low* to *high*,
+ * inclusive, to *viewer*, in order of field value and then of recno.
+ *
+ * The viewer is called with the index locked, so it must not change
+ * the indexed table.
+ *
+ * @param handle   handle to an open recno database
+ * @param btree    offset to the index head, from `btree_create`
+ * @param low      lowest field value, in the field's type and width, NULL for no limit
+ * @param high     highest field value, NULL for no limit
+ * @param viewer   function to receive each recno
+ * @param closure  optional pointer passed to *viewer*
+ */
+RND_ERROR btree_range(RNDH *handle,
+                      off_t btree,
+                      const void *low,
+                      const void *high,
+                      rnd_range_view viewer,
+                      void *closure)
+{
+   prime_handle(handle);
+
+   RND_HEAD_BTREE hb;
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_at(handle, btree, &hb, sizeof(hb))))
+      return rval;
+
+   if (hb.bhead.block_type != RBT_BTREE)
+      return RND_BAD_PARAMETER;
+
+   RND_FIELD_TYPE type = (RND_FIELD_TYPE)hb.bthead.field_type;
+   uint32_t width = hb.bthead.field_width;
+
+   BT_CLO clo = { viewer, closure,
+                  low ? btree_field_key(type, width, low) : 0,
+                  high ? btree_field_key(type, width, high) : UINT64_MAX,
+                  0, BTA_RANGE };
+
+   return btree_run(handle, btree, &clo);
+}
@@ -0,0 +1,26 @@
+#ifndef RECNODB_BTREE_H
+#define RECNODB_BTREE_H
+
+#include "recnodb.h"
+
+RND_ERROR btree_create(RNDH *handle, off_t table_head, const RND_FIELD *field, off_t *btree);
+RND_ERROR btree_range(RNDH *handle,
+                      off_t btree,
+                      const void *low,
+                      const void *high,
+                      rnd_range_view viewer,
+                      void *closure);
+
+RND_ERROR btree_table_indexed(RNDH *handle, off_t table_head, bool *indexed);
+RND_ERROR btree_bytes_indexed(RNDH *handle, off_t table_head, uint32_t offset, uint32_t len, bool *indexed);
+RND_ERROR btree_record_changed(RNDH *handle,
+                               off_t table_head,
+                               uint32_t recno,
+                               const void *old_record,
+                               uint32_t old_size,
+                               const void *new_record,
+                               uint32_t new_size);
+
+uint64_t btree_field_key(RND_FIELD_TYPE type, uint32_t width, const void *field);
+
+#endif
@@ -0,0 +1,133 @@
+/** @file
+ *
+ * Fixed pool of aligned buffers for RND_DIRECT I/O.
+ *
+ * O_DIRECT transfers need memory, offsets and lengths aligned to the
+ * device's logical block size.  The pool is allocated once when the file
+ * is opened, so memory use doesn't grow with the size of the database.
+ * Threads sharing a handle's pool, such as the workers of a parallel
+ * scan, may want more buffers than it has; they get buffers allocated
+ * for the one transfer, and freed after it, instead of failing.
+ */
+
+#include "bufpool.h"
+
+#include <errno.h>
+#include <stdlib.h>   // for posix_memalign()
+
+/**
+ * Allocates a pool of aligned buffers for the handle.
+ *
+ * @param handle     handle being opened in RND_DIRECT mode
+ * @param alignment  required alignment of buffers, offsets and lengths
+ */
+RND_ERROR bufpool_create(RNDH *handle, size_t alignment)
+{
+   struct rnd_bufpool *pool = (struct rnd_bufpool*)calloc(1, sizeof(struct rnd_bufpool));
+   if (!pool)
+      goto system_error;
+
+   handle->bufpool = pool;
+
+   pool->buffer_size = (RND_BUFPOOL_BUFFER_SIZE + alignment - 1) / alignment * alignment;
+   pool->alignment = (uint32_t)alignment;
+
+   for (int i = 0; i < RND_BUFPOOL_BUFFERS; ++i)
+   {
+      void *buffer;
+      if ((errno = posix_memalign(&buffer, alignment, pool->buffer_size)))
+         goto system_error;
+
+      pool->buffers[i] = (char*)buffer;
+   }
+
+   return RND_SUCCESS;
+
+  system_error:
+   handle->sys_errno = errno;
+   bufpool_free(handle);
+   return RND_SYSTEM_ERROR;
+}
+
+/**
+ * Borrows a buffer from the pool, or allocates one if all the pool's
+ * buffers are lent.  Safe to call from several threads.
+ *
+ * @return pointer to an aligned buffer of `bufpool_buffer_size` bytes,
+ *         or NULL, with errno set, if the handle has no pool or the
+ *         allocation failed.
+ */
+void *bufpool_acquire(RNDH *handle)
+{
+   struct rnd_bufpool *pool = handle->bufpool;
+   void *buffer;
+
+   if (!pool)
+   {
+      errno = ENOBUFS;
+      return NULL;
+   }
+
+   uint32_t in_use = __atomic_load_n(&pool->in_use, __ATOMIC_ACQUIRE);
+
+   for (int i = 0; i < RND_BUFPOOL_BUFFERS; ++i)
+   {
+      uint32_t bit = (uint32_t)1 << i;
+      if (in_use & bit)
+         continue;
+
+      if (__atomic_compare_exchange_n(&pool->in_use, &in_use, in_use | bit,
+                                      0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+         return pool->buffers[i];
+
+      // *in_use* was refreshed by the failed exchange, so start over
+      i = -1;
+   }
+
+   if ((errno = posix_memalign(&buffer, pool->alignment, pool->buffer_size)))
+      return NULL;
+
+   return buffer;
+}
+
+/**
+ * Returns a buffer obtained from `bufpool_acquire`, freeing it if it
+ * isn't one of the pool's.
+ */
+void bufpool_release(RNDH *handle, void *buffer)
+{
+   struct rnd_bufpool *pool = handle->bufpool;
+
+   for (int i = 0; i < RND_BUFPOOL_BUFFERS; ++i)
+   {
+      if (pool->buffers[i] == buffer)
+      {
+         __atomic_fetch_and(&pool->in_use, ~((uint32_t)1 << i), __ATOMIC_RELEASE);
+         return;
+      }
+   }
+
+   free(buffer);
+}
+
+size_t bufpool_buffer_size(const RNDH *handle)
+{
+   return handle->bufpool ? handle->bufpool->buffer_size : 0;
+}
+
+/**
+ * Releases the pool and its buffers.
+ */
+void bufpool_free(RNDH *handle)
+{
+   struct rnd_bufpool *pool = handle->bufpool;
+
+   if (pool)
+   {
+      for (int i = 0; i < RND_BUFPOOL_BUFFERS; ++i)
+         free(pool->buffers[i]);
+
+      free(pool);
+      handle->bufpool = NULL;
+   }
+}
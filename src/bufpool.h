@@ -0,0 +1,25 @@
+#ifndef RECNODB_BUFPOOL_H
+#define RECNODB_BUFPOOL_H
+
+#include "recnodb.h"
+
+/** Number of buffers in a handle's pool. */
+#define RND_BUFPOOL_BUFFERS 4
+
+/** Preferred size of each pool buffer, rounded up to the I/O alignment. */
+#define RND_BUFPOOL_BUFFER_SIZE 65536
+
+struct rnd_bufpool {
+   size_t   buffer_size;                    /**< Bytes in each buffer                 */
+   uint32_t in_use;                         /**< Bit *n* set while buffer *n* is lent */
+   uint32_t alignment;                      /**< Alignment of the buffers             */
+   char     *buffers[RND_BUFPOOL_BUFFERS];  /**< Aligned buffers                      */
+};
+
+RND_ERROR bufpool_create(RNDH *handle, size_t alignment);
+void     *bufpool_acquire(RNDH *handle);
+void      bufpool_release(RNDH *handle, void *buffer);
+size_t    bufpool_buffer_size(const RNDH *handle);
+void      bufpool_free(RNDH *handle);
+
+#endif
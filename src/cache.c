@@ -0,0 +1,336 @@
+/** @file
+ *
+ * Per-handle cache of whole-block images.
+ *
+ * Compressed blocks are decompressed into the cache on first access, and
+ * later reads of the same block are served from memory.  An image is used
+ * only while the block's header on disk matches the header that was saved
+ * with the image, so a block that another process expanded or recompressed
+ * is loaded again.
+ *
+ * The cache also keeps partial aggregates of fields over single blocks.
+ * Every write through the handle discards the partials of the blocks it
+ * touches (see `cache_forget_written`), and a partial is used only while
+ * the block's header and record count match those it was computed with.
+ * Writes by other processes that change neither go unnoticed, which is
+ * why callers of `scan_aggregate` ask for the partials explicitly.
+ */
+
+#include "cache.h"
+#include "compress.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Returns the handle's cache, allocating it on first use.
+ */
+static struct rnd_cache *cache_prepare(RNDH *handle)
+{
+   if (!handle->cache)
+   {
+      struct rnd_cache *cache = (struct rnd_cache*)calloc(1, sizeof(struct rnd_cache));
+      if (cache)
+      {
+         for (int i = 0; i < RND_CACHE_SLOTS; ++i)
+            cache->slots[i].block_offset = -1;
+
+         handle->cache = cache;
+      }
+   }
+
+   return handle->cache;
+}
+
+/**
+ * Finds or loads the slot holding an uncompressed image of a whole block.
+ *
+ * Pinned slots are never chosen to be replaced, so a stale image that is
+ * pinned stays as it is while the fresh one is loaded into another slot.
+ */
+static RND_ERROR cache_find_slot(RNDH *handle, off_t offset, const INFO_BLOCK *block, CACHE_SLOT **found)
+{
+   struct rnd_cache *cache = cache_prepare(handle);
+   if (!cache)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   CACHE_SLOT *slot = NULL, *victim = NULL;
+   RND_ERROR rval = RND_SUCCESS;
+
+   ++cache->clock;
+
+   for (int i = 0; i < RND_CACHE_SLOTS; ++i)
+   {
+      CACHE_SLOT *cur = &cache->slots[i];
+
+      if (cur->block_offset == offset && memcmp(&cur->block, block, sizeof(INFO_BLOCK)) == 0)
+      {
+         slot = cur;
+         break;
+      }
+      else if (cur->pins == 0)
+      {
+         // Prefer the stale image of this block, then the least-recently used:
+         if (!victim
+             || (cur->block_offset == offset && victim->block_offset != offset)
+             || (victim->block_offset != offset && cur->last_use < victim->last_use))
+            victim = cur;
+      }
+   }
+
+   if (slot)
+   {
+      STATS_ADD(handle, cache_hits, 1);
+      goto use_slot;
+   }
+
+   STATS_ADD(handle, cache_misses, 1);
+
+   if (!victim)
+   {
+      // Every slot is leased:
+      handle->sys_errno = ENOBUFS;
+      rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   slot = victim;
+   slot->block_offset = -1;
+
+   if (slot->image_size < block->block_size)
+   {
+      char *newimage = (char*)realloc(slot->image, block->block_size);
+      if (!newimage)
+      {
+         handle->sys_errno = errno;
+         rval = RND_SYSTEM_ERROR;
+         goto abandon_function;
+      }
+
+      slot->image = newimage;
+      slot->image_size = block->block_size;
+   }
+
+   if ((rval = compress_load_block(handle, offset, block, slot->image)))
+      goto abandon_function;
+
+   slot->block_offset = offset;
+   memcpy(&slot->block, block, sizeof(INFO_BLOCK));
+
+  use_slot:
+   slot->last_use = cache->clock;
+   *found = slot;
+
+  abandon_function:
+   return rval;
+}
+
+/**
+ * Gets an uncompressed image of a whole block.
+ *
+ * @param handle   handle to an open recno database
+ * @param offset   offset to the block
+ * @param block    header of the block as currently found on disk
+ * @param image    [out] pointer to the image, valid until the next call
+ *                 to a cache function with this handle.
+ */
+RND_ERROR cache_get_image(RNDH *handle, off_t offset, const INFO_BLOCK *block, const char **image)
+{
+   CACHE_SLOT *slot;
+   RND_ERROR rval = cache_find_slot(handle, offset, block, &slot);
+
+   if (!rval)
+      *image = slot->image;
+
+   return rval;
+}
+
+/**
+ * Gets an uncompressed image of a whole block that stays in place until
+ * `cache_unpin_image`, however the cache is used meanwhile.
+ *
+ * At most RND_CACHE_SLOTS images can be pinned at once, fewer if other
+ * cache users are to work meanwhile.
+ *
+ * @param slot  [out] the slot whose *image* holds the block
+ */
+RND_ERROR cache_pin_image(RNDH *handle, off_t offset, const INFO_BLOCK *block, CACHE_SLOT **slot)
+{
+   RND_ERROR rval = cache_find_slot(handle, offset, block, slot);
+
+   if (!rval)
+      ++(*slot)->pins;
+
+   return rval;
+}
+
+/**
+ * Releases a pin from `cache_pin_image`.
+ */
+void cache_unpin_image(CACHE_SLOT *slot)
+{
+   if (slot->pins)
+      --slot->pins;
+}
+
+/**
+ * Discards the cached image of a block, if there is one.
+ */
+void cache_invalidate(RNDH *handle, off_t offset)
+{
+   if (handle->cache)
+   {
+      for (int i = 0; i < RND_CACHE_SLOTS; ++i)
+         if (handle->cache->slots[i].block_offset == offset)
+            handle->cache->slots[i].block_offset = -1;
+   }
+}
+
+/**
+ * Orders partials by block offset, then by field.
+ */
+static int cache_compare_partials(const CACHE_PARTIAL *a, const CACHE_PARTIAL *b)
+{
+   if (a->block_offset != b->block_offset)
+      return a->block_offset < b->block_offset ? -1 : 1;
+   else if (a->field_offset != b->field_offset)
+      return a->field_offset < b->field_offset ? -1 : 1;
+   else if (a->field_width != b->field_width)
+      return a->field_width < b->field_width ? -1 : 1;
+   else if (a->field_type != b->field_type)
+      return a->field_type < b->field_type ? -1 : 1;
+   else
+      return 0;
+}
+
+/**
+ * Index of the first partial not ordered before *key*.
+ */
+static uint32_t cache_partial_position(const struct rnd_cache *cache, const CACHE_PARTIAL *key)
+{
+   uint32_t low = 0, high = cache->partial_count;
+
+   while (low < high)
+   {
+      uint32_t mid = low + (high - low) / 2;
+      if (cache_compare_partials(&cache->partials[mid], key) < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+
+   return low;
+}
+
+/**
+ * Finds a kept partial for the block and field of *key* that is still
+ * current: its block header and record count must match *key*'s.
+ *
+ * @return the partial, valid until the next cache call, or NULL.
+ */
+const CACHE_PARTIAL *cache_find_partial(RNDH *handle, const CACHE_PARTIAL *key)
+{
+   struct rnd_cache *cache = handle->cache;
+   if (!cache || !cache->partial_count)
+      return NULL;
+
+   uint32_t pos = cache_partial_position(cache, key);
+   if (pos == cache->partial_count)
+      return NULL;
+
+   const CACHE_PARTIAL *found = &cache->partials[pos];
+   if (cache_compare_partials(found, key) == 0
+       && found->nbits == key->nbits
+       && memcmp(&found->block, &key->block, sizeof(INFO_BLOCK)) == 0)
+      return found;
+
+   return NULL;
+}
+
+/**
+ * Keeps a partial, replacing any for the same block and field.
+ */
+RND_ERROR cache_keep_partial(RNDH *handle, const CACHE_PARTIAL *partial)
+{
+   struct rnd_cache *cache = cache_prepare(handle);
+   if (!cache)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   uint32_t pos = cache_partial_position(cache, partial);
+   if (pos < cache->partial_count && cache_compare_partials(&cache->partials[pos], partial) == 0)
+   {
+      cache->partials[pos] = *partial;
+      return RND_SUCCESS;
+   }
+
+   if (cache->partial_count == cache->partials_allocated)
+   {
+      uint32_t allocated = cache->partials_allocated ? cache->partials_allocated * 2 : 64;
+      CACHE_PARTIAL *partials = (CACHE_PARTIAL*)realloc(cache->partials, allocated * sizeof(CACHE_PARTIAL));
+      if (!partials)
+      {
+         handle->sys_errno = errno;
+         return RND_SYSTEM_ERROR;
+      }
+
+      cache->partials = partials;
+      cache->partials_allocated = allocated;
+   }
+
+   memmove(&cache->partials[pos + 1], &cache->partials[pos], (cache->partial_count - pos) * sizeof(CACHE_PARTIAL));
+   cache->partials[pos] = *partial;
+   ++cache->partial_count;
+   return RND_SUCCESS;
+}
+
+/**
+ * Discards the partials of every block that overlaps *len* bytes written
+ * at *offset*.  Called by `blocks_write_at` for every write.
+ */
+void cache_forget_written(RNDH *handle, off_t offset, size_t len)
+{
+   struct rnd_cache *cache = handle->cache;
+   if (!cache || !cache->partial_count || !len)
+      return;
+
+   // Blocks don't overlap, so the blocks ending after *offset* that start
+   // before the end of the write lie just before the first one after it:
+   CACHE_PARTIAL after = { 0 };
+   after.block_offset = offset + (off_t)len;
+   uint32_t end = cache_partial_position(cache, &after), start = end;
+
+   while (start > 0
+          && cache->partials[start - 1].block_offset + (off_t)cache->partials[start - 1].block.block_size > offset)
+      --start;
+
+   if (start < end)
+   {
+      memmove(&cache->partials[start], &cache->partials[end], (cache->partial_count - end) * sizeof(CACHE_PARTIAL));
+      cache->partial_count -= end - start;
+   }
+}
+
+/**
+ * Releases the handle's cache.
+ */
+void cache_free(RNDH *handle)
+{
+   if (handle->cache)
+   {
+      for (int i = 0; i < RND_CACHE_SLOTS; ++i)
+         free(handle->cache->slots[i].image);
+
+      free(handle->cache->partials);
+
+      free(handle->cache);
+      handle->cache = NULL;
+   }
+}
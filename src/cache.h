@@ -0,0 +1,54 @@
+#ifndef RECNODB_CACHE_H
+#define RECNODB_CACHE_H
+
+#include "recnodb.h"
+
+/** Number of block images a handle keeps in memory. */
+#define RND_CACHE_SLOTS 8
+
+typedef struct rnd_cache_slot {
+   off_t      block_offset;   /**< Offset of the cached block, -1 if the slot is unused */
+   uint64_t   last_use;       /**< Value of rnd_cache::clock at the most recent use      */
+   char       *image;         /**< Uncompressed image of the whole block                 */
+   size_t     image_size;     /**< Allocated size of *image*                             */
+   INFO_BLOCK block;          /**< Header of the block on disk when it was cached        */
+   uint32_t   pins;           /**< Leases on the image, which keep it from being replaced */
+   char       pad[4];
+} CACHE_SLOT;
+
+/**
+ * Partial aggregate of one field over the live records of one block,
+ * kept for `scan_aggregate`.
+ */
+typedef struct rnd_cache_partial {
+   off_t      block_offset;   /**< Offset of the block                                     */
+   INFO_BLOCK block;          /**< Header of the block when the partial was computed       */
+   uint32_t   nbits;          /**< Records of the block that existed then                  */
+   uint32_t   field_offset;   /**< The aggregated field, see RND_FIELD                     */
+   uint32_t   field_width;
+   uint32_t   field_type;
+   uint64_t   count;          /**< Live records                                            */
+   uint64_t   sum;            /**< Bits of the sum, as an RND_VALUE of the field's type    */
+   uint64_t   min_key;        /**< Least and greatest order-preserving keys of the field,  */
+   uint64_t   max_key;        /**< meaningless if *count* is 0                             */
+} CACHE_PARTIAL;
+
+struct rnd_cache {
+   uint64_t      clock;
+   CACHE_SLOT    slots[RND_CACHE_SLOTS];
+   CACHE_PARTIAL *partials;         /**< Ordered by block offset, then field    */
+   uint32_t      partial_count;
+   uint32_t      partials_allocated;
+};
+
+RND_ERROR cache_get_image(RNDH *handle, off_t offset, const INFO_BLOCK *block, const char **image);
+void cache_invalidate(RNDH *handle, off_t offset);
+RND_ERROR cache_pin_image(RNDH *handle, off_t offset, const INFO_BLOCK *block, CACHE_SLOT **slot);
+void cache_unpin_image(CACHE_SLOT *slot);
+
+const CACHE_PARTIAL *cache_find_partial(RNDH *handle, const CACHE_PARTIAL *key);
+RND_ERROR cache_keep_partial(RNDH *handle, const CACHE_PARTIAL *partial);
+void cache_forget_written(RNDH *handle, off_t offset, size_t len);
+void cache_free(RNDH *handle);
+
+#endif
@@ -1,6 +1,7 @@
 #include "recnodb.h"
 #include "blocks.h"
 #include "chains.h"
+#include "probes.h"
 
 #include <errno.h>
 #include <string.h>
@@ -11,13 +12,8 @@ RND_ERROR chains_add_link(RNDH *handle, off_t parent, BLOCK_LOC *new_link)
       
    // Read current info from parent link
    INFO_BLOCK ib_parent;
-   if (fseek(handle->file, parent, SEEK_SET)
-       || !fread(&ib_parent, sizeof(INFO_BLOCK), 1, handle->file))
-   {
-      rval = RND_SYSTEM_ERROR;
-      handle->sys_errno = errno;
+   if ((rval = blocks_read_at(handle, parent, &ib_parent, sizeof(INFO_BLOCK))))
       goto abandon_function;
-   }
 
    // Abort process if parent link is already in use
    if (ib_parent.next_block.offset != 0)
@@ -30,13 +26,8 @@ RND_ERROR chains_add_link(RNDH *handle, off_t parent, BLOCK_LOC *new_link)
    memcpy(&ib_parent.next_block, new_link, sizeof(BLOCK_LOC));
 
    // Write back
-   if (fseek(handle->file, parent, SEEK_SET)
-       || !fwrite(&ib_parent, sizeof(INFO_BLOCK), 1, handle->file))
-   {
-      rval = RND_SYSTEM_ERROR;
-      handle->sys_errno = errno;
+   if ((rval = blocks_write_block_head(handle, parent, &ib_parent, sizeof(INFO_BLOCK))))
       goto abandon_function;
-   }
 
   abandon_function:
    return rval;
@@ -45,23 +36,20 @@ RND_ERROR chains_add_link(RNDH *handle, off_t parent, BLOCK_LOC *new_link)
 RND_ERROR chains_walk(RNDH *handle, off_t block, block_walk_view viewer, void *closure)
 {
    RND_ERROR rval = RND_SUCCESS;
-   FILE *file = handle->file;
-
    char buffer[sizeof(RND_HEAD_FILE)];
+   uint32_t walked = 0;
 
    INFO_BLOCK *curblock = (INFO_BLOCK*)buffer;
    off_t      off_block = block;
 
-   if (fseek(file, off_block, SEEK_SET)
-       || !fread(curblock, sizeof(RND_HEAD_FILE), 1, file))
-   {
-      rval = RND_SYSTEM_ERROR;
-      handle->sys_errno = errno;
+   RND_PROBE1(chains_walk_entry, block);
+
+   if ((rval = blocks_read_at(handle, off_block, curblock, sizeof(RND_HEAD_FILE))))
       goto abandon_function;
-   }
 
    while (1)
    {
+      ++walked;
       if (!(*viewer)((INFO_BLOCK*)curblock, off_block, closure))
          break;
 
@@ -71,18 +59,13 @@ RND_ERROR chains_walk(RNDH *handle, off_t block, block_walk_view viewer, void *c
       if (!off_block)
          break;
 
-      if (fseek(file, off_block, SEEK_SET)
-          || !fread(curblock, sizeof(RND_HEAD_FILE), 1, file))
-      {
-         rval = RND_SYSTEM_ERROR;
-         handle->sys_errno = errno;
+      if ((rval = blocks_read_at(handle, off_block, curblock, sizeof(RND_HEAD_FILE))))
          goto abandon_function;
-      }
    }
 
   abandon_function:
+   RND_PROBE3(chains_walk_return, block, walked, rval);
    return rval;
-   
 }
 
 struct chains_last_link_closure {
@@ -0,0 +1,377 @@
+/** @file
+ *
+ * The change log: every change to the records of the file's table, in
+ * the order the changes were made, for consumers that follow the table
+ * instead of reading it all again.
+ *
+ * The log is kept once `changes_enable` has started it.  It is a chain
+ * of blocks from the RBT_CHANGES block named by INFO_FILE::changes_head,
+ * each holding CHANGE_ENTRY entries, and the position of the first entry
+ * of a block is its INFO_BLOCK::first_recno.  Each block is twice the
+ * size of the one before, up to CHANGES_BLOCK_MAX, so finding a position
+ * reads few block headers.  Entries are never removed.
+ *
+ * A writer adds its entry after the change is written, under the log
+ * lock, then counts it in the head.  Readers take no lock: they read the
+ * count, then the entries before it.
+ *
+ * Whether the log is kept is read from INFO_FILE, next to the generation
+ * that `blocks_stamp_block` has just read, so a writer to a file without
+ * a log usually pays nothing more.
+ */
+
+#include "changes.h"
+#include "blocks.h"
+#include "chains.h"
+#include "extra.h"
+#include "locks.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <string.h>
+#include <time.h>     // for clock_gettime(), nanosleep()
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/** Size of the first block of the log, rounded up to whole chunks. */
+#define CHANGES_BLOCK 65536
+
+/** Size past which the blocks of the log stop doubling. */
+#define CHANGES_BLOCK_MAX (64 * 1024 * 1024)
+
+/** Offset of INFO_FILE::changes_head in the file. */
+#define CHANGES_HEAD_OFFSET (offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, changes_head))
+
+/** Entries read from the log at once by `changes_since`. */
+#define CHANGES_BATCH 256
+
+/**
+ * Reads the head of the change log, with *head* 0 if the log isn't kept.
+ */
+static RND_ERROR changes_read_head(RNDH *handle, off_t *head, RND_HEAD_CHANGES *hc)
+{
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_at(handle, CHANGES_HEAD_OFFSET, head, sizeof(*head)))
+       || !*head)
+      return rval;
+
+   return blocks_read_at(handle, *head, hc, sizeof(*hc));
+}
+
+static uint32_t changes_capacity(const INFO_BLOCK *ib)
+{
+   return blocks_block_payload_size(ib) / sizeof(CHANGE_ENTRY);
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the file head's INFO_FILE
+ * locked, that records the head of a new change log.
+ */
+bool changes_register_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   ((INFO_FILE*)locked_buffer)->changes_head = *(off_t*)closure;
+   return 1;
+}
+
+/**
+ * Starts keeping the change log, if it isn't kept already.  Changes made
+ * before are not in it.
+ *
+ * @param handle  handle to an open recno database
+ */
+RND_ERROR changes_enable(RNDH *handle)
+{
+   prime_handle(handle);
+
+   BLOCK_LOC log_lock = { CHANGES_LOG_LOCK_OFFSET, 1 };
+   RND_HEAD_CHANGES hc;
+   RND_ERROR rval;
+   off_t head;
+
+   if ((rval = rnd_lock_place(handle, &log_lock, 1)))
+      return rval;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_lock;
+   }
+
+   if ((rval = changes_read_head(handle, &head, &hc)) || head)
+      goto release_lock;
+
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   RND_BLOCK_DEF bdef = { RBT_CHANGES, (CHANGES_BLOCK + chunk_size - 1) / chunk_size * chunk_size };
+
+   if ((rval = blocks_append_block(handle, &bdef))
+       || (rval = blocks_read_at(handle, bdef.new_block.offset, &hc, sizeof(hc))))
+      goto release_lock;
+
+   head = bdef.new_block.offset;
+   hc.chhead.entries = 0;
+   hc.chhead.tail = head;
+
+   if ((rval = blocks_write_at(handle, head + offsetof(RND_HEAD_CHANGES, chhead), &hc.chhead, sizeof(hc.chhead))))
+      goto release_lock;
+
+   handle->head_file.fhead.changes_head = head;
+
+   BLOCK_LOC bl = { offsetof(RND_HEAD_FILE, fhead), sizeof(INFO_FILE) };
+   rval = rnd_lock_area(handle, &bl, 1, changes_register_lock_callback, &head);
+
+  release_lock:
+   fflush(handle->file);
+   rnd_lock_remove(handle, &log_lock);
+   return rval;
+}
+
+/**
+ * Adds a change to the log, if it is kept.  Call it once the change is
+ * written, so a consumer that reads the entry finds the change.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the record's table;
+ *                    only changes to the file's table (0) are logged
+ * @param recno       the record
+ * @param op          what was done to it
+ */
+RND_ERROR changes_note(RNDH *handle, off_t table_head, uint32_t recno, RND_CHANGE_OP op)
+{
+   RND_ERROR rval;
+   off_t head;
+
+   if (table_head != 0
+       || (rval = blocks_read_at(handle, CHANGES_HEAD_OFFSET, &head, sizeof(head))))
+      return table_head ? RND_SUCCESS : rval;
+
+   if (!head)
+      return RND_SUCCESS;
+
+   BLOCK_LOC log_lock = { CHANGES_LOG_LOCK_OFFSET, 1 };
+   RND_HEAD_CHANGES hc;
+   INFO_BLOCK ib;
+
+   if ((rval = rnd_lock_place(handle, &log_lock, 1)))
+      return rval;
+
+   CHANGE_ENTRY entry = { 0, recno, (uint32_t)op };
+
+   if ((rval = blocks_read_generation(handle, &entry.generation))
+       || (rval = blocks_read_at(handle, head, &hc, sizeof(hc)))
+       || (rval = blocks_read_block_head(handle, hc.chhead.tail, &ib, sizeof(ib))))
+      goto release_lock;
+
+   // Start a bigger block when the tail is full:
+   if (hc.chhead.entries - ib.first_recno >= changes_capacity(&ib))
+   {
+      uint32_t size = ib.block_size * 2 > CHANGES_BLOCK_MAX ? ib.block_size : ib.block_size * 2;
+      RND_BLOCK_DEF bdef = { RBT_DATA, size, 0, 0, { 0, 0 }, hc.chhead.entries };
+
+      if ((rval = blocks_append_block(handle, &bdef))
+          || (rval = chains_add_link(handle, hc.chhead.tail, &bdef.new_block))
+          || (rval = blocks_read_block_head(handle, bdef.new_block.offset, &ib, sizeof(ib))))
+         goto release_lock;
+
+      hc.chhead.tail = bdef.new_block.offset;
+   }
+
+   off_t at = hc.chhead.tail + ib.bytes_to_data
+      + (off_t)(hc.chhead.entries - ib.first_recno) * sizeof(CHANGE_ENTRY);
+   ++hc.chhead.entries;
+
+   // The entry before the count, so readers never see a count past the entries:
+   if ((rval = blocks_write_at(handle, at, &entry, sizeof(entry))))
+      goto release_lock;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_lock;
+   }
+
+   rval = blocks_write_at(handle, head + offsetof(RND_HEAD_CHANGES, chhead), &hc.chhead, sizeof(hc.chhead));
+
+  release_lock:
+   fflush(handle->file);
+   rnd_lock_remove(handle, &log_lock);
+   return rval;
+}
+
+/**
+ * Sends the changes logged from *position* on to *viewer*, oldest first.
+ *
+ * @param handle    handle to an open recno database
+ * @param position  [in/out] position of the first change to send, 0 for
+ *                  the first ever logged; upon return, the position
+ *                  after the last change sent
+ * @param viewer    function called with each change, returning 0 to stop
+ * @param closure   passed to *viewer*
+ *
+ * @return RND_SUCCESS, with nothing sent if the log isn't kept.
+ */
+RND_ERROR changes_since(RNDH *handle, uint64_t *position, rnd_change_view viewer, void *closure)
+{
+   prime_handle(handle);
+
+   CHANGE_ENTRY batch[CHANGES_BATCH];
+   RND_HEAD_CHANGES hc;
+   RND_ERROR rval;
+   INFO_BLOCK ib;
+   off_t head, block;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if ((rval = changes_read_head(handle, &head, &hc)) || !head)
+      return rval;
+
+   uint64_t entries = hc.chhead.entries;
+   block = head;
+   ib = hc.bhead;
+
+   while (*position < entries)
+   {
+      uint64_t first = ib.first_recno, end = first + changes_capacity(&ib);
+
+      if (*position >= end)
+      {
+         if (!ib.next_block.offset)
+            return RND_REACHED_END_OF_BLOCK_CHAIN;
+
+         block = ib.next_block.offset;
+         if ((rval = blocks_read_block_head(handle, block, &ib, sizeof(ib))))
+            return rval;
+         continue;
+      }
+
+      if (end > entries)
+         end = entries;
+
+      uint32_t count = end - *position > CHANGES_BATCH ? CHANGES_BATCH : (uint32_t)(end - *position);
+      uint32_t i;
+
+      if ((rval = blocks_read_at(handle,
+                                 block + ib.bytes_to_data + (off_t)(*position - first) * sizeof(CHANGE_ENTRY),
+                                 batch,
+                                 count * sizeof(CHANGE_ENTRY))))
+         return rval;
+
+      for (i = 0; i < count; ++i)
+      {
+         ++*position;
+         if (!(*viewer)(batch[i].recno, (RND_CHANGE_OP)batch[i].op, batch[i].generation, closure))
+            return RND_SUCCESS;
+      }
+   }
+
+   return RND_SUCCESS;
+}
+
+static RND_ERROR changes_count(RNDH *handle, uint64_t *entries)
+{
+   RND_HEAD_CHANGES hc;
+   RND_ERROR rval;
+   off_t head;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if ((rval = changes_read_head(handle, &head, &hc)))
+      return rval;
+
+   *entries = head ? hc.chhead.entries : 0;
+   return RND_SUCCESS;
+}
+
+static int64_t changes_now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits until a change is logged at *position* or after, or until
+ * *timeout_ms* milliseconds pass.
+ *
+ * On Linux, the wait is woken by inotify when the file is written, by
+ * any process; elsewhere, the log is checked every few milliseconds.
+ *
+ * @param handle      handle to an open recno database
+ * @param position    position of the change to wait for, as left by `changes_since`
+ * @param timeout_ms  longest wait, or a negative number to wait as long as it takes
+ * @param arrived     [out] TRUE if a change is there to read
+ */
+RND_ERROR changes_wait(RNDH *handle, uint64_t position, int timeout_ms, bool *arrived)
+{
+   prime_handle(handle);
+
+   int64_t deadline = changes_now_ms() + timeout_ms;
+   uint64_t entries;
+   RND_ERROR rval;
+   int notify = -1;
+
+   *arrived = 0;
+
+#ifdef __linux__
+   // Watch the file before looking, so a change made in between wakes the wait:
+   char path[64];
+   snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(handle->file));
+
+   if ((notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) >= 0
+       && inotify_add_watch(notify, path, IN_MODIFY) < 0)
+   {
+      close(notify);
+      notify = -1;
+   }
+#endif
+
+   while (!(rval = changes_count(handle, &entries)))
+   {
+      if (entries > position)
+      {
+         *arrived = 1;
+         break;
+      }
+
+      int64_t left = timeout_ms < 0 ? 100 : deadline - changes_now_ms();
+      if (left <= 0)
+         break;
+
+#ifdef __linux__
+      if (notify >= 0)
+      {
+         struct pollfd pfd = { notify, POLLIN, 0 };
+         char events[4096];
+
+         if (poll(&pfd, 1, left > 1000 ? 1000 : (int)left) > 0)
+            while (read(notify, events, sizeof(events)) > 0)
+               ;
+         continue;
+      }
+#endif
+
+      struct timespec pause = { 0, (left > 10 ? 10 : left) * 1000000 };
+      nanosleep(&pause, NULL);
+   }
+
+#ifdef __linux__
+   if (notify >= 0)
+      close(notify);
+#endif
+
+   return rval;
+}
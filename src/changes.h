@@ -0,0 +1,21 @@
+#ifndef RECNODB_CHANGES_H
+#define RECNODB_CHANGES_H
+
+#include "recnodb.h"
+
+/** Offset of the byte locked while an entry is added to the log. */
+#define CHANGES_LOG_LOCK_OFFSET (INT64_MAX - 5)
+
+/** An entry of the change log. */
+typedef struct changes_entry {
+   uint64_t generation;   /**< INFO_FILE::generation when the change was made */
+   uint32_t recno;
+   uint32_t op;           /**< RND_CHANGE_OP value                             */
+} CHANGE_ENTRY;
+
+RND_ERROR changes_enable(RNDH *handle);
+RND_ERROR changes_note(RNDH *handle, off_t table_head, uint32_t recno, RND_CHANGE_OP op);
+RND_ERROR changes_since(RNDH *handle, uint64_t *position, rnd_change_view viewer, void *closure);
+RND_ERROR changes_wait(RNDH *handle, uint64_t position, int timeout_ms, bool *arrived);
+
+#endif
@@ -0,0 +1,490 @@
+/** @file
+ *
+ * Transparent compression of RBT_DATA blocks.
+ *
+ * A compressed block keeps its place and size in its chain, and its
+ * header stays uncompressed so chains can be walked without decompressing.
+ * The payload (everything after the header) is replaced by an `lz` stream
+ * of *stored_size* bytes, and where the filesystem allows, the unused
+ * remainder of the block is released with a hole.
+ *
+ * Compressed blocks are never written in place.  A writer must first
+ * restore the block with `compress_expand_block`.
+ *
+ * Compressing or expanding a block rewrites its payload in place, with
+ * the whole block locked.  What is overwritten is saved to the undo log
+ * first (see `txn_guard_begin`), so a change cut short is rolled back
+ * when the file is next opened.  The header is marked RBF_CHANGING while
+ * the payload is rewritten, and readers, which take no lock, check the
+ * header again after they read with `compress_check_read`.  Each rewrite
+ * counts in the header's *rewrites*, so a block compressed, expanded and
+ * compressed again during a read doesn't pass for unchanged.  A file in
+ * which no block was ever compressed is marked so in its head, and its
+ * readers skip the check.
+ *
+ * Atomic field changes made through the mapping take no record lock, so
+ * the whole-block lock doesn't keep them out.  They pin the block instead
+ * (see `compress_pin_block`), and a pinned block is left uncompressed.
+ */
+
+#include "compress.h"
+#include "extra.h"
+#include "locks.h"
+#include "cache.h"
+#include "lz.h"
+#include "txn.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <stdlib.h>   // for malloc()
+#include <string.h>
+
+/**
+ * Bytes of a block header saved before it's rewritten.  The generation
+ * is left out, since it only ever goes up (see `blocks_stamp_block`).
+ */
+#define COMPRESS_HEAD_SAVED ((uint32_t)offsetof(INFO_BLOCK, generation))
+
+/** Offset of the byte locked to pin the block at offset B: COMPRESS_PIN_LOCK_BASE + B. */
+#define COMPRESS_PIN_LOCK_BASE (INT64_MAX / 4)
+
+typedef struct compress_block_closure {
+   RND_ERROR rval;
+   bool      changed;
+} CBL_CLO;
+
+/**
+ * Returns the disk space past the compressed payload to the filesystem.
+ *
+ * This is an optimization only: filesystems that can't punch holes simply
+ * keep the space, so errors are ignored.
+ */
+static void compress_release_tail(RNDH *handle, off_t offset, const INFO_BLOCK *ib)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+   off_t start = offset + ib->bytes_to_data + ib->stored_size;
+   off_t end = offset + ib->block_size;
+
+   if (end > start && !fflush(handle->file))
+      fallocate(fileno(handle->file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+#endif
+}
+
+/** Offset of INFO_FILE::file_flags in the file. */
+#define COMPRESS_FILE_FLAGS_OFFSET (offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, file_flags))
+
+/**
+ * Checks that a block read without a lock was neither compressed nor
+ * expanded while it was read.  If it was, this waits for the change to
+ * finish, so the header can be read again and the read made again.
+ *
+ * Like `backup_file`, this compares the header as it is now with the
+ * header that was read before the block.  Until some block of the file
+ * has been compressed, nothing can have changed, and the check costs a
+ * load from the mapped file head (see `compress_mark_file`).
+ *
+ * @param handle  handle to an open recno database
+ * @param offset  offset to the block
+ * @param before  header of the block, read before the rest of it
+ *
+ * @return RND_SUCCESS if the read stands, RND_LOCK_FAILED if it must be made again
+ */
+RND_ERROR compress_check_read(RNDH *handle, off_t offset, const INFO_BLOCK *before)
+{
+   const RND_HEAD_FILE *head;
+   INFO_BLOCK now;
+   RND_ERROR rval;
+
+   if ((rval = blocks_map_head(handle, &head)))
+      return rval;
+
+   // The read must come before the load, as the mark is before any change:
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (!(__atomic_load_n(&head->fhead.file_flags, __ATOMIC_ACQUIRE) & RFF_COMPRESSED))
+      return RND_SUCCESS;
+
+   if (!(before->block_flags & RBF_CHANGING))
+   {
+      // Drop buffered reads that may predate the change:
+      if (fflush(handle->file))
+      {
+         handle->sys_errno = errno;
+         return RND_SYSTEM_ERROR;
+      }
+
+      if ((rval = blocks_read_block_head(handle, offset, &now, sizeof(now))))
+         return rval;
+
+      if (now.block_flags == before->block_flags
+          && now.rewrites == before->rewrites
+          && now.stored_size == before->stored_size)
+         return RND_SUCCESS;
+   }
+
+   // The whole block is locked while it changes:
+   BLOCK_LOC bl = { offset, 1 };
+   if (!(rval = rnd_lock_place(handle, &bl, 1)))
+      rval = rnd_lock_remove(handle, &bl);
+
+   return rval ? rval : RND_LOCK_FAILED;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called by `compress_mark_file` with
+ * INFO_FILE::file_flags locked.
+ */
+bool compress_mark_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   uint32_t flags;
+
+   memcpy(&flags, locked_buffer, sizeof(flags));
+   flags |= RFF_COMPRESSED;
+   memcpy(locked_buffer, &flags, sizeof(flags));
+   return 1;
+}
+
+/**
+ * Marks the file as having compressed blocks, before its first block is
+ * compressed, so that readers start to check their reads.
+ */
+static RND_ERROR compress_mark_file(RNDH *handle)
+{
+   const RND_HEAD_FILE *head;
+   RND_ERROR rval;
+
+   if ((rval = blocks_map_head(handle, &head))
+       || (__atomic_load_n(&head->fhead.file_flags, __ATOMIC_ACQUIRE) & RFF_COMPRESSED))
+      return rval;
+
+   BLOCK_LOC bl = { COMPRESS_FILE_FLAGS_OFFSET, sizeof(uint32_t) };
+   return rnd_lock_area_wait(handle, &bl, 1, compress_mark_lock_callback, NULL);
+}
+
+/**
+ * Reads a whole block into *image*, decompressing the payload if necessary.
+ *
+ * Only the header and the stored payload are read from a compressed block.
+ * The read is checked with `compress_check_read`, so RND_LOCK_FAILED
+ * means the header must be read again and the block with it.
+ *
+ * @param handle  handle to an open recno database
+ * @param offset  offset to the block
+ * @param block   header of the block, already read by the caller
+ * @param image   [out] memory of at least block->block_size bytes
+ */
+RND_ERROR compress_load_block(RNDH *handle, off_t offset, const INFO_BLOCK *block, char *image)
+{
+   RND_ERROR rval;
+
+   if (!(block->block_flags & RBF_COMPRESSED))
+   {
+      if ((rval = blocks_read_at(handle, offset, image, block->block_size)))
+         return rval;
+      return compress_check_read(handle, offset, block);
+   }
+
+   size_t payload_size = block->block_size - block->bytes_to_data;
+   char *stored = (char*)malloc(block->stored_size);
+   if (!stored)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if (!(rval = blocks_read_at(handle, offset + block->bytes_to_data, stored, block->stored_size))
+       && !(rval = compress_check_read(handle, offset, block)))
+   {
+      if (lz_decompress(stored, block->stored_size, image + block->bytes_to_data, payload_size) != payload_size)
+         rval = RND_INVALID_RECNODB_FILE;
+      else
+      {
+         // Present the image as the block looked before compression:
+         memcpy(image, block, sizeof(INFO_BLOCK));
+         ((INFO_BLOCK*)image)->block_flags &= ~RBF_COMPRESSED;
+         ((INFO_BLOCK*)image)->stored_size = 0;
+      }
+   }
+
+   free(stored);
+   return rval;
+}
+
+/**
+ * Slot of `RNDH::pinned` that holds the pin of the block at *offset*.
+ */
+static uint32_t compress_pin_slot(off_t offset)
+{
+   return (uint32_t)(((uint64_t)offset * 0x9e3779b97f4a7c15ULL) >> 32) % RND_PINNED_BLOCKS;
+}
+
+/**
+ * Pins a block against compression, for a change made through the
+ * mapping without the record lock (see `flatrecs_cas_field`).
+ *
+ * The pin is a read lock on a byte that `compress_block` must write-lock
+ * before it reads the block, so the block stays uncompressed while any
+ * handle holds its pin.  A handle keeps its pins until it is closed, one
+ * to a slot of `RNDH::pinned`, so changing the same few blocks again and
+ * again places no more locks; pinning a block lets go of the pin whose
+ * slot it takes.
+ *
+ * @return RND_SUCCESS, or RND_LOCK_FAILED if the block is being compressed
+ */
+RND_ERROR compress_pin_block(RNDH *handle, off_t offset)
+{
+   off_t *slot = &handle->pinned[compress_pin_slot(offset)];
+   RND_ERROR rval;
+
+   if (*slot == offset + 1)
+      return RND_SUCCESS;
+
+   BLOCK_LOC pin = { COMPRESS_PIN_LOCK_BASE + offset, 1 };
+   if ((rval = rnd_lock_place_shared(handle, &pin, 0)))
+      return rval;
+
+   if (*slot)
+   {
+      BLOCK_LOC displaced = { COMPRESS_PIN_LOCK_BASE + *slot - 1, 1 };
+      rnd_lock_remove(handle, &displaced);
+   }
+
+   *slot = offset + 1;
+   return RND_SUCCESS;
+}
+
+/**
+ * Lets go of the write lock `compress_block_lock_callback` takes on a
+ * block's pin.  That also drops the handle's own pin of the block, as a
+ * lock of the handle's that it overlapped, so the slot is freed.
+ */
+static void compress_unpin_block(RNDH *handle, const BLOCK_LOC *pin)
+{
+   off_t offset = pin->offset - COMPRESS_PIN_LOCK_BASE;
+   off_t *slot = &handle->pinned[compress_pin_slot(offset)];
+
+   rnd_lock_remove(handle, pin);
+   if (*slot == offset + 1)
+      *slot = 0;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called by `compress_block` with the whole block locked.
+ *
+ * A block pinned by `compress_pin_block` is being changed through a
+ * mapping, so it isn't cold, and the call fails with RND_LOCK_FAILED.
+ */
+bool compress_block_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   CBL_CLO *clo = (CBL_CLO*)closure;
+   INFO_BLOCK ib;
+   char *image = NULL, *stored = NULL;
+   BLOCK_LOC pin = { COMPRESS_PIN_LOCK_BASE + bloc->offset, 1 };
+   bool pinned = 0;
+
+   if ((clo->rval = blocks_read_block_head(handle, bloc->offset, &ib, sizeof(ib))))
+      goto abandon_function;
+
+   // Nothing to do unless it's an uncompressed data block:
+   if (ib.block_type != RBT_DATA || (ib.block_flags & RBF_COMPRESSED))
+      goto abandon_function;
+
+   if ((clo->rval = rnd_lock_place(handle, &pin, 0)))
+      goto abandon_function;
+   pinned = 1;
+
+   size_t payload_size = ib.block_size - ib.bytes_to_data;
+   size_t stored_cap = payload_size - payload_size / 8;
+
+   image = (char*)malloc(ib.block_size);
+   stored = (char*)malloc(lz_compress_bound(payload_size));
+   if (!image || !stored)
+   {
+      handle->sys_errno = errno;
+      clo->rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   if ((clo->rval = blocks_read_at(handle, bloc->offset, image, ib.block_size)))
+      goto abandon_function;
+
+   // Leave the block alone unless compression saves at least an eighth:
+   size_t stored_size = lz_compress(image + ib.bytes_to_data, payload_size, stored, stored_cap);
+   if (stored_size == 0)
+      goto abandon_function;
+
+   if ((clo->rval = compress_mark_file(handle)))
+      goto abandon_function;
+
+   // The stream overwrites the start of the payload:
+   TXN_RANGE ranges[2] = {
+      { bloc->offset, bloc->offset, image, COMPRESS_HEAD_SAVED },
+      { bloc->offset, bloc->offset + ib.bytes_to_data, image + ib.bytes_to_data, (uint32_t)stored_size }
+   };
+
+   if ((clo->rval = txn_guard_begin(handle, ranges, 2)))
+      goto abandon_function;
+
+   RND_ERROR rval;
+   ib.block_flags |= RBF_CHANGING;
+   ++ib.rewrites;
+
+   if (!(rval = blocks_write_block_head(handle, bloc->offset, &ib, sizeof(ib)))
+       && !(rval = blocks_write_at(handle, bloc->offset + ib.bytes_to_data, stored, stored_size)))
+   {
+      ib.block_flags = (ib.block_flags & ~RBF_CHANGING) | RBF_COMPRESSED;
+      ib.stored_size = stored_size;
+      rval = blocks_write_block_head(handle, bloc->offset, &ib, sizeof(ib));
+   }
+
+   if ((clo->rval = txn_guard_end(handle, rval)))
+      goto abandon_function;
+
+   compress_release_tail(handle, bloc->offset, &ib);
+   clo->changed = 1;
+
+  abandon_function:
+   if (pinned)
+      compress_unpin_block(handle, &pin);
+   free(image);
+   free(stored);
+   return 0;
+}
+
+/**
+ * Compresses an RBT_DATA block in place.
+ *
+ * The whole block is locked while it is compressed, so the call fails
+ * with RND_LOCK_FAILED rather than wait while any part of the block
+ * is locked by a writer, or while a handle has it pinned (see
+ * `compress_pin_block`).  A background compactor can simply try again
+ * later.
+ *
+ * @param handle      handle to an open recno database
+ * @param offset      offset to the block
+ * @param compressed  [out] TRUE if the block was compressed, FALSE if it was
+ *                    already compressed, not a data block, or not compressible.
+ */
+RND_ERROR compress_block(RNDH *handle, off_t offset, bool *compressed)
+{
+   prime_handle(handle);
+
+   CBL_CLO clo = { RND_SUCCESS, 0 };
+   INFO_BLOCK ib;
+   RND_ERROR rval;
+
+   *compressed = 0;
+
+   if ((rval = blocks_read_block_head(handle, offset, &ib, sizeof(ib))))
+      goto abandon_function;
+
+   BLOCK_LOC bl = { offset, ib.block_size };
+   if ((rval = rnd_lock_area(handle, &bl, 0, compress_block_lock_callback, &clo)))
+      goto abandon_function;
+
+   if ((rval = clo.rval))
+      goto abandon_function;
+
+   *compressed = clo.changed;
+
+  abandon_function:
+   return rval;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called by `compress_expand_block` with the whole block locked.
+ */
+bool compress_expand_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   CBL_CLO *clo = (CBL_CLO*)closure;
+   INFO_BLOCK ib;
+   char *image = NULL, *stored = NULL;
+
+   // Check again now that we have the lock:
+   if ((clo->rval = blocks_read_block_head(handle, bloc->offset, &ib, sizeof(ib)))
+       || !(ib.block_flags & RBF_COMPRESSED))
+      goto abandon_function;
+
+   image = (char*)malloc(ib.block_size);
+   if (!image)
+   {
+      handle->sys_errno = errno;
+      clo->rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   if ((clo->rval = compress_load_block(handle, bloc->offset, &ib, image)))
+      goto abandon_function;
+
+   // The payload overwrites the stream, which is read again to be saved:
+   if (!(stored = (char*)malloc(ib.stored_size)))
+   {
+      handle->sys_errno = errno;
+      clo->rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   TXN_RANGE ranges[2] = {
+      { bloc->offset, bloc->offset, &ib, COMPRESS_HEAD_SAVED },
+      { bloc->offset, bloc->offset + ib.bytes_to_data, stored, ib.stored_size }
+   };
+
+   if ((clo->rval = blocks_read_at(handle, bloc->offset + ib.bytes_to_data, stored, ib.stored_size))
+       || (clo->rval = txn_guard_begin(handle, ranges, 2)))
+      goto abandon_function;
+
+   RND_ERROR rval;
+   INFO_BLOCK changing = ib;
+   changing.block_flags |= RBF_CHANGING;
+   ((INFO_BLOCK*)image)->rewrites = ++changing.rewrites;
+
+   // Write the payload before the header that says it's uncompressed:
+   if (!(rval = blocks_write_block_head(handle, bloc->offset, &changing, sizeof(changing)))
+       && !(rval = blocks_write_at(handle,
+                                   bloc->offset + ib.bytes_to_data,
+                                   image + ib.bytes_to_data,
+                                   ib.block_size - ib.bytes_to_data)))
+      rval = blocks_write_block_head(handle, bloc->offset, (INFO_BLOCK*)image, sizeof(INFO_BLOCK));
+
+   if ((clo->rval = txn_guard_end(handle, rval)))
+      goto abandon_function;
+
+   clo->changed = 1;
+
+  abandon_function:
+   free(image);
+   free(stored);
+   return 0;
+}
+
+/**
+ * Restores a compressed block to its uncompressed form so it can be written.
+ *
+ * @param handle   handle to an open recno database
+ * @param offset   offset to the block
+ *
+ * @return RND_SUCCESS if the block is uncompressed upon return.
+ */
+RND_ERROR compress_expand_block(RNDH *handle, off_t offset)
+{
+   prime_handle(handle);
+
+   CBL_CLO clo = { RND_SUCCESS, 0 };
+   INFO_BLOCK ib;
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_block_head(handle, offset, &ib, sizeof(ib))))
+      goto abandon_function;
+
+   if (!(ib.block_flags & RBF_COMPRESSED))
+      goto abandon_function;
+
+   BLOCK_LOC bl = { offset, ib.block_size };
+   if ((rval = rnd_lock_area(handle, &bl, 0, compress_expand_lock_callback, &clo)))
+      goto abandon_function;
+
+   rval = clo.rval;
+   cache_invalidate(handle, offset);
+
+  abandon_function:
+   return rval;
+}
@@ -0,0 +1,12 @@
+#ifndef RECNODB_COMPRESS_H
+#define RECNODB_COMPRESS_H
+
+#include "recnodb.h"
+
+RND_ERROR compress_pin_block(RNDH *handle, off_t offset);
+RND_ERROR compress_block(RNDH *handle, off_t offset, bool *compressed);
+RND_ERROR compress_expand_block(RNDH *handle, off_t offset);
+RND_ERROR compress_check_read(RNDH *handle, off_t offset, const INFO_BLOCK *before);
+RND_ERROR compress_load_block(RNDH *handle, off_t offset, const INFO_BLOCK *block, char *image);
+
+#endif
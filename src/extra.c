@@ -46,7 +46,9 @@ const char *rnd_error_strings[] = {
    "Incomplete Write",
    "Invalid Block Size",
    "Invalid Block Location",
-   "Invalid File Head"
+   "Invalid File Head",
+   "Key Not Found",
+   "Read-only Handle"
 };
 
 /**
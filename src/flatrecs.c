@@ -1,31 +1,118 @@
 #include "flatrecs.h"
 #include "extra.h"
 #include "locks.h"
+#include "chains.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "compress.h"
+#include "mapping.h"
+#include "btree.h"
+#include "snapshot.h"
+#include "changes.h"
+#include "stats.h"
+#include "probes.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>   // for malloc()
+#include <string.h>   // for memcpy()
 
-typedef char rec_prefix;
+/**
+ * Number of chunks to which a new data block may grow in place while it
+ * is the last block in the file.  See `flatrecs_make_location_of_recno`.
+ */
+#define FLATRECS_GROWTH_CHUNKS 16
+
+/** Largest data block made by `flatrecs_bulk_load`. */
+#define FLATRECS_BULK_BLOCK_MAX (1u << 30)
+
+/** Bytes of records `flatrecs_bulk_load` asks its reader for at a time. */
+#define FLATRECS_BULK_BUFFER (8u << 20)
 
 typedef struct flatrecs_get_next_offset_locks_closure {
    void                    *caller_closure;
    flatrecs_use_new_record user;
+   RND_ERROR               rval;   /**< of finding or preparing the new record's place */
+   char                    pad[4];
 } FGN_CLO;
 
-typedef struct flatrecs_block_dimensions {
-   off_t offset_to_data;
-   off_t offset_to_end_of_block;
-} FBD;
+typedef struct flatrecs_walk_maps_closure {
+   RNDH              *handle;
+   flatrecs_map_view viewer;
+   void              *caller_closure;
+   uint32_t          rec_size;
+   uint32_t          last_recno;
+   uint32_t          start_recno;
+   RND_ERROR         rval;
+} FWM_CLO;
+
+typedef struct flatrecs_walk_records_closure {
+   RNDH                  *handle;
+   flatrecs_records_view viewer;
+   void                  *caller_closure;
+   char                  *buffer;
+   size_t                buffer_size;
+   uint32_t              rec_size;
+   uint32_t              last_recno;
+   uint32_t              start_recno;
+   RND_ERROR             rval;
+} FWR_CLO;
+
+typedef struct flatrecs_list_blocks_closure {
+   FLATREC_BLOCK *blocks;
+   uint32_t      count;
+   uint32_t      allocated;
+   uint32_t      rec_size;
+   uint32_t      last_recno;
+   uint32_t      start_recno;
+   int           sys_errno;
+} FLB_CLO;
+
+/** A block being filled by `flatrecs_bulk_load`. */
+typedef struct flatrecs_bulk_extent {
+   off_t      offset;
+   INFO_BLOCK block;
+   uint32_t   capacity;
+   uint32_t   filled;
+} FBL_EXTENT;
+
+typedef struct flatrecs_append_closure {
+   const void *data;
+   off_t      table_head;
+   uint32_t   size;
+   uint32_t   recno;       /**< [out] record number of the appended record */
+   RND_ERROR  rval;
+   char       pad[4];
+} FAP_CLO;
 
 /**
- * Add the prefix size to the payload data for the true record size.
+ * Size of the slot occupied by one record.
+ *
+ * Records carry no prefix: their liveness is kept in the map at the
+ * head of their block (see `blocks_set_record_layout`).
  *
  * @param htable  pointer to table header from which to acquire payload recsize.
  *
- * @return size of record including prefix.
+ * @return size of record slot.
  */
 uint32_t flatrecs_full_recsize(const RND_HEAD_TABLE *htable)
 {
-   return htable->thead.rec_size + sizeof(rec_prefix);
+   return htable->thead.rec_size;
+}
+
+/**
+ * Number of records of *rec_size* bytes that the block can hold.
+ */
+static uint32_t flatrecs_block_capacity(uint32_t rec_size, const INFO_BLOCK *hblock)
+{
+   if (rec_size == 0 || hblock->block_size <= hblock->bytes_to_records)
+      return 0;
+
+   uint32_t capacity = (hblock->block_size - hblock->bytes_to_records) / rec_size;
+   if (capacity > hblock->map_bits)
+      capacity = hblock->map_bits;
+
+   return capacity;
 }
 
 /**
@@ -38,33 +125,124 @@ uint32_t flatrecs_full_recsize(const RND_HEAD_TABLE *htable)
  */
 uint32_t flatrecs_get_record_capacity(const RND_HEAD_TABLE *htable, const INFO_BLOCK *hblock)
 {
-   uint32_t bytes_capacity = hblock->block_size - hblock->bytes_to_data;
-   uint32_t recsize = flatrecs_full_recsize(htable);
+   return flatrecs_block_capacity(flatrecs_full_recsize(htable), hblock);
+}
 
-   if (recsize > 0)
-      return bytes_capacity / recsize;
-   else
-      return -1;
+/**
+ * Calculates the size of a new RBT_DATA block that will hold at least
+ * *recs_needed* records, rounded up to a multiple of the chunk size.
+ */
+static uint32_t flatrecs_new_block_size(RNDH *handle, uint32_t rec_size, uint32_t recs_needed)
+{
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   uint64_t bytes_needed = (uint64_t)recs_needed * rec_size
+      + sizeof(RND_HEAD_BLOCK) + recs_needed / 8 + RND_RECORD_ALIGN;
+
+   uint32_t chunks = (bytes_needed + chunk_size - 1) / chunk_size;
+
+   INFO_BLOCK ib = { RBT_DATA, sizeof(RND_HEAD_BLOCK) };
+
+   // The estimate is generous, but confirm the layout before returning:
+   while (1)
+   {
+      ib.block_size = chunks * chunk_size;
+      blocks_set_record_layout(&ib, rec_size);
+      if (flatrecs_block_capacity(rec_size, &ib) >= recs_needed)
+         break;
+      ++chunks;
+   }
+
+   return ib.block_size;
 }
 
 /**
- * Get file offset to requested record number, extending the file, if necessary, to
- * accommodate a record past the current end of file.
+ * Offset to the 64-bit map word that holds the liveness bit of a record.
+ */
+static off_t flatrecs_map_word_offset(const FLATREC_LOC *loc)
+{
+   return loc->block_offset
+      + loc->block.bytes_to_data
+      + (loc->map_index / BITMAP_WORD_BITS) * sizeof(uint64_t);
+}
+
+/**
+ * Reads the header of the table that starts at *table_head*.
+ */
+static RND_ERROR flatrecs_read_table_head(RNDH *handle, off_t table_head, RND_HEAD_TABLE *htable)
+{
+   return blocks_read_at(handle, table_head, htable, sizeof(RND_HEAD_TABLE));
+}
+
+/**
+ * Size of a block grown in place to hold *recs_needed* records, rounded
+ * up to a multiple of the chunk size.
+ */
+static uint32_t flatrecs_grown_block_size(RNDH *handle, const INFO_BLOCK *ib, uint32_t rec_size, uint32_t recs_needed)
+{
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   uint64_t bytes_needed = ib->bytes_to_records + (uint64_t)recs_needed * rec_size;
+
+   return (bytes_needed + chunk_size - 1) / chunk_size * chunk_size;
+}
+
+/**
+ * Reads the last block of a table through the chain hints of its head.
  *
- * @param htable           pointer to the header information of the table
- * @param recno            record number to which the offset should point
- * @param offset_to_record [out] the offset to which a record can be written
+ * @param handle       handle to open recno database
+ * @param htable       header of the table
+ * @param last         [out] header of the last block
+ * @param last_offset  [out] offset to the last block
+ *
+ * @return TRUE if the hints name the current end of the chain, FALSE if the
+ *         table has no data blocks or the chain must be walked.
+ */
+static bool flatrecs_read_chain_end(RNDH *handle,
+                                    const RND_HEAD_TABLE *htable,
+                                    INFO_BLOCK *last,
+                                    off_t *last_offset)
+{
+   off_t offset = htable->chead.block_last;
+
+   if (htable->bhead.next_block.offset == 0 || offset == 0)
+      return 0;
+
+   if (blocks_read_block_head(handle, offset, last, sizeof(INFO_BLOCK))
+       || last->block_type != RBT_DATA
+       || last->next_block.offset != 0
+       || last->first_recno == 0)
+      return 0;
+
+   *last_offset = offset;
+   return 1;
+}
+
+/**
+ * Finds or makes the block that holds *recno*, extending the table's chain
+ * as necessary.
+ *
+ * A record at or past the first record of the last block is found through
+ * the chain hints in *htable* without walking the chain, so appends cost
+ * the same however large the table is.  When the chain needs more room,
+ * the last block is grown in place if it ends the file, and otherwise a
+ * new block is linked to it.
+ *
+ * @param handle  handle to open recno database
+ * @param bloc    location of the table head
+ * @param htable  pointer to the (locked) header information of the table.
+ *                Its chain hints are brought up to date, and if the head
+ *                block's link changes, its *next_block* member is updated,
+ *                so a write-back of *htable* preserves both.
+ * @param recno   record number to locate
+ * @param loc     [out] location of the record
  *
  * @return RND_SUCCESS for success, other RND_ERROR enum value for errors.
  */
-RND_ERROR flatrecs_make_offset_to_recno(RNDH *handle,
-                                        const BLOCK_LOC *bloc,
-                                        RND_HEAD_TABLE *htable,
-                                        uint32_t recno,
-                                        off_t *offset_to_record)
+static RND_ERROR flatrecs_make_location_of_recno(RNDH *handle,
+                                                 const BLOCK_LOC *bloc,
+                                                 RND_HEAD_TABLE *htable,
+                                                 uint32_t recno,
+                                                 FLATREC_LOC *loc)
 {
-   // Start by invalidating the address
-   *offset_to_record = -1;
    RND_ERROR rval = RND_FAIL;
 
    uint32_t recsize = flatrecs_full_recsize(htable);
@@ -72,8 +250,28 @@ RND_ERROR flatrecs_make_offset_to_recno(RNDH *handle,
    uint32_t rec_capacity, local_index;
    INFO_BLOCK *iblock = (INFO_BLOCK*)htable;
    off_t iblock_offset = bloc->offset;
-   
+   off_t parent_offset = 0;
+   off_t chain_offset = 0;
+
    INFO_BLOCK newblock;
+   off_t newblock_offset;
+
+   if (recsize == 0 || recno == 0)
+   {
+      rval = RND_BAD_PARAMETER;
+      goto abandon_function;
+   }
+
+   // Skip to the end of the chain when the record can't be before it:
+   if (flatrecs_read_chain_end(handle, htable, &newblock, &newblock_offset)
+       && recno >= newblock.first_recno)
+   {
+      iblock = &newblock;
+      iblock_offset = newblock_offset;
+      start_rec = newblock.first_recno;
+      parent_offset = htable->chead.block_penultimate;
+      chain_offset = htable->chead.chain_offset;
+   }
 
    while (1)
    {
@@ -84,132 +282,2084 @@ RND_ERROR flatrecs_make_offset_to_recno(RNDH *handle,
       if (local_index < rec_capacity)
       {
          // If the record is in the block, prepare for successful return:
-         *offset_to_record =
-            bloc->offset
-            + iblock->bytes_to_data
-            + (local_index * recsize);
+         loc->block_offset = iblock_offset;
+         loc->record_offset = iblock_offset
+            + iblock->bytes_to_records
+            + ((off_t)local_index * recsize);
+         loc->map_index = local_index;
+         loc->rec_size = recsize;
+         memcpy(&loc->block, iblock, sizeof(INFO_BLOCK));
 
          rval = RND_SUCCESS;
          goto abandon_function;
       }
-      else
+
+      // If not in current block, check or create blocks until the top
+      // of this loop finds a block that contains the requested record.
+
+      // Save before reading the next block may overwrite *iblock*
+      uint32_t iblock_size = iblock->block_size;
+
+      // Try to use an existing block
+      if (!(rval = blocks_get_next_block_head(handle, iblock, &newblock, &newblock_offset)))
       {
-         // If not in current block, check or create blocks until the top
-         // of this loop finds a block that contains the requested record.
-         
-         // The first record of the next block starts where the current block leaves off:
+         STATS_ADD(handle, chain_blocks_walked, 1);
          start_rec += rec_capacity;
+         chain_offset += iblock_size;
+         parent_offset = iblock_offset;
+         iblock = &newblock;
+         iblock_offset = newblock_offset;
+         continue;
+      }
+      else if (rval != RND_REACHED_END_OF_BLOCK_CHAIN)
+         // Unexpected error, abort:
+         goto abandon_function;
 
-         // Try to use an existing block
-         if (!(rval = blocks_get_next_block_head(handle, iblock, &newblock, &iblock_offset)))
+      // At the end of the chain, so the hints can be confirmed:
+      htable->chead.chain_offset = chain_offset;
+      htable->chead.block_penultimate = parent_offset;
+      htable->chead.block_last = iblock_offset;
+
+      // Grow the last block if it ends the file and its map has room:
+      if (iblock->block_type == RBT_DATA
+          && !(iblock->block_flags & RBF_COMPRESSED)
+          && local_index < iblock->map_bits)
+      {
+         uint32_t new_size = flatrecs_grown_block_size(handle, iblock, recsize, local_index + 1);
+
+         rval = blocks_grow_block(handle, iblock_offset, parent_offset, new_size);
+         if (rval == RND_SUCCESS)
          {
-           iblock = &newblock;
+            // Keep the locked copy of the head consistent with the file:
+            if (parent_offset == bloc->offset)
+               htable->bhead.next_block.size = new_size;
+
+            if ((rval = blocks_read_block_head(handle, iblock_offset, &newblock, sizeof(newblock))))
+               goto abandon_function;
+
+            iblock = &newblock;
+            continue;
          }
-         else
-         {
-            if ((rval == RND_REACHED_END_OF_BLOCK_CHAIN))
-            {
-               // Needing a new block, let's make it as large as necessary to
-               // contain the requested recno, even if it's far past last record.
-               uint32_t new_bytes_needed = recsize * (recno - start_rec);
-               uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+         else if (rval != RND_INVALID_BLOCK_LOCATION)
+            goto abandon_function;
+      }
 
-               int chunks_to_add = (new_bytes_needed / chunk_size)
-                  + (new_bytes_needed % chunk_size ? 1 : 0);
+      // Needing a new block, let's make it as large as necessary to
+      // contain the requested recno, even if it's far past last record.
+      start_rec += rec_capacity;
 
-               RND_BLOCK_DEF bdef = { RBT_DATA, chunks_to_add * chunk_size };
+      RND_BLOCK_DEF bdef = { RBT_DATA,
+                             flatrecs_new_block_size(handle, recsize, recno - start_rec + 1),
+                             recsize };
+      bdef.first_recno = start_rec;
+      bdef.max_size = handle->head_file.fhead.chunk_size * FLATRECS_GROWTH_CHUNKS;
 
-               if (!(rval = blocks_extend_chain(handle, iblock_offset, &bdef)))
-               {
-                  rval = blocks_read_block_head(handle,
-                                                bdef.new_block.offset,
-                                                &newblock,
-                                                sizeof(newblock));
+      if ((rval = blocks_extend_chain(handle, iblock_offset, &bdef, &htable->chead)))
+         goto abandon_function;
 
-                  if (rval)
-                     goto abandon_function;
+      // Keep the locked copy of the head consistent with the file:
+      if (iblock_offset == bloc->offset)
+         memcpy(&htable->bhead.next_block, &bdef.new_block, sizeof(BLOCK_LOC));
 
-                  iblock = &newblock;
-                  iblock_offset = bdef.new_block.offset;
-               }
-            }
-            else
-               // Unexpected error (not RND_REACHED_END_OF_BLOCK_CHAIN), abort:
-               goto abandon_function;
-         }
+      if ((rval = blocks_read_block_head(handle, bdef.new_block.offset, &newblock, sizeof(newblock))))
+         goto abandon_function;
+
+      chain_offset += iblock_size;
+      parent_offset = iblock_offset;
+      iblock = &newblock;
+      iblock_offset = bdef.new_block.offset;
+   }
+
+  abandon_function:
+   return rval;
+}
+
+/**
+ * Get file offset to requested record number, extending the file, if necessary, to
+ * accommodate a record past the current end of file.
+ *
+ * @param htable           pointer to the header information of the table
+ * @param recno            record number to which the offset should point
+ * @param offset_to_record [out] the offset to which a record can be written
+ *
+ * @return RND_SUCCESS for success, other RND_ERROR enum value for errors.
+ */
+RND_ERROR flatrecs_make_offset_to_recno(RNDH *handle,
+                                        const BLOCK_LOC *bloc,
+                                        RND_HEAD_TABLE *htable,
+                                        uint32_t recno,
+                                        off_t *offset_to_record)
+{
+   // Start by invalidating the address
+   *offset_to_record = -1;
+
+   RND_PROBE2(make_offset_entry, bloc->offset, recno);
+
+   FLATREC_LOC loc;
+   RND_ERROR rval = flatrecs_make_location_of_recno(handle, bloc, htable, recno, &loc);
+   if (rval == RND_SUCCESS)
+      *offset_to_record = loc.record_offset;
+
+   RND_PROBE3(make_offset_return, recno, *offset_to_record, rval);
+   return rval;
+}
+
+/**
+ * Finds an existing record of a table, without extending the table.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param recno       record number to find
+ * @param loc         [out] location of the record
+ *
+ * @return RND_SUCCESS if found, RND_EXTINCT_RECORD if *recno* has not
+ *         been assigned, or another error.
+ */
+RND_ERROR flatrecs_locate_record(RNDH *handle, off_t table_head, uint32_t recno, FLATREC_LOC *loc)
+{
+   RND_HEAD_TABLE htable;
+   RND_ERROR rval;
+
+   if ((rval = flatrecs_read_table_head(handle, table_head, &htable)))
+      goto abandon_function;
+
+   if (recno == 0 || recno > htable.thead.last_recno || htable.thead.rec_size == 0)
+   {
+      rval = RND_EXTINCT_RECORD;
+      goto abandon_function;
+   }
+
+   uint32_t rec_size = htable.thead.rec_size;
+   uint32_t start_rec = 1;
+   INFO_BLOCK iblock;
+   off_t iblock_offset = table_head;
+
+   // Recent records are found from the end of the chain
+   if (flatrecs_read_chain_end(handle, &htable, &iblock, &iblock_offset)
+       && recno >= iblock.first_recno)
+      start_rec = iblock.first_recno;
+   else
+   {
+      iblock_offset = table_head;
+      memcpy(&iblock, &htable.bhead, sizeof(INFO_BLOCK));
+   }
+
+   while (1)
+   {
+      uint32_t capacity = flatrecs_block_capacity(rec_size, &iblock);
+      uint32_t local_index = recno - start_rec;
+
+      if (local_index < capacity)
+      {
+         loc->block_offset = iblock_offset;
+         loc->record_offset = iblock_offset
+            + iblock.bytes_to_records
+            + ((off_t)local_index * rec_size);
+         loc->map_index = local_index;
+         loc->rec_size = rec_size;
+         memcpy(&loc->block, &iblock, sizeof(INFO_BLOCK));
+         break;
       }
+
+      start_rec += capacity;
+
+      if ((rval = blocks_get_next_block_head(handle, &iblock, &iblock, &iblock_offset)))
+      {
+         if (rval == RND_REACHED_END_OF_BLOCK_CHAIN)
+            rval = RND_EXTINCT_RECORD;
+         goto abandon_function;
+      }
+
+      STATS_ADD(handle, chain_blocks_walked, 1);
    }
 
   abandon_function:
    return rval;
 }
 
+/**
+ * Reads the liveness bit of a located record.
+ *
+ * @param handle  handle to an open recno database
+ * @param loc     location of the record, from `flatrecs_locate_record`
+ * @param live    [out] TRUE if the record is live, FALSE if deleted
+ */
+RND_ERROR flatrecs_record_is_live(RNDH *handle, const FLATREC_LOC *loc, bool *live)
+{
+   uint64_t word;
+
+   if (loc->block.block_flags & RBF_COMPRESSED)
+   {
+      const char *image;
+      RND_ERROR rval = cache_get_image(handle, loc->block_offset, &loc->block, &image);
+      if (rval)
+         return rval;
+
+      memcpy(&word, image + (flatrecs_map_word_offset(loc) - loc->block_offset), sizeof(word));
+   }
+   else
+   {
+      RND_ERROR rval = blocks_read_at(handle, flatrecs_map_word_offset(loc), &word, sizeof(word));
+      if (rval)
+         return rval;
+   }
+
+   *live = bitmap_test(&word, loc->map_index % BITMAP_WORD_BITS);
+   return RND_SUCCESS;
+}
+
+struct flatrecs_set_liveness_closure {
+   uint32_t bit;    /**< bit within the locked map word */
+   bool     live;
+};
 
 /**
- * Callback for `rnd_lock_area` that is called by `flatrecs_get_next_offset`
+ * Callback for `rnd_lock_area` that is called by `flatrecs_set_liveness`
+ */
+bool flatrecs_set_liveness_lock_callback(RNDH *handle,
+                                         BLOCK_LOC *bloc,
+                                         void *locked_buffer,
+                                         void *closure)
+{
+   struct flatrecs_set_liveness_closure *clo = (struct flatrecs_set_liveness_closure*)closure;
+   uint64_t *word = (uint64_t*)locked_buffer;
+
+   if (clo->live)
+      bitmap_set(word, clo->bit);
+   else
+      bitmap_clear(word, clo->bit);
+
+   return 1;
+}
+
+/**
+ * Marks a located record as live or deleted.
  *
- * @param handle         open recno database handle
- * @param bhandle        offset/size of locked memory area
- * @param locked_buffer  contents of locked area
- * @param closure        data passed from calling functions
+ * The map word is changed under a lock, so concurrent changes to
+ * neighboring records' bits are not lost.  The 64 records of a word
+ * share its lock, so it is waited for rather than failing the change of
+ * one record because a neighbor is being changed.
  *
- * @return  0 (FALSE) to simply release the lock, non-zero (TRUE)
- *          to, before releasing the lock, write the (presumably
- *          changed) contents of `locked_buffer` to the file
- *          location defined by `bhandle`.
+ * @param handle  handle to an open recno database
+ * @param loc     location of the record, from `flatrecs_locate_record`
+ * @param live    TRUE to mark the record live, FALSE to mark it deleted
  */
-bool flatrecs_get_next_offset_lock_callback(RNDH *handle,
-                                            BLOCK_LOC *bloc,
-                                            void *locked_buffer,
-                                            void *closure)
+RND_ERROR flatrecs_set_liveness(RNDH *handle, const FLATREC_LOC *loc, bool live)
 {
-   FGN_CLO *clo = (FGN_CLO*)closure;
-   RND_HEAD_TABLE *htable = (RND_HEAD_TABLE*)locked_buffer;
+   struct flatrecs_set_liveness_closure clo = { loc->map_index % BITMAP_WORD_BITS, live };
+   BLOCK_LOC bl = { flatrecs_map_word_offset(loc), sizeof(uint64_t) };
 
-   printf("The first record in this block is %lu.\n", htable->bhead.first_recno);
-   printf("The last record in this table is %u.\n", htable->thead.last_recno);
+   return rnd_lock_area_wait(handle, &bl, 1, flatrecs_set_liveness_lock_callback, &clo);
+}
 
-   uint32_t new_recno = htable->thead.last_recno + 1;
-   off_t new_record_offset = 0;
+/**
+ * Reads the header of a block again once `compress_check_read` has found
+ * it compressed or expanded while the block was read without a lock.
+ *
+ * @param rval   [in/out] result of the read, or of reading the header again
+ * @param tries  [in/out] reads left
+ *
+ * @return TRUE if the block should be read again
+ */
+static bool flatrecs_read_again(RNDH *handle, off_t offset, INFO_BLOCK *ib, RND_ERROR *rval, int *tries)
+{
+   if (*rval != RND_LOCK_FAILED || !--*tries)
+      return 0;
 
-   RND_ERROR rval = flatrecs_make_offset_to_recno(handle,
-                                                  bloc,
-                                                  htable,
-                                                  new_recno,
-                                                  &new_record_offset);
+   return !(*rval = blocks_read_block_head(handle, offset, ib, sizeof(INFO_BLOCK)));
+}
 
-   if (rval)
+/**
+ * `chains_walk` viewer for `flatrecs_walk_maps`
+ *
+ * Reads the liveness map of each block and passes it to the caller's viewer.
+ */
+bool flatrecs_walk_maps_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   FWM_CLO *clo = (FWM_CLO*)closure;
+
+   // The first block of the chain is the table head:
+   if (clo->start_recno == 0)
    {
-      // return system error somehow....gotta rethink this.
+      clo->rec_size = ((RND_HEAD_TABLE*)ib)->thead.rec_size;
+      clo->last_recno = ((RND_HEAD_TABLE*)ib)->thead.last_recno;
+      clo->start_recno = 1;
+   }
+
+   if (clo->start_recno > clo->last_recno)
       return 0;
+
+   uint32_t capacity = flatrecs_block_capacity(clo->rec_size, ib);
+   uint32_t nbits = clo->last_recno - clo->start_recno + 1;
+   if (nbits > capacity)
+      nbits = capacity;
+
+   bool keep_going = 1;
+   int tries = 3;
+
+   while (nbits)
+   {
+      const uint64_t *map = NULL;
+      uint64_t *read_map = NULL;
+
+      if (ib->block_flags & RBF_COMPRESSED)
+      {
+         const char *image;
+         if (!(clo->rval = cache_get_image(clo->handle, offset_to_ib, ib, &image)))
+            map = (const uint64_t*)(image + ib->bytes_to_data);
+      }
+      else
+      {
+         size_t map_bytes = bitmap_words_for_bits(nbits) * sizeof(uint64_t);
+         if (!(read_map = (uint64_t*)malloc(map_bytes)))
+         {
+            clo->handle->sys_errno = errno;
+            clo->rval = RND_SYSTEM_ERROR;
+            return 0;
+         }
+
+         if (!(clo->rval = blocks_read_at(clo->handle, offset_to_ib + ib->bytes_to_data, read_map, map_bytes)))
+            clo->rval = compress_check_read(clo->handle, offset_to_ib, ib);
+
+         map = read_map;
+      }
+
+      if (flatrecs_read_again(clo->handle, offset_to_ib, ib, &clo->rval, &tries))
+      {
+         free(read_map);
+         continue;
+      }
+
+      keep_going = !clo->rval && (*clo->viewer)(map, nbits, clo->start_recno, clo->caller_closure);
+      free(read_map);
+      break;
    }
-   else
-      return (*clo->user)(handle,
-                          (RND_HEAD_TABLE*)locked_buffer,
-                          new_record_offset,
-                          clo->caller_closure);
+
+   clo->start_recno += capacity;
+   return keep_going;
 }
 
 /**
- * Find a file offset to which a record can be written.
+ * Presents the liveness map of each block of a table to a viewer function.
  *
- * @param handle       handle to an open recno database.
- * @param table_head   offset to the block_head of the root of
- *                     a table.  Use 0 for default file table.
- * @param user         Callback function the new record offset is sent.
- * @param closure      Optional memory to be made available to the `user` callback function.
+ * Only the maps are read, so walking the maps touches a few cache lines
+ * per block rather than every record.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param viewer      function to call with each block's map
+ * @param closure     optional pointer passed through to *viewer*
  */
-RND_ERROR flatrecs_get_next_offset(RNDH *handle,
-                                   off_t table_head,
-                                   flatrecs_use_new_record user,
-                                   void *closure)
+RND_ERROR flatrecs_walk_maps(RNDH *handle, off_t table_head, flatrecs_map_view viewer, void *closure)
 {
-   assert(handle && handle->file);
-   prime_handle(handle);
+   FWM_CLO clo = { handle, viewer, closure };
 
-   BLOCK_LOC bl = { table_head, sizeof(RND_HEAD_TABLE) };
-   FGN_CLO clo = { closure, user };
+   RND_ERROR rval = chains_walk(handle, table_head, flatrecs_walk_maps_viewer, &clo);
+   if (!rval)
+      rval = clo.rval;
 
-   return rnd_lock_area(handle, &bl, 1, flatrecs_get_next_offset_lock_callback, &clo);
+   return rval;
 }
 
+/**
+ * `chains_walk` viewer for `flatrecs_walk_records`
+ *
+ * Reads the liveness map and the existing records of each block with a
+ * single read and passes them to the caller's viewer.
+ */
+bool flatrecs_walk_records_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   FWR_CLO *clo = (FWR_CLO*)closure;
+
+   // The first block of the chain is the table head:
+   if (clo->start_recno == 0)
+   {
+      clo->rec_size = flatrecs_full_recsize((RND_HEAD_TABLE*)ib);
+      clo->last_recno = ((RND_HEAD_TABLE*)ib)->thead.last_recno;
+      clo->start_recno = 1;
+   }
+
+   if (clo->start_recno > clo->last_recno)
+      return 0;
+
+   uint32_t capacity = flatrecs_block_capacity(clo->rec_size, ib);
+   uint32_t nbits = clo->last_recno - clo->start_recno + 1;
+   if (nbits > capacity)
+      nbits = capacity;
+
+   bool keep_going = 1;
+   int tries = 3;
+
+   while (nbits)
+   {
+      const char *image = NULL;
+      size_t records_at = ib->bytes_to_records - ib->bytes_to_data;
+
+      if (ib->block_flags & RBF_COMPRESSED)
+      {
+         if (!(clo->rval = cache_get_image(clo->handle, offset_to_ib, ib, &image)))
+            image += ib->bytes_to_data;
+      }
+      else
+      {
+         size_t bytes = records_at + (size_t)nbits * clo->rec_size;
+
+         // One buffer, grown as needed, serves every block:
+         if (bytes > clo->buffer_size)
+         {
+            char *buffer = (char*)realloc(clo->buffer, bytes);
+            if (!buffer)
+            {
+               clo->handle->sys_errno = errno;
+               clo->rval = RND_SYSTEM_ERROR;
+               return 0;
+            }
+
+            clo->buffer = buffer;
+            clo->buffer_size = bytes;
+         }
+
+         if (!(clo->rval = blocks_read_at(clo->handle, offset_to_ib + ib->bytes_to_data, clo->buffer, bytes)))
+            clo->rval = compress_check_read(clo->handle, offset_to_ib, ib);
+
+         image = clo->buffer;
+      }
+
+      if (flatrecs_read_again(clo->handle, offset_to_ib, ib, &clo->rval, &tries))
+         continue;
+
+      keep_going = !clo->rval && (*clo->viewer)((const uint64_t*)image,
+                                                image + records_at,
+                                                nbits,
+                                                clo->start_recno,
+                                                clo->rec_size,
+                                                clo->caller_closure);
+      break;
+   }
+
+   clo->start_recno += capacity;
+   return keep_going;
+}
+
+/**
+ * Presents the liveness map and records of each block of a table to a
+ * viewer function.
+ *
+ * Each block is read with one read, so scanning a table with this
+ * function costs a read per block rather than per record.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param viewer      function to call with each block's map and records
+ * @param closure     optional pointer passed through to *viewer*
+ */
+RND_ERROR flatrecs_walk_records(RNDH *handle, off_t table_head, flatrecs_records_view viewer, void *closure)
+{
+   FWR_CLO clo = { handle, viewer, closure };
+
+   RND_ERROR rval = chains_walk(handle, table_head, flatrecs_walk_records_viewer, &clo);
+   if (!rval)
+      rval = clo.rval;
+
+   free(clo.buffer);
+   return rval;
+}
+
+/**
+ * `chains_walk` viewer for `flatrecs_list_blocks`
+ */
+bool flatrecs_list_blocks_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   FLB_CLO *clo = (FLB_CLO*)closure;
+
+   // The first block of the chain is the table head:
+   if (clo->start_recno == 0)
+   {
+      clo->rec_size = flatrecs_full_recsize((RND_HEAD_TABLE*)ib);
+      clo->last_recno = ((RND_HEAD_TABLE*)ib)->thead.last_recno;
+      clo->start_recno = 1;
+   }
+
+   if (clo->start_recno > clo->last_recno)
+      return 0;
+
+   uint32_t capacity = flatrecs_block_capacity(clo->rec_size, ib);
+   uint32_t nbits = clo->last_recno - clo->start_recno + 1;
+   if (nbits > capacity)
+      nbits = capacity;
+
+   if (nbits)
+   {
+      if (clo->count == clo->allocated)
+      {
+         uint32_t allocated = clo->allocated ? clo->allocated * 2 : 64;
+         FLATREC_BLOCK *blocks = (FLATREC_BLOCK*)realloc(clo->blocks, allocated * sizeof(FLATREC_BLOCK));
+         if (!blocks)
+         {
+            clo->sys_errno = errno;
+            return 0;
+         }
+
+         clo->blocks = blocks;
+         clo->allocated = allocated;
+      }
+
+      FLATREC_BLOCK *fb = &clo->blocks[clo->count++];
+      fb->offset = offset_to_ib;
+      fb->block = *ib;
+      fb->first_recno = clo->start_recno;
+      fb->nbits = nbits;
+   }
+
+   clo->start_recno += capacity;
+   return 1;
+}
+
+/**
+ * Lists the blocks of a table that hold existing records, in chain order.
+ *
+ * The list lets a caller divide a scan among threads after walking the
+ * chain once.  The block headers are as read during the walk.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param blocks      [out] array of *count* blocks, release with free()
+ * @param count       [out] number of blocks listed
+ * @param rec_size    [out] size of the table's records
+ */
+RND_ERROR flatrecs_list_blocks(RNDH          *handle,
+                               off_t         table_head,
+                               FLATREC_BLOCK **blocks,
+                               uint32_t      *count,
+                               uint32_t      *rec_size)
+{
+   FLB_CLO clo = { NULL };
+
+   RND_ERROR rval = chains_walk(handle, table_head, flatrecs_list_blocks_viewer, &clo);
+   if (!rval && clo.sys_errno)
+   {
+      handle->sys_errno = clo.sys_errno;
+      rval = RND_SYSTEM_ERROR;
+   }
+
+   if (rval)
+   {
+      free(clo.blocks);
+      return rval;
+   }
+
+   *blocks = clo.blocks;
+   *count = clo.count;
+   *rec_size = clo.rec_size;
+   return RND_SUCCESS;
+}
+
+/**
+ * Reads the liveness map and existing records of a listed block into
+ * *buffer*, growing it as needed, and points *image* at the map.
+ *
+ * Compressed blocks are decompressed into *buffer* rather than through
+ * the handle's cache, so threads with copies of a handle can read at once.
+ * A block compressed or expanded while it's read is read again.
+ *
+ * @param handle       handle to an open recno database
+ * @param fb           the block, as listed by `flatrecs_list_blocks`
+ * @param rec_size     size of the table's records
+ * @param buffer       [in, out] memory allocated with malloc(), or NULL
+ * @param buffer_size  [in, out] size of *buffer*
+ * @param image        [out] the block's liveness map, followed by its records
+ *                     at the block's *bytes_to_records* less *bytes_to_data*
+ */
+RND_ERROR flatrecs_read_block(RNDH                *handle,
+                              const FLATREC_BLOCK *fb,
+                              uint32_t            rec_size,
+                              char                **buffer,
+                              size_t              *buffer_size,
+                              const char          **image)
+{
+   INFO_BLOCK ib = fb->block;
+   size_t records_at = ib.bytes_to_records - ib.bytes_to_data;
+   RND_ERROR rval;
+   int tries = 3;
+
+   do
+   {
+      size_t bytes = (ib.block_flags & RBF_COMPRESSED)
+         ? ib.block_size
+         : records_at + (size_t)fb->nbits * rec_size;
+
+      if (bytes > *buffer_size)
+      {
+         char *grown = (char*)realloc(*buffer, bytes);
+         if (!grown)
+         {
+            handle->sys_errno = errno;
+            return RND_SYSTEM_ERROR;
+         }
+
+         *buffer = grown;
+         *buffer_size = bytes;
+      }
+
+      if (ib.block_flags & RBF_COMPRESSED)
+      {
+         rval = compress_load_block(handle, fb->offset, &ib, *buffer);
+         *image = *buffer + ib.bytes_to_data;
+      }
+      else
+      {
+         if (!(rval = blocks_read_at(handle, fb->offset + ib.bytes_to_data, *buffer, bytes)))
+            rval = compress_check_read(handle, fb->offset, &ib);
+         *image = *buffer;
+      }
+   }
+   while (flatrecs_read_again(handle, fb->offset, &ib, &rval, &tries));
+
+   return rval;
+}
+
+bool flatrecs_count_live_viewer(const uint64_t *map, uint32_t nbits, uint32_t first_recno, void *closure)
+{
+   *(uint32_t*)closure += bitmap_popcount(map, nbits);
+   return 1;
+}
+
+/**
+ * Counts the live (assigned and not deleted) records of a table.
+ */
+RND_ERROR flatrecs_count_live(RNDH *handle, off_t table_head, uint32_t *count)
+{
+   *count = 0;
+   return flatrecs_walk_maps(handle, table_head, flatrecs_count_live_viewer, count);
+}
+
+struct flatrecs_search_closure {
+   uint32_t from_recno;
+   uint32_t found_recno;   /**< 0 until a record is found */
+   bool     want_live;
+};
+
+bool flatrecs_search_viewer(const uint64_t *map, uint32_t nbits, uint32_t first_recno, void *closure)
+{
+   struct flatrecs_search_closure *clo = (struct flatrecs_search_closure*)closure;
+
+   if (first_recno + nbits <= clo->from_recno)
+      return 1;
+
+   uint32_t from_bit = clo->from_recno > first_recno ? clo->from_recno - first_recno : 0;
+
+   int64_t bit = clo->want_live
+      ? bitmap_next_set(map, nbits, from_bit)
+      : bitmap_next_clear(map, nbits, from_bit);
+
+   if (bit < 0)
+      return 1;
+
+   clo->found_recno = first_recno + (uint32_t)bit;
+   return 0;
+}
+
+/**
+ * Finds the first live record at or after *from_recno*.
+ *
+ * @return RND_SUCCESS with *recno* set, or RND_REACHED_END_OF_BLOCK_CHAIN
+ *         if there are no more live records.
+ */
+RND_ERROR flatrecs_next_live(RNDH *handle, off_t table_head, uint32_t from_recno, uint32_t *recno)
+{
+   struct flatrecs_search_closure clo = { from_recno, 0, 1 };
+
+   RND_ERROR rval = flatrecs_walk_maps(handle, table_head, flatrecs_search_viewer, &clo);
+   if (!rval)
+   {
+      if (clo.found_recno)
+         *recno = clo.found_recno;
+      else
+         rval = RND_REACHED_END_OF_BLOCK_CHAIN;
+   }
+
+   return rval;
+}
+
+/**
+ * Finds the first deleted record, a slot that can be reused.
+ *
+ * @return RND_SUCCESS with *recno* set, or RND_REACHED_END_OF_BLOCK_CHAIN
+ *         if every assigned record is live.
+ */
+RND_ERROR flatrecs_first_free(RNDH *handle, off_t table_head, uint32_t *recno)
+{
+   struct flatrecs_search_closure clo = { 1, 0, 0 };
+
+   RND_ERROR rval = flatrecs_walk_maps(handle, table_head, flatrecs_search_viewer, &clo);
+   if (!rval)
+   {
+      if (clo.found_recno)
+         *recno = clo.found_recno;
+      else
+         rval = RND_REACHED_END_OF_BLOCK_CHAIN;
+   }
+
+   return rval;
+}
+
+/**
+ * Reads the liveness of a located record and, if it's live, its contents,
+ * without a lock.
+ *
+ * @return RND_LOCK_FAILED if the block was compressed or expanded as it
+ *         was read, so the record must be located and read again.
+ */
+static RND_ERROR flatrecs_read_located(RNDH *handle, const FLATREC_LOC *loc, void *buffer, uint32_t size, bool *live)
+{
+   RND_ERROR rval;
+
+   if (!(rval = flatrecs_record_is_live(handle, loc, live)) && *live)
+   {
+      if (loc->block.block_flags & RBF_COMPRESSED)
+      {
+         const char *image;
+         if (!(rval = cache_get_image(handle, loc->block_offset, &loc->block, &image)))
+            memcpy(buffer, image + (loc->record_offset - loc->block_offset), size);
+      }
+      else
+         rval = blocks_read_at(handle, loc->record_offset, buffer, size);
+   }
+
+   // The image of a compressed block is checked as it's loaded:
+   if (!rval && !(loc->block.block_flags & RBF_COMPRESSED))
+      rval = compress_check_read(handle, loc->block_offset, &loc->block);
+
+   return rval;
+}
+
+/**
+ * Copies a live record into *buffer*.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param recno       record to read
+ * @param buffer      [out] memory to receive the record
+ * @param size        [in/out] size of *buffer*, upon return the number of bytes copied
+ *
+ * @return RND_SUCCESS, or RND_EXTINCT_RECORD if the record is deleted or unassigned.
+ */
+RND_ERROR flatrecs_read_record(RNDH *handle, off_t table_head, uint32_t recno, void *buffer, uint32_t *size)
+{
+   prime_handle(handle);
+
+   FLATREC_LOC loc;
+   bool live;
+   RND_ERROR rval;
+   int tries = 3;
+
+   do
+   {
+      if ((rval = flatrecs_locate_record(handle, table_head, recno, &loc)))
+         break;
+
+      if (*size > loc.rec_size)
+         *size = loc.rec_size;
+
+      rval = flatrecs_read_located(handle, &loc, buffer, *size, &live);
+   }
+   while (rval == RND_LOCK_FAILED && --tries);
+
+   if (!rval && !live)
+      rval = RND_EXTINCT_RECORD;
+
+   return rval;
+}
+
+/**
+ * Gets a pointer to a record in place, rather than a copy of it.
+ *
+ * The record of an uncompressed block is found in the handle's mapping of
+ * the file, and that of a compressed block in its image in the cache,
+ * which is pinned there.  Either way, the pointer stays valid until
+ * *lease* is passed to `flatrecs_release_record`, which must be done
+ * before the handle is closed.  A handle has RND_CACHE_SLOTS cache slots,
+ * and other reads of compressed blocks fail while all are leased.
+ *
+ * The record is read-only, and later writes to it may show through, as
+ * may the compression of its block.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param recno       record number to get
+ * @param record      [out] pointer to the record
+ * @param size        [out] size of the record
+ * @param lease       [out] what holds the record in place
+ */
+RND_ERROR flatrecs_read_record_ref(RNDH *handle,
+                                   off_t table_head,
+                                   uint32_t recno,
+                                   const void **record,
+                                   uint32_t *size,
+                                   RND_LEASE *lease)
+{
+   prime_handle(handle);
+
+   FLATREC_LOC loc;
+   RND_ERROR rval;
+   const char *block_image;
+   uint64_t word;
+   int tries = 3;
+
+   memset(lease, 0, sizeof(*lease));
+
+   do
+   {
+      if ((rval = flatrecs_locate_record(handle, table_head, recno, &loc)))
+         return rval;
+
+      if (loc.block.block_flags & RBF_COMPRESSED)
+      {
+         CACHE_SLOT *slot;
+         if ((rval = cache_pin_image(handle, loc.block_offset, &loc.block, &slot)))
+            continue;
+
+         lease->holder = slot;
+         lease->kind = LEASE_CACHE;
+         block_image = slot->image;
+      }
+      else
+      {
+         struct rnd_mapping *mapping;
+         if ((rval = mapping_reach(handle, loc.record_offset + loc.rec_size, &mapping)))
+            return rval;
+
+         ++mapping->leases;
+         lease->holder = mapping;
+         lease->kind = LEASE_MAPPING;
+         block_image = mapping->base + loc.block_offset;
+      }
+
+      memcpy(&word, block_image + (flatrecs_map_word_offset(&loc) - loc.block_offset), sizeof(word));
+
+      // The image of a compressed block is checked as it's loaded:
+      if (!(loc.block.block_flags & RBF_COMPRESSED)
+          && (rval = compress_check_read(handle, loc.block_offset, &loc.block)))
+         flatrecs_release_record(lease);
+   }
+   while (rval == RND_LOCK_FAILED && --tries);
+
+   if (rval)
+      return rval;
+
+   if (!bitmap_test(&word, loc.map_index % BITMAP_WORD_BITS))
+   {
+      flatrecs_release_record(lease);
+      return RND_EXTINCT_RECORD;
+   }
+
+   *record = block_image + (loc.record_offset - loc.block_offset);
+   *size = loc.rec_size;
+   return RND_SUCCESS;
+}
+
+/**
+ * Releases the lease of a record from `flatrecs_read_record_ref`.
+ * Releasing an empty lease does nothing.
+ */
+void flatrecs_release_record(RND_LEASE *lease)
+{
+   switch(lease->kind)
+   {
+      case LEASE_MAPPING:
+         mapping_release((struct rnd_mapping*)lease->holder);
+         break;
+
+      case LEASE_CACHE:
+         cache_unpin_image((CACHE_SLOT*)lease->holder);
+         break;
+
+      default:
+         break;
+   }
+
+   memset(lease, 0, sizeof(*lease));
+}
+
+/**
+ * Writes a record at *offset*, zero-filling the slot past *size*.
+ */
+static RND_ERROR flatrecs_write_slot(RNDH *handle, off_t offset, uint32_t rec_size, const void *data, uint32_t size)
+{
+   if (size > rec_size)
+      return RND_BAD_PARAMETER;
+
+   char slot[rec_size];
+   memcpy(slot, data, size);
+   memset(slot + size, 0, rec_size - size);
+
+   return blocks_write_at(handle, offset, slot, rec_size);
+}
+
+typedef struct flatrecs_change_record_closure {
+   const FLATREC_LOC *loc;
+   const void        *data;      /**< new contents, or NULL to change only liveness */
+   off_t             table_head;
+   uint32_t          recno;
+   uint32_t          size;
+   bool              live;
+   RND_ERROR         rval;
+   bool              compressed; /**< [out] block was compressed before the lock was placed */
+   char              pad[4];
+} FCR_CLO;
+
+/**
+ * Callback for `rnd_lock_area`, called by `flatrecs_change_record` with the
+ * record locked.
+ *
+ * Compressing a block requires a lock on the whole block, so once the record
+ * is locked, a block found to be uncompressed will stay that way.
+ */
+bool flatrecs_change_record_lock_callback(RNDH *handle,
+                                          BLOCK_LOC *bloc,
+                                          void *locked_buffer,
+                                          void *closure)
+{
+   FCR_CLO *clo = (FCR_CLO*)closure;
+   INFO_BLOCK ib;
+
+   if ((clo->rval = blocks_read_block_head(handle, clo->loc->block_offset, &ib, sizeof(ib))))
+      return 0;
+
+   if (ib.block_flags & RBF_COMPRESSED)
+   {
+      clo->compressed = 1;
+      return 0;
+   }
+
+   // Open snapshots need the record as it is now:
+   if ((clo->rval = snapshot_preserve(handle, clo->table_head, clo->recno, clo->loc)))
+      return 0;
+
+   // Indexes of the table need the record's previous contents:
+   uint32_t rec_size = clo->loc->rec_size;
+   char old_record[rec_size];
+   const void *old_data = NULL, *new_data = NULL;
+   bool indexed, was_live;
+
+   if ((clo->rval = btree_table_indexed(handle, clo->table_head, &indexed)))
+      return 0;
+
+   if ((clo->rval = flatrecs_record_is_live(handle, clo->loc, &was_live)))
+      return 0;
+
+   if (indexed)
+   {
+      if (was_live && (clo->rval = blocks_read_at(handle, clo->loc->record_offset, old_record, rec_size)))
+         return 0;
+
+      old_data = was_live ? old_record : NULL;
+      new_data = !clo->live ? NULL : clo->data ? clo->data : old_record;
+
+      // Update the indexes first, so an index that can't be updated stops the change:
+      if ((clo->rval = btree_record_changed(handle, clo->table_head, clo->recno,
+                                            old_data, rec_size, new_data, clo->data ? clo->size : rec_size)))
+         return 0;
+   }
+
+   // Liveness before the record, so a change that fails leaves the record
+   // as it was, its liveness put back if the write fails:
+   if (!(clo->rval = flatrecs_set_liveness(handle, clo->loc, clo->live))
+       && clo->data
+       && (clo->rval = flatrecs_write_slot(handle, clo->loc->record_offset, rec_size, clo->data, clo->size))
+       && was_live != clo->live)
+      flatrecs_set_liveness(handle, clo->loc, was_live);
+
+   if (clo->rval)
+   {
+      if (indexed)
+         btree_record_changed(handle, clo->table_head, clo->recno,
+                              new_data, clo->data ? clo->size : rec_size, old_data, rec_size);
+      return 0;
+   }
+
+   // For incremental backups and the change feed:
+   if (!(clo->rval = blocks_stamp_block(handle, clo->loc->block_offset, ib.generation)))
+      clo->rval = changes_note(handle, clo->table_head, clo->recno,
+                               clo->live ? RND_CHANGE_PUT : RND_CHANGE_DELETE);
+   return 0;
+}
+
+/**
+ * Writes and/or changes the liveness of an assigned record, first expanding
+ * its block if the block is compressed.
+ */
+static RND_ERROR flatrecs_change_record(RNDH *handle,
+                                        off_t table_head,
+                                        uint32_t recno,
+                                        const void *data,
+                                        uint32_t size,
+                                        bool live)
+{
+   prime_handle(handle);
+
+   FLATREC_LOC loc;
+   RND_ERROR rval;
+   int tries = 3;
+
+   while (tries--)
+   {
+      if ((rval = flatrecs_locate_record(handle, table_head, recno, &loc)))
+         break;
+
+      if (loc.block.block_flags & RBF_COMPRESSED)
+      {
+         if ((rval = compress_expand_block(handle, loc.block_offset)))
+            break;
+         continue;
+      }
+
+      FCR_CLO clo = { &loc, data, table_head, recno, size, live, RND_SUCCESS, 0 };
+      BLOCK_LOC bl = { loc.record_offset, loc.rec_size };
+
+      if ((rval = rnd_lock_area(handle, &bl, 0, flatrecs_change_record_lock_callback, &clo)))
+         break;
+
+      // Compressed between locating and locking the record, try again:
+      if (clo.compressed)
+      {
+         rval = RND_LOCK_FAILED;
+         continue;
+      }
+
+      rval = clo.rval;
+      break;
+   }
+
+   return rval;
+}
+
+/**
+ * Replaces the contents of an assigned record, making it live if it had been deleted.
+ */
+RND_ERROR flatrecs_write_record(RNDH *handle, off_t table_head, uint32_t recno, const void *data, uint32_t size)
+{
+   return flatrecs_change_record(handle, table_head, recno, data, size, 1);
+}
+
+/**
+ * Marks a record as deleted.  Its space remains until the table is compacted.
+ */
+RND_ERROR flatrecs_delete_record(RNDH *handle, off_t table_head, uint32_t recno)
+{
+   return flatrecs_change_record(handle, table_head, recno, NULL, 0, 0);
+}
+
+/** How `flatrecs_change_field` changes a field. */
+typedef enum {
+   FIELD_SET,        /**< overwrite the field with *bytes*                      */
+   FIELD_CAS,        /**< store *desired* if the field holds *operand*          */
+   FIELD_ADD         /**< add *operand* to the field                            */
+} FIELD_OP;
+
+typedef struct flatrecs_change_field_closure {
+   const FLATREC_LOC *loc;
+   const void        *bytes;      /**< new contents for FIELD_SET                           */
+   off_t             table_head;
+   uint64_t          operand;    /**< expected value for FIELD_CAS, addend for FIELD_ADD   */
+   uint64_t          desired;    /**< new value for FIELD_CAS                              */
+   uint64_t          previous;   /**< [out] value before a FIELD_CAS or FIELD_ADD          */
+   uint32_t          recno;
+   uint32_t          offset;
+   uint32_t          len;
+   FIELD_OP          op;
+   RND_ERROR         rval;
+   bool              whole;      /**< the lock covers the whole record                     */
+   bool              compressed; /**< [out] block was compressed before the lock was placed */
+   bool              widen;      /**< [out] an index covers the field, lock the whole record */
+} FCF_CLO;
+
+/**
+ * Reads a native-endian unsigned integer of 1, 2, 4 or 8 bytes.
+ */
+static uint64_t flatrecs_field_load(const void *field, uint32_t width)
+{
+   uint8_t u8;
+   uint16_t u16;
+   uint32_t u32;
+   uint64_t u64;
+
+   switch(width)
+   {
+      case 1:  memcpy(&u8, field, 1);   return u8;
+      case 2:  memcpy(&u16, field, 2);  return u16;
+      case 4:  memcpy(&u32, field, 4);  return u32;
+      default: memcpy(&u64, field, 8);  return u64;
+   }
+}
+
+/**
+ * Writes *value* as a native-endian unsigned integer of 1, 2, 4 or 8
+ * bytes, dropping the bits that don't fit.
+ */
+static void flatrecs_field_store(void *field, uint32_t width, uint64_t value)
+{
+   uint8_t u8 = (uint8_t)value;
+   uint16_t u16 = (uint16_t)value;
+   uint32_t u32 = (uint32_t)value;
+
+   switch(width)
+   {
+      case 1:  memcpy(field, &u8, 1);     break;
+      case 2:  memcpy(field, &u16, 2);    break;
+      case 4:  memcpy(field, &u32, 4);    break;
+      default: memcpy(field, &value, 8);  break;
+   }
+}
+
+/**
+ * Points at a field of a located record in the handle's mapping, if the
+ * field can be changed there with one atomic instruction: it is 4 or 8
+ * bytes on a boundary of its size, and the handle writes through the
+ * page cache.  Returns NULL otherwise, as for RND_DIRECT handles, whose
+ * writes bypass the page cache and so can't be atomic with the mapping.
+ */
+static char *flatrecs_mapped_field(RNDH *handle, const FLATREC_LOC *loc, const FCF_CLO *clo)
+{
+   off_t field = loc->record_offset + clo->offset;
+   struct rnd_mapping *mapping;
+
+   if (handle->readonly || handle->io_align || handle->positional
+       || (clo->len != 4 && clo->len != 8) || field % clo->len
+       || mapping_reach(handle, field + clo->len, &mapping))
+      return NULL;
+
+   return mapping->base + field;
+}
+
+/**
+ * Makes *clo->op* on a field found by `flatrecs_mapped_field` with one
+ * atomic instruction, so that changes made at once through the mappings
+ * of several handles aren't lost.
+ *
+ * @return TRUE if the field was written, FALSE if a FIELD_CAS found
+ *         another value in it
+ */
+static bool flatrecs_field_atomic(RNDH *handle, char *field, FCF_CLO *clo)
+{
+   bool written = 1;
+
+   if (clo->len == 4)
+   {
+      uint32_t *word = (uint32_t*)field, value;
+
+      if (clo->op == FIELD_SET)
+      {
+         memcpy(&value, clo->bytes, sizeof(value));
+         __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+      }
+      else if (clo->op == FIELD_ADD)
+         clo->previous = __atomic_fetch_add(word, (uint32_t)clo->operand, __ATOMIC_SEQ_CST);
+      else
+      {
+         // An *expected* too wide for the field can't match it:
+         if (clo->operand > UINT32_MAX)
+         {
+            value = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            written = 0;
+         }
+         else
+         {
+            value = (uint32_t)clo->operand;
+            written = __atomic_compare_exchange_n(word, &value, (uint32_t)clo->desired, 0,
+                                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+         }
+         clo->previous = value;
+      }
+   }
+   else
+   {
+      uint64_t *word = (uint64_t*)field, value;
+
+      if (clo->op == FIELD_SET)
+      {
+         memcpy(&value, clo->bytes, sizeof(value));
+         __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+      }
+      else if (clo->op == FIELD_ADD)
+         clo->previous = __atomic_fetch_add(word, clo->operand, __ATOMIC_SEQ_CST);
+      else
+      {
+         value = clo->operand;
+         written = __atomic_compare_exchange_n(word, &value, clo->desired, 0,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+         clo->previous = value;
+      }
+   }
+
+   if (written)
+   {
+      STATS_ADD(handle, bytes_written, clo->len);
+      cache_forget_written(handle, field - handle->mapping->base, clo->len);
+   }
+
+   return written;
+}
+
+/**
+ * Makes a FIELD_CAS or FIELD_ADD on a located record through the
+ * handle's mapping, without the record lock.
+ *
+ * This is for counters and the like that many writers change at once.
+ * Nothing but the field may have to change with it: no index covers the
+ * field, the file keeps no change log, and no snapshot is open, since
+ * those need the record to hold still.  The block is pinned against
+ * compression (see `compress_pin_block`), and its header and liveness
+ * bit are read from the mapping.  Once the handle has pinned the block
+ * and has a mapping long enough, the change makes no system call, unless
+ * the block must be stamped for a backup.
+ *
+ * @return RND_SUCCESS, RND_EXTINCT_RECORD, or RND_LOCK_FAILED if the
+ *         change must be made under the record lock instead
+ */
+static RND_ERROR flatrecs_change_field_mapped(RNDH *handle, const FLATREC_LOC *loc, FCF_CLO *clo)
+{
+   char *field = flatrecs_mapped_field(handle, loc, clo);
+   if (!field)
+      return RND_LOCK_FAILED;
+
+   const char *base = handle->mapping->base;
+   const INFO_FILE *fhead = &((const RND_HEAD_FILE*)base)->fhead;
+   const INFO_BLOCK *ib = (const INFO_BLOCK*)(base + loc->block_offset);
+   bool indexed;
+   RND_ERROR rval;
+
+   if (__atomic_load_n(&fhead->changes_head, __ATOMIC_ACQUIRE)
+       || (__atomic_load_n(&fhead->snapshot_head, __ATOMIC_ACQUIRE) && snapshot_any_open(handle)))
+      return RND_LOCK_FAILED;
+
+   if (__atomic_load_n(&fhead->btree_head, __ATOMIC_ACQUIRE))
+   {
+      if ((rval = btree_bytes_indexed(handle, clo->table_head, clo->offset, clo->len, &indexed)))
+         return rval;
+      if (indexed)
+         return RND_LOCK_FAILED;
+   }
+
+   // The header is read after the pin, which keeps it from changing:
+   if ((rval = compress_pin_block(handle, loc->block_offset)))
+      return rval;
+
+   if (__atomic_load_n(&ib->block_flags, __ATOMIC_ACQUIRE) & (RBF_COMPRESSED | RBF_CHANGING))
+      return RND_LOCK_FAILED;
+
+   uint64_t word = __atomic_load_n((const uint64_t*)(base + flatrecs_map_word_offset(loc)), __ATOMIC_ACQUIRE);
+   if (!bitmap_test(&word, loc->map_index % BITMAP_WORD_BITS))
+      return RND_EXTINCT_RECORD;
+
+   if (!flatrecs_field_atomic(handle, field, clo))
+      return RND_SUCCESS;
+
+   return blocks_stamp_block(handle, loc->block_offset, __atomic_load_n(&ib->generation, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Callback for `rnd_lock_area`, called by `flatrecs_change_field` with the
+ * field, or the whole record if it is indexed, locked.
+ *
+ * Only an index needs the rest of the record, so a field no index covers
+ * is changed without reading anything but the record's liveness bit and,
+ * for FIELD_CAS and FIELD_ADD, the field itself.  Such a field is changed
+ * atomically through the mapping where it can be, even under the lock,
+ * as `flatrecs_change_field_mapped` may be changing it without the lock.
+ */
+bool flatrecs_change_field_lock_callback(RNDH *handle,
+                                         BLOCK_LOC *bloc,
+                                         void *locked_buffer,
+                                         void *closure)
+{
+   FCF_CLO *clo = (FCF_CLO*)closure;
+   const FLATREC_LOC *loc = clo->loc;
+   INFO_BLOCK ib;
+   bool indexed, live;
+
+   if ((clo->rval = blocks_read_block_head(handle, loc->block_offset, &ib, sizeof(ib))))
+      return 0;
+
+   if (ib.block_flags & RBF_COMPRESSED)
+   {
+      clo->compressed = 1;
+      return 0;
+   }
+
+   if ((clo->rval = btree_bytes_indexed(handle, clo->table_head, clo->offset, clo->len, &indexed)))
+      return 0;
+
+   // Updating an index needs the whole record to hold still:
+   if (indexed && !clo->whole)
+   {
+      clo->widen = 1;
+      return 0;
+   }
+
+   if ((clo->rval = flatrecs_record_is_live(handle, loc, &live)))
+      return 0;
+
+   if (!live)
+   {
+      clo->rval = RND_EXTINCT_RECORD;
+      return 0;
+   }
+
+   char *mapped = indexed ? NULL : flatrecs_mapped_field(handle, loc, clo);
+   if (mapped)
+   {
+      // The record is copied for a snapshot even if a FIELD_CAS then fails:
+      if (!(clo->rval = snapshot_preserve(handle, clo->table_head, clo->recno, loc))
+          && flatrecs_field_atomic(handle, mapped, clo)
+          && !(clo->rval = blocks_stamp_block(handle, loc->block_offset, ib.generation)))
+         clo->rval = changes_note(handle, clo->table_head, clo->recno, RND_CHANGE_FIELD);
+      return 0;
+   }
+
+   uint32_t rec_size = loc->rec_size;
+   char old_record[indexed ? rec_size : 1], new_record[indexed ? rec_size : 1];
+   char old_field[sizeof(uint64_t)], new_field[sizeof(uint64_t)];
+   const void *bytes = clo->bytes;
+
+   if (indexed)
+   {
+      if ((clo->rval = blocks_read_at(handle, loc->record_offset, old_record, rec_size)))
+         return 0;
+      if (clo->op != FIELD_SET)
+         memcpy(old_field, old_record + clo->offset, clo->len);
+   }
+   else if (clo->op != FIELD_SET
+            && (clo->rval = blocks_read_at(handle, loc->record_offset + clo->offset, old_field, clo->len)))
+      return 0;
+
+   if (clo->op != FIELD_SET)
+   {
+      clo->previous = flatrecs_field_load(old_field, clo->len);
+
+      // A failed compare leaves the record alone:
+      if (clo->op == FIELD_CAS && clo->previous != clo->operand)
+         return 0;
+
+      flatrecs_field_store(new_field, clo->len,
+                           clo->op == FIELD_CAS ? clo->desired : clo->previous + clo->operand);
+      bytes = new_field;
+   }
+
+   if ((clo->rval = snapshot_preserve(handle, clo->table_head, clo->recno, loc)))
+      return 0;
+
+   if (!indexed)
+   {
+      if (!(clo->rval = blocks_write_at(handle, loc->record_offset + clo->offset, bytes, clo->len))
+          && !(clo->rval = blocks_stamp_block(handle, loc->block_offset, ib.generation)))
+         clo->rval = changes_note(handle, clo->table_head, clo->recno, RND_CHANGE_FIELD);
+      return 0;
+   }
+
+   memcpy(new_record, old_record, rec_size);
+   memcpy(new_record + clo->offset, bytes, clo->len);
+
+   if ((clo->rval = btree_record_changed(handle, clo->table_head, clo->recno,
+                                         old_record, rec_size, new_record, rec_size)))
+      return 0;
+
+   if ((clo->rval = blocks_write_at(handle, loc->record_offset + clo->offset, bytes, clo->len)))
+      btree_record_changed(handle, clo->table_head, clo->recno, new_record, rec_size, old_record, rec_size);
+   else if (!(clo->rval = blocks_stamp_block(handle, loc->block_offset, ib.generation)))
+      clo->rval = changes_note(handle, clo->table_head, clo->recno, RND_CHANGE_FIELD);
+
+   return 0;
+}
+
+/**
+ * Changes *clo->len* bytes at *clo->offset* within a live record as
+ * *clo->op* directs, leaving the rest of the record alone.
+ *
+ * Only the bytes being changed are locked, read and written, so writers
+ * of different fields of a record don't wait for each other.  If an index
+ * covers any of the bytes, the whole record is locked and read instead,
+ * to update the index.
+ *
+ * A FIELD_CAS or FIELD_ADD is first tried without the lock, by
+ * `flatrecs_change_field_mapped`, and takes the locked path only where
+ * that can't be used: on an RND_DIRECT handle, for a field of 1 or 2
+ * bytes or one off its natural boundary, and while an index, change log
+ * or open snapshot needs the record held still, or the block is
+ * compressed or being compressed.
+ */
+static RND_ERROR flatrecs_change_field(RNDH *handle, uint32_t recno, FCF_CLO *clo)
+{
+   prime_handle(handle);
+
+   FLATREC_LOC loc;
+   RND_ERROR rval;
+   int tries = 3;
+
+   while (tries--)
+   {
+      if ((rval = flatrecs_locate_record(handle, clo->table_head, recno, &loc)))
+         break;
+
+      if (clo->offset > loc.rec_size || clo->len > loc.rec_size - clo->offset)
+      {
+         rval = RND_BAD_PARAMETER;
+         break;
+      }
+
+      if (loc.block.block_flags & RBF_COMPRESSED)
+      {
+         if ((rval = compress_expand_block(handle, loc.block_offset)))
+            break;
+         continue;
+      }
+
+      if (clo->op != FIELD_SET && !clo->whole
+          && (rval = flatrecs_change_field_mapped(handle, &loc, clo)) != RND_LOCK_FAILED)
+         break;
+
+      clo->loc = &loc;
+      clo->recno = recno;
+      clo->rval = RND_SUCCESS;
+      clo->compressed = clo->widen = 0;
+
+      BLOCK_LOC bl = { loc.record_offset + (clo->whole ? 0 : clo->offset),
+                       clo->whole ? loc.rec_size : clo->len };
+
+      if ((rval = rnd_lock_area(handle, &bl, 0, flatrecs_change_field_lock_callback, clo)))
+         break;
+
+      // Compressed between locating and locking the record, or indexed, try again:
+      if (clo->compressed || clo->widen)
+      {
+         clo->whole |= clo->widen;
+         rval = RND_LOCK_FAILED;
+         continue;
+      }
+
+      rval = clo->rval;
+      break;
+   }
+
+   return rval;
+}
+
+/**
+ * Overwrites *len* bytes at *offset* within a live record, leaving the
+ * rest of the record alone.
+ *
+ * Unlike `flatrecs_write_record`, only the bytes being changed are locked
+ * and written.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param recno       record to update
+ * @param offset      offset of the field within the record
+ * @param len         bytes in the field
+ * @param bytes       new contents of the field
+ */
+RND_ERROR flatrecs_update_field(RNDH *handle,
+                                off_t table_head,
+                                uint32_t recno,
+                                uint32_t offset,
+                                uint32_t len,
+                                const void *bytes)
+{
+   FCF_CLO clo = { NULL, bytes, table_head, 0, 0, 0, 0, offset, len, FIELD_SET };
+   return flatrecs_change_field(handle, recno, &clo);
+}
+
+/**
+ * Stores *desired* in an integer field of a live record if the field holds
+ * *expected*.
+ *
+ * The field is a native-endian unsigned integer of *width* 1, 2, 4 or 8
+ * bytes.  *found* receives the value the field held, so the swap was made
+ * if it equals *expected*.
+ *
+ * A field of 4 or 8 bytes on a boundary of its size is swapped with an
+ * atomic instruction on the mapped file, usually without the record lock
+ * (see `flatrecs_change_field`).  Writes of the whole record, such as
+ * `flatrecs_write_record` and a committing transaction, don't wait for
+ * such a swap, so one made at the same time lands before or after it.
+ */
+RND_ERROR flatrecs_cas_field(RNDH *handle,
+                             off_t table_head,
+                             uint32_t recno,
+                             uint32_t offset,
+                             uint32_t width,
+                             uint64_t expected,
+                             uint64_t desired,
+                             uint64_t *found)
+{
+   if (width != 1 && width != 2 && width != 4 && width != 8)
+      return RND_BAD_PARAMETER;
+
+   FCF_CLO clo = { NULL, NULL, table_head, expected, desired, 0, 0, offset, width, FIELD_CAS };
+   RND_ERROR rval = flatrecs_change_field(handle, recno, &clo);
+
+   if (!rval)
+      *found = clo.previous;
+   return rval;
+}
+
+/**
+ * Adds *addend* to an integer field of a live record, wrapping at the
+ * field's width.  Two's complement lets a "negative" addend subtract.
+ *
+ * The field is a native-endian unsigned integer of *width* 1, 2, 4 or 8
+ * bytes.  *previous* receives the value before the addition.  The field
+ * is added to as `flatrecs_cas_field` swaps it.
+ */
+RND_ERROR flatrecs_fetch_add_field(RNDH *handle,
+                                   off_t table_head,
+                                   uint32_t recno,
+                                   uint32_t offset,
+                                   uint32_t width,
+                                   uint64_t addend,
+                                   uint64_t *previous)
+{
+   if (width != 1 && width != 2 && width != 4 && width != 8)
+      return RND_BAD_PARAMETER;
+
+   FCF_CLO clo = { NULL, NULL, table_head, addend, 0, 0, 0, offset, width, FIELD_ADD };
+   RND_ERROR rval = flatrecs_change_field(handle, recno, &clo);
+
+   if (!rval)
+      *previous = clo.previous;
+   return rval;
+}
+
+struct flatrecs_compress_cold_closure {
+   RNDH      *handle;
+   uint32_t  rec_size;
+   uint32_t  last_recno;
+   uint32_t  start_recno;
+   uint32_t  compressed;    /**< [out] number of blocks compressed */
+   RND_ERROR rval;
+   char      pad[4];
+};
+
+/**
+ * `chains_walk` viewer for `flatrecs_compress_cold`
+ */
+bool flatrecs_compress_cold_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   struct flatrecs_compress_cold_closure *clo = (struct flatrecs_compress_cold_closure*)closure;
+
+   if (clo->start_recno == 0)
+   {
+      clo->rec_size = ((RND_HEAD_TABLE*)ib)->thead.rec_size;
+      clo->last_recno = ((RND_HEAD_TABLE*)ib)->thead.last_recno;
+      clo->start_recno = 1;
+   }
+
+   uint32_t capacity = flatrecs_block_capacity(clo->rec_size, ib);
+   uint32_t block_last_recno = clo->start_recno + capacity - 1;
+   clo->start_recno += capacity;
+
+   // Only full data blocks that aren't at the end of the chain are cold:
+   if (ib->block_type == RBT_DATA
+       && !(ib->block_flags & RBF_COMPRESSED)
+       && ib->next_block.offset
+       && capacity
+       && block_last_recno <= clo->last_recno)
+   {
+      bool compressed;
+      RND_ERROR rval = compress_block(clo->handle, offset_to_ib, &compressed);
+
+      // A locked block is in use, so not cold.  Skip it.
+      if (rval && rval != RND_LOCK_FAILED)
+      {
+         clo->rval = rval;
+         return 0;
+      }
+
+      if (!rval && compressed)
+         ++clo->compressed;
+   }
+
+   return clo->start_recno <= clo->last_recno;
+}
+
+/**
+ * Compresses the cold blocks of a table.
+ *
+ * Cold blocks are the full data blocks before the last block of the table.
+ * No access is tracked, so that is all "cold" means, beyond skipping the
+ * blocks in use: those a writer has locked, and those pinned by atomic
+ * field changes (see `compress_pin_block`).  Nothing compresses blocks but
+ * a call of this function; the library runs no background compactor of
+ * its own.  The compression of each block is done under a lock of the
+ * whole block, so a caller's thread or process can run it alongside
+ * readers and writers.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param count       [out] number of blocks that were compressed
+ */
+RND_ERROR flatrecs_compress_cold(RNDH *handle, off_t table_head, uint32_t *count)
+{
+   struct flatrecs_compress_cold_closure clo = { handle };
+
+   RND_ERROR rval = chains_walk(handle, table_head, flatrecs_compress_cold_viewer, &clo);
+   if (!rval)
+      rval = clo.rval;
+
+   *count = clo.compressed;
+   return rval;
+}
+
+/**
+ * `flatrecs_use_new_record` implementation for `flatrecs_append_record`
+ */
+bool flatrecs_append_record_user(RNDH              *handle,
+                                 RND_HEAD_TABLE    *head_table,
+                                 const FLATREC_LOC *loc,
+                                 void              *closure)
+{
+   FAP_CLO *clo = (FAP_CLO*)closure;
+   uint32_t recno = head_table->thead.last_recno + 1;
+
+   // Index the record first, so an index that can't be updated stops the append:
+   if ((clo->rval = btree_record_changed(handle, clo->table_head, recno, NULL, 0, clo->data, clo->size)))
+      return 0;
+
+   // Stamped once written, for incremental backups:
+   if ((clo->rval = flatrecs_write_slot(handle,
+                                        loc->record_offset,
+                                        head_table->thead.rec_size,
+                                        clo->data,
+                                        clo->size))
+       || (clo->rval = blocks_stamp_block(handle, loc->block_offset, loc->block.generation)))
+   {
+      btree_record_changed(handle, clo->table_head, recno, clo->data, clo->size, NULL, 0);
+      return 0;
+   }
+
+   clo->recno = ++head_table->thead.last_recno;
+   return 1;
+}
+
+/**
+ * Adds a record to the end of a table.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param data        record contents
+ * @param size        number of bytes in *data*, not more than the record size
+ * @param recno       [out] record number assigned to the new record
+ */
+RND_ERROR flatrecs_append_record(RNDH *handle, off_t table_head, const void *data, uint32_t size, uint32_t *recno)
+{
+   FAP_CLO clo = { data, table_head, size, 0, RND_SUCCESS };
+
+   RND_ERROR rval = flatrecs_get_next_offset(handle, table_head, flatrecs_append_record_user, &clo);
+   if (!rval)
+      rval = clo.rval;
+
+   // Noted once the table counts the record, so a consumer can read it:
+   if (!rval && !(rval = changes_note(handle, table_head, clo.recno, RND_CHANGE_APPEND)))
+      *recno = clo.recno;
+
+   return rval;
+}
+
+/**
+ * Callback for `rnd_lock_area` that is called by `flatrecs_get_next_offset`
+ *
+ * @param handle         open recno database handle
+ * @param bhandle        offset/size of locked memory area
+ * @param locked_buffer  contents of locked area
+ * @param closure        data passed from calling functions
+ *
+ * @return  0 (FALSE) to simply release the lock, non-zero (TRUE)
+ *          to, before releasing the lock, write the (presumably
+ *          changed) contents of `locked_buffer` to the file
+ *          location defined by `bhandle`.
+ */
+bool flatrecs_get_next_offset_lock_callback(RNDH *handle,
+                                            BLOCK_LOC *bloc,
+                                            void *locked_buffer,
+                                            void *closure)
+{
+   FGN_CLO *clo = (FGN_CLO*)closure;
+   RND_HEAD_TABLE *htable = (RND_HEAD_TABLE*)locked_buffer;
+
+   uint32_t new_recno = htable->thead.last_recno + 1;
+   FLATREC_LOC loc;
+
+   // Saved to notice changes to the chain that must be written back:
+   RND_HEAD_TABLE original;
+   memcpy(&original, htable, sizeof(original));
+
+   if ((clo->rval = flatrecs_make_location_of_recno(handle, bloc, htable, new_recno, &loc)))
+      return 0;
+
+   bool chain_changed = memcmp(&original.bhead.next_block, &htable->bhead.next_block, sizeof(BLOCK_LOC))
+      || memcmp(&original.chead, &htable->chead, sizeof(INFO_CHAIN));
+
+   // Mark the record live before the user writes anything, so a failure
+   // leaves nothing to undo.  Readers don't see the record until
+   // last_recno, written back below, counts it:
+   if ((clo->rval = flatrecs_set_liveness(handle, &loc, 1)))
+      return chain_changed;
+
+   bool write_back = (*clo->user)(handle,
+                                  (RND_HEAD_TABLE*)locked_buffer,
+                                  &loc,
+                                  clo->caller_closure);
+
+   // Unless the user claimed the record by advancing last_recno, the next
+   // append marks it live again, so clearing the bit is only tidiness:
+   if (!(write_back && htable->thead.last_recno >= new_recno))
+      flatrecs_set_liveness(handle, &loc, 0);
+
+   return write_back || chain_changed;
+}
+
+/**
+ * Find a file offset to which a record can be written.
+ *
+ * @param handle       handle to an open recno database.
+ * @param table_head   offset to the block_head of the root of
+ *                     a table.  Use 0 for default file table.
+ * @param user         Callback function the new record offset is sent.
+ * @param closure      Optional memory to be made available to the `user` callback function.
+ */
+RND_ERROR flatrecs_get_next_offset(RNDH *handle,
+                                   off_t table_head,
+                                   flatrecs_use_new_record user,
+                                   void *closure)
+{
+   assert(handle && handle->file);
+   prime_handle(handle);
+
+   BLOCK_LOC bl = { table_head, sizeof(RND_HEAD_TABLE) };
+   FGN_CLO clo = { closure, user, RND_SUCCESS };
+
+   RND_ERROR rval = rnd_lock_area(handle, &bl, 1, flatrecs_get_next_offset_lock_callback, &clo);
+   return rval ? rval : clo.rval;
+}
+
+/**
+ * Reserves disk space for *records* more records of a table.
+ *
+ * The space is reserved past the end of file without changing the file
+ * size (see `blocks_reserve`), so the blocks that appends later add to
+ * the table are allocated together instead of as each is added.
+ *
+ * @param handle      handle to open recno database
+ * @param table_head  offset to the head block of the table
+ * @param records     number of records for which to reserve space
+ */
+RND_ERROR flatrecs_reserve(RNDH *handle, off_t table_head, uint32_t records)
+{
+   RND_HEAD_TABLE htable;
+   RND_ERROR rval;
+
+   if ((rval = flatrecs_read_table_head(handle, table_head, &htable)))
+      return rval;
+
+   uint32_t rec_size = flatrecs_full_recsize(&htable);
+   if (rec_size == 0)
+      return RND_BAD_PARAMETER;
+
+   // Appends add chunk-sized blocks, so count the chunks they will need:
+   INFO_BLOCK ib = { RBT_DATA, sizeof(RND_HEAD_BLOCK) };
+   ib.block_size = handle->head_file.fhead.chunk_size;
+   blocks_set_record_layout(&ib, rec_size);
+
+   uint32_t per_chunk = flatrecs_block_capacity(rec_size, &ib);
+   off_t bytes = per_chunk
+      ? (off_t)((records + per_chunk - 1) / per_chunk) * ib.block_size
+      : (off_t)records * flatrecs_new_block_size(handle, rec_size, 1);
+
+   return blocks_reserve(handle, bytes);
+}
+
+/**
+ * Plans the next data block of a bulk load, sized for the records the
+ * hint still expects, and allocates it at the end of the file.
+ *
+ * @param prev       the block the new one follows, in the file and the chain
+ * @param rec_size   size of the table's records
+ * @param expected   records still expected, or 0 if the hint is spent
+ * @param loaded     records loaded so far
+ * @param ext        [out] the new block, empty
+ */
+static RND_ERROR flatrecs_bulk_next_extent(RNDH             *handle,
+                                           const FBL_EXTENT *prev,
+                                           uint32_t         rec_size,
+                                           uint64_t         expected,
+                                           uint64_t         loaded,
+                                           FBL_EXTENT       *ext)
+{
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   uint64_t max_size = FLATRECS_BULK_BLOCK_MAX / chunk_size * chunk_size;
+   RND_ERROR rval;
+
+   // Past the hint, double the table as appends would in many small steps:
+   if (expected == 0)
+      expected = loaded;
+
+   uint64_t bytes = blocks_bytes_to_data(RBT_DATA) + expected / 8 + 2 * RND_RECORD_ALIGN
+      + expected * rec_size;
+   uint64_t size = (bytes + chunk_size - 1) / chunk_size * chunk_size;
+   if (size > max_size)
+      size = max_size;
+
+   memset(ext, 0, sizeof(*ext));
+   ext->offset = prev->offset + prev->block.block_size;
+   ext->block.block_type = RBT_DATA;
+   ext->block.bytes_to_data = blocks_bytes_to_data(RBT_DATA);
+   ext->block.first_recno = loaded + 1;
+
+   // Records larger than the estimate allows still get a block:
+   while (1)
+   {
+      ext->block.block_size = (uint32_t)size;
+      blocks_set_record_layout(&ext->block, rec_size);
+      ext->capacity = flatrecs_block_capacity(rec_size, &ext->block);
+      if (ext->capacity || size + chunk_size > UINT32_MAX)
+         break;
+      size += chunk_size;
+   }
+
+   if (ext->capacity == 0)
+      return RND_INVALID_BLOCK_SIZE;
+
+   if ((rval = blocks_extend_file(handle, ext->block.block_size)))
+      return rval;
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Writes the liveness map of a filled block, marking its records live.
+ */
+static RND_ERROR flatrecs_bulk_write_map(RNDH *handle, const FBL_EXTENT *ext, uint64_t **map, size_t *map_size)
+{
+   size_t bytes = ext->block.bytes_to_records - ext->block.bytes_to_data;
+
+   if (bytes > *map_size)
+   {
+      uint64_t *grown = (uint64_t*)realloc(*map, bytes);
+      if (!grown)
+      {
+         handle->sys_errno = errno;
+         return RND_SYSTEM_ERROR;
+      }
+
+      *map = grown;
+      *map_size = bytes;
+   }
+
+   memset(*map, 0, bytes);
+   memset(*map, 0xff, (ext->filled / BITMAP_WORD_BITS) * sizeof(uint64_t));
+   if (ext->filled % BITMAP_WORD_BITS)
+      (*map)[ext->filled / BITMAP_WORD_BITS] = ((uint64_t)1 << (ext->filled % BITMAP_WORD_BITS)) - 1;
+
+   return blocks_write_at(handle, ext->offset + ext->block.bytes_to_data, *map, bytes);
+}
+
+/**
+ * Fills the table of a newly-created file with records from a reader.
+ *
+ * Records are copied into the blocks with large sequential writes, and
+ * nothing else is written until the reader is done: each block's map is
+ * written when it is full, and the block headers, their links, the chain
+ * hints and *last_recno* once at the end.  The data blocks are sized
+ * from *count_hint* and follow each other in the file, so a good hint
+ * makes the table one contiguous extent of a few large blocks.  Space
+ * left in the last block past its records is released.
+ *
+ * No locks are taken, so the file must not be open elsewhere until the
+ * load is done.  A failed load leaves the table empty.
+ *
+ * @param handle      handle to a file just created with RND_CREATE
+ * @param count_hint  expected number of records, or 0 if unknown
+ * @param reader      function to supply the records
+ * @param closure     optional pointer passed through to *reader*
+ * @param loaded      [out] number of records loaded, the last recno
+ */
+RND_ERROR flatrecs_bulk_load(RNDH *handle,
+                             uint64_t count_hint,
+                             rnd_bulk_reader reader,
+                             void *closure,
+                             uint32_t *loaded)
+{
+   prime_handle(handle);
+
+   RND_HEAD_FILE head;
+   FBL_EXTENT *extents = NULL, *ext;
+   uint32_t nextents = 1, allocated = 16, i;
+   uint64_t *map = NULL;
+   size_t map_size = 0;
+   char *buffer = NULL;
+   uint64_t total = 0;
+   RND_ERROR rval;
+
+   *loaded = 0;
+
+   if ((rval = blocks_read_at(handle, 0, &head, sizeof(head))))
+      return rval;
+
+   uint32_t rec_size = flatrecs_full_recsize((RND_HEAD_TABLE*)&head);
+   if (rec_size == 0 || head.thead.last_recno != 0 || head.bhead.next_block.offset != 0)
+      return RND_BAD_PARAMETER;
+
+   uint32_t room = FLATRECS_BULK_BUFFER / rec_size;
+   if (room == 0)
+      room = 1;
+
+   extents = (FBL_EXTENT*)malloc(allocated * sizeof(FBL_EXTENT));
+   buffer = (char*)malloc((size_t)room * rec_size);
+   if (!extents || !buffer)
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   // The file's head block takes the first records:
+   memset(extents, 0, sizeof(FBL_EXTENT));
+   extents[0].block = head.bhead;
+   extents[0].capacity = flatrecs_block_capacity(rec_size, &head.bhead);
+
+   // Reserve the whole table at once so its blocks are contiguous on disk:
+   if (count_hint > extents[0].capacity
+       && (rval = blocks_reserve(handle, (off_t)((count_hint - extents[0].capacity) * rec_size))))
+      goto abandon_function;
+
+   uint32_t got;
+   while ((got = (*reader)(buffer, room, closure)))
+   {
+      const char *from = buffer;
+
+      if (got > room || total + got > UINT32_MAX)
+      {
+         rval = RND_BAD_PARAMETER;
+         goto abandon_function;
+      }
+
+      while (got)
+      {
+         ext = &extents[nextents - 1];
+
+         if (ext->filled == ext->capacity)
+         {
+            if ((rval = flatrecs_bulk_write_map(handle, ext, &map, &map_size)))
+               goto abandon_function;
+
+            if (nextents == allocated)
+            {
+               FBL_EXTENT *grown = (FBL_EXTENT*)realloc(extents, allocated * 2 * sizeof(FBL_EXTENT));
+               if (!grown)
+               {
+                  handle->sys_errno = errno;
+                  rval = RND_SYSTEM_ERROR;
+                  goto abandon_function;
+               }
+
+               extents = grown;
+               allocated *= 2;
+               ext = &extents[nextents - 1];
+            }
+
+            if ((rval = flatrecs_bulk_next_extent(handle,
+                                                  ext,
+                                                  rec_size,
+                                                  count_hint > total ? count_hint - total : 0,
+                                                  total,
+                                                  &extents[nextents])))
+               goto abandon_function;
+
+            ++nextents;
+            continue;
+         }
+
+         uint32_t take = ext->capacity - ext->filled;
+         if (take > got)
+            take = got;
+
+         if ((rval = blocks_write_at(handle,
+                                     ext->offset + ext->block.bytes_to_records + (off_t)ext->filled * rec_size,
+                                     from,
+                                     (size_t)take * rec_size)))
+            goto abandon_function;
+
+         ext->filled += take;
+         total += take;
+         from += (size_t)take * rec_size;
+         got -= take;
+      }
+   }
+
+   ext = &extents[nextents - 1];
+   if ((rval = flatrecs_bulk_write_map(handle, ext, &map, &map_size)))
+      goto abandon_function;
+
+   // Release the unfilled end of the last data block; its map still
+   // allows it to grow back in place:
+   if (nextents > 1)
+   {
+      uint32_t chunk_size = head.fhead.chunk_size;
+      uint64_t used = ext->block.bytes_to_records + (uint64_t)ext->filled * rec_size;
+      uint32_t size = (uint32_t)((used + chunk_size - 1) / chunk_size * chunk_size);
+
+      if (size < ext->block.block_size)
+      {
+         ext->block.block_size = size;
+         if ((rval = blocks_truncate_file(handle, ext->offset + size)))
+            goto abandon_function;
+      }
+   }
+
+   // Link the data blocks, last to first, then the head:
+   for (i = nextents - 1; i > 0; --i)
+   {
+      ext = &extents[i];
+      if (i + 1 < nextents)
+      {
+         ext->block.next_block.offset = extents[i + 1].offset;
+         ext->block.next_block.size = extents[i + 1].block.block_size;
+      }
+
+      if ((rval = blocks_write_block_head(handle, ext->offset, &ext->block, sizeof(INFO_BLOCK))))
+         goto abandon_function;
+   }
+
+   if (nextents > 1)
+   {
+      head.bhead.next_block.offset = extents[1].offset;
+      head.bhead.next_block.size = extents[1].block.block_size;
+
+      head.chead.chain_offset = 0;
+      for (i = 0; i + 1 < nextents; ++i)
+         head.chead.chain_offset += extents[i].block.block_size;
+      head.chead.block_penultimate = extents[nextents - 2].offset;
+      head.chead.block_last = extents[nextents - 1].offset;
+   }
+
+   head.thead.last_recno = (uint32_t)total;
+
+   if ((rval = blocks_write_at(handle, 0, &head, sizeof(head))))
+      goto abandon_function;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   handle->head_file = head;
+   *loaded = (uint32_t)total;
+
+  abandon_function:
+   free(buffer);
+   free(map);
+   free(extents);
+   return rval;
+}
@@ -3,6 +3,20 @@
 
 #include "recnodb.h"
 
+/**
+ * Where a record lives, as found by `flatrecs_locate_record`.
+ */
+typedef struct flatrecs_record_location {
+   off_t      block_offset;   /**< Offset of the block containing the record      */
+   off_t      record_offset;  /**< Offset of the record itself                    */
+   uint32_t   map_index;      /**< Index of the record's bit in the liveness map */
+   uint32_t   rec_size;       /**< Size of the record                             */
+   INFO_BLOCK block;          /**< Header of the block containing the record      */
+} FLATREC_LOC;
+
+uint32_t flatrecs_full_recsize(const RND_HEAD_TABLE *htable);
+uint32_t flatrecs_get_record_capacity(const RND_HEAD_TABLE *htable, const INFO_BLOCK *hblock);
+
 RND_ERROR flatrecs_make_offset_to_recno(RNDH            *handle,
                                         const BLOCK_LOC *bloc,
                                         RND_HEAD_TABLE  *htable,
@@ -12,23 +26,138 @@ RND_ERROR flatrecs_make_offset_to_recno(RNDH            *handle,
 /**
  * Function type called by `flatrecs_get_next_offset`
  *
- * @param handle             handle to open recno database
- * @param head_table         pointer to fresh, locked table header
- * @param offset_new_record  file offset to record for writing
- * @param closure            optional pointer to data from calling function
+ * @param handle      handle to open recno database
+ * @param head_table  pointer to fresh, locked table header
+ * @param loc         where the new record goes, already marked live
+ * @param closure     optional pointer to data from calling function
  *
  * @return    Return non-zero (TRUE) if there are changes to the *head_table* param
  *            that must be written back before releasing the lock.  0 (FALSE) assumes
  *            that no changes were made and the lock will be released without writing.
+ *            Advancing *head_table::thead.last_recno* claims the new record, so
+ *            whatever must be done before readers see it must be done first,
+ *            including `blocks_stamp_block` once the record is written.
  */
-typedef bool (*flatrecs_use_new_record)(RNDH           *handle,
-                                        RND_HEAD_TABLE *head_table,
-                                        off_t          offset_new_record,
-                                        void           *closure);
+typedef bool (*flatrecs_use_new_record)(RNDH              *handle,
+                                        RND_HEAD_TABLE    *head_table,
+                                        const FLATREC_LOC *loc,
+                                        void              *closure);
 
 RND_ERROR flatrecs_get_next_offset(RNDH *handle,
                                    off_t table_head,
                                    flatrecs_use_new_record user,
                                    void *closure);
 
+/**
+ * Function type called by `flatrecs_walk_maps` for each block of a table.
+ *
+ * @param map          liveness map of the block, one bit per record
+ * @param nbits        number of map bits that refer to existing records
+ * @param first_recno  record number of the record of bit 0
+ * @param closure      optional pointer to data from calling function
+ *
+ * @return non-zero (TRUE) to continue to the next block, 0 to stop.
+ */
+typedef bool (*flatrecs_map_view)(const uint64_t *map,
+                                  uint32_t       nbits,
+                                  uint32_t       first_recno,
+                                  void           *closure);
+
+RND_ERROR flatrecs_walk_maps(RNDH *handle, off_t table_head, flatrecs_map_view viewer, void *closure);
+
+/**
+ * Function type called by `flatrecs_walk_records` for each block of a table.
+ *
+ * @param map          liveness map of the block, one bit per record
+ * @param records      the block's records, *rec_size* bytes apart
+ * @param nbits        number of map bits, and records, that refer to existing records
+ * @param first_recno  record number of the first record
+ * @param rec_size     size of each record
+ * @param closure      optional pointer to data from calling function
+ *
+ * @return non-zero (TRUE) to continue to the next block, 0 to stop.
+ */
+typedef bool (*flatrecs_records_view)(const uint64_t *map,
+                                      const char     *records,
+                                      uint32_t       nbits,
+                                      uint32_t       first_recno,
+                                      uint32_t       rec_size,
+                                      void           *closure);
+
+RND_ERROR flatrecs_walk_records(RNDH *handle, off_t table_head, flatrecs_records_view viewer, void *closure);
+
+/**
+ * A block of a table holding existing records, as listed by `flatrecs_list_blocks`.
+ */
+typedef struct flatrecs_block_extent {
+   off_t      offset;       /**< Offset of the block                         */
+   INFO_BLOCK block;        /**< Header of the block                         */
+   uint32_t   first_recno;  /**< Record number of the block's first record   */
+   uint32_t   nbits;        /**< Number of records of the block that exist   */
+} FLATREC_BLOCK;
+
+RND_ERROR flatrecs_list_blocks(RNDH          *handle,
+                               off_t         table_head,
+                               FLATREC_BLOCK **blocks,
+                               uint32_t      *count,
+                               uint32_t      *rec_size);
+
+RND_ERROR flatrecs_read_block(RNDH                *handle,
+                              const FLATREC_BLOCK *fb,
+                              uint32_t            rec_size,
+                              char                **buffer,
+                              size_t              *buffer_size,
+                              const char          **image);
+
+RND_ERROR flatrecs_locate_record(RNDH *handle, off_t table_head, uint32_t recno, FLATREC_LOC *loc);
+RND_ERROR flatrecs_record_is_live(RNDH *handle, const FLATREC_LOC *loc, bool *live);
+RND_ERROR flatrecs_set_liveness(RNDH *handle, const FLATREC_LOC *loc, bool live);
+
+RND_ERROR flatrecs_read_record_ref(RNDH *handle,
+                                   off_t table_head,
+                                   uint32_t recno,
+                                   const void **record,
+                                   uint32_t *size,
+                                   RND_LEASE *lease);
+void flatrecs_release_record(RND_LEASE *lease);
+
+RND_ERROR flatrecs_count_live(RNDH *handle, off_t table_head, uint32_t *count);
+RND_ERROR flatrecs_next_live(RNDH *handle, off_t table_head, uint32_t from_recno, uint32_t *recno);
+RND_ERROR flatrecs_first_free(RNDH *handle, off_t table_head, uint32_t *recno);
+
+RND_ERROR flatrecs_read_record(RNDH *handle, off_t table_head, uint32_t recno, void *buffer, uint32_t *size);
+RND_ERROR flatrecs_write_record(RNDH *handle, off_t table_head, uint32_t recno, const void *data, uint32_t size);
+RND_ERROR flatrecs_append_record(RNDH *handle, off_t table_head, const void *data, uint32_t size, uint32_t *recno);
+RND_ERROR flatrecs_update_field(RNDH *handle,
+                                off_t table_head,
+                                uint32_t recno,
+                                uint32_t offset,
+                                uint32_t len,
+                                const void *bytes);
+RND_ERROR flatrecs_cas_field(RNDH *handle,
+                             off_t table_head,
+                             uint32_t recno,
+                             uint32_t offset,
+                             uint32_t width,
+                             uint64_t expected,
+                             uint64_t desired,
+                             uint64_t *found);
+RND_ERROR flatrecs_fetch_add_field(RNDH *handle,
+                                   off_t table_head,
+                                   uint32_t recno,
+                                   uint32_t offset,
+                                   uint32_t width,
+                                   uint64_t addend,
+                                   uint64_t *previous);
+RND_ERROR flatrecs_delete_record(RNDH *handle, off_t table_head, uint32_t recno);
+
+RND_ERROR flatrecs_compress_cold(RNDH *handle, off_t table_head, uint32_t *count);
+RND_ERROR flatrecs_reserve(RNDH *handle, off_t table_head, uint32_t records);
+
+RND_ERROR flatrecs_bulk_load(RNDH *handle,
+                             uint64_t count_hint,
+                             rnd_bulk_reader reader,
+                             void *closure,
+                             uint32_t *loaded);
+
 #endif
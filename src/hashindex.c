@@ -0,0 +1,809 @@
+/** @file
+ *
+ * Persistent linear-hash index that associates variable-length keys
+ * with recnos.
+ *
+ * The index is a chain of its own, starting at an RBT_INDEX head block
+ * whose offset is kept in the file head (INFO_FILE::index_head).  Keys
+ * hash to buckets, and each bucket is a list of pages of *page_size*
+ * bytes, the file's chunk size.
+ *
+ * The first page of every bucket lives in a segment, a block of
+ * contiguous pages.  Segment 0 holds the *base_buckets* original buckets
+ * and segment s > 0 holds the base_buckets * 2^(s-1) buckets added while
+ * the index grows from level s-1 to level s, so the first page of a
+ * bucket is found by arithmetic.  Overflow pages come from spare blocks
+ * of HASHINDEX_SPARE_PAGES pages, and pages released by splits are kept
+ * in a free list for reuse.
+ *
+ * Linear hashing grows the index one bucket at a time: when the entries
+ * fill more than HASHINDEX_LOAD_PERCENT of the buckets' capacity, the
+ * bucket at *split* is divided with a new bucket at the end of the
+ * current level.  No insert pays for more than one bucket's split.
+ *
+ * Every operation holds the lock on the index head, so, like other
+ * locks in the library, a busy index fails with RND_LOCK_FAILED rather
+ * than wait.  Lookups hold it shared, so only writers make it busy for
+ * them.  Deleting keys doesn't merge buckets.
+ */
+
+#include "hashindex.h"
+#include "extra.h"
+#include "locks.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <stdlib.h>   // for malloc()
+#include <string.h>
+
+#define HASHINDEX_BASE_BUCKETS  4      /**< Must be a power of 2              */
+#define HASHINDEX_SPARE_PAGES   16     /**< Overflow pages per spare block    */
+#define HASHINDEX_LOAD_PERCENT  75     /**< Fill level that triggers a split  */
+
+/** Header at the top of every bucket page. */
+typedef struct hashindex_page {
+   off_t    overflow;    /**< Next page of the bucket, or of the free list, 0 if last */
+   uint32_t used;        /**< Bytes of entries following the header                   */
+   uint32_t count;       /**< Number of entries in the page                           */
+} HI_PAGE;
+
+/** Header of an entry, followed by the key and padding to a 4-byte boundary. */
+typedef struct hashindex_entry {
+   uint32_t hash;
+   uint32_t recno;
+   uint16_t key_len;
+   char     pad[2];
+} HI_ENTRY;
+
+typedef enum {
+   HIA_GET,
+   HIA_PUT,
+   HIA_DELETE
+} HI_ACTION;
+
+typedef struct hashindex_closure {
+   const void *key;
+   uint32_t   key_len;
+   uint32_t   hash;
+   uint32_t   recno;
+   HI_ACTION  action;
+   RND_ERROR  rval;
+   char       pad[4];
+} HI_CLO;
+
+/** A bucket being filled by `hashindex_split`. */
+typedef struct hashindex_writer {
+   off_t offset;         /**< Offset to *page*                                   */
+   char  *page;          /**< Image of the page being filled, *first* or *rest*  */
+   off_t first_offset;   /**< The bucket's first page, written last              */
+   char  *first;
+   char  *rest;          /**< Image of the overflow pages, written as they fill  */
+} HI_WRITER;
+
+/**
+ * Hashes a key with FNV-1a, finished with the MurmurHash3 mixer so the
+ * low bits, which choose the bucket, depend on every byte.
+ */
+uint32_t hashindex_hash(const void *key, uint32_t key_len)
+{
+   const unsigned char *p = (const unsigned char*)key;
+   uint32_t h = 2166136261u;
+
+   for (uint32_t i = 0; i < key_len; ++i)
+      h = (h ^ p[i]) * 16777619u;
+
+   h ^= h >> 16;
+   h *= 0x85ebca6bu;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35u;
+   h ^= h >> 16;
+
+   return h;
+}
+
+static uint32_t hashindex_entry_size(uint32_t key_len)
+{
+   return (sizeof(HI_ENTRY) + key_len + 3) & ~3u;
+}
+
+static uint32_t hashindex_page_capacity(const INFO_INDEX *ii)
+{
+   return ii->page_size - sizeof(HI_PAGE);
+}
+
+/**
+ * Number of buckets in the index.
+ */
+static uint32_t hashindex_bucket_count(const INFO_INDEX *ii)
+{
+   return (ii->base_buckets << ii->level) + ii->split;
+}
+
+/**
+ * The bucket to which *hash* belongs.
+ */
+static uint32_t hashindex_bucket_of(const INFO_INDEX *ii, uint32_t hash)
+{
+   uint32_t level_buckets = ii->base_buckets << ii->level;
+   uint32_t bucket = hash & (level_buckets - 1);
+
+   // Buckets before *split* have been divided with the next level's mask:
+   if (bucket < ii->split)
+      bucket = hash & (level_buckets * 2 - 1);
+
+   return bucket;
+}
+
+/**
+ * Offset to the first page of a bucket.
+ */
+static off_t hashindex_bucket_page(const INFO_INDEX *ii, uint32_t bucket)
+{
+   uint32_t first = ii->base_buckets;
+   int segment = 0;
+
+   if (bucket >= first)
+   {
+      for (segment = 1; bucket >= first * 2; ++segment)
+         first *= 2;
+
+      bucket -= first;
+   }
+
+   return ii->segments[segment] + (off_t)bucket * ii->page_size;
+}
+
+/**
+ * Links a new block of *pages* pages to the end of the index chain.
+ *
+ * The block's first page is left for the block header, so the pages are
+ * page-aligned.
+ *
+ * @param handle       handle to an open recno database
+ * @param head_offset  offset to the index head
+ * @param hi           [in/out] locked copy of the index head
+ * @param pages        number of pages for the new block
+ * @param first_page   [out] offset to the first usable page of the block
+ */
+static RND_ERROR hashindex_add_block(RNDH *handle,
+                                     off_t head_offset,
+                                     RND_HEAD_INDEX *hi,
+                                     uint32_t pages,
+                                     off_t *first_page)
+{
+   RND_ERROR rval;
+   uint32_t page_size = hi->ihead.page_size;
+   off_t chain_end = hi->bhead.next_block.offset ? hi->chead.block_last : head_offset;
+
+   RND_BLOCK_DEF bdef = { RBT_DATA, page_size * (pages + 1) };
+
+   if ((rval = blocks_extend_chain(handle, chain_end, &bdef, &hi->chead)))
+      return rval;
+
+   // Keep the locked copy of the head consistent with the file:
+   if (chain_end == head_offset)
+      memcpy(&hi->bhead.next_block, &bdef.new_block, sizeof(BLOCK_LOC));
+
+   *first_page = bdef.new_block.offset + page_size;
+   return RND_SUCCESS;
+}
+
+/**
+ * Gets a page for a bucket's overflow, from the free list if possible.
+ */
+static RND_ERROR hashindex_alloc_page(RNDH *handle, off_t head_offset, RND_HEAD_INDEX *hi, off_t *page_offset)
+{
+   INFO_INDEX *ii = &hi->ihead;
+   RND_ERROR rval;
+
+   if (ii->free_pages)
+   {
+      HI_PAGE ph;
+      if ((rval = blocks_read_at(handle, ii->free_pages, &ph, sizeof(ph))))
+         return rval;
+
+      *page_offset = ii->free_pages;
+      ii->free_pages = ph.overflow;
+      return RND_SUCCESS;
+   }
+
+   if (ii->spare_next == ii->spare_end)
+   {
+      off_t first_page;
+      if ((rval = hashindex_add_block(handle, head_offset, hi, HASHINDEX_SPARE_PAGES, &first_page)))
+         return rval;
+
+      ii->spare_next = first_page;
+      ii->spare_end = first_page + (off_t)HASHINDEX_SPARE_PAGES * ii->page_size;
+   }
+
+   *page_offset = ii->spare_next;
+   ii->spare_next += ii->page_size;
+   return RND_SUCCESS;
+}
+
+/**
+ * Returns an overflow page to the free list.
+ */
+static RND_ERROR hashindex_free_page(RNDH *handle, RND_HEAD_INDEX *hi, off_t page_offset)
+{
+   HI_PAGE ph = { hi->ihead.free_pages, 0, 0 };
+   RND_ERROR rval = blocks_write_at(handle, page_offset, &ph, sizeof(ph));
+
+   if (!rval)
+      hi->ihead.free_pages = page_offset;
+
+   return rval;
+}
+
+/**
+ * Searches one page for a key.
+ *
+ * @return pointer to the entry, or NULL if the page doesn't have the key.
+ */
+static HI_ENTRY *hashindex_search_page(char *page, const HI_CLO *clo)
+{
+   HI_PAGE *ph = (HI_PAGE*)page;
+   char *ptr = page + sizeof(HI_PAGE);
+   char *end = ptr + ph->used;
+
+   while (ptr < end)
+   {
+      HI_ENTRY *entry = (HI_ENTRY*)ptr;
+
+      if (entry->hash == clo->hash
+          && entry->key_len == clo->key_len
+          && memcmp(ptr + sizeof(HI_ENTRY), clo->key, clo->key_len) == 0)
+         return entry;
+
+      ptr += hashindex_entry_size(entry->key_len);
+   }
+
+   return NULL;
+}
+
+/**
+ * Finds the page of *bucket* that holds the key, or the first page with
+ * room for it.
+ *
+ * @param handle      handle to an open recno database
+ * @param ii          index information
+ * @param bucket      bucket of the key
+ * @param clo         key to find
+ * @param page        [out] memory of *page_size* bytes for the page image
+ * @param page_offset [out] offset to the page in *page*, 0 if not found
+ * @param entry       [out] the key's entry in *page*, NULL if not found
+ * @param last_page   [out] offset to the bucket's last page
+ */
+static RND_ERROR hashindex_find(RNDH *handle,
+                                const INFO_INDEX *ii,
+                                uint32_t bucket,
+                                const HI_CLO *clo,
+                                char *page,
+                                off_t *page_offset,
+                                HI_ENTRY **entry,
+                                off_t *last_page)
+{
+   RND_ERROR rval;
+   uint32_t needed = hashindex_entry_size(clo->key_len);
+   off_t offset = hashindex_bucket_page(ii, bucket);
+   off_t room = 0;
+
+   *entry = NULL;
+   *page_offset = 0;
+
+   while (offset)
+   {
+      HI_PAGE *ph = (HI_PAGE*)page;
+
+      if ((rval = blocks_read_at(handle, offset, page, ii->page_size)))
+         return rval;
+
+      if ((*entry = hashindex_search_page(page, clo)))
+      {
+         *page_offset = offset;
+         return RND_SUCCESS;
+      }
+
+      if (!room && hashindex_page_capacity(ii) - ph->used >= needed)
+         room = offset;
+
+      *last_page = offset;
+      offset = ph->overflow;
+   }
+
+   // Leave the page with room in the buffer for an insert:
+   if (room && room != *last_page)
+   {
+      if ((rval = blocks_read_at(handle, room, page, ii->page_size)))
+         return rval;
+   }
+
+   *page_offset = room;
+   return RND_SUCCESS;
+}
+
+/**
+ * Adds an entry to a page image.
+ */
+static void hashindex_page_add(char *page, const HI_CLO *clo)
+{
+   HI_PAGE *ph = (HI_PAGE*)page;
+   HI_ENTRY *entry = (HI_ENTRY*)(page + sizeof(HI_PAGE) + ph->used);
+   uint32_t size = hashindex_entry_size(clo->key_len);
+
+   memset(entry, 0, size);
+   entry->hash = clo->hash;
+   entry->recno = clo->recno;
+   entry->key_len = clo->key_len;
+   memcpy((char*)entry + sizeof(HI_ENTRY), clo->key, clo->key_len);
+
+   ph->used += size;
+   ++ph->count;
+}
+
+/**
+ * Adds an entry to a bucket being rebuilt by `hashindex_split`, moving
+ * to an overflow page when the current page is full.  Full overflow pages
+ * are written at once; the first page is kept for `hashindex_split` to
+ * write when the rest of the bucket is in place.
+ */
+static RND_ERROR hashindex_writer_add(RNDH *handle,
+                                      off_t head_offset,
+                                      RND_HEAD_INDEX *hi,
+                                      HI_WRITER *writer,
+                                      const HI_ENTRY *entry)
+{
+   HI_PAGE *ph = (HI_PAGE*)writer->page;
+   uint32_t size = hashindex_entry_size(entry->key_len);
+   RND_ERROR rval;
+
+   if (ph->used + size > hashindex_page_capacity(&hi->ihead))
+   {
+      off_t next;
+      if ((rval = hashindex_alloc_page(handle, head_offset, hi, &next)))
+         return rval;
+
+      ph->overflow = next;
+      if (writer->page == writer->first)
+         writer->page = writer->rest;
+      else if ((rval = blocks_write_at(handle, writer->offset, writer->page, hi->ihead.page_size)))
+         return rval;
+
+      memset(writer->page, 0, hi->ihead.page_size);
+      writer->offset = next;
+   }
+
+   memcpy(writer->page + sizeof(HI_PAGE) + ph->used, entry, size);
+   ph->used += size;
+   ++ph->count;
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Divides the bucket at *split* between itself and a new bucket.
+ *
+ * The entries of the old bucket are read into memory and both buckets
+ * are written again from the entries, on fresh overflow pages.  The old
+ * bucket's first page is written last, so until then the old bucket is
+ * whole, and a split that fails before it puts *hi* back as it was.  The
+ * old overflow pages are released once the split is done.
+ */
+static RND_ERROR hashindex_split(RNDH *handle, off_t head_offset, RND_HEAD_INDEX *hi)
+{
+   INFO_INDEX *ii = &hi->ihead;
+   RND_ERROR rval = RND_SUCCESS;
+
+   uint32_t level_buckets = ii->base_buckets << ii->level;
+   uint32_t old_bucket = ii->split;
+   uint32_t new_mask = level_buckets * 2 - 1;
+   uint32_t segment = ii->level + 1;
+
+   char *entries = NULL;
+   off_t *overflow = NULL;
+   uint32_t overflow_count = 0;
+   HI_WRITER writers[2];
+   INFO_INDEX before;
+
+   memset(writers, 0, sizeof(writers));
+
+   // Stop growing when the next segment can't be addressed or allocated:
+   if (segment >= RND_INDEX_SEGMENTS
+       || (uint64_t)(level_buckets + 1) * ii->page_size > UINT32_MAX)
+      goto abandon_function;
+
+   if (!ii->segments[segment]
+       && (rval = hashindex_add_block(handle, head_offset, hi, level_buckets, &ii->segments[segment])))
+      goto abandon_function;
+
+   // Pages added from here are lost if the split fails, but the chain
+   // stays whole:
+   memcpy(&before, ii, sizeof(before));
+
+   // Gather the entries of the old bucket, noting its overflow pages:
+   size_t entries_used = 0, entries_size = 0;
+   off_t offset = hashindex_bucket_page(ii, old_bucket);
+   bool first_page = 1;
+
+   while (offset)
+   {
+      char *newentries = (char*)realloc(entries, entries_size + ii->page_size);
+      if (!newentries)
+         goto system_error;
+
+      entries = newentries;
+      entries_size += ii->page_size;
+
+      char *page = entries + entries_used;
+      if ((rval = blocks_read_at(handle, offset, page, ii->page_size)))
+         goto abandon_function;
+
+      HI_PAGE ph;
+      memcpy(&ph, page, sizeof(ph));
+      memmove(page, page + sizeof(HI_PAGE), ph.used);
+      entries_used += ph.used;
+
+      if (!first_page)
+      {
+         off_t *grown = (off_t*)realloc(overflow, (overflow_count + 1) * sizeof(off_t));
+         if (!grown)
+            goto system_error;
+
+         overflow = grown;
+         overflow[overflow_count++] = offset;
+      }
+
+      first_page = 0;
+      offset = ph.overflow;
+   }
+
+   // Write both buckets from the gathered entries:
+   for (int i = 0; i < 2; ++i)
+   {
+      if (!(writers[i].first = (char*)calloc(1, ii->page_size))
+          || !(writers[i].rest = (char*)calloc(1, ii->page_size)))
+         goto system_error;
+
+      writers[i].page = writers[i].first;
+   }
+
+   writers[0].offset = writers[0].first_offset = hashindex_bucket_page(ii, old_bucket);
+
+   ++ii->split;
+   writers[1].offset = writers[1].first_offset = hashindex_bucket_page(ii, old_bucket + level_buckets);
+
+   for (size_t pos = 0; pos < entries_used; )
+   {
+      const HI_ENTRY *entry = (const HI_ENTRY*)(entries + pos);
+      int target = (entry->hash & new_mask) != old_bucket;
+
+      if ((rval = hashindex_writer_add(handle, head_offset, hi, &writers[target], entry)))
+         goto abandon_split;
+
+      pos += hashindex_entry_size(entry->key_len);
+   }
+
+   // The new bucket, then the old one, whose first page completes the split:
+   for (int i = 1; i >= 0; --i)
+   {
+      if ((writers[i].page != writers[i].first
+           && (rval = blocks_write_at(handle, writers[i].offset, writers[i].page, ii->page_size)))
+          || (rval = blocks_write_at(handle, writers[i].first_offset, writers[i].first, ii->page_size)))
+         goto abandon_split;
+   }
+
+   // A page that can't be released is lost, but the split stands:
+   for (uint32_t i = 0; i < overflow_count; ++i)
+   {
+      if ((rval = hashindex_free_page(handle, hi, overflow[i])))
+         break;
+   }
+
+   // Start the next level when every bucket of this one has been split:
+   if (ii->split == level_buckets)
+   {
+      ++ii->level;
+      ii->split = 0;
+   }
+
+   goto abandon_function;
+
+  system_error:
+   handle->sys_errno = errno;
+   rval = RND_SYSTEM_ERROR;
+
+  abandon_split:
+   memcpy(ii, &before, sizeof(before));
+
+  abandon_function:
+   free(entries);
+   free(overflow);
+   for (int i = 0; i < 2; ++i)
+   {
+      free(writers[i].first);
+      free(writers[i].rest);
+   }
+   return rval;
+}
+
+/**
+ * Adds a key to its bucket, which must not already have the key.
+ *
+ * @param page        image of the page with room from `hashindex_find`
+ * @param page_offset offset to *page*, or 0 if no page has room
+ * @param last_page   offset to the last page of the bucket
+ */
+static RND_ERROR hashindex_insert(RNDH *handle,
+                                  off_t head_offset,
+                                  RND_HEAD_INDEX *hi,
+                                  const HI_CLO *clo,
+                                  char *page,
+                                  off_t page_offset,
+                                  off_t last_page)
+{
+   INFO_INDEX *ii = &hi->ihead;
+   RND_ERROR rval;
+
+   if (!page_offset)
+   {
+      // Add an overflow page to the end of the bucket:
+      HI_PAGE ph;
+      if ((rval = hashindex_alloc_page(handle, head_offset, hi, &page_offset))
+          || (rval = blocks_read_at(handle, last_page, &ph, sizeof(ph))))
+         return rval;
+
+      ph.overflow = page_offset;
+      if ((rval = blocks_write_at(handle, last_page, &ph, sizeof(ph))))
+         return rval;
+
+      memset(page, 0, ii->page_size);
+   }
+
+   hashindex_page_add(page, clo);
+
+   if ((rval = blocks_write_at(handle, page_offset, page, ii->page_size)))
+      return rval;
+
+   ++ii->key_count;
+   ii->bytes_used += hashindex_entry_size(clo->key_len);
+
+   uint64_t capacity = (uint64_t)hashindex_bucket_count(ii) * hashindex_page_capacity(ii);
+   if (ii->bytes_used * 100 > capacity * HASHINDEX_LOAD_PERCENT)
+      rval = hashindex_split(handle, head_offset, hi);
+
+   return rval;
+}
+
+/**
+ * Removes an entry from a page image and writes the page.
+ */
+static RND_ERROR hashindex_remove(RNDH *handle, RND_HEAD_INDEX *hi, char *page, off_t page_offset, HI_ENTRY *entry)
+{
+   HI_PAGE *ph = (HI_PAGE*)page;
+   uint32_t size = hashindex_entry_size(entry->key_len);
+   char *end = page + sizeof(HI_PAGE) + ph->used;
+   char *next = (char*)entry + size;
+
+   memmove(entry, next, end - next);
+   memset(end - size, 0, size);
+   ph->used -= size;
+   --ph->count;
+
+   RND_ERROR rval = blocks_write_at(handle, page_offset, page, hi->ihead.page_size);
+   if (!rval)
+   {
+      --hi->ihead.key_count;
+      hi->ihead.bytes_used -= size;
+   }
+
+   return rval;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the index head locked.
+ */
+bool hashindex_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   HI_CLO *clo = (HI_CLO*)closure;
+   RND_HEAD_INDEX *hi = (RND_HEAD_INDEX*)locked_buffer;
+   RND_HEAD_INDEX original;
+   memcpy(&original, hi, sizeof(original));
+
+   char *page = (char*)malloc(hi->ihead.page_size);
+   if (!page)
+   {
+      handle->sys_errno = errno;
+      clo->rval = RND_SYSTEM_ERROR;
+      return 0;
+   }
+
+   off_t page_offset, last_page = 0;
+   HI_ENTRY *entry;
+   uint32_t bucket = hashindex_bucket_of(&hi->ihead, clo->hash);
+
+   if ((clo->rval = hashindex_find(handle, &hi->ihead, bucket, clo, page, &page_offset, &entry, &last_page)))
+      goto abandon_function;
+
+   switch(clo->action)
+   {
+      case HIA_GET:
+         if (entry)
+            clo->recno = entry->recno;
+         else
+            clo->rval = RND_KEY_NOT_FOUND;
+         break;
+
+      case HIA_PUT:
+         if (entry)
+         {
+            entry->recno = clo->recno;
+            clo->rval = blocks_write_at(handle, page_offset, page, hi->ihead.page_size);
+         }
+         else
+            clo->rval = hashindex_insert(handle, bloc->offset, hi, clo, page, page_offset, last_page);
+         break;
+
+      case HIA_DELETE:
+         if (entry)
+            clo->rval = hashindex_remove(handle, hi, page, page_offset, entry);
+         else
+            clo->rval = RND_KEY_NOT_FOUND;
+         break;
+   }
+
+  abandon_function:
+   free(page);
+
+   // A failed operation leaves the head matching the pages it did write
+   // (see `hashindex_split`), so the head is written back either way:
+   return memcmp(&original, hi, sizeof(original)) != 0;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the file head's INFO_FILE
+ * locked, that creates the index unless another process just did.
+ */
+bool hashindex_create_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   RND_ERROR *rval = (RND_ERROR*)closure;
+   INFO_FILE *fhead = (INFO_FILE*)locked_buffer;
+
+   if (fhead->index_head)
+      return 0;
+
+   RND_BLOCK_DEF bdef = { RBT_INDEX, fhead->chunk_size };
+   if ((*rval = blocks_append_block(handle, &bdef)))
+      return 0;
+
+   RND_HEAD_INDEX hi;
+   if ((*rval = blocks_read_at(handle, bdef.new_block.offset, &hi, sizeof(hi))))
+      return 0;
+
+   hi.ihead.page_size = fhead->chunk_size;
+   hi.ihead.base_buckets = HASHINDEX_BASE_BUCKETS;
+
+   if ((*rval = hashindex_add_block(handle, bdef.new_block.offset, &hi, HASHINDEX_BASE_BUCKETS, &hi.ihead.segments[0]))
+       || (*rval = blocks_write_at(handle, bdef.new_block.offset, &hi, sizeof(hi))))
+      return 0;
+
+   fhead->index_head = bdef.new_block.offset;
+   return 1;
+}
+
+/**
+ * Gets the offset to the index head, creating the index if requested.
+ *
+ * @param handle  handle to an open recno database
+ * @param create  TRUE to create the index if the file doesn't have one
+ * @param head    [out] offset to the index head
+ *
+ * @return RND_KEY_NOT_FOUND if the file has no index and *create* is FALSE.
+ */
+static RND_ERROR hashindex_get_head(RNDH *handle, bool create, off_t *head)
+{
+   off_t fhead_offset = offsetof(RND_HEAD_FILE, fhead);
+   RND_ERROR rval = RND_SUCCESS;
+   INFO_FILE fhead;
+
+   // The index never moves, so a known head can be used without reading:
+   if (!handle->head_file.fhead.index_head)
+   {
+      // Another process may have created the index since the file was opened:
+      if ((rval = blocks_read_at(handle, fhead_offset, &fhead, sizeof(fhead))))
+         return rval;
+
+      if (!fhead.index_head && create)
+      {
+         BLOCK_LOC bl = { fhead_offset, sizeof(INFO_FILE) };
+         RND_ERROR create_rval = RND_SUCCESS;
+
+         if ((rval = rnd_lock_area(handle, &bl, 1, hashindex_create_lock_callback, &create_rval))
+             || (rval = create_rval)
+             || (rval = blocks_read_at(handle, fhead_offset, &fhead, sizeof(fhead))))
+            return rval;
+      }
+
+      if (!fhead.index_head)
+         return RND_KEY_NOT_FOUND;
+
+      handle->head_file.fhead.index_head = fhead.index_head;
+   }
+
+   *head = handle->head_file.fhead.index_head;
+   return RND_SUCCESS;
+}
+
+/**
+ * Runs an index operation with the index head locked.
+ */
+static RND_ERROR hashindex_run(RNDH *handle, HI_CLO *clo, bool create)
+{
+   prime_handle(handle);
+
+   RND_ERROR rval;
+   off_t head;
+
+   if (clo->key_len == 0 || clo->key_len > UINT16_MAX)
+      return RND_BAD_PARAMETER;
+
+   if ((rval = hashindex_get_head(handle, create, &head)))
+      return rval;
+
+   // A key must fit in an empty page:
+   if (hashindex_entry_size(clo->key_len) > handle->head_file.fhead.chunk_size - sizeof(HI_PAGE))
+      return RND_BAD_PARAMETER;
+
+   clo->hash = hashindex_hash(clo->key, clo->key_len);
+
+   // Lookups share the head, so they run alongside each other:
+   BLOCK_LOC bl = { head, sizeof(RND_HEAD_INDEX) };
+   if ((rval = clo->action == HIA_GET
+        ? rnd_lock_area_shared(handle, &bl, 1, hashindex_lock_callback, clo)
+        : rnd_lock_area(handle, &bl, 1, hashindex_lock_callback, clo)))
+      return rval;
+
+   return clo->rval;
+}
+
+/**
+ * Associates a key with a recno, replacing the key's previous recno if
+ * it already had one.  The index is created on the first call.
+ *
+ * @param handle   handle to an open recno database
+ * @param key      key bytes
+ * @param key_len  number of bytes in the key, which must fit in a page
+ * @param recno    record number to associate with the key
+ */
+RND_ERROR hashindex_put(RNDH *handle, const void *key, uint32_t key_len, uint32_t recno)
+{
+   HI_CLO clo = { key, key_len, 0, recno, HIA_PUT };
+   return hashindex_run(handle, &clo, 1);
+}
+
+/**
+ * Gets the recno associated with a key.
+ *
+ * @return RND_KEY_NOT_FOUND if the key isn't in the index.
+ */
+RND_ERROR hashindex_get(RNDH *handle, const void *key, uint32_t key_len, uint32_t *recno)
+{
+   HI_CLO clo = { key, key_len, 0, 0, HIA_GET };
+   RND_ERROR rval = hashindex_run(handle, &clo, 0);
+
+   if (!rval)
+      *recno = clo.recno;
+
+   return rval;
+}
+
+/**
+ * Removes a key from the index.
+ *
+ * @return RND_KEY_NOT_FOUND if the key isn't in the index.
+ */
+RND_ERROR hashindex_delete(RNDH *handle, const void *key, uint32_t key_len)
+{
+   HI_CLO clo = { key, key_len, 0, 0, HIA_DELETE };
+   return hashindex_run(handle, &clo, 0);
+}
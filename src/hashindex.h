@@ -0,0 +1,12 @@
+#ifndef RECNODB_HASHINDEX_H
+#define RECNODB_HASHINDEX_H
+
+#include "recnodb.h"
+
+RND_ERROR hashindex_put(RNDH *handle, const void *key, uint32_t key_len, uint32_t recno);
+RND_ERROR hashindex_get(RNDH *handle, const void *key, uint32_t key_len, uint32_t *recno);
+RND_ERROR hashindex_delete(RNDH *handle, const void *key, uint32_t key_len);
+
+uint32_t hashindex_hash(const void *key, uint32_t key_len);
+
+#endif
@@ -1,16 +1,23 @@
 #include "recnodb.h"
 #include "extra.h"
 #include "locks.h"
+#include "blocks.h"
+#include "probes.h"
+#include "stats.h"
 
 #include <string.h>   // for memset()
 #include <fcntl.h>    // for fcntl()  (setting locks)
-#include <unistd.h>   // for getpid()
 #include <errno.h>
 
 /**
  * Places a lock on an area of the file, optionally providing contents of the area.
  *
  * - The lock are is specified in the *bhandle* parameter.
+ * - The *wait* flag waits for another handle's lock to be removed,
+ *   rather than failing at once with RND_LOCK_FAILED.
+ * - The *shared* flag places a read lock, which other readers may hold
+ *   at the same time.  Nothing is written back under a read lock, so the
+ *   callback's return is ignored.
  * - The *retrieve_data* flag requests the contents of the lock area
  *   be included in the argument of the callback function.
  * - The *callback* parameter is a pointer to a function that will be
@@ -20,90 +27,206 @@
  * - *closure* is an optional pointer variable the will be passed through
  *   to the *callback* function.
  *
+ * The stream is flushed as the lock is placed and again before it is
+ * released, so the callback reads what other processes wrote under the
+ * lock, and they read what the callback wrote.
+ *
  * To complete this function, I referred to `man 3 fcntl` and `man 3 fileno`
  */
-RND_ERROR rnd_lock_area(RNDH *handle,
-                        BLOCK_LOC *bhandle,
-                        bool retrieve_data,
-                        lock_callback callback,
-                        void *closure)
+static RND_ERROR lock_area(RNDH *handle,
+                           BLOCK_LOC *bhandle,
+                           bool wait,
+                           bool shared,
+                           bool retrieve_data,
+                           lock_callback callback,
+                           void *closure)
 {
    prime_handle(handle);
    
-   RND_ERROR rval = RND_FAIL;
+   RND_ERROR rval;
 
-   int fd = fileno(handle->file);
-   struct flock fl;
-   memset(&fl, 0, sizeof(fl));
-   fl.l_type = F_WRLCK;
-   fl.l_whence = SEEK_SET;
-   fl.l_start = bhandle->offset;
-   fl.l_len = bhandle->size;
-   fl.l_pid = getpid();
+   RND_PROBE2(lock_area_entry, bhandle->offset, bhandle->size);
 
-   if (fcntl(fd, F_SETLK, &fl) == -1)
-   {
-      if (errno == EAGAIN || errno == EACCES)
-         rval = RND_LOCK_FAILED;
-      else
-      {
-         rval = RND_SYSTEM_ERROR;
-         handle->sys_errno = errno;
-      }
-      
+   if ((rval = shared ? rnd_lock_place_shared(handle, bhandle, wait) : rnd_lock_place(handle, bhandle, wait)))
       goto abandon_function;
+
+   // Drop buffered reads, which may predate writes another process made
+   // under the lock, so the callback sees the file as it is now:
+   if (fflush(handle->file))
+   {
+      rval = RND_SYSTEM_ERROR;
+      handle->sys_errno = errno;
+      goto abandon_lock;
    }
 
    if (retrieve_data)
    {
       char buffer[bhandle->size];
-      off_t saved_offset = ftell(handle->file);
-      if (fseek(handle->file, bhandle->offset, SEEK_SET))
-      {
-         rval = RND_SYSTEM_ERROR;
-         handle->sys_errno = errno;
-         goto abandon_lock;
-      }
-
-      if (!fread(buffer, sizeof(buffer), 1, handle->file))
+      if (blocks_read_at(handle, bhandle->offset, buffer, sizeof(buffer)))
       {
          rval = RND_LOCK_READ_FAILED;
-         goto restore_file_position;
+         goto abandon_lock;
       }
 
       // Had back to calling function, writing changed
       // buffer if callback returns TRUE:
-      if ((*callback)(handle, bhandle, buffer, closure))
-      {
-         if (fseek(handle->file, bhandle->offset, SEEK_SET)
-             || !fwrite(buffer, sizeof(buffer), 1, handle->file))
-         {
-            rval = RND_UNLOCK_WRITE_FAILED;
-            goto restore_file_position;
-         }
-      }
-
-      rval = RND_SUCCESS;
-
-     restore_file_position:
-      fseek(handle->file, saved_offset, SEEK_SET);
+      if ((*callback)(handle, bhandle, buffer, closure) && !shared
+          && blocks_write_at(handle, bhandle->offset, buffer, sizeof(buffer)))
+         rval = RND_UNLOCK_WRITE_FAILED;
+      else
+         rval = RND_SUCCESS;
    }
    else
+   {
       (*callback)(handle, bhandle, NULL, closure);
+      rval = RND_SUCCESS;
+   }
 
   abandon_lock:
 
-   fl.l_type = F_UNLCK;
-   if (fcntl(fd, F_SETLK, &fl) == -1)
+   // Writes made under the lock must reach the file before another process can take it:
+   if (fflush(handle->file) && rval == RND_SUCCESS)
    {
       rval = RND_SYSTEM_ERROR;
       handle->sys_errno = errno;
    }
 
+   RND_ERROR unlock_rval = rnd_lock_remove(handle, bhandle);
+   if (unlock_rval)
+      rval = unlock_rval;
+
   abandon_function:
+   RND_PROBE3(lock_area_return, bhandle->offset, bhandle->size, rval);
    return rval;
 }
 
+/**
+ * Places a lock on an area of the file, see `lock_area`, failing with
+ * RND_LOCK_FAILED if another handle holds it.
+ */
+RND_ERROR rnd_lock_area(RNDH *handle,
+                        BLOCK_LOC *bhandle,
+                        bool retrieve_data,
+                        lock_callback callback,
+                        void *closure)
+{
+   return lock_area(handle, bhandle, 0, 0, retrieve_data, callback, closure);
+}
+
+/**
+ * Like `rnd_lock_area`, but waits for the lock instead of failing with
+ * RND_LOCK_FAILED.
+ *
+ * Only for locks that are taken last and held for a moment, like that of
+ * a liveness map word, which many records share: a caller holding one
+ * never waits for another lock, so waiting for one can't deadlock.
+ */
+RND_ERROR rnd_lock_area_wait(RNDH *handle,
+                             BLOCK_LOC *bhandle,
+                             bool retrieve_data,
+                             lock_callback callback,
+                             void *closure)
+{
+   return lock_area(handle, bhandle, 1, 0, retrieve_data, callback, closure);
+}
+
+/**
+ * Like `rnd_lock_area`, but with a read lock, for lookups, which may run
+ * alongside each other and fail with RND_LOCK_FAILED only while a writer
+ * holds the area.  The callback must not change the contents.
+ */
+RND_ERROR rnd_lock_area_shared(RNDH *handle,
+                               BLOCK_LOC *bhandle,
+                               bool retrieve_data,
+                               lock_callback callback,
+                               void *closure)
+{
+   return lock_area(handle, bhandle, 0, 1, retrieve_data, callback, closure);
+}
+
+/**
+ * Places a lock of *type*, F_WRLCK or F_RDLCK, for `rnd_lock_place` and
+ * `rnd_lock_place_shared`.
+ */
+static RND_ERROR lock_place(RNDH *handle, const BLOCK_LOC *bhandle, short type, bool wait)
+{
+   // A read-only handle writes nothing, so it has nothing to lock out:
+   if (handle->readonly)
+      return RND_SUCCESS;
+
+   struct flock fl;
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = type;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = bhandle->offset;
+   fl.l_len = bhandle->size;
+
+   uint64_t started = LATENCY_START();
+   int failed = fcntl(fileno(handle->file), wait ? LOCK_SETW : LOCK_SET, &fl) == -1;
+   LATENCY_RECORD(RND_LATENCY_LOCK, started);
+
+   if (failed)
+   {
+      if (errno == EAGAIN || errno == EACCES)
+         return RND_LOCK_FAILED;
+
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Places a lock on an area of the file, for callers that hold several
+ * locks at once and so can't nest `rnd_lock_area` callbacks.
+ *
+ * Unlike `rnd_lock_area`, this doesn't flush the stream; callers that
+ * read or write under the lock must flush it themselves.
+ *
+ * @param handle   handle to an open recno database
+ * @param bhandle  area to lock
+ * @param wait     TRUE to wait for the lock, FALSE to fail with
+ *                 RND_LOCK_FAILED if another process holds it
+ */
+RND_ERROR rnd_lock_place(RNDH *handle, const BLOCK_LOC *bhandle, bool wait)
+{
+   return lock_place(handle, bhandle, F_WRLCK, wait);
+}
+
+/**
+ * Like `rnd_lock_place`, but places a read lock, which excludes writers
+ * and not other readers.  Remove it with `rnd_lock_remove`.
+ */
+RND_ERROR rnd_lock_place_shared(RNDH *handle, const BLOCK_LOC *bhandle, bool wait)
+{
+   return lock_place(handle, bhandle, F_RDLCK, wait);
+}
+
+/**
+ * Removes a lock placed by `rnd_lock_place` or `rnd_lock_place_shared`.
+ */
+RND_ERROR rnd_lock_remove(RNDH *handle, const BLOCK_LOC *bhandle)
+{
+   if (handle->readonly)
+      return RND_SUCCESS;
+
+   struct flock fl;
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = F_UNLCK;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = bhandle->offset;
+   fl.l_len = bhandle->size;
+
+   if (fcntl(fileno(handle->file), LOCK_SET, &fl) == -1)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   return RND_SUCCESS;
+}
+
 RND_ERROR rnd_lock_add_block(int tries)
 {
    return RND_SUCCESS;
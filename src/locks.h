@@ -4,17 +4,49 @@
 #include "blocks.h"
 #include "recnodb.h"
 
+#include <fcntl.h>
+
+/*
+ * Where the system has them, locks belong to the open file rather than
+ * to the process, so that threads with handles of their own exclude each
+ * other as processes do, and closing one handle doesn't drop the locks
+ * of another.  Such locks need l_pid set to 0.
+ */
+#ifdef F_OFD_SETLK
+#define LOCK_SET   F_OFD_SETLK
+#define LOCK_SETW  F_OFD_SETLKW
+#define LOCK_GET   F_OFD_GETLK
+#else
+#define LOCK_SET   F_SETLK
+#define LOCK_SETW  F_SETLKW
+#define LOCK_GET   F_GETLK
+#endif
+
 // Return TRUE (!=0) to write back contents of locked_buffer.
 typedef bool (*lock_callback)(RNDH *handle,
                               BLOCK_LOC *bhandle,
                               void *locked_buffer,
                               void *closure);
 
+RND_ERROR rnd_lock_place(RNDH *handle, const BLOCK_LOC *bhandle, bool wait);
+RND_ERROR rnd_lock_place_shared(RNDH *handle, const BLOCK_LOC *bhandle, bool wait);
+RND_ERROR rnd_lock_remove(RNDH *handle, const BLOCK_LOC *bhandle);
+
 RND_ERROR rnd_lock_area(RNDH *handle,
                         BLOCK_LOC *bhandle,
                         bool retrieve_data,
                         lock_callback callback,
                         void *closure);
+RND_ERROR rnd_lock_area_wait(RNDH *handle,
+                             BLOCK_LOC *bhandle,
+                             bool retrieve_data,
+                             lock_callback callback,
+                             void *closure);
+RND_ERROR rnd_lock_area_shared(RNDH *handle,
+                               BLOCK_LOC *bhandle,
+                               bool retrieve_data,
+                               lock_callback callback,
+                               void *closure);
 
 
 
@@ -0,0 +1,250 @@
+/** @file
+ *
+ * Small, dependency-free LZ77 codec for compressing cold blocks.
+ *
+ * The stream is a series of sequences, each a token byte followed by
+ * literals and, except in the final sequence, a match:
+ *
+ * - token high nibble: literal count (15 means more count bytes follow)
+ * - token low nibble:  match length - LZ_MIN_MATCH (15 means more bytes follow)
+ * - extended counts add bytes of 255 until a byte less than 255
+ * - the match is a 2-byte little-endian distance back into the output
+ *
+ * The final sequence has only literals and ends the stream.
+ */
+
+#include "lz.h"
+
+#include <string.h>   // for memcpy()
+
+#define LZ_MIN_MATCH   4
+#define LZ_MAX_OFFSET  65535
+#define LZ_HASH_BITS   12
+
+static uint32_t lz_read32(const unsigned char *p)
+{
+   uint32_t value;
+   memcpy(&value, p, sizeof(value));
+   return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+   return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Writes the 255-run extension of a count that overflowed its nibble.
+ *
+ * @return pointer past the extension, or NULL if *dst_end* would be overrun.
+ */
+static unsigned char *lz_put_count(unsigned char *dst, unsigned char *dst_end, size_t count)
+{
+   for (; count >= 255; count -= 255)
+   {
+      if (dst >= dst_end)
+         return NULL;
+      *dst++ = 255;
+   }
+
+   if (dst >= dst_end)
+      return NULL;
+   *dst++ = (unsigned char)count;
+
+   return dst;
+}
+
+/**
+ * Writes one sequence.  A *match_len* of 0 writes the final, literals-only sequence.
+ */
+static unsigned char *lz_put_sequence(unsigned char *dst,
+                                      unsigned char *dst_end,
+                                      const unsigned char *literals,
+                                      size_t lit_len,
+                                      size_t offset,
+                                      size_t match_len)
+{
+   size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+   if (dst >= dst_end)
+      return NULL;
+
+   unsigned char *token = dst++;
+   *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4)
+                            | (match_code < 15 ? match_code : 15));
+
+   if (lit_len >= 15 && !(dst = lz_put_count(dst, dst_end, lit_len - 15)))
+      return NULL;
+
+   if ((size_t)(dst_end - dst) < lit_len)
+      return NULL;
+   memcpy(dst, literals, lit_len);
+   dst += lit_len;
+
+   if (match_len)
+   {
+      if (dst_end - dst < 2)
+         return NULL;
+      *dst++ = (unsigned char)(offset & 0xff);
+      *dst++ = (unsigned char)(offset >> 8);
+
+      if (match_code >= 15 && !(dst = lz_put_count(dst, dst_end, match_code - 15)))
+         return NULL;
+   }
+
+   return dst;
+}
+
+/**
+ * Largest output `lz_compress` can produce for *src_len* input bytes.
+ */
+size_t lz_compress_bound(size_t src_len)
+{
+   return src_len + src_len / 255 + 16;
+}
+
+/**
+ * Compresses *src* into *dst*.
+ *
+ * @param src      data to compress
+ * @param src_len  number of bytes in *src*
+ * @param dst      [out] memory for the compressed stream
+ * @param dst_cap  size of *dst*
+ *
+ * @return size of the compressed stream, or 0 if it doesn't fit in *dst_cap*.
+ */
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+   const unsigned char *in = (const unsigned char*)src;
+   const unsigned char *in_end = in + src_len;
+   const unsigned char *anchor = in;
+   const unsigned char *ip = in;
+
+   unsigned char *out = (unsigned char*)dst;
+   unsigned char *out_end = out + dst_cap;
+
+   // Positions are stored +1 so a zeroed table means "no candidate"
+   uint32_t table[1 << LZ_HASH_BITS];
+   memset(table, 0, sizeof(table));
+
+   if (src_len >= LZ_MIN_MATCH)
+   {
+      const unsigned char *match_limit = in_end - LZ_MIN_MATCH;
+
+      while (ip <= match_limit)
+      {
+         uint32_t sequence = lz_read32(ip);
+         uint32_t hash = lz_hash(sequence);
+         uint32_t candidate = table[hash];
+         table[hash] = (uint32_t)(ip - in) + 1;
+
+         if (candidate
+             && (size_t)(ip - (in + candidate - 1)) <= LZ_MAX_OFFSET
+             && lz_read32(in + candidate - 1) == sequence)
+         {
+            const unsigned char *ref = in + candidate - 1;
+            size_t match_len = LZ_MIN_MATCH;
+
+            while (ip + match_len < in_end && ref[match_len] == ip[match_len])
+               ++match_len;
+
+            out = lz_put_sequence(out, out_end, anchor, ip - anchor, ip - ref, match_len);
+            if (!out)
+               return 0;
+
+            ip += match_len;
+            anchor = ip;
+         }
+         else
+            ++ip;
+      }
+   }
+
+   out = lz_put_sequence(out, out_end, anchor, in_end - anchor, 0, 0);
+   if (!out)
+      return 0;
+
+   return out - (unsigned char*)dst;
+}
+
+/**
+ * Reads a 255-run extension, adding it to *count*.
+ *
+ * @return pointer past the extension, or NULL if the stream is truncated.
+ */
+static const unsigned char *lz_get_count(const unsigned char *src, const unsigned char *src_end, size_t *count)
+{
+   unsigned char byte;
+   do
+   {
+      if (src >= src_end)
+         return NULL;
+      byte = *src++;
+      *count += byte;
+   }
+   while (byte == 255);
+
+   return src;
+}
+
+/**
+ * Decompresses a stream made by `lz_compress`.
+ *
+ * Every length and distance is checked against the buffers, so a
+ * corrupt stream fails rather than overrunning memory.
+ *
+ * @param src      compressed stream
+ * @param src_len  number of bytes in *src*
+ * @param dst      [out] memory for the decompressed data
+ * @param dst_cap  size of *dst*
+ *
+ * @return number of bytes decompressed, or 0 if the stream is corrupt
+ *         or doesn't fit in *dst_cap*.
+ */
+size_t lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+   const unsigned char *ip = (const unsigned char*)src;
+   const unsigned char *ip_end = ip + src_len;
+   unsigned char *out = (unsigned char*)dst;
+   unsigned char *op = out;
+   unsigned char *op_end = out + dst_cap;
+
+   while (ip < ip_end)
+   {
+      unsigned char token = *ip++;
+      size_t lit_len = token >> 4;
+      size_t match_len = token & 0x0f;
+
+      if (lit_len == 15 && !(ip = lz_get_count(ip, ip_end, &lit_len)))
+         return 0;
+
+      if ((size_t)(ip_end - ip) < lit_len || (size_t)(op_end - op) < lit_len)
+         return 0;
+      memcpy(op, ip, lit_len);
+      ip += lit_len;
+      op += lit_len;
+
+      // The final sequence ends with its literals
+      if (ip == ip_end)
+         break;
+
+      if (ip_end - ip < 2)
+         return 0;
+      size_t offset = ip[0] | ((size_t)ip[1] << 8);
+      ip += 2;
+
+      if (match_len == 15 && !(ip = lz_get_count(ip, ip_end, &match_len)))
+         return 0;
+      match_len += LZ_MIN_MATCH;
+
+      if (offset == 0 || offset > (size_t)(op - out) || (size_t)(op_end - op) < match_len)
+         return 0;
+
+      // Byte-by-byte, because the match may overlap its own output
+      const unsigned char *ref = op - offset;
+      while (match_len--)
+         *op++ = *ref++;
+   }
+
+   return op - out;
+}
@@ -0,0 +1,11 @@
+#ifndef RECNODB_LZ_H
+#define RECNODB_LZ_H
+
+#include <stdint.h>
+#include <stddef.h>   // for size_t
+
+size_t lz_compress_bound(size_t src_len);
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+size_t lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+#endif
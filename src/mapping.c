@@ -0,0 +1,124 @@
+/** @file
+ *
+ * Shared mappings of the database file, for reads without copying and
+ * for atomic changes to integer fields (see `flatrecs_cas_field`).
+ *
+ * A handle keeps one current mapping of the file, made on first use and
+ * replaced by a longer one when a read reaches past its end.  Pointers
+ * into a mapping are leased (see `rnd_get_ref`), and a replaced mapping
+ * stays mapped until its last lease is released, so a lease's pointer
+ * stays valid however the file grows meanwhile.
+ *
+ * The mappings are MAP_SHARED, so they see writes once they reach the
+ * kernel.  Writes through a handle with a mapping are therefore flushed
+ * as they are made (see `blocks_write_at`).  A handle that can write maps
+ * the file writable too, though only atomic field changes write through
+ * the mapping; a read-only handle's file can only be mapped for reading.
+ */
+
+#include "mapping.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/**
+ * Unmaps a mapping that has no leases and no handle.
+ */
+static void mapping_destroy(struct rnd_mapping *mapping)
+{
+   munmap(mapping->base, mapping->length);
+   free(mapping);
+}
+
+/**
+ * Retires the handle's current mapping, destroying it now if no leases hold it.
+ */
+static void mapping_retire(RNDH *handle)
+{
+   struct rnd_mapping *mapping = handle->mapping;
+
+   if (mapping)
+   {
+      handle->mapping = NULL;
+
+      if (mapping->leases)
+         mapping->retired = 1;
+      else
+         mapping_destroy(mapping);
+   }
+}
+
+/**
+ * Gets a mapping that covers the file from its start to *end*.
+ *
+ * @param handle   handle to an open recno database
+ * @param end      offset past the last byte to be read through the mapping
+ * @param mapping  [out] the handle's current mapping
+ */
+RND_ERROR mapping_reach(RNDH *handle, off_t end, struct rnd_mapping **mapping)
+{
+   if (handle->mapping && (off_t)handle->mapping->length >= end)
+   {
+      *mapping = handle->mapping;
+      return RND_SUCCESS;
+   }
+
+   // Buffered writes must reach the file before it is mapped:
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   off_t size;
+   RND_ERROR rval = blocks_file_size(handle, &size);
+   if (rval)
+      return rval;
+
+   if (size < end)
+      return RND_INCOMPLETE_READ;
+
+   struct rnd_mapping *fresh = (struct rnd_mapping*)calloc(1, sizeof(struct rnd_mapping));
+   if (!fresh)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   int prot = handle->readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+   void *base = mmap(NULL, (size_t)size, prot, MAP_SHARED, fileno(handle->file), 0);
+   if (base == MAP_FAILED)
+   {
+      handle->sys_errno = errno;
+      free(fresh);
+      return RND_SYSTEM_ERROR;
+   }
+
+   fresh->base = (char*)base;
+   fresh->length = (size_t)size;
+
+   mapping_retire(handle);
+   handle->mapping = fresh;
+
+   *mapping = fresh;
+   return RND_SUCCESS;
+}
+
+/**
+ * Returns a lease on a mapping, unmapping a retired mapping with its last lease.
+ */
+void mapping_release(struct rnd_mapping *mapping)
+{
+   if (mapping->leases && --mapping->leases == 0 && mapping->retired)
+      mapping_destroy(mapping);
+}
+
+/**
+ * Lets go of the handle's mapping as the handle is closed.  Leases that
+ * are still outstanding keep it mapped until they are released.
+ */
+void mapping_free(RNDH *handle)
+{
+   mapping_retire(handle);
+}
@@ -0,0 +1,24 @@
+#ifndef RECNODB_MAPPING_H
+#define RECNODB_MAPPING_H
+
+#include "recnodb.h"
+
+/** What an RND_LEASE holds, see `rnd_release`. */
+typedef enum {
+   LEASE_NONE = 0,
+   LEASE_MAPPING,    /**< *holder* is a struct rnd_mapping  */
+   LEASE_CACHE       /**< *holder* is a pinned CACHE_SLOT   */
+} LEASE_KIND;
+
+struct rnd_mapping {
+   char     *base;      /**< Shared mapping of the start of the file                 */
+   size_t   length;     /**< Bytes mapped                                            */
+   uint32_t leases;     /**< Outstanding leases of pointers into the mapping         */
+   bool     retired;    /**< Replaced or closed, to be unmapped with the last lease  */
+};
+
+RND_ERROR mapping_reach(RNDH *handle, off_t end, struct rnd_mapping **mapping);
+void mapping_release(struct rnd_mapping *mapping);
+void mapping_free(RNDH *handle);
+
+#endif
@@ -0,0 +1,250 @@
+/** @file
+ *
+ * Scans of a table's blocks by a pool of threads.
+ *
+ * The blocks of a table are independent: each holds its own liveness map
+ * and a known run of records.  `parallel_scan` walks the chain once to
+ * list the blocks, deals the list into equal, contiguous runs, one per
+ * worker, and lets each worker take blocks from the front of its own run.
+ * A worker that finishes its run steals from the back of another's, so
+ * workers given slow blocks, or compressed ones, don't hold up the scan.
+ *
+ * Workers read with their own copy of the handle that reads through
+ * pread() (see `RNDH::positional`), so they share neither a file
+ * position nor the decompression cache, and each has its own sys_errno.
+ */
+
+#include "parallel.h"
+#include "extra.h"
+#include "flatrecs.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>   // for sysconf()
+
+/** A worker's run of blocks: it takes from *next*, thieves from *end*. */
+typedef struct parallel_queue {
+   pthread_mutex_t lock;
+   uint32_t        next;
+   uint32_t        end;
+} PAR_QUEUE;
+
+typedef struct parallel_pool {
+   RNDH                *handle;
+   const FLATREC_BLOCK *blocks;
+   PAR_QUEUE           *queues;
+   parallel_view       viewer;
+   void                *caller_closure;
+   uint32_t            nworkers;
+   uint32_t            rec_size;
+   int                 stop;        // set, atomically, to end the scan
+   RND_ERROR           rval;        // first error, guarded by *stop*
+   int                 sys_errno;
+   char                pad[4];
+} PAR_POOL;
+
+typedef struct parallel_worker {
+   PAR_POOL  *pool;
+   pthread_t thread;
+   uint32_t  index;
+   char      pad[4];
+   RND_STATS stats;   /**< Counts of the worker's reads, added to the handle's after the scan */
+} PAR_WORKER;
+
+/**
+ * Takes the next block from a worker's own run, or steals the last block
+ * of another worker's run.
+ *
+ * @return TRUE with *task* set, or FALSE if every run is empty.
+ */
+static bool parallel_take_task(PAR_POOL *pool, uint32_t index, uint32_t *task)
+{
+   PAR_QUEUE *queue = &pool->queues[index];
+   bool found = 0;
+   uint32_t i;
+
+   pthread_mutex_lock(&queue->lock);
+   if (queue->next < queue->end)
+   {
+      *task = queue->next++;
+      found = 1;
+   }
+   pthread_mutex_unlock(&queue->lock);
+
+   for (i = 1; !found && i < pool->nworkers; ++i)
+   {
+      queue = &pool->queues[(index + i) % pool->nworkers];
+
+      pthread_mutex_lock(&queue->lock);
+      if (queue->next < queue->end)
+      {
+         *task = --queue->end;
+         found = 1;
+      }
+      pthread_mutex_unlock(&queue->lock);
+   }
+
+   return found;
+}
+
+/**
+ * Stops the scan, recording *rval* and *sys_errno* if this is the first
+ * worker to stop it.
+ */
+static void parallel_stop(PAR_POOL *pool, RND_ERROR rval, int sys_errno)
+{
+   int expected = 0;
+
+   if (__atomic_compare_exchange_n(&pool->stop, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+   {
+      pool->rval = rval;
+      pool->sys_errno = sys_errno;
+   }
+}
+
+/**
+ * Thread function: scans blocks until none remain or the scan is stopped.
+ */
+static void *parallel_worker(void *arg)
+{
+   PAR_WORKER *worker = (PAR_WORKER*)arg;
+   PAR_POOL *pool = worker->pool;
+   RNDH handle = *pool->handle;
+   char *buffer = NULL;
+   size_t buffer_size = 0;
+   uint32_t task;
+
+   // Workers read with pread(), even for a read-only handle, rather than
+   // race each other to replace the handle's mapping:
+   handle.positional = 1;
+   handle.readonly = 0;
+   handle.cache = NULL;
+   handle.stats = &worker->stats;
+   handle.sys_errno = 0;
+
+   while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)
+          && parallel_take_task(pool, worker->index, &task))
+   {
+      const FLATREC_BLOCK *fb = &pool->blocks[task];
+      const char *image;
+      RND_ERROR rval;
+
+      if ((rval = flatrecs_read_block(&handle, fb, pool->rec_size, &buffer, &buffer_size, &image)))
+      {
+         parallel_stop(pool, rval, handle.sys_errno);
+         break;
+      }
+
+      if (!(*pool->viewer)((const uint64_t*)image,
+                           image + fb->block.bytes_to_records - fb->block.bytes_to_data,
+                           fb->nbits,
+                           fb->first_recno,
+                           pool->rec_size,
+                           pool->caller_closure))
+      {
+         parallel_stop(pool, RND_SUCCESS, 0);
+         break;
+      }
+   }
+
+   free(buffer);
+   return NULL;
+}
+
+/**
+ * Presents the liveness map and records of each block of a table to a
+ * viewer function, called from several threads at once.
+ *
+ * Blocks are presented in no particular order, and *viewer* must be safe
+ * to call concurrently.  Once any call returns 0, workers stop taking new
+ * blocks, though calls already under way finish.  The calling thread is
+ * one of the workers.  The table mustn't be changed during the scan.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table
+ * @param nthreads    number of threads to use, 0 for one per online processor
+ * @param viewer      function to call with each block's map and records
+ * @param closure     optional pointer passed through to *viewer*
+ */
+RND_ERROR parallel_scan(RNDH *handle,
+                        off_t table_head,
+                        uint32_t nthreads,
+                        parallel_view viewer,
+                        void *closure)
+{
+   prime_handle(handle);
+
+   FLATREC_BLOCK *blocks;
+   uint32_t count, rec_size, i;
+   RND_ERROR rval;
+
+   if ((rval = flatrecs_list_blocks(handle, table_head, &blocks, &count, &rec_size)))
+      return rval;
+
+   // Writes still buffered in the stream would be invisible to pread():
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      free(blocks);
+      return RND_SYSTEM_ERROR;
+   }
+
+   if (nthreads == 0)
+   {
+      long online = sysconf(_SC_NPROCESSORS_ONLN);
+      nthreads = online > 0 ? (uint32_t)online : 1;
+   }
+
+   if (nthreads > count)
+      nthreads = count ? count : 1;
+
+   PAR_QUEUE *queues = (PAR_QUEUE*)calloc(nthreads, sizeof(PAR_QUEUE));
+   PAR_WORKER *workers = (PAR_WORKER*)calloc(nthreads, sizeof(PAR_WORKER));
+   if (!queues || !workers)
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto abandon_function;
+   }
+
+   PAR_POOL pool = { handle, blocks, queues, viewer, closure, nthreads, rec_size };
+
+   for (i = 0; i < nthreads; ++i)
+   {
+      pthread_mutex_init(&queues[i].lock, NULL);
+      queues[i].next = (uint32_t)((uint64_t)count * i / nthreads);
+      queues[i].end = (uint32_t)((uint64_t)count * (i + 1) / nthreads);
+
+      workers[i].pool = &pool;
+      workers[i].index = i;
+   }
+
+   // Any thread that can't be started leaves its run to be stolen:
+   uint32_t started = 1;
+   while (started < nthreads
+          && !pthread_create(&workers[started].thread, NULL, parallel_worker, &workers[started]))
+      ++started;
+
+   parallel_worker(&workers[0]);
+
+   for (i = 1; i < started; ++i)
+      pthread_join(workers[i].thread, NULL);
+
+   for (i = 0; i < nthreads; ++i)
+      stats_merge(handle->stats, &workers[i].stats);
+
+   for (i = 0; i < nthreads; ++i)
+      pthread_mutex_destroy(&queues[i].lock);
+
+   if ((rval = pool.rval))
+      handle->sys_errno = pool.sys_errno;
+
+  abandon_function:
+   free(workers);
+   free(queues);
+   free(blocks);
+   return rval;
+}
@@ -0,0 +1,15 @@
+#ifndef RECNODB_PARALLEL_H
+#define RECNODB_PARALLEL_H
+
+#include "recnodb.h"
+
+/** Function type called by `parallel_scan`, see `rnd_records_view`. */
+typedef rnd_records_view parallel_view;
+
+RND_ERROR parallel_scan(RNDH *handle,
+                        off_t table_head,
+                        uint32_t nthreads,
+                        parallel_view viewer,
+                        void *closure);
+
+#endif
@@ -0,0 +1,44 @@
+/** @file
+ *
+ * Static tracepoints (USDT) on the block, chain and lock paths, for
+ * tools like bpftrace to attach to a running process.
+ *
+ * They are compiled in with -DRND_PROBES, which the Makefile sets when
+ * <sys/sdt.h> is found.  Each is a single nop until a tracer attaches,
+ * and nothing at all without RND_PROBES.  Every probe is in the
+ * "recnodb" provider, an *_entry and a *_return for each function, with
+ * the offsets and sizes involved and, on return, the RND_ERROR.  For
+ * example, to see how long the writers of `rnd_stress` wait in
+ * `rnd_lock_area`:
+ *
+ * ~~~sh
+ * bpftrace -e 'usdt:tools/rnd_stress:recnodb:lock_area_entry { @t[tid] = nsecs; }
+ *              usdt:tools/rnd_stress:recnodb:lock_area_return /@t[tid]/
+ *              { @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+ * ~~~
+ *
+ * The probes are in whatever binary the library is linked into: the
+ * tools link librecnodb.a, so attach to the tool itself, or to
+ * librecnodb.so for programs linked against that.
+ */
+
+#ifndef RECNODB_PROBES_H
+#define RECNODB_PROBES_H
+
+#ifdef RND_PROBES
+
+#include <sys/sdt.h>
+
+#define RND_PROBE1(name, a)          DTRACE_PROBE1(recnodb, name, a)
+#define RND_PROBE2(name, a, b)       DTRACE_PROBE2(recnodb, name, a, b)
+#define RND_PROBE3(name, a, b, c)    DTRACE_PROBE3(recnodb, name, a, b, c)
+
+#else
+
+#define RND_PROBE1(name, a)          ((void)(a))
+#define RND_PROBE2(name, a, b)       ((void)(a), (void)(b))
+#define RND_PROBE3(name, a, b, c)    ((void)(a), (void)(b), (void)(c))
+
+#endif
+
+#endif
@@ -1,9 +1,28 @@
 #include "recnodb.h"
 #include "extra.h"
+#include "flatrecs.h"
+#include "hashindex.h"
+#include "relations.h"
+#include "btree.h"
+#include "scan.h"
+#include "parallel.h"
+#include "txn.h"
+#include "snapshot.h"
+#include "backup.h"
+#include "changes.h"
+#include "stats.h"
 
 #include <string.h>
 #include <errno.h>
 
+/*
+ * Calls that write refuse a handle opened RND_READONLY with
+ * RND_READ_ONLY_HANDLE before they start.  Deeper down, the handle's
+ * record locks are no-ops and its read-only stream can't place the
+ * locks some writers take themselves, so a write let through would fail
+ * with whichever error it happened to reach first.
+ */
+
 /*
  * Prepare an RNDH handle.
  */
@@ -19,7 +38,19 @@ EXPORT RND_ERROR rnd_init(RNDH *handle)
 EXPORT
 RND_ERROR rnd_open_raw(RNDH *handle, const char *path, int reclen, RND_FLAGS flags)
 {
-   return blocks_file_open(path, flags, 4096, reclen, handle);
+   RND_ERROR rval = blocks_file_open(path, flags, 4096, reclen, handle);
+
+   if (!rval)
+      STATS_CALL(handle, RND_CALL_OPEN);
+
+   // Roll back a transaction cut short by a crash:
+   if (!rval && (rval = txn_recover(handle)))
+   {
+      snapshot_free(handle);
+      blocks_file_close(handle);
+   }
+
+   return rval;
 
   //  RND_ERROR rval = RND_FAIL;
 
@@ -64,8 +95,9 @@ EXPORT RND_ERROR rnd_close_raw(RNDH *handle)
 {
    if (handle->file)
    {
-      fclose(handle->file);
-      handle->file = NULL;
+      STATS_CALL(handle, RND_CALL_CLOSE);
+      snapshot_free(handle);
+      blocks_file_close(handle);
       return RND_SUCCESS;
    }
    else
@@ -84,30 +116,254 @@ RND_ERROR rnd_open(const char *path, int reclen, RND_FLAGS flags, rnd_user user,
 
    if (!(result = blocks_file_open(path, flags, get_blocksize(), reclen, &handle)))
    {
-      (*user)(&handle, closure);
+      STATS_CALL(&handle, RND_CALL_OPEN);
+
+      // Roll back a transaction cut short by a crash:
+      if (!(result = txn_recover(&handle)))
+         (*user)(&handle, closure);
+
+      snapshot_free(&handle);
+      blocks_file_close(&handle);
+   }
+
+   return result;
+}
+
+
+
+/*
+ * Create a file at *path* and fill its table with the records from *reader*.
+ *
+ * Any existing file at *path* is replaced.  See `flatrecs_bulk_load`.
+ */
+EXPORT RND_ERROR rnd_bulk_load(const char *path,
+                               uint32_t rec_size,
+                               uint64_t count_hint,
+                               rnd_bulk_reader reader,
+                               void *closure,
+                               RND_RECNO *loaded)
+{
+   STATS_CALL(NULL, RND_CALL_BULK_LOAD);
+   RNDH handle;
+   RND_ERROR result;
+
+   *loaded = 0;
+
+   if (rec_size == 0)
+      return RND_BAD_PARAMETER;
+
+   rnd_init(&handle);
 
+   if (!(result = blocks_file_open(path, RND_CREATE, get_blocksize(), rec_size, &handle)))
+   {
+      result = flatrecs_bulk_load(&handle, count_hint, reader, closure, loaded);
       blocks_file_close(&handle);
    }
 
    return result;
 }
 
+/*
+ * Get what the library has done through *handle*, or through every handle
+ * of the process if *handle* is NULL.  See `stats_read`.
+ */
+EXPORT RND_ERROR rnd_stats(RNDH *handle, RND_STATS *stats)
+{
+   return stats_read(handle, stats);
+}
+
+/*
+ * Start or stop timing gets, puts, deletes, locks and file extensions
+ * in every thread of the process, for `rnd_latency`.  Timing is off
+ * until it is started.
+ */
+EXPORT void rnd_latency_enable(bool enable)
+{
+   stats_latency_enable(enable);
+}
+
+/*
+ * Get the count, mean and percentiles of the latencies of an operation
+ * timed since `rnd_latency_enable`, in nanoseconds.
+ */
+EXPORT RND_ERROR rnd_latency(RND_LATENCY_OP op, RND_LATENCY *latency)
+{
+   return stats_latency(op, latency);
+}
+
+/*
+ * Print a table of the latencies of every timed operation to *out*.
+ */
+EXPORT void rnd_latency_print(FILE *out)
+{
+   stats_latency_print(out);
+}
+
+/*
+ * Start logging changes to the records of the file, for
+ * `rnd_changes_since`.  Changes made before are not logged.
+ */
+EXPORT RND_ERROR rnd_changes_enable(RNDH *handle)
+{
+   STATS_CALL(handle, RND_CALL_CHANGES_ENABLE);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return changes_enable(handle);
+}
+
+/*
+ * Pass the changes logged from *position on to *viewer*, oldest first,
+ * leaving *position after the last one passed.  Start from 0.
+ */
+EXPORT RND_ERROR rnd_changes_since(RNDH *handle, uint64_t *position, rnd_change_view viewer, void *closure)
+{
+   STATS_CALL(handle, RND_CALL_CHANGES_SINCE);
+   return changes_since(handle, position, viewer, closure);
+}
+
+/*
+ * Wait up to *timeout_ms* milliseconds, or forever if negative, for a
+ * change to be logged at *position* or after, by any process.
+ */
+EXPORT RND_ERROR rnd_changes_wait(RNDH *handle, uint64_t position, int timeout_ms, bool *arrived)
+{
+   STATS_CALL(handle, RND_CALL_CHANGES_WAIT);
+   return changes_wait(handle, position, timeout_ms, arrived);
+}
 
+/*
+ * Stream the blocks changed since generation *since* to *out_fd*, 0 for
+ * all of them, while writers carry on.  *next is set to the *since* for
+ * the next backup.  See `backup_incremental`.
+ */
+EXPORT RND_ERROR rnd_backup_incremental(RNDH *handle, uint64_t since, int out_fd, uint64_t *next)
+{
+   STATS_CALL(handle, RND_CALL_BACKUP_INCREMENTAL);
+   return backup_incremental(handle, since, out_fd, next);
+}
+
+/*
+ * Write a stream from `rnd_backup_incremental` over the copy of a file at
+ * *path*, creating the copy from a full backup.
+ */
+EXPORT RND_ERROR rnd_backup_apply(const char *path, int in_fd)
+{
+   STATS_CALL(NULL, RND_CALL_BACKUP_APPLY);
+   return backup_apply(path, in_fd);
+}
 
 /*
  * Write some data to the database.
+ *
+ * A *recno of 0 appends a new record and returns its record number
+ * in *recno.  Otherwise, the existing record *recno is replaced.
  */
 EXPORT RND_ERROR rnd_put(RNDH *handle, RND_RECNO *recno, RND_DATA *data)
 {
-   return RND_SUCCESS;
+   STATS_CALL(handle, RND_CALL_PUT);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   uint64_t started = LATENCY_START();
+   RND_ERROR rval;
+   if (*recno == 0)
+      rval = flatrecs_append_record(handle, 0, data->data, data->size, recno);
+   else
+      rval = flatrecs_write_record(handle, 0, *recno, data->data, data->size);
+   LATENCY_RECORD(RND_LATENCY_PUT, started);
+   return rval;
 }
 
 /*
  * Retrieve data from the database.
+ *
+ * Copies up to data->size bytes into data->data, updating data->size
+ * with the number of bytes copied.
  */
 EXPORT RND_ERROR rnd_get(RNDH *handle, RND_RECNO recno, RND_DATA *data)
 {
-   return RND_SUCCESS;
+   STATS_CALL(handle, RND_CALL_GET);
+   uint64_t started = LATENCY_START();
+   RND_ERROR rval = flatrecs_read_record(handle, 0, recno, data->data, &data->size);
+   LATENCY_RECORD(RND_LATENCY_GET, started);
+   return rval;
+}
+
+/*
+ * Point *data* at a record in place, without copying it.
+ *
+ * *data->data* is read-only and stays valid until *lease* is passed to
+ * `rnd_release`, which must be done before the handle is closed.
+ */
+EXPORT RND_ERROR rnd_get_ref(RNDH *handle, RND_RECNO recno, RND_DATA *data, RND_LEASE *lease)
+{
+   STATS_CALL(handle, RND_CALL_GET_REF);
+   const void *record;
+   RND_ERROR rval = flatrecs_read_record_ref(handle, 0, recno, &record, &data->size, lease);
+
+   if (!rval)
+      data->data = (void*)record;
+
+   return rval;
+}
+
+/*
+ * Release a record from `rnd_get_ref`.
+ */
+EXPORT void rnd_release(RND_LEASE *lease)
+{
+   flatrecs_release_record(lease);
+}
+
+/*
+ * Overwrite *len* bytes at *offset* within a live record, locking and
+ * writing only those bytes.
+ */
+EXPORT RND_ERROR rnd_update_field(RNDH *handle, RND_RECNO recno, uint32_t offset, uint32_t len, const void *bytes)
+{
+   STATS_CALL(handle, RND_CALL_UPDATE_FIELD);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return flatrecs_update_field(handle, 0, recno, offset, len, bytes);
+}
+
+/*
+ * Store *desired* in a 1, 2, 4 or 8-byte unsigned field of a record if
+ * it holds *expected*.  *found* gets the value it held, so the swap was
+ * made if *found* equals *expected*.  A 4 or 8-byte field on a boundary
+ * of its size is swapped atomically in the mapped file, without the
+ * record lock, unless an index, the change log or an open snapshot needs
+ * the record held still; RND_DIRECT handles and other fields lock it.
+ */
+EXPORT RND_ERROR rnd_cas_field(RNDH *handle,
+                               RND_RECNO recno,
+                               uint32_t offset,
+                               uint32_t width,
+                               uint64_t expected,
+                               uint64_t desired,
+                               uint64_t *found)
+{
+   STATS_CALL(handle, RND_CALL_CAS_FIELD);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return flatrecs_cas_field(handle, 0, recno, offset, width, expected, desired, found);
+}
+
+/*
+ * Add *addend* to a 1, 2, 4 or 8-byte unsigned field of a record,
+ * getting the value it held before in *previous*.  The record lock is
+ * skipped as it is by `rnd_cas_field`.
+ */
+EXPORT RND_ERROR rnd_fetch_add_field(RNDH *handle,
+                                     RND_RECNO recno,
+                                     uint32_t offset,
+                                     uint32_t width,
+                                     uint64_t addend,
+                                     uint64_t *previous)
+{
+   STATS_CALL(handle, RND_CALL_FETCH_ADD_FIELD);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return flatrecs_fetch_add_field(handle, 0, recno, offset, width, addend, previous);
 }
 
 /*
@@ -115,7 +371,274 @@ EXPORT RND_ERROR rnd_get(RNDH *handle, RND_RECNO recno, RND_DATA *data)
  */
 EXPORT RND_ERROR rnd_delete(RNDH *handle, RND_RECNO recno)
 {
-   return RND_SUCCESS;
+   STATS_CALL(handle, RND_CALL_DELETE);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   uint64_t started = LATENCY_START();
+   RND_ERROR rval = flatrecs_delete_record(handle, 0, recno);
+   LATENCY_RECORD(RND_LATENCY_DELETE, started);
+   return rval;
 }
 
+/*
+ * Count the live records in the database.
+ */
+EXPORT RND_ERROR rnd_count(RNDH *handle, RND_RECNO *count)
+{
+   STATS_CALL(handle, RND_CALL_COUNT);
+   prime_handle(handle);
+   return flatrecs_count_live(handle, 0, count);
+}
 
+/*
+ * Start a transaction.  Writes added with `rnd_txn_put` and
+ * `rnd_txn_delete` are made together or not at all by `rnd_txn_commit`,
+ * or discarded by `rnd_txn_abort`.
+ */
+EXPORT RND_ERROR rnd_txn_begin(RNDH *handle, RND_TXN **txn)
+{
+   STATS_CALL(handle, RND_CALL_TXN_BEGIN);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   prime_handle(handle);
+   return txn_begin(handle, txn);
+}
+
+/*
+ * Add the replacement of an existing record to a transaction.
+ */
+EXPORT RND_ERROR rnd_txn_put(RND_TXN *txn, RND_RECNO recno, RND_DATA *data)
+{
+   STATS_CALL(txn->handle, RND_CALL_TXN_PUT);
+   return txn_write(txn, 0, recno, data->data, data->size);
+}
+
+/*
+ * Add the deletion of a record to a transaction.
+ */
+EXPORT RND_ERROR rnd_txn_delete(RND_TXN *txn, RND_RECNO recno)
+{
+   STATS_CALL(txn->handle, RND_CALL_TXN_DELETE);
+   return txn_write(txn, 0, recno, NULL, 0);
+}
+
+/*
+ * Make every write of a transaction, or none of them, waiting for
+ * records other processes hold.
+ *
+ * Finishes the transaction, except on RND_LOCK_FAILED, when its blocks
+ * kept being compressed under it and the transaction stays open to
+ * commit again or abort.
+ */
+EXPORT RND_ERROR rnd_txn_commit(RND_TXN *txn)
+{
+   STATS_CALL(txn->handle, RND_CALL_TXN_COMMIT);
+   if (txn->handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return txn_commit(txn);
+}
+
+/*
+ * Discard a transaction without making its writes.
+ */
+EXPORT void rnd_txn_abort(RND_TXN *txn)
+{
+   STATS_CALL(txn->handle, RND_CALL_TXN_ABORT);
+   txn_abort(txn);
+}
+
+/*
+ * Open a snapshot: reads through it with `rnd_snapshot_get` see the
+ * records as they are now, while writers carry on changing them.
+ */
+EXPORT RND_ERROR rnd_snapshot_open(RNDH *handle, RND_SNAPSHOT **snapshot)
+{
+   STATS_CALL(handle, RND_CALL_SNAPSHOT_OPEN);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return snapshot_open(handle, snapshot);
+}
+
+/*
+ * Get a record as it was when the snapshot opened.
+ */
+EXPORT RND_ERROR rnd_snapshot_get(RND_SNAPSHOT *snapshot, RND_RECNO recno, RND_DATA *data)
+{
+   STATS_CALL(snapshot->handle, RND_CALL_SNAPSHOT_GET);
+   return snapshot_read_record(snapshot, recno, data->data, &data->size);
+}
+
+/*
+ * Close a snapshot.  Close every snapshot of a handle before the handle.
+ */
+EXPORT void rnd_snapshot_close(RND_SNAPSHOT *snapshot)
+{
+   STATS_CALL(snapshot->handle, RND_CALL_SNAPSHOT_CLOSE);
+   snapshot_close(snapshot);
+}
+
+/*
+ * Compress the cold blocks of the database: the full data blocks before
+ * the last one, skipping blocks in use.  Blocks are compressed only when
+ * this is called, as no access is tracked and no compactor runs in the
+ * background.
+ *
+ * Safe to call from a background thread or process, see `flatrecs_compress_cold`.
+ */
+EXPORT RND_ERROR rnd_compress_cold_blocks(RNDH *handle, uint32_t *blocks_compressed)
+{
+   STATS_CALL(handle, RND_CALL_COMPRESS_COLD_BLOCKS);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return flatrecs_compress_cold(handle, 0, blocks_compressed);
+}
+
+/*
+ * Reserve disk space for appending *records* more records.
+ *
+ * Call before a bulk load so the new blocks get contiguous extents
+ * instead of being allocated one at a time.
+ */
+EXPORT RND_ERROR rnd_reserve(RNDH *handle, RND_RECNO records)
+{
+   STATS_CALL(handle, RND_CALL_RESERVE);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return flatrecs_reserve(handle, 0, records);
+}
+
+/*
+ * Associate a key with a record number, replacing any previous association.
+ */
+EXPORT RND_ERROR rnd_index_put(RNDH *handle, const RND_DATA *key, RND_RECNO recno)
+{
+   STATS_CALL(handle, RND_CALL_INDEX_PUT);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return hashindex_put(handle, key->data, key->size, recno);
+}
+
+/*
+ * Get the record number associated with a key.
+ */
+EXPORT RND_ERROR rnd_index_get(RNDH *handle, const RND_DATA *key, RND_RECNO *recno)
+{
+   STATS_CALL(handle, RND_CALL_INDEX_GET);
+   return hashindex_get(handle, key->data, key->size, recno);
+}
+
+/*
+ * Remove a key's association.
+ */
+EXPORT RND_ERROR rnd_index_delete(RNDH *handle, const RND_DATA *key)
+{
+   STATS_CALL(handle, RND_CALL_INDEX_DELETE);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return hashindex_delete(handle, key->data, key->size);
+}
+
+/*
+ * Make record *child* a child of record *parent*.
+ */
+EXPORT RND_ERROR rnd_relation_add(RNDH *handle, RND_RECNO parent, RND_RECNO child)
+{
+   STATS_CALL(handle, RND_CALL_RELATION_ADD);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return relations_add(handle, parent, child);
+}
+
+/*
+ * Remove record *child* from the children of record *parent*.
+ */
+EXPORT RND_ERROR rnd_relation_remove(RNDH *handle, RND_RECNO parent, RND_RECNO child)
+{
+   STATS_CALL(handle, RND_CALL_RELATION_REMOVE);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return relations_remove(handle, parent, child);
+}
+
+/*
+ * Send the children of record *parent*, in ascending recno order, to *viewer*.
+ */
+EXPORT RND_ERROR rnd_relation_walk(RNDH *handle, RND_RECNO parent, rnd_relation_view viewer, void *closure)
+{
+   STATS_CALL(handle, RND_CALL_RELATION_WALK);
+   return relations_walk(handle, parent, viewer, closure);
+}
+
+/*
+ * Get the number of children of record *parent*.
+ */
+EXPORT RND_ERROR rnd_relation_count(RNDH *handle, RND_RECNO parent, RND_RECNO *count)
+{
+   STATS_CALL(handle, RND_CALL_RELATION_COUNT);
+   return relations_count(handle, parent, count);
+}
+
+/*
+ * Find the live records of a table whose field satisfies a comparison.
+ */
+EXPORT RND_ERROR rnd_scan_filter(RNDH *handle,
+                                 off_t table_head,
+                                 const RND_FIELD *field,
+                                 RND_SCAN_OP op,
+                                 const void *value,
+                                 RND_BITMAP *matches)
+{
+   STATS_CALL(handle, RND_CALL_SCAN_FILTER);
+   return scan_filter(handle, table_head, field, op, value, matches);
+}
+
+/*
+ * Compute the count, sum, minimum, maximum or mean of a field over a table's live records.
+ */
+EXPORT RND_ERROR rnd_aggregate(RNDH *handle,
+                               off_t table_head,
+                               const RND_FIELD *field,
+                               uint32_t ops,
+                               RND_AGGREGATE *result)
+{
+   STATS_CALL(handle, RND_CALL_AGGREGATE);
+   return scan_aggregate(handle, table_head, field, ops, result);
+}
+
+/*
+ * Create an ordered index over a fixed-offset field of a table's records.
+ */
+EXPORT RND_ERROR rnd_btree_create(RNDH *handle, off_t table_head, const RND_FIELD *field, off_t *btree)
+{
+   STATS_CALL(handle, RND_CALL_BTREE_CREATE);
+   if (handle->readonly)
+      return RND_READ_ONLY_HANDLE;
+   return btree_create(handle, table_head, field, btree);
+}
+
+/*
+ * Send the recnos of the records whose indexed field is from *low* to *high* to *viewer*.
+ */
+EXPORT RND_ERROR rnd_btree_range(RNDH *handle,
+                                 off_t btree,
+                                 const void *low,
+                                 const void *high,
+                                 rnd_range_view viewer,
+                                 void *closure)
+{
+   STATS_CALL(handle, RND_CALL_BTREE_RANGE);
+   return btree_range(handle, btree, low, high, viewer, closure);
+}
+
+/*
+ * Present every block of a table to *viewer* from a pool of *nthreads* threads.
+ */
+EXPORT RND_ERROR rnd_parallel_scan(RNDH *handle,
+                                   off_t table_head,
+                                   uint32_t nthreads,
+                                   rnd_records_view viewer,
+                                   void *closure)
+{
+   STATS_CALL(handle, RND_CALL_PARALLEL_SCAN);
+   return parallel_scan(handle, table_head, nthreads, viewer, closure);
+}
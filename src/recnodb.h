@@ -30,12 +30,15 @@ typedef enum {
    RND_INVALID_BLOCK_SIZE,
    RND_INVALID_BLOCK_LOCATION,
    RND_INVALID_HEAD_FILE,
+   RND_KEY_NOT_FOUND,
+   RND_READ_ONLY_HANDLE,
    RND_ERROR_LIMIT
 } RND_ERROR;
 
 typedef enum {
    RND_CREATE = 1,
-   RND_READONLY = 2
+   RND_READONLY = 2,   /**< Read through a shared mapping, taking no locks */
+   RND_DIRECT = 4      /**< Bypass the kernel page cache (O_DIRECT) */
 } RND_FLAGS;
 
 typedef struct recnodb_handle RNDH;
@@ -53,15 +56,240 @@ typedef struct recnodb_data {
    char          pad[4];
 } RND_DATA;
 
+/** How to interpret a fixed-offset field of a record, see RND_FIELD. */
+typedef enum {
+   RND_FIELD_UINT,    /**< Unsigned integer of 1, 2, 4 or 8 bytes */
+   RND_FIELD_INT,     /**< Signed integer of 1, 2, 4 or 8 bytes   */
+   RND_FIELD_FLOAT    /**< float (4 bytes) or double (8 bytes)    */
+} RND_FIELD_TYPE;
+
+/** A field at a fixed offset in every record, in native byte order. */
+typedef struct recnodb_field {
+   uint32_t        offset;   /**< Bytes from the start of the record */
+   uint32_t        width;    /**< Bytes in the field                 */
+   RND_FIELD_TYPE  type;
+} RND_FIELD;
+
+/** Comparisons for `rnd_scan_filter`, of a field with a value. */
+typedef enum {
+   RND_OP_EQ,
+   RND_OP_NE,
+   RND_OP_LT,
+   RND_OP_LE,
+   RND_OP_GT,
+   RND_OP_GE,
+   RND_OP_BETWEEN   /**< Inclusive range: the value is two field values, low then high */
+} RND_SCAN_OP;
+
+/** A set of recnos, as returned by `rnd_scan_filter`. */
+typedef struct recnodb_bitmap {
+   uint64_t  *words;   /**< Bit *recno* is set for each member, release with free() */
+   uint32_t  nbits;    /**< Number of bits, one more than the last recno considered */
+   char      pad[4];
+} RND_BITMAP;
+
+/** Aggregates for `rnd_aggregate` to compute, combined with |. */
+typedef enum {
+   RND_AGG_COUNT = 1,
+   RND_AGG_SUM   = 2,
+   RND_AGG_MIN   = 4,
+   RND_AGG_MAX   = 8,
+   RND_AGG_MEAN  = 16,
+   RND_AGG_CACHE = 32   /**< Keep per-block partials to answer later calls from memory */
+} RND_AGG_OP;
+
+/** A field value, or a sum of values, in the member for the field's type. */
+typedef union recnodb_value {
+   uint64_t  u;   /**< RND_FIELD_UINT  */
+   int64_t   i;   /**< RND_FIELD_INT   */
+   double    f;   /**< RND_FIELD_FLOAT */
+} RND_VALUE;
+
+/** Results of `rnd_aggregate`; members not asked for are 0. */
+typedef struct recnodb_aggregate {
+   uint64_t  count;   /**< Number of live records                          */
+   RND_VALUE sum;     /**< Integer sums wrap at 64 bits                    */
+   RND_VALUE min;     /**< *min* and *max* are 0 if *count* is 0           */
+   RND_VALUE max;
+   double    mean;    /**< Mean of the values, 0 if *count* is 0           */
+} RND_AGGREGATE;
+
+/**
+ * Function type called by `rnd_btree_range` with each recno in the range,
+ * in order of field value.  Return 0 to stop the iteration.
+ */
+typedef bool (*rnd_range_view)(RND_RECNO recno, void *closure);
+
+/**
+ * Function type called by `rnd_relation_walk` with runs of a parent's
+ * children, in ascending recno order.  Return 0 to stop the walk.
+ */
+typedef bool (*rnd_relation_view)(const RND_RECNO *children, uint32_t count, void *closure);
+
+/**
+ * Function type called by `rnd_parallel_scan` with the liveness map and
+ * the first *nbits* records of a block, *rec_size* bytes apart, from
+ * several threads at once.  Return 0 to stop the scan.
+ */
+typedef bool (*rnd_records_view)(const uint64_t *map,
+                                 const char     *records,
+                                 uint32_t       nbits,
+                                 uint32_t       first_recno,
+                                 uint32_t       rec_size,
+                                 void           *closure);
+
+/** What a change reported by `rnd_changes_since` did to its record. */
+typedef enum {
+   RND_CHANGE_APPEND = 1,   /**< Added to the end of the table            */
+   RND_CHANGE_PUT,          /**< Replaced                                 */
+   RND_CHANGE_DELETE,       /**< Deleted                                  */
+   RND_CHANGE_FIELD         /**< Changed in part, see `rnd_update_field`  */
+} RND_CHANGE_OP;
+
+/**
+ * Function type called by `rnd_changes_since` with each change, oldest
+ * first, and the generation it was made in (see `rnd_backup_incremental`).
+ * Return 0 to stop.
+ */
+typedef bool (*rnd_change_view)(RND_RECNO recno, RND_CHANGE_OP op, uint64_t generation, void *closure);
+
+/** Public functions whose calls are counted in RND_STATS::calls. */
+typedef enum {
+   RND_CALL_OPEN,
+   RND_CALL_CLOSE,
+   RND_CALL_BULK_LOAD,
+   RND_CALL_PUT,
+   RND_CALL_GET,
+   RND_CALL_GET_REF,
+   RND_CALL_UPDATE_FIELD,
+   RND_CALL_CAS_FIELD,
+   RND_CALL_FETCH_ADD_FIELD,
+   RND_CALL_DELETE,
+   RND_CALL_COUNT,
+   RND_CALL_TXN_BEGIN,
+   RND_CALL_TXN_PUT,
+   RND_CALL_TXN_DELETE,
+   RND_CALL_TXN_COMMIT,
+   RND_CALL_TXN_ABORT,
+   RND_CALL_SNAPSHOT_OPEN,
+   RND_CALL_SNAPSHOT_GET,
+   RND_CALL_SNAPSHOT_CLOSE,
+   RND_CALL_CHANGES_ENABLE,
+   RND_CALL_CHANGES_SINCE,
+   RND_CALL_CHANGES_WAIT,
+   RND_CALL_BACKUP_INCREMENTAL,
+   RND_CALL_BACKUP_APPLY,
+   RND_CALL_COMPRESS_COLD_BLOCKS,
+   RND_CALL_RESERVE,
+   RND_CALL_INDEX_PUT,
+   RND_CALL_INDEX_GET,
+   RND_CALL_INDEX_DELETE,
+   RND_CALL_RELATION_ADD,
+   RND_CALL_RELATION_REMOVE,
+   RND_CALL_RELATION_WALK,
+   RND_CALL_RELATION_COUNT,
+   RND_CALL_SCAN_FILTER,
+   RND_CALL_AGGREGATE,
+   RND_CALL_BTREE_CREATE,
+   RND_CALL_BTREE_RANGE,
+   RND_CALL_PARALLEL_SCAN,
+   RND_CALL_LIMIT
+} RND_CALL;
+
+/**
+ * What the library has done, for a handle or for the whole process, as
+ * returned by `rnd_stats`.  Every member is a uint64_t.
+ */
+typedef struct recnodb_stats {
+   uint64_t calls[RND_CALL_LIMIT];  /**< Calls of each public function, by RND_CALL        */
+   uint64_t bytes_read;             /**< Bytes read from the file                          */
+   uint64_t bytes_written;          /**< Bytes written to the file                         */
+   uint64_t seeks;                  /**< fseek() calls made by blocks.c                    */
+   uint64_t reads;                  /**< fread() and pread() calls made by blocks.c        */
+   uint64_t writes;                 /**< fwrite() and pwrite() calls made by blocks.c      */
+   uint64_t chain_blocks_walked;    /**< Table blocks stepped past to find a record        */
+   uint64_t blocks_appended;        /**< Blocks added to the file                          */
+   uint64_t cache_hits;             /**< Compressed blocks found decompressed in the cache */
+   uint64_t cache_misses;           /**< Compressed blocks decompressed into the cache     */
+} RND_STATS;
+
+/** Operations timed by `rnd_latency_enable`. */
+typedef enum {
+   RND_LATENCY_GET,      /**< `rnd_get`                                */
+   RND_LATENCY_PUT,      /**< `rnd_put`                                */
+   RND_LATENCY_DELETE,   /**< `rnd_delete`                             */
+   RND_LATENCY_LOCK,     /**< Placing a lock, including any wait for it */
+   RND_LATENCY_EXTEND,   /**< Extending the file for a new block       */
+   RND_LATENCY_LIMIT
+} RND_LATENCY_OP;
+
+/** Latencies of an operation, in nanoseconds, as returned by `rnd_latency`. */
+typedef struct recnodb_latency {
+   uint64_t count;
+   uint64_t min;
+   uint64_t mean;
+   uint64_t p50;
+   uint64_t p90;
+   uint64_t p99;
+   uint64_t p999;
+   uint64_t max;
+} RND_LATENCY;
+
+/**
+ * Keeps the data of `rnd_get_ref` in place until passed to `rnd_release`.
+ */
+typedef struct recnodb_lease {
+   void     *holder;   /**< The mapping or cached image that holds the data */
+   uint32_t kind;      /**< What *holder* is, 0 for nothing                 */
+   char     pad[4];
+} RND_LEASE;
+
+/**
+ * Writes to several records made together or not at all, see `rnd_txn_begin`.
+ */
+typedef struct rnd_txn RND_TXN;
+
+/**
+ * A read view of the database as it was at one moment, see `rnd_snapshot_open`.
+ */
+typedef struct rnd_snapshot RND_SNAPSHOT;
+
+/**
+ * Function type called by `rnd_bulk_load` for more records.  Copy up to
+ * *room* records, one after another, into *records* and return the
+ * number copied, or 0 when there are no more.
+ */
+typedef uint32_t (*rnd_bulk_reader)(void *records, uint32_t room, void *closure);
+
 // Forward declaration of recnodb_handle member defined in blocks.h
 struct rnd_head_file;
 
+// Forward declaration of recnodb_handle members defined in cache.h, bufpool.h and mapping.h
+struct rnd_cache;
+struct rnd_bufpool;
+struct rnd_mapping;
+
+// Forward declaration of recnodb_handle member defined in snapshot.h
+struct rnd_snapshot_log;
+
+/** Blocks a handle keeps pinned against compression, see `compress_pin_block`. */
+#define RND_PINNED_BLOCKS 4
+
 struct recnodb_handle {
    FILE                  *file;
    // struct rnd_head_file  *fhead;
    int                   sys_errno;  // 32-bit integer
-   uint32_t              padding;    // 32-bit padding for alignment
+   uint32_t              io_align;   // RND_DIRECT transfer alignment, 0 for buffered I/O
    RND_HEAD_FILE         head_file;
+   struct rnd_cache      *cache;     // decompressed blocks, allocated on first use
+   struct rnd_bufpool    *bufpool;   // aligned buffers for RND_DIRECT I/O
+   struct rnd_mapping    *mapping;   // map of the file for rnd_get_ref and atomic field changes, made on first use
+   struct rnd_snapshot_log *snapshots; // copies this handle made for snapshots, made on first write
+   const RND_HEAD_FILE   *mapped_head; // the file head, mapped on first use by blocks_map_head
+   off_t                 pinned[RND_PINNED_BLOCKS]; // 1 + offsets of blocks pinned by compress_pin_block, 0 if free
+   bool                  positional; // read with pread(), for copies used by worker threads
+   bool                  readonly;   // opened RND_READONLY: reads come from the mapping, no locks
+   RND_STATS             *stats;     // counts for `rnd_stats`, NULL if they couldn't be allocated
 };
 
 
@@ -73,7 +301,92 @@ RND_ERROR rnd_close_raw(RNDH *handle);
 
 RND_ERROR rnd_put(RNDH *handle, RND_RECNO *recno, RND_DATA *data);
 RND_ERROR rnd_get(RNDH *handle, RND_RECNO recno, RND_DATA *data);
+RND_ERROR rnd_update_field(RNDH *handle, RND_RECNO recno, uint32_t offset, uint32_t len, const void *bytes);
+RND_ERROR rnd_cas_field(RNDH *handle,
+                        RND_RECNO recno,
+                        uint32_t offset,
+                        uint32_t width,
+                        uint64_t expected,
+                        uint64_t desired,
+                        uint64_t *found);
+RND_ERROR rnd_fetch_add_field(RNDH *handle,
+                              RND_RECNO recno,
+                              uint32_t offset,
+                              uint32_t width,
+                              uint64_t addend,
+                              uint64_t *previous);
 RND_ERROR rnd_delete(RNDH *handle, RND_RECNO recno);
+RND_ERROR rnd_get_ref(RNDH *handle, RND_RECNO recno, RND_DATA *data, RND_LEASE *lease);
+void rnd_release(RND_LEASE *lease);
+RND_ERROR rnd_count(RNDH *handle, RND_RECNO *count);
+
+RND_ERROR rnd_txn_begin(RNDH *handle, RND_TXN **txn);
+RND_ERROR rnd_txn_put(RND_TXN *txn, RND_RECNO recno, RND_DATA *data);
+RND_ERROR rnd_txn_delete(RND_TXN *txn, RND_RECNO recno);
+RND_ERROR rnd_txn_commit(RND_TXN *txn);
+void rnd_txn_abort(RND_TXN *txn);
+
+RND_ERROR rnd_snapshot_open(RNDH *handle, RND_SNAPSHOT **snapshot);
+RND_ERROR rnd_snapshot_get(RND_SNAPSHOT *snapshot, RND_RECNO recno, RND_DATA *data);
+void rnd_snapshot_close(RND_SNAPSHOT *snapshot);
+
+RND_ERROR rnd_bulk_load(const char *path,
+                        uint32_t rec_size,
+                        uint64_t count_hint,
+                        rnd_bulk_reader reader,
+                        void *closure,
+                        RND_RECNO *loaded);
+
+RND_ERROR rnd_stats(RNDH *handle, RND_STATS *stats);
+void rnd_latency_enable(bool enable);
+RND_ERROR rnd_latency(RND_LATENCY_OP op, RND_LATENCY *latency);
+void rnd_latency_print(FILE *out);
+
+RND_ERROR rnd_changes_enable(RNDH *handle);
+RND_ERROR rnd_changes_since(RNDH *handle, uint64_t *position, rnd_change_view viewer, void *closure);
+RND_ERROR rnd_changes_wait(RNDH *handle, uint64_t position, int timeout_ms, bool *arrived);
+
+RND_ERROR rnd_backup_incremental(RNDH *handle, uint64_t since, int out_fd, uint64_t *next);
+RND_ERROR rnd_backup_apply(const char *path, int in_fd);
+
+RND_ERROR rnd_compress_cold_blocks(RNDH *handle, uint32_t *blocks_compressed);
+RND_ERROR rnd_reserve(RNDH *handle, RND_RECNO records);
+
+RND_ERROR rnd_index_put(RNDH *handle, const RND_DATA *key, RND_RECNO recno);
+RND_ERROR rnd_index_get(RNDH *handle, const RND_DATA *key, RND_RECNO *recno);
+RND_ERROR rnd_index_delete(RNDH *handle, const RND_DATA *key);
+
+RND_ERROR rnd_relation_add(RNDH *handle, RND_RECNO parent, RND_RECNO child);
+RND_ERROR rnd_relation_remove(RNDH *handle, RND_RECNO parent, RND_RECNO child);
+RND_ERROR rnd_relation_walk(RNDH *handle, RND_RECNO parent, rnd_relation_view viewer, void *closure);
+RND_ERROR rnd_relation_count(RNDH *handle, RND_RECNO parent, RND_RECNO *count);
+
+RND_ERROR rnd_scan_filter(RNDH *handle,
+                          off_t table_head,
+                          const RND_FIELD *field,
+                          RND_SCAN_OP op,
+                          const void *value,
+                          RND_BITMAP *matches);
+
+RND_ERROR rnd_aggregate(RNDH *handle,
+                        off_t table_head,
+                        const RND_FIELD *field,
+                        uint32_t ops,
+                        RND_AGGREGATE *result);
+
+RND_ERROR rnd_btree_create(RNDH *handle, off_t table_head, const RND_FIELD *field, off_t *btree);
+RND_ERROR rnd_btree_range(RNDH *handle,
+                          off_t btree,
+                          const void *low,
+                          const void *high,
+                          rnd_range_view viewer,
+                          void *closure);
+
+RND_ERROR rnd_parallel_scan(RNDH *handle,
+                            off_t table_head,
+                            uint32_t nthreads,
+                            rnd_records_view viewer,
+                            void *closure);
 
 
 #endif
@@ -0,0 +1,744 @@
+/** @file
+ *
+ * Many-to-one relationships: each parent recno owns a list of child recnos.
+ *
+ * The relationships start at an RBT_RELATION head block whose offset is
+ * kept in the file head (INFO_FILE::relation_head).  The head also starts
+ * a table, managed by the `flatrecs` functions, whose record for each
+ * parent recno is the parent's REL_LIST.
+ *
+ * A child list is a chain of fixed-size segments, each holding a run of
+ * children in ascending order: the first child in full, then each
+ * following child as a varint delta from its predecessor.  Ascending
+ * recnos are also the physical order of the records, so reading the
+ * children in list order reads the table sequentially.  The segments come
+ * from spare blocks of RELATIONS_SPARE_SEGMENTS segments that are chained from
+ * INFO_RELATION::segment_chain, and emptied segments are kept in a free
+ * list for reuse.
+ *
+ * Every operation holds the lock on the relationship head; walks and
+ * counts hold it shared, so only changes make it busy for them.
+ */
+
+#include "relations.h"
+#include "extra.h"
+#include "locks.h"
+#include "chains.h"
+#include "flatrecs.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <string.h>
+
+#define RELATIONS_SEGMENT_SIZE  256
+#define RELATIONS_SPARE_SEGMENTS 16   /**< Segments per spare block, after the block header */
+
+/** The child list of one parent, the record of the parent in the relationship table. */
+typedef struct relations_list {
+   off_t    first;        /**< First segment of the list, 0 if no children */
+   off_t    last;         /**< Last segment of the list                    */
+   uint32_t count;        /**< Number of children                          */
+   uint32_t last_child;   /**< Largest child recno, for O(1) appends       */
+} REL_LIST;
+
+/** Header at the top of every segment, followed by *used* bytes of deltas. */
+typedef struct relations_segment {
+   off_t    next;         /**< Next segment of the list, or of the free list, 0 if last */
+   uint32_t base;         /**< First child in the segment                               */
+   uint16_t count;        /**< Number of children in the segment, including *base*      */
+   uint16_t used;         /**< Bytes of deltas following the header                     */
+} REL_SEG;
+
+#define RELATIONS_DELTA_BYTES (RELATIONS_SEGMENT_SIZE - sizeof(REL_SEG))
+
+/** Most children a segment can hold, with every delta a single byte. */
+#define RELATIONS_MAX_RUN (RELATIONS_DELTA_BYTES + 1)
+
+typedef enum {
+   RLA_ADD,
+   RLA_REMOVE,
+   RLA_WALK,
+   RLA_COUNT
+} REL_ACTION;
+
+typedef struct relations_closure {
+   relations_view viewer;
+   void           *caller_closure;
+   uint32_t       parent;
+   uint32_t       child;
+   uint32_t       count;      /**< [out] number of children for RLA_COUNT */
+   REL_ACTION     action;
+   RND_ERROR      rval;
+   char           pad[4];
+} REL_CLO;
+
+/**
+ * Writes *value* as a varint, returning its length.
+ */
+static uint32_t relations_put_varint(unsigned char *ptr, uint32_t value)
+{
+   uint32_t len = 0;
+
+   while (value >= 0x80)
+   {
+      ptr[len++] = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+
+   ptr[len++] = (unsigned char)value;
+   return len;
+}
+
+/**
+ * Decodes the children of a segment image.
+ *
+ * @return number of children, or 0 if the segment is corrupt.
+ */
+static uint32_t relations_decode(const char *image, uint32_t *children)
+{
+   const REL_SEG *seg = (const REL_SEG*)image;
+   const unsigned char *ptr = (const unsigned char*)image + sizeof(REL_SEG);
+   const unsigned char *end = ptr + seg->used;
+   uint32_t count = 0;
+
+   if (seg->count == 0 || seg->used > RELATIONS_DELTA_BYTES)
+      return 0;
+
+   children[count++] = seg->base;
+
+   while (ptr < end && count < seg->count)
+   {
+      uint32_t delta = 0;
+      int shift = 0;
+
+      do
+      {
+         if (ptr >= end || shift > 28)
+            return 0;
+         delta |= (uint32_t)(*ptr & 0x7f) << shift;
+         shift += 7;
+      }
+      while (*ptr++ & 0x80);
+
+      children[count] = children[count - 1] + delta;
+      ++count;
+   }
+
+   return count == seg->count ? count : 0;
+}
+
+/**
+ * Encodes as many of *children* as fit into a segment image, keeping the
+ * image's *next* link.
+ *
+ * @return number of children encoded.
+ */
+static uint32_t relations_encode(const uint32_t *children, uint32_t count, char *image)
+{
+   REL_SEG *seg = (REL_SEG*)image;
+   unsigned char *deltas = (unsigned char*)image + sizeof(REL_SEG);
+   unsigned char varint[5];
+   uint32_t encoded = 1, used = 0;
+
+   memset(deltas, 0, RELATIONS_DELTA_BYTES);
+   seg->base = children[0];
+
+   for (; encoded < count; ++encoded)
+   {
+      uint32_t len = relations_put_varint(varint, children[encoded] - children[encoded - 1]);
+      if (used + len > RELATIONS_DELTA_BYTES)
+         break;
+
+      memcpy(deltas + used, varint, len);
+      used += len;
+   }
+
+   seg->count = encoded;
+   seg->used = used;
+
+   return encoded;
+}
+
+/**
+ * Rounds *bytes* up to a whole number of chunks.
+ */
+static uint32_t relations_round_to_chunks(uint32_t chunk_size, uint32_t bytes)
+{
+   return (bytes + chunk_size - 1) / chunk_size * chunk_size;
+}
+
+static RND_ERROR relations_read_segment(RNDH *handle, off_t offset, char *image)
+{
+   return blocks_read_at(handle, offset, image, RELATIONS_SEGMENT_SIZE);
+}
+
+static RND_ERROR relations_write_segment(RNDH *handle, off_t offset, const char *image)
+{
+   return blocks_write_at(handle, offset, image, RELATIONS_SEGMENT_SIZE);
+}
+
+/**
+ * Gets an unused segment, from the free list if possible.
+ */
+static RND_ERROR relations_alloc_segment(RNDH *handle, RND_HEAD_RELATION *hr, off_t *offset)
+{
+   INFO_RELATION *ir = &hr->rhead;
+   RND_ERROR rval;
+
+   if (ir->free_segments)
+   {
+      REL_SEG seg;
+      if ((rval = blocks_read_at(handle, ir->free_segments, &seg, sizeof(seg))))
+         return rval;
+
+      *offset = ir->free_segments;
+      ir->free_segments = seg.next;
+      return RND_SUCCESS;
+   }
+
+   if (ir->spare_next + ir->segment_size > ir->spare_end)
+   {
+      RND_BLOCK_DEF bdef = { RBT_DATA,
+                             relations_round_to_chunks(handle->head_file.fhead.chunk_size,
+                                                       ir->segment_size * (RELATIONS_SPARE_SEGMENTS + 1)) };
+
+      if ((rval = blocks_append_block(handle, &bdef)))
+         return rval;
+
+      if (ir->segment_last)
+      {
+         if ((rval = chains_add_link(handle, ir->segment_last, &bdef.new_block)))
+            return rval;
+      }
+      else
+         ir->segment_chain = bdef.new_block.offset;
+
+      ir->segment_last = bdef.new_block.offset;
+
+      // The first segment's worth of the block holds the block header:
+      ir->spare_next = bdef.new_block.offset + ir->segment_size;
+      ir->spare_end = bdef.new_block.offset + bdef.new_block.size;
+   }
+
+   *offset = ir->spare_next;
+   ir->spare_next += ir->segment_size;
+   return RND_SUCCESS;
+}
+
+/**
+ * Returns a segment to the free list.
+ */
+static RND_ERROR relations_free_segment(RNDH *handle, RND_HEAD_RELATION *hr, off_t offset)
+{
+   REL_SEG seg = { hr->rhead.free_segments, 0, 0, 0 };
+   RND_ERROR rval = blocks_write_at(handle, offset, &seg, sizeof(seg));
+
+   if (!rval)
+      hr->rhead.free_segments = offset;
+
+   return rval;
+}
+
+/**
+ * Finds the segment of a list in which *child* is, or belongs.
+ *
+ * @param image        [out] image of the segment
+ * @param offset       [out] offset to the segment
+ * @param prev_offset  [out] offset to the preceding segment, 0 if first
+ */
+static RND_ERROR relations_find_segment(RNDH *handle,
+                                        const REL_LIST *list,
+                                        uint32_t child,
+                                        char *image,
+                                        off_t *offset,
+                                        off_t *prev_offset)
+{
+   char next_image[RELATIONS_SEGMENT_SIZE];
+   RND_ERROR rval;
+
+   *prev_offset = 0;
+   *offset = list->first;
+
+   if ((rval = relations_read_segment(handle, *offset, image)))
+      return rval;
+
+   while (((REL_SEG*)image)->next)
+   {
+      off_t next = ((REL_SEG*)image)->next;
+
+      if ((rval = relations_read_segment(handle, next, next_image)))
+         return rval;
+
+      if (((REL_SEG*)next_image)->base > child)
+         break;
+
+      *prev_offset = *offset;
+      *offset = next;
+      memcpy(image, next_image, RELATIONS_SEGMENT_SIZE);
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Adds a child to a list, keeping the children in ascending order.
+ *
+ * @param changed  [out] FALSE if the child was already in the list
+ */
+static RND_ERROR relations_insert(RNDH *handle, RND_HEAD_RELATION *hr, REL_LIST *list, uint32_t child, bool *changed)
+{
+   char image[RELATIONS_SEGMENT_SIZE];
+   uint32_t children[RELATIONS_MAX_RUN + 1];
+   off_t offset, prev_offset;
+   RND_ERROR rval;
+
+   *changed = 0;
+
+   if (list->count == 0)
+   {
+      // First child, start the list:
+      if ((rval = relations_alloc_segment(handle, hr, &offset)))
+         return rval;
+
+      memset(image, 0, sizeof(image));
+      relations_encode(&child, 1, image);
+
+      if ((rval = relations_write_segment(handle, offset, image)))
+         return rval;
+
+      list->first = list->last = offset;
+      list->last_child = child;
+   }
+   else if (child > list->last_child)
+   {
+      // Append to the last segment, or link a new one:
+      if ((rval = relations_read_segment(handle, list->last, image)))
+         return rval;
+
+      REL_SEG *seg = (REL_SEG*)image;
+      unsigned char varint[5];
+      uint32_t len = relations_put_varint(varint, child - list->last_child);
+
+      if (seg->used + len <= RELATIONS_DELTA_BYTES)
+      {
+         memcpy(image + sizeof(REL_SEG) + seg->used, varint, len);
+         seg->used += len;
+         ++seg->count;
+
+         if ((rval = relations_write_segment(handle, list->last, image)))
+            return rval;
+      }
+      else
+      {
+         char new_image[RELATIONS_SEGMENT_SIZE];
+
+         if ((rval = relations_alloc_segment(handle, hr, &offset)))
+            return rval;
+
+         memset(new_image, 0, sizeof(new_image));
+         relations_encode(&child, 1, new_image);
+         seg->next = offset;
+
+         // Write the new segment before the link to it:
+         if ((rval = relations_write_segment(handle, offset, new_image))
+             || (rval = relations_write_segment(handle, list->last, image)))
+            return rval;
+
+         list->last = offset;
+      }
+
+      list->last_child = child;
+   }
+   else
+   {
+      // Insert in order, splitting the segment if it overflows:
+      if ((rval = relations_find_segment(handle, list, child, image, &offset, &prev_offset)))
+         return rval;
+
+      uint32_t count = relations_decode(image, children);
+      uint32_t pos = 0;
+
+      if (count == 0)
+         return RND_INVALID_RECNODB_FILE;
+
+      while (pos < count && children[pos] < child)
+         ++pos;
+
+      if (pos < count && children[pos] == child)
+         return RND_SUCCESS;
+
+      memmove(&children[pos + 1], &children[pos], (count - pos) * sizeof(uint32_t));
+      children[pos] = child;
+      ++count;
+
+      uint32_t encoded = relations_encode(children, count, image);
+      if (encoded < count)
+      {
+         // Keep the first half here, and move the rest to new segments:
+         encoded = relations_encode(children, count / 2, image);
+
+         off_t following = ((REL_SEG*)image)->next;
+         off_t current = offset;
+         char *current_image = image;
+         char new_image[RELATIONS_SEGMENT_SIZE];
+
+         while (encoded < count)
+         {
+            off_t new_offset;
+            if ((rval = relations_alloc_segment(handle, hr, &new_offset)))
+               return rval;
+
+            ((REL_SEG*)current_image)->next = new_offset;
+            if ((rval = relations_write_segment(handle, current, current_image)))
+               return rval;
+
+            memset(new_image, 0, sizeof(new_image));
+            ((REL_SEG*)new_image)->next = following;
+            encoded += relations_encode(&children[encoded], count - encoded, new_image);
+
+            current = new_offset;
+            current_image = new_image;
+         }
+
+         if ((rval = relations_write_segment(handle, current, current_image)))
+            return rval;
+
+         if (list->last == offset)
+            list->last = current;
+      }
+      else if ((rval = relations_write_segment(handle, offset, image)))
+         return rval;
+   }
+
+   ++list->count;
+   ++hr->rhead.children;
+   *changed = 1;
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Removes a child from a list, releasing its segment if it empties.
+ */
+static RND_ERROR relations_erase(RNDH *handle, RND_HEAD_RELATION *hr, REL_LIST *list, uint32_t child)
+{
+   char image[RELATIONS_SEGMENT_SIZE];
+   uint32_t children[RELATIONS_MAX_RUN];
+   off_t offset, prev_offset;
+   RND_ERROR rval;
+
+   if (list->count == 0 || child > list->last_child)
+      return RND_EXTINCT_RECORD;
+
+   if ((rval = relations_find_segment(handle, list, child, image, &offset, &prev_offset)))
+      return rval;
+
+   uint32_t count = relations_decode(image, children);
+   uint32_t pos = 0;
+
+   if (count == 0)
+      return RND_INVALID_RECNODB_FILE;
+
+   while (pos < count && children[pos] < child)
+      ++pos;
+
+   if (pos == count || children[pos] != child)
+      return RND_EXTINCT_RECORD;
+
+   memmove(&children[pos], &children[pos + 1], (count - pos - 1) * sizeof(uint32_t));
+   --count;
+
+   if (count)
+   {
+      // Removing a child never lengthens the deltas, so the rest still fits:
+      relations_encode(children, count, image);
+      if ((rval = relations_write_segment(handle, offset, image)))
+         return rval;
+   }
+   else
+   {
+      off_t next = ((REL_SEG*)image)->next;
+
+      // Unlink the empty segment:
+      if (prev_offset)
+      {
+         char prev_image[RELATIONS_SEGMENT_SIZE];
+         if ((rval = relations_read_segment(handle, prev_offset, prev_image)))
+            return rval;
+
+         ((REL_SEG*)prev_image)->next = next;
+         if ((rval = relations_write_segment(handle, prev_offset, prev_image)))
+            return rval;
+      }
+      else
+         list->first = next;
+
+      if (list->last == offset)
+         list->last = prev_offset;
+
+      if ((rval = relations_free_segment(handle, hr, offset)))
+         return rval;
+   }
+
+   --list->count;
+   --hr->rhead.children;
+
+   // Find the new largest child if it was removed:
+   if (list->count == 0)
+      list->first = list->last = list->last_child = 0;
+   else if (child == list->last_child)
+   {
+      if ((rval = relations_read_segment(handle, list->last, image)))
+         return rval;
+
+      count = relations_decode(image, children);
+      if (count == 0)
+         return RND_INVALID_RECNODB_FILE;
+
+      list->last_child = children[count - 1];
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Sends the children of a list to the viewer, one segment at a time.
+ */
+static RND_ERROR relations_send(RNDH *handle, const REL_LIST *list, REL_CLO *clo)
+{
+   char image[RELATIONS_SEGMENT_SIZE];
+   uint32_t children[RELATIONS_MAX_RUN];
+   off_t offset = list->count ? list->first : 0;
+   RND_ERROR rval;
+
+   while (offset)
+   {
+      if ((rval = relations_read_segment(handle, offset, image)))
+         return rval;
+
+      uint32_t count = relations_decode(image, children);
+      if (count == 0)
+         return RND_INVALID_RECNODB_FILE;
+
+      if (!(*clo->viewer)(children, count, clo->caller_closure))
+         break;
+
+      offset = ((REL_SEG*)image)->next;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the relationship head locked.
+ */
+bool relations_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   REL_CLO *clo = (REL_CLO*)closure;
+   RND_HEAD_RELATION *hr = (RND_HEAD_RELATION*)locked_buffer;
+   RND_HEAD_RELATION original;
+   memcpy(&original, hr, sizeof(original));
+
+   REL_LIST list;
+   off_t list_offset = 0;
+   bool changed = 0;
+
+   memset(&list, 0, sizeof(list));
+
+   // Only an addition makes a record for a parent that doesn't have one:
+   if (clo->parent <= hr->thead.last_recno || clo->action == RLA_ADD)
+   {
+      if ((clo->rval = flatrecs_make_offset_to_recno(handle,
+                                                     bloc,
+                                                     (RND_HEAD_TABLE*)hr,
+                                                     clo->parent,
+                                                     &list_offset))
+          || (clo->rval = blocks_read_at(handle, list_offset, &list, sizeof(list))))
+         goto abandon_function;
+
+      if (clo->parent > hr->thead.last_recno)
+         hr->thead.last_recno = clo->parent;
+   }
+
+   switch(clo->action)
+   {
+      case RLA_ADD:
+         clo->rval = relations_insert(handle, hr, &list, clo->child, &changed);
+         break;
+
+      case RLA_REMOVE:
+         clo->rval = relations_erase(handle, hr, &list, clo->child);
+         changed = !clo->rval;
+         break;
+
+      case RLA_WALK:
+         clo->rval = relations_send(handle, &list, clo);
+         break;
+
+      case RLA_COUNT:
+         clo->count = list.count;
+         break;
+   }
+
+   if (changed && !clo->rval)
+      clo->rval = blocks_write_at(handle, list_offset, &list, sizeof(list));
+
+  abandon_function:
+   return memcmp(&original, hr, sizeof(original)) != 0;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the file head's INFO_FILE
+ * locked, that creates the relationships unless another process just did.
+ */
+bool relations_create_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   RND_ERROR *rval = (RND_ERROR*)closure;
+   INFO_FILE *fhead = (INFO_FILE*)locked_buffer;
+
+   if (fhead->relation_head)
+      return 0;
+
+   RND_BLOCK_DEF bdef = { RBT_RELATION,
+                          relations_round_to_chunks(fhead->chunk_size, sizeof(RND_HEAD_RELATION)),
+                          sizeof(REL_LIST) };
+   if ((*rval = blocks_append_block(handle, &bdef)))
+      return 0;
+
+   INFO_RELATION ir;
+   memset(&ir, 0, sizeof(ir));
+   ir.segment_size = RELATIONS_SEGMENT_SIZE;
+
+   if ((*rval = blocks_write_at(handle,
+                                bdef.new_block.offset + offsetof(RND_HEAD_RELATION, rhead),
+                                &ir,
+                                sizeof(ir))))
+      return 0;
+
+   fhead->relation_head = bdef.new_block.offset;
+   return 1;
+}
+
+/**
+ * Gets the offset to the relationship head, creating it if requested.
+ *
+ * @return RND_EXTINCT_RECORD if the file has no relationships and
+ *         *create* is FALSE.
+ */
+static RND_ERROR relations_get_head(RNDH *handle, bool create, off_t *head)
+{
+   off_t fhead_offset = offsetof(RND_HEAD_FILE, fhead);
+   RND_ERROR rval = RND_SUCCESS;
+   INFO_FILE fhead;
+
+   // The head never moves, so a known head can be used without reading:
+   if (!handle->head_file.fhead.relation_head)
+   {
+      // Another process may have created the head since the file was opened:
+      if ((rval = blocks_read_at(handle, fhead_offset, &fhead, sizeof(fhead))))
+         return rval;
+
+      if (!fhead.relation_head && create)
+      {
+         BLOCK_LOC bl = { fhead_offset, sizeof(INFO_FILE) };
+         RND_ERROR create_rval = RND_SUCCESS;
+
+         if ((rval = rnd_lock_area(handle, &bl, 1, relations_create_lock_callback, &create_rval))
+             || (rval = create_rval)
+             || (rval = blocks_read_at(handle, fhead_offset, &fhead, sizeof(fhead))))
+            return rval;
+      }
+
+      if (!fhead.relation_head)
+         return RND_EXTINCT_RECORD;
+
+      handle->head_file.fhead.relation_head = fhead.relation_head;
+   }
+
+   *head = handle->head_file.fhead.relation_head;
+   return RND_SUCCESS;
+}
+
+/**
+ * Runs a relationship operation with the relationship head locked.
+ */
+static RND_ERROR relations_run(RNDH *handle, REL_CLO *clo)
+{
+   prime_handle(handle);
+
+   RND_ERROR rval;
+   off_t head;
+
+   if (clo->parent == 0 || (clo->action <= RLA_REMOVE && clo->child == 0))
+      return RND_BAD_PARAMETER;
+
+   if ((rval = relations_get_head(handle, clo->action == RLA_ADD, &head)))
+   {
+      // A file without relationships has no children to walk or count:
+      if (rval == RND_EXTINCT_RECORD && clo->action >= RLA_WALK)
+         rval = RND_SUCCESS;
+
+      return rval;
+   }
+
+   // Walks and counts share the head, so they run alongside each other:
+   BLOCK_LOC bl = { head, sizeof(RND_HEAD_RELATION) };
+   if ((rval = clo->action >= RLA_WALK
+        ? rnd_lock_area_shared(handle, &bl, 1, relations_lock_callback, clo)
+        : rnd_lock_area(handle, &bl, 1, relations_lock_callback, clo)))
+      return rval;
+
+   return clo->rval;
+}
+
+/**
+ * Makes *child* a child of *parent*.  Adding an existing child does nothing.
+ *
+ * Appending children in ascending order is the fast case: the child is
+ * added to the end of the parent's last segment without reading the
+ * rest of the list.
+ */
+RND_ERROR relations_add(RNDH *handle, uint32_t parent, uint32_t child)
+{
+   REL_CLO clo = { NULL, NULL, parent, child, 0, RLA_ADD };
+   return relations_run(handle, &clo);
+}
+
+/**
+ * Removes *child* from the children of *parent*.
+ *
+ * @return RND_EXTINCT_RECORD if *child* isn't a child of *parent*.
+ */
+RND_ERROR relations_remove(RNDH *handle, uint32_t parent, uint32_t child)
+{
+   REL_CLO clo = { NULL, NULL, parent, child, 0, RLA_REMOVE };
+   return relations_run(handle, &clo);
+}
+
+/**
+ * Sends the children of *parent* to *viewer* in ascending recno order,
+ * which is the physical order of the child records.  Each call to the
+ * viewer delivers the children of one segment, read with a single read.
+ *
+ * @param handle   handle to an open recno database
+ * @param parent   recno of the parent
+ * @param viewer   function to receive runs of children
+ * @param closure  optional pointer passed to *viewer*
+ */
+RND_ERROR relations_walk(RNDH *handle, uint32_t parent, relations_view viewer, void *closure)
+{
+   REL_CLO clo = { viewer, closure, parent, 0, 0, RLA_WALK };
+   return relations_run(handle, &clo);
+}
+
+/**
+ * Gets the number of children of *parent*.
+ */
+RND_ERROR relations_count(RNDH *handle, uint32_t parent, uint32_t *count)
+{
+   REL_CLO clo = { NULL, NULL, parent, 0, 0, RLA_COUNT };
+   RND_ERROR rval = relations_run(handle, &clo);
+
+   *count = rval ? 0 : clo.count;
+   return rval;
+}
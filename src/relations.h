@@ -0,0 +1,14 @@
+#ifndef RECNODB_RELATIONS_H
+#define RECNODB_RELATIONS_H
+
+#include "recnodb.h"
+
+/** Function type called by `relations_walk`, see `rnd_relation_view`. */
+typedef rnd_relation_view relations_view;
+
+RND_ERROR relations_add(RNDH *handle, uint32_t parent, uint32_t child);
+RND_ERROR relations_remove(RNDH *handle, uint32_t parent, uint32_t child);
+RND_ERROR relations_walk(RNDH *handle, uint32_t parent, relations_view viewer, void *closure);
+RND_ERROR relations_count(RNDH *handle, uint32_t parent, uint32_t *count);
+
+#endif
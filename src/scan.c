@@ -0,0 +1,896 @@
+/** @file
+ *
+ * Predicate scans over a fixed-offset field of the records of a table.
+ *
+ * Every comparison is reduced to a closed range of order-preserving
+ * keys (see `scan_key`), possibly inverted, so a single kernel per field
+ * width tests a block's records against any predicate: a record matches
+ * if its key less the range's low key is, unsigned, no more than the
+ * range's span.  The kernels test up to 64 records per call and return
+ * a word of match bits that is combined with the block's liveness map,
+ * so deleted records never match.
+ *
+ * The fields of consecutive records are *rec_size* bytes apart, so the
+ * AVX2 kernels gather eight 4-byte or four 8-byte fields per instruction;
+ * the portable kernel handles every width, and the tails of blocks.
+ *
+ * Aggregates (`scan_aggregate`) read the same blocks and reduce each to
+ * a partial count, sum and least and greatest key, with kernels of the
+ * same shape, and can keep the partials in the handle's cache.
+ */
+
+#include "scan.h"
+#include "extra.h"
+#include "flatrecs.h"
+#include "bitmap.h"
+#include "cache.h"
+
+#include <errno.h>
+#include <stdlib.h>   // for calloc()
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/** A predicate reduced to a range of keys. */
+typedef struct scan_predicate {
+   uint64_t        low;       /**< Lowest matching key                            */
+   uint64_t        span;      /**< Highest matching key less *low*                */
+   uint32_t        width;
+   RND_FIELD_TYPE  type;
+   bool            invert;    /**< Match the keys outside of the range (RND_OP_NE) */
+   bool            empty;     /**< No key can match, as with x < 0 for unsigned x  */
+} SCAN_PRED;
+
+typedef uint64_t (*scan_kernel)(const char *field, uint32_t stride, uint32_t count, const SCAN_PRED *pred);
+
+/**
+ * Converts a field value to a key of its own width whose unsigned order
+ * is the order of the values.  Floating-point zeros of either sign have
+ * the key of 0.0, and NaNs sort beyond the infinities of their sign.
+ */
+static uint64_t scan_key(RND_FIELD_TYPE type, uint32_t width, const void *field)
+{
+   uint64_t bits = 0, sign = (uint64_t)1 << (width * 8 - 1);
+   uint64_t all = width == 8 ? ~(uint64_t)0 : ((uint64_t)1 << (width * 8)) - 1;
+
+   switch(width)
+   {
+      case 1: { uint8_t v;  memcpy(&v, field, 1); bits = v; break; }
+      case 2: { uint16_t v; memcpy(&v, field, 2); bits = v; break; }
+      case 4: { uint32_t v; memcpy(&v, field, 4); bits = v; break; }
+      default: memcpy(&bits, field, 8); break;
+   }
+
+   switch(type)
+   {
+      case RND_FIELD_INT:
+         return bits ^ sign;
+
+      case RND_FIELD_FLOAT:
+         if ((bits & ~sign) == 0)
+            bits = 0;
+         return bits ^ ((bits & sign) ? all : sign);
+
+      default:
+         return bits;
+   }
+}
+
+/**
+ * Whether *field* is a field that can be found in records of *rec_size*
+ * bytes, with a width that suits its type.
+ */
+bool scan_field_is_valid(const RND_FIELD *field, uint32_t rec_size)
+{
+   bool valid_width = field->width == 4 || field->width == 8
+      || (field->type != RND_FIELD_FLOAT && (field->width == 1 || field->width == 2));
+
+   return field->type <= RND_FIELD_FLOAT
+      && valid_width
+      && field->offset + field->width <= rec_size;
+}
+
+/**
+ * Reduces a comparison to a range of keys.
+ */
+static RND_ERROR scan_make_predicate(const RND_FIELD *field, RND_SCAN_OP op, const void *value, SCAN_PRED *pred)
+{
+   uint32_t width = field->width;
+   uint64_t max = width == 8 ? ~(uint64_t)0 : ((uint64_t)1 << (width * 8)) - 1;
+   uint64_t key = scan_key(field->type, width, value);
+   uint64_t high = max;
+
+   memset(pred, 0, sizeof(*pred));
+   pred->width = width;
+   pred->type = field->type;
+
+   switch(op)
+   {
+      case RND_OP_NE:
+         pred->invert = 1;
+         // Fall through
+      case RND_OP_EQ:
+         pred->low = high = key;
+         break;
+
+      case RND_OP_LT:
+         pred->empty = key == 0;
+         high = key - 1;
+         break;
+
+      case RND_OP_LE:
+         high = key;
+         break;
+
+      case RND_OP_GT:
+         pred->empty = key == max;
+         pred->low = key + 1;
+         break;
+
+      case RND_OP_GE:
+         pred->low = key;
+         break;
+
+      case RND_OP_BETWEEN:
+         pred->low = key;
+         high = scan_key(field->type, width, (const char*)value + width);
+         pred->empty = high < key;
+         break;
+
+      default:
+         return RND_BAD_PARAMETER;
+   }
+
+   pred->span = high - pred->low;
+   return RND_SUCCESS;
+}
+
+/*************************
+ * Kernel implementations
+ ************************/
+
+static uint64_t scan_kernel_portable(const char *field, uint32_t stride, uint32_t count, const SCAN_PRED *pred)
+{
+   uint64_t bits = 0;
+   uint32_t i;
+
+   for (i = 0; i < count; ++i, field += stride)
+   {
+      if (scan_key(pred->type, pred->width, field) - pred->low <= pred->span)
+         bits |= (uint64_t)1 << i;
+   }
+
+   return bits;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * Tests eight 4-byte fields per iteration.  AVX2 has no unsigned
+ * compare, so both sides of the range test are offset by the sign bit
+ * for a signed compare.
+ */
+__attribute__((target("avx2")))
+static uint64_t scan_kernel4_avx2(const char *field, uint32_t stride, uint32_t count, const SCAN_PRED *pred)
+{
+   const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32((int)stride));
+   const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+   const __m256i magnitude = _mm256_set1_epi32(INT32_MAX);
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i low = _mm256_set1_epi32((int)(uint32_t)pred->low);
+   const __m256i span = _mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)pred->span), sign);
+   uint64_t bits = 0;
+   uint32_t i = 0;
+
+   for (; i + 8 <= count; i += 8, field += (size_t)stride * 8)
+   {
+      __m256i key = _mm256_i32gather_epi32((const int*)field, index, 1);
+
+      if (pred->type == RND_FIELD_INT)
+         key = _mm256_xor_si256(key, sign);
+      else if (pred->type == RND_FIELD_FLOAT)
+      {
+         __m256i is_zero = _mm256_cmpeq_epi32(_mm256_and_si256(key, magnitude), zero);
+         key = _mm256_andnot_si256(is_zero, key);
+         key = _mm256_xor_si256(key, _mm256_or_si256(_mm256_srai_epi32(key, 31), sign));
+      }
+
+      __m256i offset = _mm256_xor_si256(_mm256_sub_epi32(key, low), sign);
+      __m256i outside = _mm256_cmpgt_epi32(offset, span);
+      uint32_t inside = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xff;
+
+      bits |= (uint64_t)inside << i;
+   }
+
+   if (i < count)
+      bits |= scan_kernel_portable(field, stride, count - i, pred) << i;
+
+   return bits;
+}
+
+/**
+ * Tests four 8-byte fields per iteration.
+ */
+__attribute__((target("avx2")))
+static uint64_t scan_kernel8_avx2(const char *field, uint32_t stride, uint32_t count, const SCAN_PRED *pred)
+{
+   const __m128i index = _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32((int)stride));
+   const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+   const __m256i magnitude = _mm256_set1_epi64x(INT64_MAX);
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i low = _mm256_set1_epi64x((long long)pred->low);
+   const __m256i span = _mm256_xor_si256(_mm256_set1_epi64x((long long)pred->span), sign);
+   uint64_t bits = 0;
+   uint32_t i = 0;
+
+   for (; i + 4 <= count; i += 4, field += (size_t)stride * 4)
+   {
+      __m256i key = _mm256_i32gather_epi64((const long long*)field, index, 1);
+
+      if (pred->type == RND_FIELD_INT)
+         key = _mm256_xor_si256(key, sign);
+      else if (pred->type == RND_FIELD_FLOAT)
+      {
+         __m256i is_zero = _mm256_cmpeq_epi64(_mm256_and_si256(key, magnitude), zero);
+         key = _mm256_andnot_si256(is_zero, key);
+         key = _mm256_xor_si256(key, _mm256_or_si256(_mm256_cmpgt_epi64(zero, key), sign));
+      }
+
+      __m256i offset = _mm256_xor_si256(_mm256_sub_epi64(key, low), sign);
+      __m256i outside = _mm256_cmpgt_epi64(offset, span);
+      uint32_t inside = ~(uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf;
+
+      bits |= (uint64_t)inside << i;
+   }
+
+   if (i < count)
+      bits |= scan_kernel_portable(field, stride, count - i, pred) << i;
+
+   return bits;
+}
+
+#endif  // SCAN_X86
+
+static scan_kernel scan_kernel4_impl = NULL;
+static scan_kernel scan_kernel8_impl = NULL;
+
+/**
+ * Chooses the kernels for the running CPU.  Racing threads all arrive
+ * at the same choice, so no synchronization is needed.
+ */
+static void scan_select_impl(void)
+{
+   scan_kernel kernel4 = scan_kernel_portable;
+   scan_kernel kernel8 = scan_kernel_portable;
+
+#ifdef SCAN_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+   {
+      kernel4 = scan_kernel4_avx2;
+      kernel8 = scan_kernel8_avx2;
+   }
+#endif
+
+   scan_kernel8_impl = kernel8;
+   scan_kernel4_impl = kernel4;
+}
+
+static scan_kernel scan_kernel_for(uint32_t width)
+{
+   if (!scan_kernel4_impl)
+      scan_select_impl();
+
+   return width == 4 ? scan_kernel4_impl
+      : width == 8 ? scan_kernel8_impl
+      : scan_kernel_portable;
+}
+
+typedef struct scan_filter_closure {
+   const SCAN_PRED *pred;
+   scan_kernel     kernel;
+   RND_BITMAP      *matches;
+   uint32_t        offset;
+   char            pad[4];
+} SCAN_CLO;
+
+/**
+ * `flatrecs_walk_records` viewer that adds a block's matching live
+ * records to the result.
+ */
+bool scan_filter_viewer(const uint64_t *map,
+                        const char *records,
+                        uint32_t nbits,
+                        uint32_t first_recno,
+                        uint32_t rec_size,
+                        void *closure)
+{
+   SCAN_CLO *clo = (SCAN_CLO*)closure;
+   uint64_t *words = clo->matches->words;
+   uint32_t done;
+
+   // Ignore records appended since the result was sized:
+   if (first_recno >= clo->matches->nbits)
+      return 0;
+   if (nbits > clo->matches->nbits - first_recno)
+      nbits = clo->matches->nbits - first_recno;
+
+   for (done = 0; done < nbits; done += BITMAP_WORD_BITS)
+   {
+      uint32_t count = nbits - done < BITMAP_WORD_BITS ? nbits - done : BITMAP_WORD_BITS;
+      uint64_t valid = count < BITMAP_WORD_BITS ? ((uint64_t)1 << count) - 1 : ~(uint64_t)0;
+
+      uint64_t bits = (*clo->kernel)(records + (size_t)done * rec_size + clo->offset, rec_size, count, clo->pred);
+      if (clo->pred->invert)
+         bits = ~bits;
+
+      bits &= map[done / BITMAP_WORD_BITS] & valid;
+
+      // Blocks needn't start on a word boundary of the result:
+      uint32_t bit = first_recno + done;
+      uint32_t shift = bit % BITMAP_WORD_BITS;
+
+      words[bit / BITMAP_WORD_BITS] |= bits << shift;
+      if (shift)
+         words[bit / BITMAP_WORD_BITS + 1] |= bits >> (BITMAP_WORD_BITS - shift);
+   }
+
+   return 1;
+}
+
+/**
+ * Finds the live records of a table whose field satisfies a comparison.
+ *
+ * The table is read a block at a time, and each block's fields are
+ * compared with the vector kernel for the field's width.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table, 0 for the file's table
+ * @param field       the field to compare
+ * @param op          the comparison
+ * @param value       value to compare with, in the field's type and width, or two
+ *                    consecutive values, low then high, for RND_OP_BETWEEN
+ * @param matches     [out] set of matching recnos, whose *words* the caller frees
+ */
+RND_ERROR scan_filter(RNDH *handle,
+                      off_t table_head,
+                      const RND_FIELD *field,
+                      RND_SCAN_OP op,
+                      const void *value,
+                      RND_BITMAP *matches)
+{
+   prime_handle(handle);
+
+   RND_HEAD_TABLE htable;
+   SCAN_PRED pred;
+   RND_ERROR rval;
+
+   memset(matches, 0, sizeof(*matches));
+
+   if ((rval = blocks_read_at(handle, table_head, &htable, sizeof(htable))))
+      return rval;
+
+   if ((htable.bhead.block_type != RBT_TABLE && htable.bhead.block_type != RBT_FILE)
+       || !scan_field_is_valid(field, htable.thead.rec_size))
+      return RND_BAD_PARAMETER;
+
+   if ((rval = scan_make_predicate(field, op, value, &pred)))
+      return rval;
+
+   // One spare word takes the overflow of a block's last shifted word:
+   matches->nbits = htable.thead.last_recno + 1;
+   matches->words = (uint64_t*)calloc(bitmap_words_for_bits(matches->nbits) + 1, sizeof(uint64_t));
+   if (!matches->words)
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if (pred.empty)
+      return RND_SUCCESS;
+
+   SCAN_CLO clo = { &pred, scan_kernel_for(pred.width), matches, field->offset };
+
+   if ((rval = flatrecs_walk_records(handle, table_head, scan_filter_viewer, &clo)))
+   {
+      free(matches->words);
+      memset(matches, 0, sizeof(*matches));
+   }
+
+   return rval;
+}
+
+/*************************
+ * Aggregates
+ ************************/
+
+/** Running aggregate of a field over some live records. */
+typedef struct scan_partial {
+   uint64_t  count;
+   RND_VALUE sum;       /**< In the member for the field's type              */
+   uint64_t  min_key;   /**< Least and greatest keys, as from `scan_key`     */
+   uint64_t  max_key;
+} SCAN_PART;
+
+/**
+ * Adds the fields of the records whose bits are set in *live* to the sum,
+ * least and greatest keys of *part*.  *count* is at most 64.
+ */
+typedef void (*scan_aggregator)(const char     *field,
+                                uint32_t       stride,
+                                uint32_t       count,
+                                uint64_t       live,
+                                RND_FIELD_TYPE type,
+                                uint32_t       width,
+                                SCAN_PART      *part);
+
+/**
+ * Inverts `scan_key`, widening the value to the RND_VALUE member for its type.
+ */
+static RND_VALUE scan_value_of_key(RND_FIELD_TYPE type, uint32_t width, uint64_t key)
+{
+   uint32_t bits = width * 8;
+   uint64_t sign = (uint64_t)1 << (bits - 1);
+   uint64_t all = width == 8 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+   RND_VALUE value;
+
+   switch(type)
+   {
+      case RND_FIELD_INT:
+         // The key is the value with its sign bit flipped, so flipping it
+         // back and subtracting it sign-extends from the field's width:
+         value.i = (int64_t)(key - sign);
+         break;
+
+      case RND_FIELD_FLOAT:
+         key ^= (key & sign) ? sign : all;
+         if (width == 4)
+         {
+            uint32_t raw = (uint32_t)key;
+            float f;
+            memcpy(&f, &raw, 4);
+            value.f = f;
+         }
+         else
+            memcpy(&value.f, &key, 8);
+         break;
+
+      default:
+         value.u = key;
+         break;
+   }
+
+   return value;
+}
+
+static void scan_aggregate_portable(const char     *field,
+                                    uint32_t       stride,
+                                    uint32_t       count,
+                                    uint64_t       live,
+                                    RND_FIELD_TYPE type,
+                                    uint32_t       width,
+                                    SCAN_PART      *part)
+{
+   uint32_t i;
+
+   for (i = 0; i < count; ++i, field += stride)
+   {
+      if (!(live >> i & 1))
+         continue;
+
+      uint64_t key = scan_key(type, width, field);
+      if (key < part->min_key)
+         part->min_key = key;
+      if (key > part->max_key)
+         part->max_key = key;
+
+      // Sums are of the raw value, so -0.0 adds as itself:
+      RND_VALUE value;
+      if (type == RND_FIELD_FLOAT)
+      {
+         if (width == 4)
+         {
+            float f;
+            memcpy(&f, field, 4);
+            value.f = f;
+         }
+         else
+            memcpy(&value.f, field, 8);
+
+         part->sum.f += value.f;
+      }
+      else
+      {
+         value = scan_value_of_key(type, width, key);
+         part->sum.u += value.u;
+      }
+   }
+}
+
+#ifdef SCAN_X86
+
+/**
+ * Aggregates eight 4-byte fields per iteration.  Fields of deleted
+ * records are masked to 0 for the sums, to the greatest key for the
+ * minimum and to the least for the maximum.  Integers are summed in
+ * 64-bit lanes and floats in double lanes.
+ */
+__attribute__((target("avx2")))
+static void scan_aggregate4_avx2(const char     *field,
+                                 uint32_t       stride,
+                                 uint32_t       count,
+                                 uint64_t       live,
+                                 RND_FIELD_TYPE type,
+                                 uint32_t       width,
+                                 SCAN_PART      *part)
+{
+   const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32((int)stride));
+   const __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+   const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+   const __m256i magnitude = _mm256_set1_epi32(INT32_MAX);
+   const __m256i zero = _mm256_setzero_si256();
+   __m256i kmin = _mm256_set1_epi32(-1), kmax = zero, isum = zero;
+   __m256d fsum = _mm256_setzero_pd();
+   uint32_t i = 0;
+   bool seen = 0;
+
+   for (; i + 8 <= count; i += 8, field += (size_t)stride * 8)
+   {
+      uint32_t bits = (uint32_t)(live >> i) & 0xff;
+      if (!bits)
+         continue;
+
+      seen = 1;
+
+      __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int)bits), lanes), lanes);
+      __m256i raw = _mm256_and_si256(_mm256_i32gather_epi32((const int*)field, index, 1), mask);
+      __m256i key = raw;
+
+      if (type == RND_FIELD_INT)
+         key = _mm256_xor_si256(key, sign);
+      else if (type == RND_FIELD_FLOAT)
+      {
+         __m256i is_zero = _mm256_cmpeq_epi32(_mm256_and_si256(key, magnitude), zero);
+         key = _mm256_andnot_si256(is_zero, key);
+         key = _mm256_xor_si256(key, _mm256_or_si256(_mm256_srai_epi32(key, 31), sign));
+      }
+
+      kmin = _mm256_min_epu32(kmin, _mm256_or_si256(key, _mm256_cmpeq_epi32(mask, zero)));
+      kmax = _mm256_max_epu32(kmax, _mm256_and_si256(key, mask));
+
+      __m128i low = _mm256_castsi256_si128(raw), high = _mm256_extracti128_si256(raw, 1);
+      if (type == RND_FIELD_UINT)
+         isum = _mm256_add_epi64(isum, _mm256_add_epi64(_mm256_cvtepu32_epi64(low), _mm256_cvtepu32_epi64(high)));
+      else if (type == RND_FIELD_INT)
+         isum = _mm256_add_epi64(isum, _mm256_add_epi64(_mm256_cvtepi32_epi64(low), _mm256_cvtepi32_epi64(high)));
+      else
+         fsum = _mm256_add_pd(fsum, _mm256_add_pd(_mm256_cvtps_pd(_mm_castsi128_ps(low)),
+                                                  _mm256_cvtps_pd(_mm_castsi128_ps(high))));
+   }
+
+   // Lanes that saw no records would add their initial keys:
+   if (seen)
+   {
+      uint32_t mins[8], maxs[8];
+      uint64_t isums[4];
+      double fsums[4];
+      int lane;
+
+      _mm256_storeu_si256((__m256i*)mins, kmin);
+      _mm256_storeu_si256((__m256i*)maxs, kmax);
+      _mm256_storeu_si256((__m256i*)isums, isum);
+      _mm256_storeu_pd(fsums, fsum);
+
+      for (lane = 0; lane < 8; ++lane)
+      {
+         if (mins[lane] < part->min_key)
+            part->min_key = mins[lane];
+         if (maxs[lane] > part->max_key)
+            part->max_key = maxs[lane];
+      }
+
+      if (type == RND_FIELD_FLOAT)
+         part->sum.f += (fsums[0] + fsums[1]) + (fsums[2] + fsums[3]);
+      else
+         part->sum.u += isums[0] + isums[1] + isums[2] + isums[3];
+   }
+
+   if (i < count)
+      scan_aggregate_portable(field, stride, count - i, live >> i, type, width, part);
+}
+
+/**
+ * Aggregates four 8-byte fields per iteration.  AVX2 has no unsigned
+ * 64-bit compare, so keys are offset by the sign bit for a signed one.
+ */
+__attribute__((target("avx2")))
+static void scan_aggregate8_avx2(const char     *field,
+                                 uint32_t       stride,
+                                 uint32_t       count,
+                                 uint64_t       live,
+                                 RND_FIELD_TYPE type,
+                                 uint32_t       width,
+                                 SCAN_PART      *part)
+{
+   const __m128i index = _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32((int)stride));
+   const __m256i lanes = _mm256_setr_epi64x(1, 2, 4, 8);
+   const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+   const __m256i magnitude = _mm256_set1_epi64x(INT64_MAX);
+   const __m256i zero = _mm256_setzero_si256();
+   __m256i kmin = _mm256_set1_epi64x(-1), kmax = zero, isum = zero;
+   __m256d fsum = _mm256_setzero_pd();
+   uint32_t i = 0;
+   bool seen = 0;
+
+   for (; i + 4 <= count; i += 4, field += (size_t)stride * 4)
+   {
+      uint32_t bits = (uint32_t)(live >> i) & 0xf;
+      if (!bits)
+         continue;
+
+      seen = 1;
+
+      __m256i mask = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(bits), lanes), lanes);
+      __m256i raw = _mm256_and_si256(_mm256_i32gather_epi64((const long long*)field, index, 1), mask);
+      __m256i key = raw;
+
+      if (type == RND_FIELD_INT)
+         key = _mm256_xor_si256(key, sign);
+      else if (type == RND_FIELD_FLOAT)
+      {
+         __m256i is_zero = _mm256_cmpeq_epi64(_mm256_and_si256(key, magnitude), zero);
+         key = _mm256_andnot_si256(is_zero, key);
+         key = _mm256_xor_si256(key, _mm256_or_si256(_mm256_cmpgt_epi64(zero, key), sign));
+      }
+
+      __m256i low_candidate = _mm256_or_si256(key, _mm256_cmpeq_epi64(mask, zero));
+      __m256i high_candidate = _mm256_and_si256(key, mask);
+      __m256i lower = _mm256_cmpgt_epi64(_mm256_xor_si256(kmin, sign), _mm256_xor_si256(low_candidate, sign));
+      __m256i higher = _mm256_cmpgt_epi64(_mm256_xor_si256(high_candidate, sign), _mm256_xor_si256(kmax, sign));
+      kmin = _mm256_blendv_epi8(kmin, low_candidate, lower);
+      kmax = _mm256_blendv_epi8(kmax, high_candidate, higher);
+
+      if (type == RND_FIELD_FLOAT)
+         fsum = _mm256_add_pd(fsum, _mm256_castsi256_pd(raw));
+      else
+         isum = _mm256_add_epi64(isum, raw);
+   }
+
+   // Lanes that saw no records would add their initial keys:
+   if (seen)
+   {
+      uint64_t mins[4], maxs[4], isums[4];
+      double fsums[4];
+      int lane;
+
+      _mm256_storeu_si256((__m256i*)mins, kmin);
+      _mm256_storeu_si256((__m256i*)maxs, kmax);
+      _mm256_storeu_si256((__m256i*)isums, isum);
+      _mm256_storeu_pd(fsums, fsum);
+
+      for (lane = 0; lane < 4; ++lane)
+      {
+         if (mins[lane] < part->min_key)
+            part->min_key = mins[lane];
+         if (maxs[lane] > part->max_key)
+            part->max_key = maxs[lane];
+      }
+
+      if (type == RND_FIELD_FLOAT)
+         part->sum.f += (fsums[0] + fsums[1]) + (fsums[2] + fsums[3]);
+      else
+         part->sum.u += isums[0] + isums[1] + isums[2] + isums[3];
+   }
+
+   if (i < count)
+      scan_aggregate_portable(field, stride, count - i, live >> i, type, width, part);
+}
+
+#endif  // SCAN_X86
+
+static scan_aggregator scan_aggregate4_impl = NULL;
+static scan_aggregator scan_aggregate8_impl = NULL;
+
+static scan_aggregator scan_aggregator_for(uint32_t width)
+{
+   if (!scan_aggregate4_impl)
+   {
+      scan_aggregator aggregate4 = scan_aggregate_portable;
+      scan_aggregator aggregate8 = scan_aggregate_portable;
+
+#ifdef SCAN_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+      {
+         aggregate4 = scan_aggregate4_avx2;
+         aggregate8 = scan_aggregate8_avx2;
+      }
+#endif
+
+      scan_aggregate8_impl = aggregate8;
+      scan_aggregate4_impl = aggregate4;
+   }
+
+   return width == 4 ? scan_aggregate4_impl
+      : width == 8 ? scan_aggregate8_impl
+      : scan_aggregate_portable;
+}
+
+static void scan_merge_partial(SCAN_PART *total, const SCAN_PART *part, RND_FIELD_TYPE type)
+{
+   if (!part->count)
+      return;
+
+   total->count += part->count;
+   if (type == RND_FIELD_FLOAT)
+      total->sum.f += part->sum.f;
+   else
+      total->sum.u += part->sum.u;
+
+   if (part->min_key < total->min_key)
+      total->min_key = part->min_key;
+   if (part->max_key > total->max_key)
+      total->max_key = part->max_key;
+}
+
+/**
+ * Aggregates the live records of one block.
+ */
+static void scan_aggregate_block(const FLATREC_BLOCK *fb,
+                                 const char          *image,
+                                 uint32_t            rec_size,
+                                 const RND_FIELD     *field,
+                                 SCAN_PART           *part)
+{
+   const uint64_t *map = (const uint64_t*)image;
+   const char *records = image + fb->block.bytes_to_records - fb->block.bytes_to_data;
+   scan_aggregator aggregate = scan_aggregator_for(field->width);
+   uint32_t done;
+
+   for (done = 0; done < fb->nbits; done += BITMAP_WORD_BITS)
+   {
+      uint32_t count = fb->nbits - done < BITMAP_WORD_BITS ? fb->nbits - done : BITMAP_WORD_BITS;
+      uint64_t valid = count < BITMAP_WORD_BITS ? ((uint64_t)1 << count) - 1 : ~(uint64_t)0;
+      uint64_t live = map[done / BITMAP_WORD_BITS] & valid;
+
+      if (!live)
+         continue;
+
+      part->count += bitmap_popcount(&live, BITMAP_WORD_BITS);
+      (*aggregate)(records + (size_t)done * rec_size + field->offset,
+                   rec_size, count, live, field->type, field->width, part);
+   }
+}
+
+/**
+ * Computes aggregates of a field over the live records of a table.
+ *
+ * Each block's records are aggregated in place, with vector kernels for
+ * 4- and 8-byte fields.  With RND_AGG_CACHE in *ops*, each block's
+ * partial aggregate is kept in the handle's cache, and blocks whose
+ * partials are still current aren't read at all.  Writes through the
+ * handle discard the partials of the blocks they change, but writes by
+ * other processes are only noticed if they change the block's header or
+ * its number of records, so only ask for the cache where that suffices.
+ *
+ * Sums of floating-point fields are accumulated in a different order by
+ * different kernels, so may differ in the last bits between machines.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the table, 0 for the file's table
+ * @param field       the field to aggregate
+ * @param ops         RND_AGG_OP values, combined with |
+ * @param result      [out] the aggregates asked for, the rest 0
+ */
+RND_ERROR scan_aggregate(RNDH *handle,
+                         off_t table_head,
+                         const RND_FIELD *field,
+                         uint32_t ops,
+                         RND_AGGREGATE *result)
+{
+   prime_handle(handle);
+
+   const uint32_t all_ops = RND_AGG_COUNT | RND_AGG_SUM | RND_AGG_MIN | RND_AGG_MAX | RND_AGG_MEAN | RND_AGG_CACHE;
+   RND_HEAD_TABLE htable;
+   FLATREC_BLOCK *blocks;
+   uint32_t count, rec_size, i;
+   char *buffer = NULL;
+   size_t buffer_size = 0;
+   RND_ERROR rval;
+
+   memset(result, 0, sizeof(*result));
+
+   if (ops & ~all_ops)
+      return RND_BAD_PARAMETER;
+
+   if ((rval = blocks_read_at(handle, table_head, &htable, sizeof(htable))))
+      return rval;
+
+   if ((htable.bhead.block_type != RBT_TABLE && htable.bhead.block_type != RBT_FILE)
+       || !scan_field_is_valid(field, htable.thead.rec_size))
+      return RND_BAD_PARAMETER;
+
+   if ((rval = flatrecs_list_blocks(handle, table_head, &blocks, &count, &rec_size)))
+      return rval;
+
+   SCAN_PART total = { 0, { 0 }, ~(uint64_t)0, 0 };
+
+   for (i = 0; i < count; ++i)
+   {
+      const FLATREC_BLOCK *fb = &blocks[i];
+      SCAN_PART part = { 0, { 0 }, ~(uint64_t)0, 0 };
+      CACHE_PARTIAL kept;
+
+      if (ops & RND_AGG_CACHE)
+      {
+         memset(&kept, 0, sizeof(kept));
+         kept.block_offset = fb->offset;
+         kept.block = fb->block;
+         kept.nbits = fb->nbits;
+         kept.field_offset = field->offset;
+         kept.field_width = field->width;
+         kept.field_type = field->type;
+
+         const CACHE_PARTIAL *found = cache_find_partial(handle, &kept);
+         if (found)
+         {
+            part.count = found->count;
+            part.sum.u = found->sum;
+            part.min_key = found->min_key;
+            part.max_key = found->max_key;
+            scan_merge_partial(&total, &part, field->type);
+            continue;
+         }
+      }
+
+      const char *image;
+      if ((rval = flatrecs_read_block(handle, fb, rec_size, &buffer, &buffer_size, &image)))
+         goto abandon_function;
+
+      scan_aggregate_block(fb, image, rec_size, field, &part);
+      scan_merge_partial(&total, &part, field->type);
+
+      if (ops & RND_AGG_CACHE)
+      {
+         kept.count = part.count;
+         kept.sum = part.sum.u;
+         kept.min_key = part.min_key;
+         kept.max_key = part.max_key;
+
+         if ((rval = cache_keep_partial(handle, &kept)))
+            goto abandon_function;
+      }
+   }
+
+   if (ops & RND_AGG_COUNT)
+      result->count = total.count;
+
+   if (ops & RND_AGG_SUM)
+      result->sum = total.sum;
+
+   if (total.count)
+   {
+      if (ops & RND_AGG_MIN)
+         result->min = scan_value_of_key(field->type, field->width, total.min_key);
+      if (ops & RND_AGG_MAX)
+         result->max = scan_value_of_key(field->type, field->width, total.max_key);
+
+      if (ops & RND_AGG_MEAN)
+      {
+         result->mean = field->type == RND_FIELD_FLOAT ? total.sum.f
+            : field->type == RND_FIELD_INT ? (double)total.sum.i
+            : (double)total.sum.u;
+         result->mean /= (double)total.count;
+      }
+   }
+
+  abandon_function:
+   free(buffer);
+   free(blocks);
+   return rval;
+}
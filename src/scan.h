@@ -0,0 +1,21 @@
+#ifndef RECNODB_SCAN_H
+#define RECNODB_SCAN_H
+
+#include "recnodb.h"
+
+bool scan_field_is_valid(const RND_FIELD *field, uint32_t rec_size);
+
+RND_ERROR scan_filter(RNDH *handle,
+                      off_t table_head,
+                      const RND_FIELD *field,
+                      RND_SCAN_OP op,
+                      const void *value,
+                      RND_BITMAP *matches);
+
+RND_ERROR scan_aggregate(RNDH *handle,
+                         off_t table_head,
+                         const RND_FIELD *field,
+                         uint32_t ops,
+                         RND_AGGREGATE *result);
+
+#endif
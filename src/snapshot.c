@@ -0,0 +1,750 @@
+/** @file
+ *
+ * Snapshots: point-in-time read views of the file's table that don't
+ * block writers.
+ *
+ * Records are written in place, so a snapshot can't simply keep reading
+ * the blocks it started with.  Instead, before a writer first changes a
+ * record while a snapshot is open, it copies the record (its contents and
+ * liveness) into the snapshot log, a chain of blocks that starts at the
+ * RBT_SNAPSHOT block named by INFO_FILE::snapshot_head.  Each copy is
+ * tagged with the epoch of the newest open snapshot, and a record is
+ * copied once per epoch.  The copy is of a record rather than of its
+ * block, since a block can hold up to a gigabyte of records (see
+ * `flatrecs_bulk_load`).
+ *
+ * A snapshot of epoch E reads a record from the first copy tagged E or
+ * later, which holds the record as it was when the snapshot opened, and
+ * otherwise from the table, where it hasn't changed since.  It reads the
+ * table before the log: since a copy is made before its record changes,
+ * a change that the table read saw has its copy in the log by then.
+ *
+ * Every handle with a snapshot open holds a read lock on
+ * SNAPSHOT_OPEN_LOCK_OFFSET, so a writer with no snapshot open anywhere
+ * pays one lock test per change.  As a lock test doesn't show a handle
+ * its own lock, each handle also counts its open snapshots.  When the
+ * last snapshot closes, the log is emptied for reuse.
+ *
+ * A snapshot opens under the commit lock, so it sees a transaction
+ * (see txn.h) whole or not at all.  Snapshots cover the records of the
+ * file's table, not its indexes or relations.
+ */
+
+#include "snapshot.h"
+#include "extra.h"
+#include "locks.h"
+#include "txn.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <stdlib.h>
+#include <string.h>
+
+/** Offset of the byte read-locked by every open snapshot. */
+#define SNAPSHOT_OPEN_LOCK_OFFSET (INT64_MAX - 3)
+
+/** Least size of a block of the snapshot log, rounded up to whole chunks. */
+#define SNAPSHOT_LOG_BLOCK 65536
+
+/** Offset of INFO_FILE::snapshot_head in the file. */
+#define SNAPSHOT_HEAD_OFFSET (offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, snapshot_head))
+
+/**
+ * A copy of a record in the snapshot log, followed by the record's
+ * contents, padded to a multiple of 8 bytes.
+ */
+typedef struct snapshot_entry {
+   off_t    table_head;
+   uint64_t epoch;      /**< Newest snapshot when the copy was made           */
+   uint32_t recno;      /**< 0 marks the end of the entries in a block        */
+   uint32_t rec_size;   /**< Bytes of contents that follow, 0 if it was dead  */
+   uint32_t was_live;
+   char     pad[4];
+} SNAP_ENTRY;
+
+static size_t snapshot_entry_size(uint32_t rec_size)
+{
+   return sizeof(SNAP_ENTRY) + ((rec_size + 7) & ~7u);
+}
+
+/*************************
+ * (table, recno) map
+ ************************/
+
+static uint32_t snapshot_map_hash(off_t table_head, uint32_t recno)
+{
+   uint64_t h = ((uint64_t)table_head * 0x9e3779b97f4a7c15ULL) ^ recno;
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return (uint32_t)h;
+}
+
+static SNAP_SLOT *snapshot_map_find(SNAP_MAP *map, off_t table_head, uint32_t recno)
+{
+   if (!map->capacity)
+      return NULL;
+
+   uint32_t mask = map->capacity - 1, i = snapshot_map_hash(table_head, recno) & mask;
+
+   for (; map->slots[i].recno; i = (i + 1) & mask)
+   {
+      if (map->slots[i].recno == recno && map->slots[i].table_head == table_head)
+         return &map->slots[i];
+   }
+
+   return NULL;
+}
+
+/**
+ * Sets the value of a key, adding it if it's new.
+ *
+ * @return FALSE if memory ran out
+ */
+static bool snapshot_map_put(SNAP_MAP *map, off_t table_head, uint32_t recno, uint64_t value)
+{
+   SNAP_SLOT *slot = snapshot_map_find(map, table_head, recno);
+
+   if (slot)
+   {
+      slot->value = value;
+      return 1;
+   }
+
+   // Keep the map at most half full:
+   if ((map->count + 1) * 2 > map->capacity)
+   {
+      SNAP_MAP bigger = { NULL, map->capacity ? map->capacity * 2 : 1024, 0 };
+      if (!(bigger.slots = (SNAP_SLOT*)calloc(bigger.capacity, sizeof(SNAP_SLOT))))
+         return 0;
+
+      for (uint32_t i = 0; i < map->capacity; ++i)
+      {
+         if (map->slots[i].recno)
+            snapshot_map_put(&bigger, map->slots[i].table_head, map->slots[i].recno, map->slots[i].value);
+      }
+
+      free(map->slots);
+      *map = bigger;
+   }
+
+   uint32_t mask = map->capacity - 1, i = snapshot_map_hash(table_head, recno) & mask;
+   while (map->slots[i].recno)
+      i = (i + 1) & mask;
+
+   map->slots[i].table_head = table_head;
+   map->slots[i].recno = recno;
+   map->slots[i].value = value;
+   ++map->count;
+   return 1;
+}
+
+static void snapshot_map_clear(SNAP_MAP *map)
+{
+   if (map->slots)
+      memset(map->slots, 0, map->capacity * sizeof(SNAP_SLOT));
+   map->count = 0;
+}
+
+/*************************
+ * Who has snapshots open
+ ************************/
+
+/**
+ * Returns what the handle knows of the snapshot log, starting it if need be.
+ */
+static RND_ERROR snapshot_log_of(RNDH *handle, struct rnd_snapshot_log **log)
+{
+   if (!handle->snapshots
+       && !(handle->snapshots = (struct rnd_snapshot_log*)calloc(1, sizeof(struct rnd_snapshot_log))))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   *log = handle->snapshots;
+   return RND_SUCCESS;
+}
+
+/**
+ * Reports whether any handle, this one included, has a snapshot open on the file.
+ */
+bool snapshot_any_open(RNDH *handle)
+{
+   if (handle->snapshots && handle->snapshots->opens)
+      return 1;
+
+   struct flock fl;
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = F_WRLCK;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = SNAPSHOT_OPEN_LOCK_OFFSET;
+   fl.l_len = 1;
+
+   // Assume a snapshot is open if the lock can't be checked, since that's safe:
+   return fcntl(fileno(handle->file), LOCK_GET, &fl) == -1 || fl.l_type != F_UNLCK;
+}
+
+/**
+ * Takes or lets go of this handle's share of the open-snapshot lock.
+ */
+static RND_ERROR snapshot_hold_open(RNDH *handle, bool hold)
+{
+   struct flock fl;
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = hold ? F_RDLCK : F_UNLCK;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = SNAPSHOT_OPEN_LOCK_OFFSET;
+   fl.l_len = 1;
+
+   if (fcntl(fileno(handle->file), LOCK_SETW, &fl) == -1)
+   {
+      handle->sys_errno = errno;
+      return hold ? RND_LOCK_FAILED : RND_UNLOCK_FAILED;
+   }
+
+   return RND_SUCCESS;
+}
+
+/*************************
+ * The log
+ ************************/
+
+/**
+ * Reads the head of the snapshot log, with *head* 0 if there's no log yet.
+ */
+static RND_ERROR snapshot_read_head(RNDH *handle, off_t *head, RND_HEAD_SNAPSHOT *hs)
+{
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_at(handle, SNAPSHOT_HEAD_OFFSET, head, sizeof(*head)))
+       || !*head)
+      return rval;
+
+   return blocks_read_at(handle, *head, hs, sizeof(*hs));
+}
+
+static RND_ERROR snapshot_write_head(RNDH *handle, off_t head, const RND_HEAD_SNAPSHOT *hs)
+{
+   return blocks_write_at(handle, head + offsetof(RND_HEAD_SNAPSHOT, shead), &hs->shead, sizeof(hs->shead));
+}
+
+static uint32_t snapshot_round_block(RNDH *handle, size_t bytes)
+{
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   return (uint32_t)((bytes + chunk_size - 1) / chunk_size * chunk_size);
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the file head's INFO_FILE
+ * locked, that records the head of a new snapshot log.
+ */
+bool snapshot_register_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   ((INFO_FILE*)locked_buffer)->snapshot_head = *(off_t*)closure;
+   return 1;
+}
+
+/**
+ * Starts an empty snapshot log.  Must be called with the log lock held.
+ */
+static RND_ERROR snapshot_create_log(RNDH *handle, off_t *head, RND_HEAD_SNAPSHOT *hs)
+{
+   RND_ERROR rval;
+   RND_BLOCK_DEF bdef = { RBT_SNAPSHOT, snapshot_round_block(handle, SNAPSHOT_LOG_BLOCK) };
+
+   if ((rval = blocks_append_block(handle, &bdef))
+       || (rval = blocks_read_at(handle, bdef.new_block.offset, hs, sizeof(*hs))))
+      return rval;
+
+   *head = bdef.new_block.offset;
+   memset(&hs->shead, 0, sizeof(hs->shead));
+   hs->shead.tail = *head;
+
+   if ((rval = snapshot_write_head(handle, *head, hs)))
+      return rval;
+
+   handle->head_file.fhead.snapshot_head = *head;
+
+   BLOCK_LOC bl = { offsetof(RND_HEAD_FILE, fhead), sizeof(INFO_FILE) };
+   return rnd_lock_area(handle, &bl, 1, snapshot_register_lock_callback, head);
+}
+
+/**
+ * Empties the log, keeping its blocks for reuse.  Must be called with
+ * the log lock held and no snapshot open.
+ */
+static RND_ERROR snapshot_reset_log(RNDH *handle, off_t head, RND_HEAD_SNAPSHOT *hs)
+{
+   hs->shead.entries = 0;
+   hs->shead.tail = head;
+   hs->shead.tail_used = 0;
+   ++hs->shead.resets;
+
+   return snapshot_write_head(handle, head, hs);
+}
+
+/**
+ * Adds a copy of a record to the end of the log, moving to the next
+ * block of the chain, or adding one, when the tail block is full.  Must
+ * be called with the log lock held.
+ */
+static RND_ERROR snapshot_append(RNDH *handle,
+                                 off_t head,
+                                 RND_HEAD_SNAPSHOT *hs,
+                                 const SNAP_ENTRY *entry,
+                                 const char *contents)
+{
+   INFO_SNAPSHOT *sh = &hs->shead;
+   size_t size = snapshot_entry_size(entry->rec_size);
+   INFO_BLOCK ib;
+   RND_ERROR rval;
+
+   if ((rval = blocks_read_block_head(handle, sh->tail, &ib, sizeof(ib))))
+      return rval;
+
+   if (sh->tail_used + size > blocks_block_payload_size(&ib))
+   {
+      // Mark the end of this block's entries, if the mark fits:
+      if (sh->tail_used + sizeof(SNAP_ENTRY) <= blocks_block_payload_size(&ib))
+      {
+         SNAP_ENTRY end;
+         memset(&end, 0, sizeof(end));
+         if ((rval = blocks_write_at(handle, sh->tail + ib.bytes_to_data + sh->tail_used, &end, sizeof(end))))
+            return rval;
+      }
+
+      off_t next = ib.next_block.offset;
+      INFO_BLOCK nb;
+
+      // Reuse the next block, left from before the log was emptied, if the copy fits:
+      if (next
+          && (rval = blocks_read_block_head(handle, next, &nb, sizeof(nb))))
+         return rval;
+
+      if (!next || size > blocks_block_payload_size(&nb))
+      {
+         RND_BLOCK_DEF bdef = { RBT_DATA,
+                                snapshot_round_block(handle, sizeof(INFO_BLOCK) + size > SNAPSHOT_LOG_BLOCK
+                                                     ? sizeof(INFO_BLOCK) + size : SNAPSHOT_LOG_BLOCK) };
+
+         if ((rval = blocks_append_block(handle, &bdef))
+             || (rval = blocks_read_block_head(handle, bdef.new_block.offset, &nb, sizeof(nb))))
+            return rval;
+
+         nb.next_block = ib.next_block;
+         ib.next_block = bdef.new_block;
+         next = bdef.new_block.offset;
+
+         if ((rval = blocks_write_block_head(handle, next, &nb, sizeof(nb)))
+             || (rval = blocks_write_block_head(handle, sh->tail, &ib, sizeof(ib))))
+            return rval;
+      }
+
+      sh->tail = next;
+      sh->tail_used = 0;
+      ib = nb;
+   }
+
+   off_t at = sh->tail + ib.bytes_to_data + sh->tail_used;
+
+   if ((rval = blocks_write_at(handle, at, entry, sizeof(*entry)))
+       || (rval = blocks_write_at(handle, at + sizeof(*entry), contents, entry->rec_size)))
+      return rval;
+
+   sh->tail_used += (uint32_t)size;
+   ++sh->entries;
+
+   return snapshot_write_head(handle, head, hs);
+}
+
+/** Function type called by `snapshot_follow_log` with each new entry. */
+typedef bool (*snapshot_entry_view)(const SNAP_ENTRY *entry, off_t offset, void *closure);
+
+/**
+ * Reads the entries added to the log since *cursor*, passing each to
+ * *viewer*.  If the log was emptied since, the cursor starts again at
+ * the beginning and *restarted* is set, so the caller can forget what
+ * it read before.
+ */
+static RND_ERROR snapshot_follow_log(RNDH *handle,
+                                     off_t head,
+                                     const INFO_SNAPSHOT *sh,
+                                     SNAP_CURSOR *cursor,
+                                     bool *restarted,
+                                     snapshot_entry_view viewer,
+                                     void *closure)
+{
+   INFO_BLOCK ib;
+   RND_ERROR rval;
+   bool have_block = 0;
+
+   *restarted = 0;
+
+   if (!cursor->block || cursor->resets != sh->resets)
+   {
+      cursor->resets = sh->resets;
+      cursor->entries = 0;
+      cursor->block = head;
+      cursor->position = 0;
+      *restarted = 1;
+   }
+
+   while (cursor->entries < sh->entries)
+   {
+      SNAP_ENTRY entry;
+
+      if (!have_block)
+      {
+         if ((rval = blocks_read_block_head(handle, cursor->block, &ib, sizeof(ib))))
+            return rval;
+         have_block = 1;
+      }
+
+      off_t at = cursor->block + ib.bytes_to_data + cursor->position;
+      bool at_end = cursor->position + sizeof(SNAP_ENTRY) > blocks_block_payload_size(&ib);
+
+      if (!at_end)
+      {
+         if ((rval = blocks_read_at(handle, at, &entry, sizeof(entry))))
+            return rval;
+         at_end = entry.recno == 0;
+      }
+
+      if (at_end)
+      {
+         if (!ib.next_block.offset)
+            return RND_REACHED_END_OF_BLOCK_CHAIN;
+
+         cursor->block = ib.next_block.offset;
+         cursor->position = 0;
+         have_block = 0;
+         continue;
+      }
+
+      (*viewer)(&entry, at, closure);
+
+      cursor->position += (uint32_t)snapshot_entry_size(entry.rec_size);
+      ++cursor->entries;
+   }
+
+   return RND_SUCCESS;
+}
+
+/*************************
+ * Writers
+ ************************/
+
+/**
+ * `snapshot_follow_log` viewer that notes the highest epoch each record
+ * has been copied for.
+ */
+static bool snapshot_note_copied(const SNAP_ENTRY *entry, off_t offset, void *closure)
+{
+   SNAP_MAP *copied = (SNAP_MAP*)closure;
+   SNAP_SLOT *slot = snapshot_map_find(copied, entry->table_head, entry->recno);
+
+   if (!slot || slot->value < entry->epoch)
+      snapshot_map_put(copied, entry->table_head, entry->recno, entry->epoch);
+
+   return 1;
+}
+
+/**
+ * Copies a record into the snapshot log if a snapshot is open that
+ * hasn't got a copy of it yet.  Called with the record locked, before it
+ * is changed.
+ *
+ * @param handle      handle to an open recno database
+ * @param table_head  offset to the head block of the record's table
+ * @param recno       the record
+ * @param loc         location of the record, in an uncompressed block
+ */
+RND_ERROR snapshot_preserve(RNDH *handle, off_t table_head, uint32_t recno, const FLATREC_LOC *loc)
+{
+   struct rnd_snapshot_log *log;
+   RND_ERROR rval;
+
+   if (!snapshot_any_open(handle))
+      return RND_SUCCESS;
+
+   if ((rval = snapshot_log_of(handle, &log)))
+      return rval;
+
+   BLOCK_LOC log_lock = { SNAPSHOT_LOG_LOCK_OFFSET, 1 };
+   if ((rval = rnd_lock_place(handle, &log_lock, 1)))
+      return rval;
+
+   RND_HEAD_SNAPSHOT hs;
+   off_t head;
+   bool restarted;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_lock;
+   }
+
+   if ((rval = snapshot_read_head(handle, &head, &hs)) || !head || !hs.shead.epoch)
+      goto release_lock;
+
+   if ((rval = snapshot_follow_log(handle, head, &hs.shead, &log->cursor, &restarted,
+                                   snapshot_note_copied, &log->copied)))
+      goto release_lock;
+
+   if (restarted)
+   {
+      snapshot_map_clear(&log->copied);
+      if ((rval = snapshot_follow_log(handle, head, &hs.shead, &log->cursor, &restarted,
+                                      snapshot_note_copied, &log->copied)))
+         goto release_lock;
+   }
+
+   SNAP_SLOT *slot = snapshot_map_find(&log->copied, table_head, recno);
+   if (slot && slot->value >= hs.shead.epoch)
+      goto release_lock;
+
+   bool live;
+   if ((rval = flatrecs_record_is_live(handle, loc, &live)))
+      goto release_lock;
+
+   {
+      char contents[loc->rec_size];
+      SNAP_ENTRY entry = { table_head, hs.shead.epoch, recno, live ? loc->rec_size : 0, (uint32_t)live };
+
+      if ((live && (rval = blocks_read_at(handle, loc->record_offset, contents, loc->rec_size)))
+          || (rval = snapshot_append(handle, head, &hs, &entry, contents)))
+         goto release_lock;
+   }
+
+   if (!snapshot_map_put(&log->copied, table_head, recno, hs.shead.epoch))
+   {
+      handle->sys_errno = ENOMEM;
+      rval = RND_SYSTEM_ERROR;
+   }
+
+  release_lock:
+   fflush(handle->file);
+   rnd_lock_remove(handle, &log_lock);
+   return rval;
+}
+
+/**
+ * Lets go of what a handle knows of the snapshot log, as it is closed.
+ */
+void snapshot_free(RNDH *handle)
+{
+   if (handle->snapshots)
+   {
+      free(handle->snapshots->copied.slots);
+      free(handle->snapshots);
+      handle->snapshots = NULL;
+   }
+}
+
+/*************************
+ * Snapshots
+ ************************/
+
+/**
+ * Opens a snapshot of the file's table as it is now.
+ *
+ * Reads through the snapshot with `snapshot_read_record` see the table
+ * as it was when the snapshot opened, however it is changed meanwhile.
+ * Close the snapshot with `snapshot_close` before closing the handle.
+ *
+ * @param handle    handle to an open recno database
+ * @param snapshot  [out] the new snapshot
+ */
+RND_ERROR snapshot_open(RNDH *handle, RND_SNAPSHOT **snapshot)
+{
+   prime_handle(handle);
+
+   struct rnd_snapshot_log *log;
+   RND_SNAPSHOT *snap;
+   RND_HEAD_SNAPSHOT hs;
+   RND_ERROR rval;
+   off_t head;
+
+   if ((rval = snapshot_log_of(handle, &log)))
+      return rval;
+
+   if (!(snap = (RND_SNAPSHOT*)calloc(1, sizeof(RND_SNAPSHOT))))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   snap->handle = handle;
+
+   // Open between transactions, and while no writer is using the log:
+   BLOCK_LOC commit_lock = { TXN_COMMIT_LOCK_OFFSET, 1 };
+   BLOCK_LOC log_lock = { SNAPSHOT_LOG_LOCK_OFFSET, 1 };
+
+   if ((rval = rnd_lock_place(handle, &commit_lock, 1)))
+      goto abandon_snapshot;
+
+   if ((rval = rnd_lock_place(handle, &log_lock, 1)))
+      goto release_commit_lock;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_log_lock;
+   }
+
+   if ((rval = snapshot_read_head(handle, &head, &hs))
+       || (!head && (rval = snapshot_create_log(handle, &head, &hs))))
+      goto release_log_lock;
+
+   // Copies left by snapshots that were never closed, as when a process dies, can go:
+   if (!snapshot_any_open(handle)
+       && hs.shead.entries
+       && (rval = snapshot_reset_log(handle, head, &hs)))
+      goto release_log_lock;
+
+   ++hs.shead.epoch;
+
+   if ((rval = snapshot_write_head(handle, head, &hs))
+       || (rval = blocks_read_at(handle,
+                                 offsetof(RND_HEAD_FILE, thead) + offsetof(INFO_TABLE, last_recno),
+                                 &snap->last_recno,
+                                 sizeof(snap->last_recno)))
+       || (rval = snapshot_hold_open(handle, 1)))
+      goto release_log_lock;
+
+   ++log->opens;
+
+   // Copies already in the log were made for older snapshots:
+   snap->epoch = hs.shead.epoch;
+   snap->cursor.resets = hs.shead.resets;
+   snap->cursor.entries = hs.shead.entries;
+   snap->cursor.block = hs.shead.tail;
+   snap->cursor.position = hs.shead.tail_used;
+
+  release_log_lock:
+   fflush(handle->file);
+   rnd_lock_remove(handle, &log_lock);
+
+  release_commit_lock:
+   rnd_lock_remove(handle, &commit_lock);
+
+  abandon_snapshot:
+   if (rval)
+      free(snap);
+   else
+      *snapshot = snap;
+
+   return rval;
+}
+
+/**
+ * `snapshot_follow_log` viewer that notes the first copy of each record
+ * made for a snapshot or a later one.
+ */
+static bool snapshot_note_first(const SNAP_ENTRY *entry, off_t offset, void *closure)
+{
+   RND_SNAPSHOT *snap = (RND_SNAPSHOT*)closure;
+
+   if (entry->epoch >= snap->epoch && !snapshot_map_find(&snap->firsts, entry->table_head, entry->recno))
+      snapshot_map_put(&snap->firsts, entry->table_head, entry->recno, (uint64_t)offset);
+
+   return 1;
+}
+
+/**
+ * Copies a record of the file's table, as it was when the snapshot
+ * opened, into *buffer*.
+ *
+ * @param snapshot  snapshot from `snapshot_open`
+ * @param recno     record to read
+ * @param buffer    [out] memory to receive the record
+ * @param size      [in/out] size of *buffer*, upon return the number of bytes copied
+ *
+ * @return RND_SUCCESS, or RND_EXTINCT_RECORD if the record was deleted or
+ *         unassigned when the snapshot opened.
+ */
+RND_ERROR snapshot_read_record(RND_SNAPSHOT *snapshot, uint32_t recno, void *buffer, uint32_t *size)
+{
+   RNDH *handle = snapshot->handle;
+   RND_HEAD_SNAPSHOT hs;
+   RND_ERROR rval, table_rval;
+   uint32_t table_size = *size;
+   off_t head;
+   bool restarted;
+
+   if (recno == 0 || recno > snapshot->last_recno)
+      return RND_EXTINCT_RECORD;
+
+   // The table first, then the log, so a change seen in the table has its copy in the log:
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   table_rval = flatrecs_read_record(handle, 0, recno, buffer, &table_size);
+   if (table_rval && table_rval != RND_EXTINCT_RECORD)
+      return table_rval;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if ((rval = snapshot_read_head(handle, &head, &hs))
+       || (rval = snapshot_follow_log(handle, head, &hs.shead, &snapshot->cursor, &restarted,
+                                      snapshot_note_first, snapshot)))
+      return rval;
+
+   SNAP_SLOT *slot = snapshot_map_find(&snapshot->firsts, 0, recno);
+   if (!slot)
+   {
+      *size = table_size;
+      return table_rval;
+   }
+
+   SNAP_ENTRY entry;
+   if ((rval = blocks_read_at(handle, (off_t)slot->value, &entry, sizeof(entry))))
+      return rval;
+
+   if (!entry.was_live)
+      return RND_EXTINCT_RECORD;
+
+   if (*size > entry.rec_size)
+      *size = entry.rec_size;
+
+   return blocks_read_at(handle, (off_t)slot->value + sizeof(entry), buffer, *size);
+}
+
+/**
+ * Closes a snapshot, emptying the snapshot log if no other is open.
+ */
+void snapshot_close(RND_SNAPSHOT *snapshot)
+{
+   RNDH *handle = snapshot->handle;
+   RND_HEAD_SNAPSHOT hs;
+   off_t head;
+
+   if (--handle->snapshots->opens == 0)
+      snapshot_hold_open(handle, 0);
+
+   BLOCK_LOC log_lock = { SNAPSHOT_LOG_LOCK_OFFSET, 1 };
+   if (rnd_lock_place(handle, &log_lock, 1) == RND_SUCCESS)
+   {
+      if (!fflush(handle->file)
+          && !snapshot_any_open(handle)
+          && !snapshot_read_head(handle, &head, &hs)
+          && head)
+         snapshot_reset_log(handle, head, &hs);
+
+      fflush(handle->file);
+      rnd_lock_remove(handle, &log_lock);
+   }
+
+   free(snapshot->firsts.slots);
+   free(snapshot);
+}
@@ -0,0 +1,60 @@
+#ifndef RECNODB_SNAPSHOT_H
+#define RECNODB_SNAPSHOT_H
+
+#include "recnodb.h"
+#include "flatrecs.h"
+
+/** Offset of the byte locked while the snapshot log is changed. */
+#define SNAPSHOT_LOG_LOCK_OFFSET (INT64_MAX - 4)
+
+
+/** A slot of a SNAP_MAP. */
+typedef struct snapshot_map_slot {
+   off_t    table_head;
+   uint64_t value;
+   uint32_t recno;      /**< 0 for an empty slot */
+   char     pad[4];
+} SNAP_SLOT;
+
+/** Open-addressed map from (table, recno) to a 64-bit value. */
+typedef struct snapshot_map {
+   SNAP_SLOT *slots;
+   uint32_t  capacity;
+   uint32_t  count;
+} SNAP_MAP;
+
+/** How far a reader of the snapshot log has got. */
+typedef struct snapshot_cursor {
+   uint64_t resets;     /**< INFO_SNAPSHOT::resets when the log was read   */
+   uint64_t entries;    /**< Entries read                                  */
+   off_t    block;      /**< Block of the next entry                       */
+   uint32_t position;   /**< Offset of the next entry in the block payload */
+   char     pad[4];
+} SNAP_CURSOR;
+
+/** What a handle knows of the snapshot log, to copy each record once per snapshot. */
+struct rnd_snapshot_log {
+   SNAP_MAP    copied;  /**< Highest epoch each record was copied for */
+   SNAP_CURSOR cursor;
+   uint32_t    opens;   /**< Snapshots open on the handle, see `snapshot_any_open` */
+   char        pad[4];
+};
+
+struct rnd_snapshot {
+   RNDH        *handle;
+   uint64_t    epoch;
+   SNAP_MAP    firsts;      /**< Offset of the first copy of each record made for this snapshot */
+   SNAP_CURSOR cursor;
+   uint32_t    last_recno;  /**< Of the file's table when the snapshot opened */
+   char        pad[4];
+};
+
+RND_ERROR snapshot_open(RNDH *handle, RND_SNAPSHOT **snapshot);
+RND_ERROR snapshot_read_record(RND_SNAPSHOT *snapshot, uint32_t recno, void *buffer, uint32_t *size);
+void snapshot_close(RND_SNAPSHOT *snapshot);
+
+bool snapshot_any_open(RNDH *handle);
+RND_ERROR snapshot_preserve(RNDH *handle, off_t table_head, uint32_t recno, const FLATREC_LOC *loc);
+void snapshot_free(RNDH *handle);
+
+#endif
@@ -0,0 +1,407 @@
+/** @file
+ *
+ * Operation counts, for `rnd_stats`, and latency histograms, for
+ * `rnd_latency`.
+ *
+ * Each count is kept twice: in the handle that did the work, and in the
+ * counts of the thread that did it.  Each has one writer, so counting
+ * takes no lock and no atomic addition, and can stay on in production.
+ * Other threads read the counts while they are written, so the writer
+ * loads and stores them atomically (see `STATS_BUMP`).  Threads whose
+ * own counts couldn't be allocated share counts, and add to them with an
+ * atomic addition.
+ *
+ * Latencies are recorded only while `stats_latency_enable` has turned
+ * them on, since each takes two reads of the clock, and only per thread.
+ * A thread's histogram of an operation has log-linear buckets, as HDR
+ * histograms do: each power of two is split into LATENCY_SUB buckets, so
+ * every latency is kept to within about 3% however long it is.
+ *
+ * The counts and histograms of the process are those of every thread,
+ * merged when read.  A thread registers its own on its first count, and
+ * as it exits they are folded into those of the threads before it.
+ */
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>     // for clock_gettime()
+
+/** Bits of a latency kept below its highest set bit. */
+#define LATENCY_SUB_BITS 5
+
+/** Buckets each power of two is split into. */
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+
+/** Highest bit of the longest latency told apart, 2^40 ns being about 18 minutes. */
+#define LATENCY_TOP_BIT 40
+
+/** Buckets of a histogram: one per value below 2 * LATENCY_SUB, then LATENCY_SUB per power of two. */
+#define LATENCY_BUCKETS (2 * LATENCY_SUB + (LATENCY_TOP_BIT - LATENCY_SUB_BITS) * LATENCY_SUB)
+
+/** A histogram of the latencies of an operation, in nanoseconds. */
+typedef struct stats_latency {
+   uint64_t buckets[LATENCY_BUCKETS];
+   uint64_t total;   /**< Sum of the latencies, for the mean */
+   uint64_t min;     /**< 0 until the first latency          */
+   uint64_t max;
+} STATS_LATENCY;
+
+/** A thread's counts, on the list of the process's threads. */
+typedef struct stats_thread_block {
+   RND_STATS                 counts;   /**< First, so a pointer to it is one to the block */
+   STATS_LATENCY             latency[RND_LATENCY_LIMIT];
+   struct stats_thread_block *next;
+} STATS_BLOCK;
+
+__thread RND_STATS *stats_thread;
+int stats_timing;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static STATS_BLOCK *stats_threads;   /**< Threads that are counting        */
+static STATS_BLOCK stats_exited;     /**< Counts of threads that have exited */
+
+/** Counts of threads whose own counts couldn't be allocated. */
+static STATS_BLOCK stats_homeless;
+
+#define STATS_WORDS (sizeof(RND_STATS) / sizeof(uint64_t))
+
+/**
+ * Adds every count of *from* to *into*.  Counts are read one word at a
+ * time, so those of a thread still counting may be a moment behind.
+ */
+void stats_merge(RND_STATS *into, const RND_STATS *from)
+{
+   uint64_t *to = (uint64_t*)into;
+   const uint64_t *add = (const uint64_t*)from;
+   uint32_t i;
+
+   if (into)
+      for (i = 0; i < STATS_WORDS; ++i)
+         STATS_BUMP(to[i], __atomic_load_n(&add[i], __ATOMIC_RELAXED));
+}
+
+static void stats_merge_latency(STATS_LATENCY *into, const STATS_LATENCY *from)
+{
+   uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+   uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+   uint32_t i;
+
+   for (i = 0; i < LATENCY_BUCKETS; ++i)
+      into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+
+   into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+
+   if (min && (!into->min || min < into->min))
+      into->min = min;
+   if (max > into->max)
+      into->max = max;
+}
+
+/**
+ * Destructor of *stats_key*, run as a thread exits, that folds its counts
+ * into those of exited threads.
+ */
+static void stats_thread_exit(void *block)
+{
+   STATS_BLOCK *exiting = (STATS_BLOCK*)block, **link;
+   int op;
+
+   pthread_mutex_lock(&stats_lock);
+
+   for (link = &stats_threads; *link; link = &(*link)->next)
+   {
+      if (*link == exiting)
+      {
+         *link = (*link)->next;
+         break;
+      }
+   }
+
+   stats_merge(&stats_exited.counts, &exiting->counts);
+   for (op = 0; op < RND_LATENCY_LIMIT; ++op)
+      stats_merge_latency(&stats_exited.latency[op], &exiting->latency[op]);
+
+   pthread_mutex_unlock(&stats_lock);
+
+   stats_thread = NULL;
+   free(block);
+}
+
+static void stats_make_key(void)
+{
+   pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/**
+ * Gives the calling thread counts of its own, for `STATS_ADD`.
+ *
+ * @return the thread's counts, or shared ones if they can't be allocated
+ */
+RND_STATS *stats_register_thread(void)
+{
+   STATS_BLOCK *block = (STATS_BLOCK*)calloc(1, sizeof(STATS_BLOCK));
+   if (!block)
+      return &stats_homeless.counts;
+
+   pthread_once(&stats_once, stats_make_key);
+   pthread_setspecific(stats_key, block);
+
+   pthread_mutex_lock(&stats_lock);
+   block->next = stats_threads;
+   stats_threads = block;
+   pthread_mutex_unlock(&stats_lock);
+
+   return stats_thread = &block->counts;
+}
+
+/**
+ * Gives a newly-opened handle counts of its own.  A handle without them
+ * is still counted in the counts of the process.
+ */
+void stats_open(RNDH *handle)
+{
+   handle->stats = (RND_STATS*)calloc(1, sizeof(RND_STATS));
+}
+
+void stats_close(RNDH *handle)
+{
+   free(handle->stats);
+   handle->stats = NULL;
+}
+
+/**
+ * Gets the counts of a handle, or of the process.
+ *
+ * @param handle  handle to an open recno database, or NULL for the counts
+ *                of every thread of the process, including those that
+ *                have exited
+ * @param stats   [out] the counts
+ */
+RND_ERROR stats_read(RNDH *handle, RND_STATS *stats)
+{
+   STATS_BLOCK *block;
+
+   memset(stats, 0, sizeof(*stats));
+
+   if (handle)
+   {
+      if (handle->stats)
+         stats_merge(stats, handle->stats);
+      return RND_SUCCESS;
+   }
+
+   pthread_mutex_lock(&stats_lock);
+
+   stats_merge(stats, &stats_exited.counts);
+   stats_merge(stats, &stats_homeless.counts);
+   for (block = stats_threads; block; block = block->next)
+      stats_merge(stats, &block->counts);
+
+   pthread_mutex_unlock(&stats_lock);
+   return RND_SUCCESS;
+}
+
+uint64_t stats_clock_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Finds the bucket of a latency: the latency itself below 2 * LATENCY_SUB,
+ * then its highest set bit and the LATENCY_SUB_BITS bits below it.
+ */
+static uint32_t stats_latency_bucket(uint64_t ns)
+{
+   if (ns < 2 * LATENCY_SUB)
+      return (uint32_t)ns;
+
+   uint32_t top = 63 - (uint32_t)__builtin_clzll(ns);
+   if (top > LATENCY_TOP_BIT)
+      return LATENCY_BUCKETS - 1;
+
+   uint32_t shift = top - LATENCY_SUB_BITS;
+   return 2 * LATENCY_SUB + (top - LATENCY_SUB_BITS - 1) * LATENCY_SUB
+      + (uint32_t)(ns >> shift) - LATENCY_SUB;
+}
+
+/** Returns the highest latency that falls in a bucket. */
+static uint64_t stats_latency_bucket_high(uint32_t bucket)
+{
+   if (bucket < 2 * LATENCY_SUB)
+      return bucket;
+
+   uint32_t above = bucket - 2 * LATENCY_SUB;
+   uint32_t shift = above / LATENCY_SUB + 1;
+   uint64_t sub = LATENCY_SUB + above % LATENCY_SUB;
+
+   return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Lowers (*lower*) or raises a bound of a histogram to *ns*, if that
+ * widens it.  A *shared* histogram may be changed by other threads
+ * meanwhile, so its bound is swapped in only if it hasn't changed.
+ */
+static void stats_widen(uint64_t *bound, uint64_t ns, bool lower, bool shared)
+{
+   uint64_t now = __atomic_load_n(bound, __ATOMIC_RELAXED);
+
+   while (lower ? (!now || ns < now) : ns > now)
+   {
+      if (!shared)
+      {
+         __atomic_store_n(bound, ns, __ATOMIC_RELAXED);
+         break;
+      }
+
+      if (__atomic_compare_exchange_n(bound, &now, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         break;
+   }
+}
+
+/**
+ * Adds the time since *started*, from `LATENCY_START`, to the calling
+ * thread's histogram of *op*, or to the shared one of threads whose own
+ * couldn't be allocated.
+ */
+void stats_record_latency(RND_LATENCY_OP op, uint64_t started)
+{
+   uint64_t ns = stats_clock_ns() - started;
+   RND_STATS *counts = stats_thread ? stats_thread : stats_register_thread();
+   STATS_LATENCY *latency = &((STATS_BLOCK*)counts)->latency[op];
+   bool shared = counts != stats_thread;
+   uint64_t *bucket = &latency->buckets[stats_latency_bucket(ns)];
+
+   if (shared)
+   {
+      __atomic_fetch_add(bucket, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&latency->total, ns, __ATOMIC_RELAXED);
+   }
+   else
+   {
+      STATS_BUMP(*bucket, 1);
+      STATS_BUMP(latency->total, ns);
+   }
+
+   // A latency of 0 is kept as 1, leaving 0 to mean none:
+   stats_widen(&latency->min, ns ? ns : 1, 1, shared);
+   stats_widen(&latency->max, ns, 0, shared);
+}
+
+/**
+ * Starts or stops recording latencies, in every thread.  Recording is
+ * off until it is started.
+ */
+void stats_latency_enable(bool enable)
+{
+   __atomic_store_n(&stats_timing, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Finds the latency that *per_100000* in 100,000 latencies of a histogram
+ * are no longer than, as the highest latency of its bucket.
+ */
+static uint64_t stats_latency_percentile(const STATS_LATENCY *latency, uint64_t count, uint64_t per_100000)
+{
+   uint64_t rank = (count * per_100000 + 99999) / 100000, seen = 0;
+   uint32_t i;
+
+   if (rank == 0)
+      rank = 1;
+
+   for (i = 0; i < LATENCY_BUCKETS; ++i)
+   {
+      if ((seen += latency->buckets[i]) >= rank)
+      {
+         uint64_t high = stats_latency_bucket_high(i);
+         return high < latency->max ? high : latency->max;
+      }
+   }
+
+   return latency->max;
+}
+
+static void stats_summarize_latency(const STATS_LATENCY *merged, RND_LATENCY *summary)
+{
+   uint64_t count = 0;
+   uint32_t i;
+
+   memset(summary, 0, sizeof(*summary));
+
+   for (i = 0; i < LATENCY_BUCKETS; ++i)
+      count += merged->buckets[i];
+
+   if (!count)
+      return;
+
+   summary->count = count;
+   summary->min = merged->min;
+   summary->mean = merged->total / count;
+   summary->p50 = stats_latency_percentile(merged, count, 50000);
+   summary->p90 = stats_latency_percentile(merged, count, 90000);
+   summary->p99 = stats_latency_percentile(merged, count, 99000);
+   summary->p999 = stats_latency_percentile(merged, count, 99900);
+   summary->max = merged->max;
+}
+
+/**
+ * Gets the latencies of an operation recorded by every thread of the
+ * process, including those that have exited.
+ *
+ * @param op       operation
+ * @param latency  [out] count, mean and percentiles, in nanoseconds, all
+ *                 0 if none were recorded
+ */
+RND_ERROR stats_latency(RND_LATENCY_OP op, RND_LATENCY *latency)
+{
+   STATS_LATENCY merged;
+   STATS_BLOCK *block;
+
+   if ((unsigned)op >= RND_LATENCY_LIMIT)
+      return RND_BAD_PARAMETER;
+
+   memset(&merged, 0, sizeof(merged));
+
+   pthread_mutex_lock(&stats_lock);
+
+   stats_merge_latency(&merged, &stats_exited.latency[op]);
+   stats_merge_latency(&merged, &stats_homeless.latency[op]);
+   for (block = stats_threads; block; block = block->next)
+      stats_merge_latency(&merged, &block->latency[op]);
+
+   pthread_mutex_unlock(&stats_lock);
+
+   stats_summarize_latency(&merged, latency);
+   return RND_SUCCESS;
+}
+
+/**
+ * Prints a table of the latencies of every operation, in microseconds.
+ */
+void stats_latency_print(FILE *out)
+{
+   static const char *names[RND_LATENCY_LIMIT] = { "get", "put", "delete", "lock", "extend" };
+   RND_LATENCY latency;
+   int op;
+
+   fprintf(out, "%-8s %10s %9s %9s %9s %9s %9s %9s %9s\n",
+           "op", "count", "min us", "mean us", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+   for (op = 0; op < RND_LATENCY_LIMIT; ++op)
+   {
+      stats_latency((RND_LATENCY_OP)op, &latency);
+      fprintf(out, "%-8s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+              names[op], (unsigned long)latency.count,
+              latency.min / 1000.0, latency.mean / 1000.0, latency.p50 / 1000.0,
+              latency.p90 / 1000.0, latency.p99 / 1000.0, latency.p999 / 1000.0,
+              latency.max / 1000.0);
+   }
+}
@@ -0,0 +1,67 @@
+#ifndef RECNODB_STATS_H
+#define RECNODB_STATS_H
+
+#include "recnodb.h"
+
+/** The calling thread's counts, NULL until its first count. */
+extern __thread RND_STATS *stats_thread;
+
+RND_STATS *stats_register_thread(void);
+
+/**
+ * Adds *n* to a count that only the calling thread writes.  Other threads
+ * may read it meanwhile, so it is loaded and stored atomically, which
+ * costs no more than a plain addition where words are read and written
+ * whole, as on x86-64.
+ */
+#define STATS_BUMP(count, n) \
+   __atomic_store_n(&(count), __atomic_load_n(&(count), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/**
+ * Adds *n* to *counter* of the handle's counts, if it has any, and of
+ * the calling thread's.  *handle* may be NULL.  A thread whose counts
+ * couldn't be allocated adds to counts shared with others like it, with
+ * an atomic addition.
+ */
+#define STATS_ADD(handle, counter, n)                                     \
+   do {                                                                   \
+      RNDH *stats_handle = (handle);                                      \
+      RND_STATS *stats_counts;                                            \
+      if (stats_handle && stats_handle->stats)                            \
+         STATS_BUMP(stats_handle->stats->counter, (n));                   \
+      stats_counts = stats_thread ? stats_thread : stats_register_thread(); \
+      if (stats_counts == stats_thread)                                   \
+         STATS_BUMP(stats_counts->counter, (n));                          \
+      else                                                                \
+         __atomic_fetch_add(&stats_counts->counter, (n), __ATOMIC_RELAXED); \
+   } while (0)
+
+/** Counts a call of a public function. */
+#define STATS_CALL(handle, call) STATS_ADD(handle, calls[call], 1)
+
+/** Nonzero while latencies are recorded, see `stats_latency_enable`. */
+extern int stats_timing;
+
+uint64_t stats_clock_ns(void);
+void stats_record_latency(RND_LATENCY_OP op, uint64_t started);
+
+/** Starts timing an operation: the time now, or 0 while latencies aren't recorded. */
+#define LATENCY_START() (__atomic_load_n(&stats_timing, __ATOMIC_RELAXED) ? stats_clock_ns() : 0)
+
+/** Records the latency of an operation timed by `LATENCY_START`, if it was timed. */
+#define LATENCY_RECORD(op, started)               \
+   do {                                           \
+      if (started)                                \
+         stats_record_latency((op), (started));   \
+   } while (0)
+
+void stats_open(RNDH *handle);
+void stats_close(RNDH *handle);
+void stats_merge(RND_STATS *into, const RND_STATS *from);
+RND_ERROR stats_read(RNDH *handle, RND_STATS *stats);
+
+void stats_latency_enable(bool enable);
+RND_ERROR stats_latency(RND_LATENCY_OP op, RND_LATENCY *latency);
+void stats_latency_print(FILE *out);
+
+#endif
@@ -0,0 +1,344 @@
+#include "backup.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/stat.h>   // for fstat()
+#include <sys/wait.h>   // for waitpid()
+
+#define RECORD_COUNT 20000
+#define COUNTERS 200
+#define ADDS 2000
+
+static uint64_t next_since;
+
+static void make_record(char *record, uint32_t recno, const char *state)
+{
+   memset(record, 0, 64);
+   snprintf(record, 64, "order %u %s", recno, state);
+}
+
+static RND_ERROR put_state(RNDH *handle, uint32_t recno, const char *state)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_RECNO rn = recno;
+
+   make_record(record, recno, state);
+   return rnd_put(handle, &rn, &data);
+}
+
+/**
+ * Backs up the file into *stream*, then applies the stream to the copy.
+ *
+ * @return bytes in the stream, or 0 on failure
+ */
+static off_t backup_and_apply(RNDH *handle, const char *stream)
+{
+   int fd = open(stream, O_RDWR | O_CREAT | O_TRUNC, 0666);
+   struct stat st;
+   RND_ERROR err;
+
+   if (fd < 0)
+      return 0;
+
+   if ((err = rnd_backup_incremental(handle, next_since, fd, &next_since))
+       || fstat(fd, &st)
+       || lseek(fd, 0, SEEK_SET)
+       || (err = rnd_backup_apply("restored.db", fd)))
+   {
+      fprintf(stderr, "Backing up to %s failed (%s).\n", stream, rnd_strerror(err, handle));
+      close(fd);
+      return 0;
+   }
+
+   close(fd);
+   return st.st_size;
+}
+
+/**
+ * Confirms that the copy holds the same live records as the file.
+ */
+static bool copy_matches(RNDH *handle)
+{
+   RNDH copy;
+   RND_RECNO count, copy_count;
+   bool matches = 1;
+   uint32_t recno;
+
+   if (rnd_open_raw(&copy, "restored.db", 0, 0))
+   {
+      fprintf(stderr, "The copy won't open.\n");
+      return 0;
+   }
+
+   if (rnd_count(handle, &count) || rnd_count(&copy, &copy_count) || count != copy_count)
+   {
+      fprintf(stderr, "The copy has %u records, the file %u.\n", copy_count, count);
+      matches = 0;
+   }
+
+   uint32_t last = 0;
+   fflush(handle->file);
+   blocks_read_at(handle, offsetof(RND_HEAD_FILE, thead) + offsetof(INFO_TABLE, last_recno), &last, sizeof(last));
+
+   for (recno = 1; matches && recno <= last; ++recno)
+   {
+      char record[64], copied[64];
+      RND_DATA data = { record, sizeof(record) }, copy_data = { copied, sizeof(copied) };
+      RND_ERROR err = rnd_get(handle, recno, &data), copy_err = rnd_get(&copy, recno, &copy_data);
+
+      if (err != copy_err || (!err && memcmp(record, copied, sizeof(record))))
+      {
+         fprintf(stderr, "Record %u differs in the copy.\n", recno);
+         matches = 0;
+      }
+   }
+
+   rnd_close_raw(&copy);
+   return matches;
+}
+
+void make_orders(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   uint32_t i;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { record, sizeof(record) };
+
+      make_record(record, i, "open");
+      if (rnd_put(handle, &recno, &data))
+         return;
+   }
+
+   *passed = 1;
+}
+
+/**
+ * Takes a full backup, then incremental ones after a few changes, and
+ * checks that each brings the copy up to date with fewer bytes.
+ */
+void test_incremental(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   uint64_t previous;
+   RND_RECNO recno = 0;
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+
+   off_t full = backup_and_apply(handle, "backup.0");
+   if (!full || !copy_matches(handle))
+      return;
+
+   make_record(record, RECORD_COUNT + 1, "new");
+   if (put_state(handle, 5, "paid") || rnd_delete(handle, 7)
+       || rnd_fetch_add_field(handle, 15000, 56, 8, 9, &previous)
+       || rnd_put(handle, &recno, &data))
+      return;
+
+   off_t changed = backup_and_apply(handle, "backup.1");
+   if (!changed || !copy_matches(handle))
+      return;
+
+   off_t unchanged = backup_and_apply(handle, "backup.2");
+   if (!unchanged || !copy_matches(handle))
+      return;
+
+   if (changed * 4 > full || unchanged > changed)
+   {
+      fprintf(stderr, "Backups took %ld bytes in full, %ld after changes, %ld with none.\n",
+              (long)full, (long)changed, (long)unchanged);
+      return;
+   }
+
+   printf("Incremental backups (%ld, %ld bytes) bring a copy up to date, as a full one (%ld bytes) did.\n",
+          (long)changed, (long)unchanged, (long)full);
+   *passed = 1;
+}
+
+void add_to_counters(RNDH *handle, void *closure)
+{
+   uint64_t previous;
+   uint32_t i;
+
+   for (i = 0; i < ADDS; ++i)
+   {
+      uint32_t recno = 1 + (i * 97) % COUNTERS * (RECORD_COUNT / COUNTERS);
+
+      // A backup may hold the record's piece for a moment:
+      while (rnd_fetch_add_field(handle, recno, 56, 8, 1, &previous) == RND_LOCK_FAILED)
+         ;
+   }
+}
+
+/**
+ * Backs up repeatedly while another process writes, then checks that one
+ * more backup taken after the writer stops brings the copy up to date.
+ */
+void test_hot_backup(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   int status, rounds = 0;
+   char stream[32];
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      rnd_open("backup.db", 0, 0, add_to_counters, NULL);
+      _exit(0);
+   }
+
+   while (waitpid(child, &status, WNOHANG) == 0)
+   {
+      snprintf(stream, sizeof(stream), "backup.%d", 3 + rounds++ % 2);
+      if (!backup_and_apply(handle, stream))
+      {
+         waitpid(child, &status, 0);
+         return;
+      }
+   }
+
+   if (backup_and_apply(handle, "backup.5") && copy_matches(handle))
+   {
+      printf("Backups taken alongside a writer (%d) miss nothing.\n", rounds);
+      *passed = 1;
+   }
+}
+
+/** Offset of the key index's INFO_INDEX::bytes_used, from its head. */
+#define INDEX_BYTES_USED (offsetof(RND_HEAD_INDEX, ihead) + offsetof(INFO_INDEX, bytes_used))
+
+struct index_changer {
+   off_t head;       /**< Head of the key index            */
+   int   ready_fd;   /**< Written once the change is begun */
+   char  pad[4];
+};
+
+/**
+ * Changes the key index head under its lock, as an index operation
+ * would, leaving it changed for a moment before putting it back.
+ */
+void change_index_head(RNDH *handle, void *closure)
+{
+   struct index_changer *changer = (struct index_changer*)closure;
+   BLOCK_LOC bl = { changer->head, sizeof(RND_HEAD_INDEX) };
+   uint64_t original, changed;
+
+   if (rnd_lock_place(handle, &bl, 1)
+       || fflush(handle->file)
+       || blocks_read_at(handle, changer->head + INDEX_BYTES_USED, &original, sizeof(original)))
+      return;
+
+   changed = original + 1000;
+   if (blocks_write_at(handle, changer->head + INDEX_BYTES_USED, &changed, sizeof(changed))
+       || fflush(handle->file)
+       || write(changer->ready_fd, "", 1) != 1)
+      return;
+
+   usleep(300000);
+
+   blocks_write_at(handle, changer->head + INDEX_BYTES_USED, &original, sizeof(original));
+   fflush(handle->file);
+   rnd_lock_remove(handle, &bl);
+}
+
+/**
+ * Backs up while another process is partway through changing the key
+ * index, and checks that the backup waited to copy the index head.
+ */
+void test_index_held(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char key_bytes[] = "order 12";
+   RND_DATA key = { key_bytes, sizeof(key_bytes) };
+   struct index_changer changer = { 0 };
+   uint64_t live = 0, copied = 1;
+   int ready_pipe[2], status;
+   char ready;
+   RNDH copy;
+
+   if (rnd_index_put(handle, &key, 12) || fflush(handle->file)
+       || blocks_read_at(handle, offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, index_head),
+                         &changer.head, sizeof(changer.head))
+       || pipe(ready_pipe))
+   {
+      fprintf(stderr, "Failed to set up the held index test.\n");
+      return;
+   }
+
+   changer.ready_fd = ready_pipe[1];
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      rnd_open("backup.db", 0, 0, change_index_head, &changer);
+      _exit(0);
+   }
+
+   bool backed_up = child != -1 && read(ready_pipe[0], &ready, 1) == 1
+      && backup_and_apply(handle, "backup.6");
+
+   waitpid(child, &status, 0);
+   close(ready_pipe[0]);
+   close(ready_pipe[1]);
+
+   if (!backed_up || fflush(handle->file)
+       || blocks_read_at(handle, changer.head + INDEX_BYTES_USED, &live, sizeof(live)))
+      return;
+
+   if (!rnd_open_raw(&copy, "restored.db", 0, 0))
+   {
+      blocks_read_at(&copy, changer.head + INDEX_BYTES_USED, &copied, sizeof(copied));
+      rnd_close_raw(&copy);
+   }
+
+   if (copied != live)
+      fprintf(stderr, "The copy's index head reads %lu bytes used, the file's %lu.\n",
+              (unsigned long)copied, (unsigned long)live);
+   else
+   {
+      printf("Backups wait for index writers rather than copy a change half-made.\n");
+      *passed = 1;
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   bool made = 0, incremental_passed = 0, hot_passed = 0, index_passed = 0;
+
+   rnd_open("backup.db", 64, RND_CREATE, make_orders, &made);
+   if (!made)
+      return 1;
+
+   rnd_open("backup.db", 0, 0, test_incremental, &incremental_passed);
+   rnd_open("backup.db", 0, 0, test_hot_backup, &hot_passed);
+   rnd_open("backup.db", 0, 0, test_index_held, &index_passed);
+
+   return incremental_passed && hot_passed && index_passed ? 0 : 1;
+}
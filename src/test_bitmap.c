@@ -0,0 +1,81 @@
+#include "bitmap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bitmap.c"
+
+/**
+ * Compare the dispatched popcount and searches against bit-at-a-time answers.
+ */
+bool test_against_naive(const uint64_t *words, uint64_t nbits)
+{
+   uint64_t expected = 0, bit;
+   for (bit = 0; bit < nbits; ++bit)
+      expected += bitmap_test(words, bit);
+
+   if (bitmap_popcount(words, nbits) != expected)
+   {
+      fprintf(stderr, "popcount of %lu bits is %lu, expected %lu.\n",
+              nbits, bitmap_popcount(words, nbits), expected);
+      return 0;
+   }
+
+   for (bit = 0; bit < nbits; bit += 7)
+   {
+      int64_t set = -1, clear = -1;
+      uint64_t probe;
+      for (probe = bit; probe < nbits && set < 0; ++probe)
+         if (bitmap_test(words, probe))
+            set = probe;
+      for (probe = bit; probe < nbits && clear < 0; ++probe)
+         if (!bitmap_test(words, probe))
+            clear = probe;
+
+      if (bitmap_next_set(words, nbits, bit) != set
+          || bitmap_next_clear(words, nbits, bit) != clear)
+      {
+         fprintf(stderr, "search from bit %lu disagrees (set %ld/%ld, clear %ld/%ld).\n",
+                 bit,
+                 bitmap_next_set(words, nbits, bit), set,
+                 bitmap_next_clear(words, nbits, bit), clear);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+int main(int argc, const char **argv)
+{
+   uint64_t words[40];
+   uint64_t seed = 88172645463325252ULL;
+   int i;
+
+   // Sparse, dense and random maps, with lengths that end mid-word:
+   memset(words, 0, sizeof(words));
+   bitmap_set(words, 5);
+   bitmap_set(words, 1000);
+   bitmap_set(words, 2500);
+   if (!test_against_naive(words, 2555))
+      return 1;
+
+   memset(words, 0xff, sizeof(words));
+   bitmap_clear(words, 700);
+   bitmap_clear(words, 2001);
+   if (!test_against_naive(words, 2499))
+      return 1;
+
+   for (i = 0; i < 40; ++i)
+   {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      words[i] = seed;
+   }
+   if (!test_against_naive(words, 40 * 64) || !test_against_naive(words, 1234))
+      return 1;
+
+   printf("All bitmap tests were successful.\n");
+   return 0;
+}
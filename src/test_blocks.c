@@ -8,9 +8,28 @@
 #include "recnodb.h"
 #include "chains.h"
 
+#include "recnodb.c"
 #include "blocks.c"
 #include "chains.c"
 #include "extra.c"
+#include "cache.c"
+#include "compress.c"
+#include "locks.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "bitmap.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
 
 #define MODE_NEW_OR_TRUNCATE "w+b"
 #define MODE_OPEN_EXISTING "r+b"
@@ -0,0 +1,369 @@
+#include "btree.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/wait.h>   // for waitpid()
+
+#define RECORD_COUNT 20000
+
+typedef struct reading {
+   uint64_t timestamp;
+   int32_t  temperature;
+   float    pressure;
+   char     station[16];
+} READING;
+
+static off_t time_index, temperature_index, pressure_index;
+
+/**
+ * Makes the contents of a record from its recno and a generation, so
+ * replaced records differ from the originals.
+ */
+static void make_reading(READING *rd, uint32_t recno, uint32_t generation)
+{
+   memset(rd, 0, sizeof(*rd));
+   rd->timestamp = 1700000000ULL + (recno * 7919ULL + generation * 104729ULL) % 1000003ULL;
+   rd->temperature = (int32_t)((recno * 31 + generation) % 200) - 100;
+   rd->pressure = (float)((int)(recno % 97) - 48) / 4.0f;
+   snprintf(rd->station, sizeof(rd->station), "st-%u", recno % 13);
+}
+
+/** Collects the recnos sent by `btree_range`. */
+struct range_tally {
+   uint32_t *recnos;
+   uint32_t count;
+   char     pad[4];
+};
+
+bool tally_range(RND_RECNO recno, void *closure)
+{
+   struct range_tally *tally = (struct range_tally*)closure;
+   tally->recnos[tally->count++] = recno;
+   return 1;
+}
+
+/**
+ * Compares a range from an index with a scan of every record.
+ *
+ * @param field  the indexed field, to find its value in each record
+ */
+static bool check_range(RNDH *handle,
+                        off_t index,
+                        const RND_FIELD *field,
+                        const void *low,
+                        const void *high)
+{
+   static uint32_t recnos[RECORD_COUNT];
+   struct range_tally tally = { recnos };
+   RND_ERROR err;
+
+   if ((err = btree_range(handle, index, low, high, tally_range, &tally)))
+   {
+      fprintf(stderr, "Range iteration failed (%s).\n", rnd_strerror(err, handle));
+      return 0;
+   }
+
+   uint64_t low_key = low ? btree_field_key(field->type, field->width, low) : 0;
+   uint64_t high_key = high ? btree_field_key(field->type, field->width, high) : UINT64_MAX;
+   uint64_t prev_key = 0;
+   uint32_t expected = 0, i;
+   READING rd;
+
+   // The index must return the records in field order:
+   for (i = 0; i < tally.count; ++i)
+   {
+      RND_DATA data = { &rd, sizeof(rd) };
+      if ((err = rnd_get(handle, recnos[i], &data)))
+      {
+         fprintf(stderr, "Index returned unreadable record %u (%s).\n", recnos[i], rnd_strerror(err, handle));
+         return 0;
+      }
+
+      uint64_t key = btree_field_key(field->type, field->width, (char*)&rd + field->offset);
+      if (key < low_key || key > high_key || key < prev_key)
+      {
+         fprintf(stderr, "Index returned record %u out of range or order.\n", recnos[i]);
+         return 0;
+      }
+      prev_key = key;
+   }
+
+   // And every record in the range:
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_DATA data = { &rd, sizeof(rd) };
+      if (rnd_get(handle, i, &data) == RND_SUCCESS)
+      {
+         uint64_t key = btree_field_key(field->type, field->width, (char*)&rd + field->offset);
+         if (key >= low_key && key <= high_key)
+            ++expected;
+      }
+   }
+
+   if (expected != tally.count)
+   {
+      fprintf(stderr, "Index found %u records, a scan found %u.\n", tally.count, expected);
+      return 0;
+   }
+
+   return 1;
+}
+
+static const RND_FIELD time_field = { offsetof(READING, timestamp), 8, RND_FIELD_UINT };
+static const RND_FIELD temperature_field = { offsetof(READING, temperature), 4, RND_FIELD_INT };
+static const RND_FIELD pressure_field = { offsetof(READING, pressure), 4, RND_FIELD_FLOAT };
+
+static bool check_ranges(RNDH *handle)
+{
+   uint64_t t1 = 1700100000ULL, t2 = 1700300000ULL;
+   int32_t cold = -40, mild = 15;
+   float low = -3.5f, high = 2.25f;
+
+   return check_range(handle, time_index, &time_field, &t1, &t2)
+      && check_range(handle, time_index, &time_field, NULL, &t1)
+      && check_range(handle, time_index, &time_field, &t2, NULL)
+      && check_range(handle, temperature_index, &temperature_field, &cold, &mild)
+      && check_range(handle, temperature_index, &temperature_field, &mild, &mild)
+      && check_range(handle, pressure_index, &pressure_field, &low, &high)
+      && check_range(handle, pressure_index, &pressure_field, NULL, NULL);
+}
+
+/**
+ * Bulk-builds indexes over half of the records, then appends, replaces
+ * and deletes records and confirms that the indexes keep up.
+ */
+void test_btree_operations(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   READING rd;
+   uint32_t i;
+
+   for (i = 1; i <= RECORD_COUNT / 2; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { &rd, sizeof(rd) };
+      make_reading(&rd, i, 0);
+
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Append of record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   if ((err = btree_create(handle, 0, &time_field, &time_index))
+       || (err = btree_create(handle, 0, &temperature_field, &temperature_index))
+       || (err = btree_create(handle, 0, &pressure_field, &pressure_index)))
+   {
+      fprintf(stderr, "Creating the indexes failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   RND_FIELD bad_field = { sizeof(READING) - 2, 4, RND_FIELD_UINT };
+   off_t bad_index;
+   if (btree_create(handle, 0, &bad_field, &bad_index) != RND_BAD_PARAMETER)
+   {
+      fprintf(stderr, "A field past the end of the record was accepted.\n");
+      return;
+   }
+
+   for (i = RECORD_COUNT / 2 + 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { &rd, sizeof(rd) };
+      make_reading(&rd, i, 0);
+
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Indexed append of record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   // Replace every third record, delete every eleventh:
+   for (i = 3; i <= RECORD_COUNT; i += 3)
+   {
+      RND_RECNO recno = i;
+      RND_DATA data = { &rd, sizeof(rd) };
+      make_reading(&rd, i, 1);
+
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Replacing record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   for (i = 11; i <= RECORD_COUNT; i += 11)
+   {
+      if ((err = rnd_delete(handle, i)))
+      {
+         fprintf(stderr, "Deleting record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   // Update an indexed field of every fifth record, and an unindexed one of every fourth:
+   for (i = 5; i <= RECORD_COUNT; i += 5)
+   {
+      int32_t temperature = (int32_t)(i % 150) - 60;
+      err = rnd_update_field(handle, i, offsetof(READING, temperature), sizeof(temperature), &temperature);
+      if (err && !(err == RND_EXTINCT_RECORD && i % 11 == 0))
+      {
+         fprintf(stderr, "Updating record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   for (i = 4; i <= RECORD_COUNT; i += 4)
+   {
+      err = rnd_update_field(handle, i, offsetof(READING, station), 6, "moved");
+      if (err && !(err == RND_EXTINCT_RECORD && i % 11 == 0))
+      {
+         fprintf(stderr, "Updating record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   RND_HEAD_BTREE hb;
+   blocks_read_at(handle, time_index, &hb, sizeof(hb));
+   printf("Time index has %lu entries, %u levels.\n", (unsigned long)hb.bthead.entries, hb.bthead.height);
+
+   if (hb.bthead.entries != RECORD_COUNT - RECORD_COUNT / 11)
+   {
+      fprintf(stderr, "Time index counts %lu entries.\n", (unsigned long)hb.bthead.entries);
+      return;
+   }
+
+   if (check_ranges(handle))
+      *passed = 1;
+}
+
+/**
+ * Reopens the file to confirm that the indexes persist.
+ */
+void test_btree_persists(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+
+   if (check_ranges(handle))
+   {
+      printf("Reopened indexes agree with a scan of every record.\n");
+      *passed = 1;
+   }
+}
+
+struct head_reader {
+   int  ready_fd;   /**< Written once the index head is held */
+   bool held;
+};
+
+/**
+ * Holds the temperature index head as a range does, for a moment.
+ */
+void hold_btree_head(RNDH *handle, void *closure)
+{
+   struct head_reader *reader = (struct head_reader*)closure;
+   BLOCK_LOC bl = { temperature_index, sizeof(RND_HEAD_BTREE) };
+
+   if (rnd_lock_place_shared(handle, &bl, 0) || write(reader->ready_fd, "", 1) != 1)
+      return;
+
+   usleep(300000);
+   rnd_lock_remove(handle, &bl);
+   reader->held = 1;
+}
+
+/**
+ * Iterates a range while another process is in the middle of one, and
+ * confirms that only a change to the index is kept out.
+ */
+void test_shared_ranges(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   int32_t cold = -40, mild = 15;
+   int ready_pipe[2], status;
+   bool ranged;
+   char ready;
+   READING rd;
+   RND_DATA data = { &rd, sizeof(rd) };
+   RND_RECNO recno = 1;
+   RND_ERROR put_err;
+
+   if (pipe(ready_pipe) || rnd_get(handle, recno, &data))
+      return;
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      struct head_reader reader = { ready_pipe[1], 0 };
+      rnd_open("btree.db", 0, 0, hold_btree_head, &reader);
+      _exit(reader.held ? 0 : 1);
+   }
+
+   if (child == -1 || read(ready_pipe[0], &ready, 1) != 1)
+   {
+      fprintf(stderr, "The index head holder did not start.\n");
+      return;
+   }
+
+   // The change first, as checking the range takes a while after the
+   // iteration itself:
+   rd.temperature = rd.temperature == mild ? cold : mild;
+   put_err = rnd_put(handle, &recno, &data);
+
+   ranged = check_range(handle, temperature_index, &temperature_field, &cold, &mild);
+
+   close(ready_pipe[0]);
+   close(ready_pipe[1]);
+
+   if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+      fprintf(stderr, "The index head holder failed.\n");
+   else if (!ranged)
+      fprintf(stderr, "A range beside another range failed.\n");
+   else if (put_err != RND_LOCK_FAILED)
+      fprintf(stderr, "Changing an indexed field beside a range returned %s.\n", rnd_strerror(put_err, handle));
+   else if (check_ranges(handle))
+   {
+      printf("Ranges run alongside each other and keep changes out.\n");
+      *passed = 1;
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   bool operations_passed = 0, persist_passed = 0, shared_passed = 0;
+
+   rnd_open("btree.db", sizeof(READING), RND_CREATE, test_btree_operations, &operations_passed);
+   if (operations_passed)
+   {
+      rnd_open("btree.db", 0, 0, test_btree_persists, &persist_passed);
+      rnd_open("btree.db", 0, 0, test_shared_ranges, &shared_passed);
+   }
+
+   return operations_passed && persist_passed && shared_passed ? 0 : 1;
+}
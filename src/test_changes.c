@@ -0,0 +1,284 @@
+#include "changes.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/wait.h>   // for waitpid()
+
+#define RECORD_COUNT 1000
+#define MANY_CHANGES 10000
+
+typedef struct seen_changes {
+   RND_RECNO     recno[16];
+   RND_CHANGE_OP op[16];
+   uint64_t      generation[16];
+   uint32_t      count;
+   uint32_t      stop_after;
+} SEEN;
+
+static void make_record(char *record, uint32_t recno, const char *state)
+{
+   memset(record, 0, 64);
+   snprintf(record, 64, "order %u %s", recno, state);
+}
+
+static RND_ERROR put_state(RNDH *handle, uint32_t recno, const char *state)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_RECNO rn = recno;
+
+   make_record(record, recno, state);
+   return rnd_put(handle, &rn, &data);
+}
+
+static bool note_change(RND_RECNO recno, RND_CHANGE_OP op, uint64_t generation, void *closure)
+{
+   SEEN *seen = (SEEN*)closure;
+
+   if (seen->count < 16)
+   {
+      seen->recno[seen->count] = recno;
+      seen->op[seen->count] = op;
+      seen->generation[seen->count] = generation;
+   }
+
+   return ++seen->count != seen->stop_after;
+}
+
+static bool count_change(RND_RECNO recno, RND_CHANGE_OP op, uint64_t generation, void *closure)
+{
+   uint32_t *expected = (uint32_t*)closure;
+
+   if (recno != *expected % RECORD_COUNT + 1 || op != RND_CHANGE_PUT)
+   {
+      fprintf(stderr, "Change %u is %u to record %u.\n", *expected, (unsigned)op, recno);
+      return 0;
+   }
+
+   ++*expected;
+   return 1;
+}
+
+void make_orders(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   uint32_t i;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { record, sizeof(record) };
+
+      make_record(record, i, "open");
+      if (rnd_put(handle, &recno, &data))
+         return;
+   }
+
+   *passed = 1;
+}
+
+/**
+ * Changes records in each way a record can change and checks that the
+ * feed reports them in order, and nothing from before it was enabled.
+ */
+void test_feed(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   uint64_t position = 0, previous;
+   SEEN seen = { { 0 } };
+   RND_RECNO appended = 0;
+   RND_TXN *txn;
+   RND_ERROR err;
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+
+   // Before the feed is enabled, nothing is logged and nothing is sent:
+   put_state(handle, 1, "early");
+   if ((err = rnd_changes_since(handle, &position, note_change, &seen)) || seen.count || position)
+   {
+      fprintf(stderr, "A feed that isn't enabled sent %u changes (%s).\n", seen.count, rnd_strerror(err, handle));
+      return;
+   }
+
+   make_record(record, RECORD_COUNT + 1, "new");
+
+   if ((err = rnd_changes_enable(handle))
+       || (err = rnd_changes_enable(handle))
+       || (err = put_state(handle, 10, "paid"))
+       || (err = rnd_delete(handle, 20))
+       || (err = rnd_put(handle, &appended, &data))
+       || (err = rnd_fetch_add_field(handle, 30, 56, 8, 1, &previous))
+       || (err = rnd_txn_begin(handle, &txn))
+       || (err = txn_write(txn, 0, 40, "order 40 shipped", 17))
+       || (err = rnd_txn_delete(txn, 41))
+       || (err = rnd_txn_commit(txn)))
+   {
+      fprintf(stderr, "Changing records failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   // A failed compare changes nothing, so logs nothing:
+   rnd_cas_field(handle, 30, 56, 8, 99, 100, &previous);
+
+   static const RND_RECNO recnos[] = { 10, 20, 0, 30, 40, 41 };
+   static const RND_CHANGE_OP ops[] = { RND_CHANGE_PUT, RND_CHANGE_DELETE, RND_CHANGE_APPEND,
+                                        RND_CHANGE_FIELD, RND_CHANGE_PUT, RND_CHANGE_DELETE };
+   uint32_t i;
+
+   // Read in two calls, the first stopped by the viewer:
+   seen.stop_after = 2;
+   if ((err = rnd_changes_since(handle, &position, note_change, &seen)) || position != 2
+       || (err = rnd_changes_since(handle, &position, note_change, &seen)) || position != 6 || seen.count != 6)
+   {
+      fprintf(stderr, "The feed sent %u changes, up to %lu (%s).\n",
+              seen.count, (unsigned long)position, rnd_strerror(err, handle));
+      return;
+   }
+
+   for (i = 0; i < 6; ++i)
+   {
+      RND_RECNO expected = recnos[i] ? recnos[i] : appended;
+      if (seen.recno[i] != expected || seen.op[i] != ops[i]
+          || (i && seen.generation[i] < seen.generation[i - 1]))
+      {
+         fprintf(stderr, "Change %u is %u to record %u, expected %u to %u.\n",
+                 i, (unsigned)seen.op[i], seen.recno[i], (unsigned)ops[i], expected);
+         return;
+      }
+   }
+
+   printf("The feed reports each kind of change, in order.\n");
+   *passed = 1;
+}
+
+/**
+ * Makes enough changes to fill several blocks of the log, then reads
+ * them all, and reads on from a position in the middle.
+ */
+void test_many_changes(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   uint64_t start = 0, position;
+   uint32_t i, expected;
+   SEEN seen = { { 0 } };
+
+   rnd_changes_since(handle, &start, note_change, &seen);
+
+   for (i = 0; i < MANY_CHANGES; ++i)
+      if (put_state(handle, i % RECORD_COUNT + 1, "busy"))
+         return;
+
+   position = start;
+   expected = 0;
+   if (rnd_changes_since(handle, &position, count_change, &expected)
+       || expected != MANY_CHANGES || position != start + MANY_CHANGES)
+   {
+      fprintf(stderr, "Read %u of %u changes.\n", expected, MANY_CHANGES);
+      return;
+   }
+
+   position = start + 7777;
+   expected = 7777;
+   if (rnd_changes_since(handle, &position, count_change, &expected) || expected != MANY_CHANGES)
+   {
+      fprintf(stderr, "Read from the middle up to change %u.\n", expected);
+      return;
+   }
+
+   printf("A feed of %u changes spans blocks and reads from any position.\n", MANY_CHANGES);
+   *passed = 1;
+}
+
+void change_in_child(RNDH *handle, void *closure)
+{
+   struct timespec pause = { 0, 200 * 1000000 };
+   nanosleep(&pause, NULL);
+   put_state(handle, 50, "changed elsewhere");
+}
+
+/**
+ * Waits for a change made by another process, then waits for one that
+ * never comes.
+ */
+void test_wait(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   uint64_t position = 0;
+   SEEN seen = { { 0 } };
+   bool arrived = 0;
+   RND_ERROR err;
+
+   seen.stop_after = 0;
+   rnd_changes_since(handle, &position, note_change, &seen);
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      rnd_open("changes.db", 0, 0, change_in_child, NULL);
+      _exit(0);
+   }
+
+   err = rnd_changes_wait(handle, position, 5000, &arrived);
+   waitpid(child, NULL, 0);
+
+   if (err || !arrived)
+   {
+      fprintf(stderr, "The change from another process didn't arrive (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   memset(&seen, 0, sizeof(seen));
+   if (rnd_changes_since(handle, &position, note_change, &seen) || seen.count != 1 || seen.recno[0] != 50)
+   {
+      fprintf(stderr, "The feed sent %u changes after the wait.\n", seen.count);
+      return;
+   }
+
+   if ((err = rnd_changes_wait(handle, position, 50, &arrived)) || arrived)
+   {
+      fprintf(stderr, "A wait with no change didn't time out (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   printf("Waits wake for changes from other processes, and time out.\n");
+   *passed = 1;
+}
+
+int main(int argc, const char **argv)
+{
+   bool made = 0, feed_passed = 0, many_passed = 0, wait_passed = 0;
+
+   rnd_open("changes.db", 64, RND_CREATE, make_orders, &made);
+   if (!made)
+      return 1;
+
+   rnd_open("changes.db", 0, 0, test_feed, &feed_passed);
+   rnd_open("changes.db", 0, 0, test_many_changes, &many_passed);
+   rnd_open("changes.db", 0, 0, test_wait, &wait_passed);
+
+   return feed_passed && many_passed && wait_passed ? 0 : 1;
+}
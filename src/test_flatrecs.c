@@ -9,12 +9,31 @@
 #include "chains.c"
 #include "extra.c"
 #include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
 
 #include "flatrecs.h"
 #include "flatrecs.c"
 
 #include <sys/types.h>   // for stat() in get_file_size()
 #include <sys/stat.h>    // for stat() in get_file_size()
+#include <sys/wait.h>    // for wait() in test_concurrent_counter()
+#include <sys/resource.h> // for setrlimit() in test_append_errors()
+#include <signal.h>      // for SIGXFSZ in test_append_errors()
 
 char default_file_path[] = "basic3.db";
 const char *g_filepath = default_file_path;
@@ -79,14 +98,14 @@ bool fake_file_table(RNDH           *handle,
  * Upon entering this callback function, we have a handle to a table (and the
  * file, BTW).  It's here that we can start testing various flatrecs functions.
  */
-bool callback_for_test_get_next_offset(RNDH           *handle,
-                                       RND_HEAD_TABLE *head_table,
-                                       off_t          offset_new_record,
-                                       void           *closure)
+bool callback_for_test_get_next_offset(RNDH              *handle,
+                                       RND_HEAD_TABLE    *head_table,
+                                       const FLATREC_LOC *loc,
+                                       void              *closure)
 {
-   // printf("We got a locked header at %#lx.\n", offset_new_record);
+   // printf("We got a locked header at %#lx.\n", loc->record_offset);
    // printf("The record size is %u.\n", flatrecs_full_recsize(head_table));
-   printf("The offset to the next record is %lu.\n", offset_new_record);
+   printf("The offset to the next record is %lu.\n", loc->record_offset);
 
    fake_file_table(handle, head_table, 20, closure);
    fake_file_table(handle, head_table, 80, closure);
@@ -121,6 +140,1348 @@ void run_test_user(RNDH *handle, void *closure)
    test_get_next_offset(handle, closure);
 }
 
+/**
+ * Appends records, deletes some, and confirms that reads, counts and
+ * searches agree with the liveness maps.
+ */
+void test_record_liveness(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   uint32_t recno, count;
+   uint32_t rec_size = handle->head_file.thead.rec_size;
+   char record[rec_size];
+   int i, records_to_add = 500;
+
+   for (i = 1; i <= records_to_add; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "record %d", i);
+
+      if ((err = flatrecs_append_record(handle, 0, record, sizeof(record), &recno)))
+      {
+         fprintf(stderr, "Append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+      else if (recno != (uint32_t)i)
+      {
+         fprintf(stderr, "Append returned recno %u, expected %d.\n", recno, i);
+         return;
+      }
+   }
+
+   // Delete every tenth record, and the first two
+   for (i = 10; i <= records_to_add; i += 10)
+      flatrecs_delete_record(handle, 0, i);
+   flatrecs_delete_record(handle, 0, 1);
+   flatrecs_delete_record(handle, 0, 2);
+
+   if ((err = flatrecs_count_live(handle, 0, &count)))
+      fprintf(stderr, "Count failed (%s).\n", rnd_strerror(err, handle));
+   else if (count != (uint32_t)(records_to_add - records_to_add / 10 - 2))
+      fprintf(stderr, "Counted %u live records, expected %d.\n", count, records_to_add - 52);
+   else if ((err = flatrecs_next_live(handle, 0, 1, &recno)) || recno != 3)
+      fprintf(stderr, "First live record is %u, expected 3.\n", recno);
+   else if ((err = flatrecs_next_live(handle, 0, 300, &recno)) || recno != 301)
+      fprintf(stderr, "Live record after 300 is %u, expected 301.\n", recno);
+   else if ((err = flatrecs_first_free(handle, 0, &recno)) || recno != 1)
+      fprintf(stderr, "First free record is %u, expected 1.\n", recno);
+   else
+   {
+      uint32_t size = sizeof(record);
+      if ((err = flatrecs_read_record(handle, 0, 10, record, &size)) != RND_EXTINCT_RECORD)
+         fprintf(stderr, "Reading deleted record 10 did not report an extinct record.\n");
+      else if ((err = flatrecs_read_record(handle, 0, 437, record, &size)))
+         fprintf(stderr, "Failed to read record 437 (%s).\n", rnd_strerror(err, handle));
+      else if (strcmp(record, "record 437"))
+         fprintf(stderr, "Record 437 contains \"%s\".\n", record);
+      else
+      {
+         printf("%u live records, liveness maps agree with deletions.\n", count);
+         *passed = 1;
+      }
+   }
+}
+
+/**
+ * Compresses the cold blocks of a table of repetitive records, then
+ * confirms that reads, counts and writes see the same records.
+ */
+void test_cold_compression(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   uint32_t recno, count, compressed, size;
+   char record[64];
+   int i, records_to_add = 2000;
+
+   for (i = 1; i <= records_to_add; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "history row %d status=CLOSED", i);
+
+      if ((err = flatrecs_append_record(handle, 0, record, sizeof(record), &recno)))
+      {
+         fprintf(stderr, "Append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   flatrecs_delete_record(handle, 0, 1000);
+
+   struct stat before, after;
+   fflush(handle->file);
+   fstat(fileno(handle->file), &before);
+
+   if ((err = flatrecs_compress_cold(handle, 0, &compressed)))
+   {
+      fprintf(stderr, "Compression failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   fstat(fileno(handle->file), &after);
+   printf("Compressed %u blocks, disk use went from %ld to %ld 512-byte blocks.\n",
+          compressed, (long)before.st_blocks, (long)after.st_blocks);
+
+   size = sizeof(record);
+   if (compressed == 0)
+      fprintf(stderr, "No blocks were compressed.\n");
+   else if ((err = flatrecs_count_live(handle, 0, &count)) || count != (uint32_t)records_to_add - 1)
+      fprintf(stderr, "Counted %u records after compression.\n", count);
+   else if ((err = flatrecs_read_record(handle, 0, 777, record, &size)) || strcmp(record, "history row 777 status=CLOSED"))
+      fprintf(stderr, "Record 777 reads \"%s\" after compression.\n", record);
+   else if (flatrecs_read_record(handle, 0, 1000, record, &size) != RND_EXTINCT_RECORD)
+      fprintf(stderr, "Deleted record 1000 is live after compression.\n");
+   else if ((err = flatrecs_write_record(handle, 0, 778, "rewritten", 10)))
+      fprintf(stderr, "Write to compressed block failed (%s).\n", rnd_strerror(err, handle));
+   else if ((err = flatrecs_read_record(handle, 0, 778, record, &size)) || strcmp(record, "rewritten"))
+      fprintf(stderr, "Record 778 reads \"%s\" after rewrite.\n", record);
+   else if ((err = flatrecs_read_record(handle, 0, 779, record, &size)) || strcmp(record, "history row 779 status=CLOSED"))
+      fprintf(stderr, "Record 779 reads \"%s\" after neighbor rewrite.\n", record);
+   else
+   {
+      printf("Compressed blocks read and write correctly.\n");
+      *passed = 1;
+   }
+}
+
+/**
+ * Compares a record got in place with a copy from `rnd_get`.
+ */
+static bool ref_matches(RNDH *handle, RND_RECNO recno, const RND_DATA *ref)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+
+   return rnd_get(handle, recno, &data) == RND_SUCCESS
+      && ref->size == data.size
+      && memcmp(ref->data, record, sizeof(record)) == 0;
+}
+
+/**
+ * Gets records in place from the file mapping and from pinned cache
+ * images, and confirms that they stay put while the file grows, is
+ * remapped and has its compressed blocks read through the cache.
+ */
+void test_record_refs(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   RND_RECNO recno;
+   RND_DATA data, first, later, packed;
+   RND_LEASE first_lease, later_lease, packed_lease, lease;
+   uint32_t i, compressed;
+   char record[64];
+
+   for (i = 1; i <= 2000; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "ledger row %u", i);
+
+      recno = 0;
+      data.data = record;
+      data.size = sizeof(record);
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+   }
+   rnd_delete(handle, 1000);
+
+   if ((err = rnd_get_ref(handle, 10, &first, &first_lease)) || !ref_matches(handle, 10, &first))
+   {
+      fprintf(stderr, "Reference to record 10 failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+   if (rnd_get_ref(handle, 1000, &data, &lease) != RND_EXTINCT_RECORD || lease.kind != LEASE_NONE)
+   {
+      fprintf(stderr, "Deleted record 1000 was referenced.\n");
+      return;
+   }
+
+   // Grow the file past the mapping, so the next reference remaps it:
+   for (i = 2001; i <= 6000; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "ledger row %u", i);
+
+      recno = 0;
+      data.data = record;
+      data.size = sizeof(record);
+      rnd_put(handle, &recno, &data);
+   }
+
+   if ((err = rnd_get_ref(handle, 6000, &later, &later_lease)) || !ref_matches(handle, 6000, &later))
+   {
+      fprintf(stderr, "Reference to record 6000 failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+   if (later_lease.holder == first_lease.holder || strcmp((char*)first.data, "ledger row 10"))
+   {
+      fprintf(stderr, "Record 10 moved when the file was remapped.\n");
+      return;
+   }
+
+   // A write is seen by a reference taken after it:
+   memset(record, 0, sizeof(record));
+   strcpy(record, "ledger row 10 amended");
+   recno = 10;
+   data.data = record;
+   data.size = sizeof(record);
+   rnd_put(handle, &recno, &data);
+
+   if ((err = rnd_get_ref(handle, 10, &data, &lease)) || strcmp((char*)data.data, "ledger row 10 amended"))
+   {
+      fprintf(stderr, "Reference to record 10 missed the write.\n");
+      return;
+   }
+   rnd_release(&lease);
+   rnd_release(&first_lease);
+   rnd_release(&later_lease);
+   rnd_release(&later_lease);   // releasing twice does nothing
+
+   if ((err = rnd_compress_cold_blocks(handle, &compressed)) || compressed == 0)
+   {
+      fprintf(stderr, "Compression failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   if ((err = rnd_get_ref(handle, 777, &packed, &packed_lease)) || packed_lease.kind != LEASE_CACHE
+       || !ref_matches(handle, 777, &packed))
+   {
+      fprintf(stderr, "Reference to compressed record 777 failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   // Cycle every compressed block through the cache around the pinned one:
+   for (i = 1; i <= 6000; i += 97)
+   {
+      data.data = record;
+      data.size = sizeof(record);
+      rnd_get(handle, i, &data);
+   }
+
+   if (strcmp((char*)packed.data, "ledger row 777"))
+      fprintf(stderr, "Pinned record 777 reads \"%s\".\n", (char*)packed.data);
+   else
+   {
+      printf("Record references survive growth, remapping and cache traffic.\n");
+      *passed = 1;
+   }
+
+   rnd_release(&packed_lease);
+}
+
+/**
+ * Updates fields in place, in plain and compressed blocks, and confirms
+ * that the rest of each record is untouched.
+ */
+void test_field_updates(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   RND_RECNO recno;
+   RND_DATA data;
+   uint32_t i, compressed;
+   uint64_t counter;
+   char record[64], expected[64];
+
+   for (i = 1; i <= 2000; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "account %u", i);
+
+      recno = 0;
+      data.data = record;
+      data.size = sizeof(record);
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+   }
+   rnd_delete(handle, 50);
+
+   if ((err = rnd_compress_cold_blocks(handle, &compressed)) || compressed == 0)
+   {
+      fprintf(stderr, "Compression failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   // Count into the last 8 bytes of every seventh record, compressed or not:
+   for (i = 7; i <= 2000; i += 7)
+   {
+      counter = i * 1000ULL;
+      if ((err = rnd_update_field(handle, i, 56, sizeof(counter), &counter)))
+      {
+         fprintf(stderr, "Updating record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   for (i = 1; i <= 2000; ++i)
+   {
+      if (i == 50)
+         continue;
+
+      memset(expected, 0, sizeof(expected));
+      snprintf(expected, sizeof(expected), "account %u", i);
+      counter = i % 7 ? 0 : i * 1000ULL;
+      memcpy(expected + 56, &counter, sizeof(counter));
+
+      data.data = record;
+      data.size = sizeof(record);
+      if ((err = rnd_get(handle, i, &data)) || memcmp(record, expected, sizeof(record)))
+      {
+         fprintf(stderr, "Record %u is wrong after field updates.\n", i);
+         return;
+      }
+   }
+
+   uint64_t previous, found;
+   uint8_t small;
+
+   if ((err = rnd_fetch_add_field(handle, 14, 56, 8, 5, &previous)) || previous != 14000)
+      fprintf(stderr, "Adding to record 14 found %lu (%s).\n", (unsigned long)previous, rnd_strerror(err, handle));
+   else if ((err = rnd_cas_field(handle, 14, 56, 8, 14000, 1, &found)) || found != 14005)
+      fprintf(stderr, "A stale compare on record 14 found %lu (%s).\n", (unsigned long)found, rnd_strerror(err, handle));
+   else if ((err = rnd_cas_field(handle, 14, 56, 8, 14005, 1, &found)) || found != 14005)
+      fprintf(stderr, "Swapping record 14 found %lu (%s).\n", (unsigned long)found, rnd_strerror(err, handle));
+   else if ((err = rnd_fetch_add_field(handle, 14, 40, 1, 300, &previous)) || previous != 0
+            || (err = rnd_fetch_add_field(handle, 14, 40, 1, (uint64_t)-1, &previous)) || previous != 44)
+      fprintf(stderr, "A byte field of record 14 did not wrap (%s).\n", rnd_strerror(err, handle));
+   else if (rnd_fetch_add_field(handle, 14, 40, 3, 1, &previous) != RND_BAD_PARAMETER)
+      fprintf(stderr, "A 3-byte counter was accepted.\n");
+   else if ((err = rnd_cas_field(handle, 14, 48, 4, 1ULL << 32, 7, &found)) || found != 0)
+      fprintf(stderr, "A compare too wide for a 4-byte field swapped it (%s).\n", rnd_strerror(err, handle));
+   else if ((data.data = record, data.size = sizeof(record), rnd_get(handle, 14, &data))
+            || memcpy(&counter, record + 56, sizeof(counter)) == NULL || counter != 1
+            || (small = (uint8_t)record[40]) != 43 || strcmp(record, "account 14"))
+      fprintf(stderr, "Record 14 is wrong after atomic updates.\n");
+   else if (rnd_update_field(handle, 50, 0, 4, "gone") != RND_EXTINCT_RECORD)
+      fprintf(stderr, "Updating deleted record 50 did not report an extinct record.\n");
+   else if (rnd_update_field(handle, 51, 60, 8, &counter) != RND_BAD_PARAMETER)
+      fprintf(stderr, "A field past the end of the record was accepted.\n");
+   else
+   {
+      printf("Field updates touch only their fields.\n");
+      *passed = 1;
+   }
+}
+
+#define COUNTER_ADDS 500
+
+/**
+ * Adds to the counter in record 1 from a process of its own, trying
+ * again whenever another process holds the counter.
+ */
+void add_to_counter(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   uint64_t previous;
+   RND_ERROR err;
+   int i;
+
+   for (i = 0; i < COUNTER_ADDS; ++i)
+   {
+      while ((err = rnd_fetch_add_field(handle, 1, 8, 8, 1, &previous)) == RND_LOCK_FAILED)
+         ;
+      if (err)
+         return;
+   }
+
+   *passed = 1;
+}
+
+void make_counter(RNDH *handle, void *closure)
+{
+   char record[64] = "counter";
+   RND_RECNO recno = 0;
+   RND_DATA data = { record, sizeof(record) };
+
+   rnd_put(handle, &recno, &data);
+}
+
+void read_counter(RNDH *handle, void *closure)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+
+   if (rnd_get(handle, 1, &data) == RND_SUCCESS)
+      memcpy(closure, record + 8, sizeof(uint64_t));
+}
+
+/**
+ * Has several processes add to one counter field at once, and confirms
+ * that no addition was lost.
+ */
+bool test_concurrent_counter(void)
+{
+   const int processes = 3;
+   uint64_t total = 0;
+   int i, status, failures = 0;
+
+   rnd_open("counter.db", 64, RND_CREATE, make_counter, NULL);
+
+   for (i = 0; i < processes; ++i)
+   {
+      if (fork() == 0)
+      {
+         bool passed = 0;
+         rnd_open("counter.db", 0, 0, add_to_counter, &passed);
+         _exit(passed ? 0 : 1);
+      }
+   }
+
+   for (i = 0; i < processes; ++i)
+   {
+      if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+         ++failures;
+   }
+
+   rnd_open("counter.db", 0, 0, read_counter, &total);
+
+   if (failures || total != (uint64_t)processes * COUNTER_ADDS)
+   {
+      fprintf(stderr, "%d processes added to a counter to make %lu.\n", processes, (unsigned long)total);
+      return 0;
+   }
+
+   printf("%d processes added to a counter without losing any.\n", processes);
+   return 1;
+}
+
+/**
+ * Callback for `rnd_lock_area` that tells the parent process the counter
+ * record is held, and holds it for a moment.
+ */
+bool hold_counter(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   int *ready_fd = (int*)closure;
+   char byte = 0;
+
+   if (write(*ready_fd, &byte, 1) == 1)
+      usleep(300000);
+
+   return 0;
+}
+
+void hold_counter_in_child(RNDH *handle, void *closure)
+{
+   FLATREC_LOC loc;
+
+   if (flatrecs_locate_record(handle, 0, 1, &loc) == RND_SUCCESS)
+   {
+      BLOCK_LOC bl = { loc.record_offset, loc.rec_size };
+      rnd_lock_area(handle, &bl, 0, hold_counter, closure);
+   }
+}
+
+/**
+ * Adds to the counter while another process holds its record.  An
+ * aligned 8-byte counter is added to through the mapping and doesn't
+ * need the lock; a 2-byte one takes the locked path and is refused.
+ */
+void add_to_held_counter(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   uint64_t before, previous;
+   RND_ERROR err;
+
+   read_counter(handle, &before);
+
+   if ((err = rnd_fetch_add_field(handle, 1, 8, 8, 1, &previous)) || previous != before)
+      fprintf(stderr, "Adding to a held 8-byte counter failed (%s).\n", rnd_strerror(err, handle));
+   else if ((err = rnd_fetch_add_field(handle, 1, 16, 2, 1, &previous)) != RND_LOCK_FAILED)
+      fprintf(stderr, "Adding to a held 2-byte counter did not wait its turn (%s).\n", rnd_strerror(err, handle));
+   else
+      *passed = 1;
+}
+
+/**
+ * Confirms that a counter is added to without the record lock, by
+ * adding to it while another process holds the record.
+ */
+bool test_counter_unlocked(void)
+{
+   int ready[2];
+   bool passed = 0;
+   char byte = 0;
+
+   if (pipe(ready))
+      return 0;
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      close(ready[0]);
+      rnd_open("counter.db", 0, 0, hold_counter_in_child, &ready[1]);
+      _exit(0);
+   }
+
+   close(ready[1]);
+   if (read(ready[0], &byte, 1) == 1)
+      rnd_open("counter.db", 0, 0, add_to_held_counter, &passed);
+   close(ready[0]);
+   waitpid(child, NULL, 0);
+
+   if (passed)
+      printf("A mapped counter is added to while its record is held.\n");
+   return passed;
+}
+
+#define CHURN_RECORDS 2000
+
+void make_churn_records(RNDH *handle, void *closure)
+{
+   bool *made = (bool*)closure;
+   char record[64];
+   uint32_t recno;
+   int i;
+
+   for (i = 1; i <= CHURN_RECORDS; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "churn row %d", i);
+      if (flatrecs_append_record(handle, 0, record, sizeof(record), &recno))
+         return;
+   }
+
+   *made = 1;
+}
+
+/** Compresses the table's blocks and expands them again, over and over. */
+void churn_compression(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   uint32_t compressed;
+   int round, i;
+
+   for (round = 0; round < 30; ++round)
+   {
+      if (flatrecs_compress_cold(handle, 0, &compressed))
+         return;
+
+      // Rewriting a record as it is expands its block:
+      for (i = 1; i <= CHURN_RECORDS; i += 50)
+      {
+         memset(record, 0, sizeof(record));
+         snprintf(record, sizeof(record), "churn row %d", i);
+         if (flatrecs_write_record(handle, 0, i, record, sizeof(record)))
+            return;
+      }
+   }
+
+   *passed = 1;
+}
+
+/**
+ * Reads records while another process compresses and expands their
+ * blocks, and confirms that no read sees a block half changed.
+ */
+bool test_compression_races(void)
+{
+   char record[64], expected[64];
+   uint32_t size, recno, reads = 0, mismatches = 0;
+   int status;
+   bool made = 0;
+   pid_t pid;
+
+   rnd_open("churn.db", 64, RND_CREATE, make_churn_records, &made);
+   if (!made)
+      return 0;
+
+   if ((pid = fork()) == 0)
+   {
+      bool passed = 0;
+      rnd_open("churn.db", 0, 0, churn_compression, &passed);
+      _exit(passed ? 0 : 1);
+   }
+
+   RNDH handle;
+   FLATREC_BLOCK *blocks;
+   uint32_t count, rec_size;
+
+   if (pid == -1 || rnd_open_raw(&handle, "churn.db", 0, 0))
+      return 0;
+
+   // Read with pread(), as the workers of a parallel scan do, so every
+   // read sees the file as it is rather than as the stream buffered it:
+   handle.positional = 1;
+
+   // The first records of a block, and its map, are what a compressed
+   // stream overwrites:
+   if (flatrecs_list_blocks(&handle, 0, &blocks, &count, &rec_size) || count == 0)
+   {
+      rnd_close_raw(&handle);
+      return 0;
+   }
+
+   while (waitpid(pid, &status, WNOHANG) == 0)
+   {
+      RND_ERROR err;
+
+      recno = blocks[reads % count].first_recno;
+      size = sizeof(record);
+      ++reads;
+
+      if ((err = flatrecs_read_record(&handle, 0, recno, record, &size)) == RND_LOCK_FAILED)
+         continue;
+
+      memset(expected, 0, sizeof(expected));
+      snprintf(expected, sizeof(expected), "churn row %u", recno);
+
+      if (err || size != sizeof(record) || memcmp(record, expected, sizeof(record)))
+      {
+         if (mismatches++ == 0)
+            fprintf(stderr, "Record %u read as \"%.20s\" (%s) while its block changed.\n",
+                    recno, record, err ? rnd_strerror(err, &handle) : "no error");
+      }
+   }
+
+   free(blocks);
+   rnd_close_raw(&handle);
+
+   if (!WIFEXITED(status) || WEXITSTATUS(status) || mismatches)
+   {
+      fprintf(stderr, "%u of %u reads were wrong while blocks were compressed and expanded.\n", mismatches, reads);
+      return 0;
+   }
+
+   printf("%u reads were right while blocks were compressed and expanded.\n", reads);
+   return 1;
+}
+
+/**
+ * Checks what `compress_check_read` costs before any block of the file
+ * is compressed, and that it catches a block compressed and expanded
+ * back to the header it had before the read.
+ */
+void check_reads_of_changed_block(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_STATS before, after;
+   FLATREC_LOC loc;
+   RND_ERROR err;
+   bool compressed = 0;
+
+   if (flatrecs_locate_record(handle, 0, CHURN_RECORDS / 2, &loc))
+      return;
+
+   rnd_stats(handle, &before);
+   err = compress_check_read(handle, loc.block_offset, &loc.block);
+   rnd_stats(handle, &after);
+
+   if (err || after.reads != before.reads)
+   {
+      fprintf(stderr, "Checking a read in a file never compressed made %lu reads (%s).\n",
+              (unsigned long)(after.reads - before.reads), rnd_strerror(err, handle));
+      return;
+   }
+
+   if ((err = compress_block(handle, loc.block_offset, &compressed)) || !compressed
+       || (err = compress_expand_block(handle, loc.block_offset)))
+   {
+      fprintf(stderr, "Compressing and expanding a block failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   if ((err = compress_check_read(handle, loc.block_offset, &loc.block)) != RND_LOCK_FAILED)
+   {
+      fprintf(stderr, "A block compressed and expanded during a read passed for unchanged (%s).\n",
+              rnd_strerror(err, handle));
+      return;
+   }
+
+   if (flatrecs_locate_record(handle, 0, CHURN_RECORDS / 2, &loc)
+       || (err = compress_check_read(handle, loc.block_offset, &loc.block)))
+   {
+      fprintf(stderr, "A read made after the block settled did not pass (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   *passed = 1;
+}
+
+bool test_compression_checks(void)
+{
+   bool made = 0, passed = 0;
+
+   rnd_open("checks.db", 64, RND_CREATE, make_churn_records, &made);
+   if (made)
+      rnd_open("checks.db", 0, 0, check_reads_of_changed_block, &passed);
+
+   if (passed)
+      printf("Reads are checked only once a block is compressed, and see it compressed and expanded.\n");
+   return passed;
+}
+
+/**
+ * Starts compressing a block as `compress_block` does, then dies with the
+ * payload half written.
+ */
+void compress_then_crash(RNDH *handle, void *closure)
+{
+   FLATREC_LOC loc;
+   char saved[256], garbage[256];
+
+   if (flatrecs_locate_record(handle, 0, CHURN_RECORDS / 2, &loc)
+       || blocks_read_at(handle, loc.block_offset + loc.block.bytes_to_data, saved, sizeof(saved)))
+      return;
+
+   TXN_RANGE ranges[2] = {
+      { loc.block_offset, loc.block_offset, &loc.block, COMPRESS_HEAD_SAVED },
+      { loc.block_offset, loc.block_offset + loc.block.bytes_to_data, saved, sizeof(saved) }
+   };
+
+   if (txn_guard_begin(handle, ranges, 2))
+      return;
+
+   loc.block.block_flags |= RBF_CHANGING;
+   memset(garbage, 0x5a, sizeof(garbage));
+   blocks_write_block_head(handle, loc.block_offset, &loc.block, sizeof(loc.block));
+   blocks_write_at(handle, loc.block_offset + loc.block.bytes_to_data, garbage, sizeof(garbage));
+   fflush(handle->file);
+   _exit(0);
+}
+
+void check_compression_rolled_back(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   FLATREC_LOC loc;
+   char record[64], expected[64];
+   uint32_t size = sizeof(record), count, recno = CHURN_RECORDS / 2;
+
+   memset(expected, 0, sizeof(expected));
+   snprintf(expected, sizeof(expected), "churn row %u", recno);
+
+   if (flatrecs_locate_record(handle, 0, recno, &loc) || (loc.block.block_flags & RBF_CHANGING))
+      fprintf(stderr, "The block is still marked changing after opening.\n");
+   else if (flatrecs_read_record(handle, 0, recno, record, &size) || memcmp(record, expected, sizeof(record)))
+      fprintf(stderr, "Record %u reads \"%.20s\" after a compression cut short.\n", recno, record);
+   else if (flatrecs_count_live(handle, 0, &count) || count != CHURN_RECORDS)
+      fprintf(stderr, "Counted %u records after a compression cut short.\n", count);
+   else
+      *passed = 1;
+}
+
+/**
+ * Opening a file rolls back a compression that was cut short.
+ */
+bool test_compression_cut_short(void)
+{
+   bool made = 0, passed = 0;
+   int status;
+   pid_t pid;
+
+   rnd_open("cutshort.db", 64, RND_CREATE, make_churn_records, &made);
+   if (!made)
+      return 0;
+
+   if ((pid = fork()) == 0)
+   {
+      rnd_open("cutshort.db", 0, 0, compress_then_crash, NULL);
+      _exit(1);
+   }
+
+   if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+   {
+      fprintf(stderr, "The compression to cut short failed early.\n");
+      return 0;
+   }
+
+   rnd_open("cutshort.db", 0, 0, check_compression_rolled_back, &passed);
+   if (passed)
+      printf("Opening rolled back a compression cut short.\n");
+
+   return passed;
+}
+
+/**
+ * Appends until the file may grow no more, and confirms that the failure
+ * is reported rather than a success with no record number.
+ */
+void fill_file(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err = RND_SUCCESS;
+   char record[64] = "filler";
+   RND_DATA data = { record, sizeof(record) };
+   RND_RECNO recno;
+   int i;
+
+   for (i = 0; i < 100000 && !err; ++i)
+   {
+      recno = 0;
+      if (!(err = rnd_put(handle, &recno, &data)) && recno == 0)
+      {
+         fprintf(stderr, "An append succeeded without a record number.\n");
+         return;
+      }
+   }
+
+   *passed = err != RND_SUCCESS;
+}
+
+bool test_append_errors(void)
+{
+   int status;
+   pid_t pid;
+
+   rnd_open("full.db", 64, RND_CREATE, make_counter, NULL);
+
+   if ((pid = fork()) == 0)
+   {
+      bool passed = 0;
+      struct rlimit limit = { (rlim_t)get_file_size("full.db"), RLIM_INFINITY };
+
+      signal(SIGXFSZ, SIG_IGN);
+      setrlimit(RLIMIT_FSIZE, &limit);
+      rnd_open("full.db", 0, 0, fill_file, &passed);
+      _exit(passed ? 0 : 1);
+   }
+
+   if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+   {
+      fprintf(stderr, "Appends to a file that could not grow did not report failure.\n");
+      return 0;
+   }
+
+   printf("Appends to a file that could not grow reported failure.\n");
+   return 1;
+}
+
+/** Holds a map word for `test_shared_map_word`. */
+struct map_word_holder {
+   BLOCK_LOC bl;
+   int       ready_fd;
+   bool      held;
+};
+
+void hold_map_word(RNDH *handle, void *closure)
+{
+   struct map_word_holder *holder = (struct map_word_holder*)closure;
+
+   if (rnd_lock_place(handle, &holder->bl, 1) || write(holder->ready_fd, "", 1) != 1)
+      return;
+
+   usleep(200000);
+   holder->held = 1;
+}
+
+/**
+ * Has another process hold the liveness map word of record 1 for a
+ * moment, and confirms that appending record 2, whose bit shares the
+ * word, waits for it rather than failing.
+ */
+void test_shared_map_word(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   FLATREC_LOC loc;
+   RND_RECNO recno = 0, count = 0;
+   char record[64] = "first", ready;
+   RND_DATA data = { record, sizeof(record) };
+   int ready_pipe[2], status;
+   pid_t pid;
+
+   if ((err = rnd_put(handle, &recno, &data))
+       || (err = flatrecs_locate_record(handle, 0, 1, &loc))
+       || pipe(ready_pipe))
+   {
+      fprintf(stderr, "Failed to set up the map word test.\n");
+      return;
+   }
+
+   if ((pid = fork()) == 0)
+   {
+      // A handle of its own, as the inherited one shares its locks:
+      struct map_word_holder holder = { { flatrecs_map_word_offset(&loc), sizeof(uint64_t) }, ready_pipe[1], 0 };
+      rnd_open("mapword.db", 0, 0, hold_map_word, &holder);
+      _exit(holder.held ? 0 : 1);
+   }
+
+   if (pid == -1 || read(ready_pipe[0], &ready, 1) != 1)
+   {
+      fprintf(stderr, "The map word holder did not start.\n");
+      return;
+   }
+
+   recno = 0;
+   strcpy(record, "second");
+   err = rnd_put(handle, &recno, &data);
+
+   if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+      fprintf(stderr, "The map word holder failed.\n");
+   else if (err)
+      fprintf(stderr, "Appending beside a held map word failed (%s).\n", rnd_strerror(err, handle));
+   else if (recno != 2 || (err = rnd_get(handle, 2, &data)) || strcmp(record, "second"))
+      fprintf(stderr, "Appended record %u reads \"%s\".\n", (unsigned)recno, record);
+   else if ((err = rnd_count(handle, &count)) || count != 2)
+      fprintf(stderr, "Counted %u records, expected 2.\n", (unsigned)count);
+   else
+   {
+      printf("Appending waited for a held map word.\n");
+      *passed = 1;
+   }
+
+   close(ready_pipe[0]);
+   close(ready_pipe[1]);
+}
+
+/**
+ * Appends, rewrites and deletes records in a file opened with RND_DIRECT,
+ * where every transfer goes through the aligned buffer pool.
+ */
+void test_direct_io(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   uint32_t recno, count, size;
+   char record[64];
+   int i, records_to_add = 300;
+
+   printf("Direct I/O aligned to %u bytes.\n", handle->io_align);
+
+   for (i = 1; i <= records_to_add; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "direct %d", i);
+
+      if ((err = flatrecs_append_record(handle, 0, record, sizeof(record), &recno)))
+      {
+         fprintf(stderr, "Direct append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   flatrecs_delete_record(handle, 0, 5);
+
+   size = sizeof(record);
+   if (!handle->io_align)
+      fprintf(stderr, "Handle opened with RND_DIRECT has no I/O alignment.\n");
+   else if ((err = flatrecs_count_live(handle, 0, &count)) || count != (uint32_t)records_to_add - 1)
+      fprintf(stderr, "Counted %u direct records.\n", count);
+   else if ((err = flatrecs_write_record(handle, 0, 200, "changed", 8)))
+      fprintf(stderr, "Direct write failed (%s).\n", rnd_strerror(err, handle));
+   else if ((err = flatrecs_read_record(handle, 0, 200, record, &size)) || strcmp(record, "changed"))
+      fprintf(stderr, "Record 200 reads \"%s\" after direct write.\n", record);
+   else if ((err = flatrecs_read_record(handle, 0, 201, record, &size)) || strcmp(record, "direct 201"))
+      fprintf(stderr, "Record 201 reads \"%s\" after direct write.\n", record);
+   else
+   {
+      printf("Direct I/O reads and writes correctly.\n");
+      *passed = 1;
+   }
+}
+
+#define NEIGHBOUR_RECORDS 40
+#define NEIGHBOUR_ROUNDS  500
+
+struct neighbour_writer {
+   int      parity;    // the writer updates records whose number has this parity
+   uint32_t lost;      // times a record no longer held what the writer last wrote
+   bool     passed;
+};
+
+static void make_neighbour(char *record, uint32_t recno, int round)
+{
+   memset(record, 0, 64);
+   snprintf(record, 64, "neighbour %u round %d", recno, round);
+}
+
+void make_neighbours(RNDH *handle, void *closure)
+{
+   bool *made = (bool*)closure;
+   char record[64];
+   uint32_t recno, i;
+
+   for (i = 1; i <= NEIGHBOUR_RECORDS; ++i)
+   {
+      make_neighbour(record, i, -1);
+      if (flatrecs_append_record(handle, 0, record, sizeof(record), &recno))
+         return;
+   }
+
+   *made = 1;
+}
+
+void update_neighbours(RNDH *handle, void *closure)
+{
+   struct neighbour_writer *writer = (struct neighbour_writer*)closure;
+   char record[64], expected[64];
+   uint32_t recno, size;
+   int round;
+
+   for (round = 0; round < NEIGHBOUR_ROUNDS; ++round)
+   {
+      for (recno = 1; recno <= NEIGHBOUR_RECORDS; ++recno)
+      {
+         if ((int)(recno % 2) != writer->parity)
+            continue;
+
+         // Only this writer changes the record, so it holds what it last wrote:
+         size = sizeof(record);
+         make_neighbour(expected, recno, round - 1);
+         if (flatrecs_read_record(handle, 0, recno, record, &size))
+            return;
+         else if (memcmp(record, expected, sizeof(record)))
+            ++writer->lost;
+
+         make_neighbour(record, recno, round);
+         if (flatrecs_write_record(handle, 0, recno, record, sizeof(record)))
+            return;
+      }
+   }
+
+   writer->passed = 1;
+}
+
+void check_neighbours(RNDH *handle, void *closure)
+{
+   uint32_t *lost = (uint32_t*)closure;
+   char record[64], expected[64];
+   uint32_t recno, size;
+
+   for (recno = 1; recno <= NEIGHBOUR_RECORDS; ++recno)
+   {
+      size = sizeof(record);
+      make_neighbour(expected, recno, NEIGHBOUR_ROUNDS - 1);
+      if (flatrecs_read_record(handle, 0, recno, record, &size) || memcmp(record, expected, sizeof(record)))
+         ++*lost;
+   }
+}
+
+/**
+ * Two processes rewrite alternate records of one block of an RND_DIRECT
+ * file, so each aligned unit they write holds records of both.  Neither
+ * may overwrite the other's records with what it read before their write,
+ * so each writer finds its records as it left them, every round.
+ *
+ * @return 1 if no change was lost
+ */
+bool test_direct_neighbours(void)
+{
+   bool made = 0;
+   uint32_t lost = 0;
+   int parity, status, failures = 0;
+
+   if (rnd_open("neighbours.db", 64, RND_CREATE | RND_DIRECT, make_neighbours, &made) == RND_SYSTEM_ERROR)
+   {
+      printf("Skipping direct neighbours test, the filesystem refused O_DIRECT.\n");
+      return 1;
+   }
+   else if (!made)
+      return 0;
+
+   for (parity = 0; parity < 2; ++parity)
+   {
+      if (fork() == 0)
+      {
+         struct neighbour_writer writer = { parity, 0, 0 };
+         rnd_open("neighbours.db", 0, RND_DIRECT, update_neighbours, &writer);
+         _exit(!writer.passed ? 255 : writer.lost < 254 ? (int)writer.lost : 254);
+      }
+   }
+
+   // Each writer exits with the number of its changes it found lost:
+   for (parity = 0; parity < 2; ++parity)
+   {
+      if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 255)
+         ++failures;
+      else
+         lost += WEXITSTATUS(status);
+   }
+
+   rnd_open("neighbours.db", 0, 0, check_neighbours, &lost);
+
+   if (failures || lost)
+   {
+      fprintf(stderr, "Direct writers of neighbouring records lost %u changes.\n", lost);
+      return 0;
+   }
+
+   printf("Direct writers of neighbouring records lose none of them.\n");
+   return 1;
+}
+
+/**
+ * Reserves space for a bulk load, then confirms that the reservation
+ * didn't change the file size and that the loaded file isn't sparse.
+ */
+void test_reserve(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   uint32_t recno, count;
+   char record[64];
+   int i, records_to_add = 3000;
+   struct stat before, reserved, loaded;
+
+   fstat(fileno(handle->file), &before);
+
+   if ((err = rnd_reserve(handle, records_to_add)))
+   {
+      fprintf(stderr, "Reserve failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   fstat(fileno(handle->file), &reserved);
+
+   for (i = 1; i <= records_to_add; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "bulk %d", i);
+
+      if ((err = flatrecs_append_record(handle, 0, record, sizeof(record), &recno)))
+      {
+         fprintf(stderr, "Append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   fflush(handle->file);
+   fstat(fileno(handle->file), &loaded);
+
+   printf("Reserving went from %ld to %ld 512-byte blocks, loading made %ld bytes in %ld blocks.\n",
+          (long)before.st_blocks, (long)reserved.st_blocks,
+          (long)loaded.st_size, (long)loaded.st_blocks);
+
+   if (reserved.st_size != before.st_size)
+      fprintf(stderr, "Reserving changed the file size from %ld to %ld.\n",
+              (long)before.st_size, (long)reserved.st_size);
+   else if ((off_t)loaded.st_blocks * 512 < loaded.st_size)
+      fprintf(stderr, "The loaded file is sparse.\n");
+   else if ((err = flatrecs_count_live(handle, 0, &count)) || count != (uint32_t)records_to_add)
+      fprintf(stderr, "Counted %u records after loading.\n", count);
+   else
+   {
+      printf("Reservation and allocation behave.\n");
+      *passed = 1;
+   }
+}
+
+struct chain_tally {
+   off_t    previous;
+   off_t    last;
+   off_t    penultimate;
+   off_t    chain_offset;
+   uint32_t blocks;
+   char     pad[4];
+};
+
+bool tally_chain_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   struct chain_tally *tally = (struct chain_tally*)closure;
+
+   if (tally->blocks++)
+      tally->chain_offset += tally->previous;
+
+   tally->penultimate = tally->last;
+   tally->last = offset_to_ib;
+   tally->previous = ib->block_size;
+   return 1;
+}
+
+/**
+ * Appends enough records to need several data blocks, then confirms
+ * that the chain hints in the table head describe the end of the chain
+ * and that the last block grew in place rather than adding a block
+ * per chunk.
+ */
+void test_append_hints(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   uint32_t recno, size;
+   char record[64];
+   int i, records_to_add = 5000;
+
+   for (i = 1; i <= records_to_add; ++i)
+   {
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "appended %d", i);
+
+      if ((err = flatrecs_append_record(handle, 0, record, sizeof(record), &recno)))
+      {
+         fprintf(stderr, "Append failed (%s).\n", rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   RND_HEAD_TABLE htable;
+   struct chain_tally tally = { 0 };
+
+   if ((err = blocks_read_at(handle, 0, &htable, sizeof(htable)))
+       || (err = chains_walk(handle, 0, tally_chain_viewer, &tally)))
+   {
+      fprintf(stderr, "Failed to read the chain (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   uint32_t max_blocks = 2 + (uint32_t)((off_t)records_to_add * sizeof(record)
+                                        / (handle->head_file.fhead.chunk_size * FLATRECS_GROWTH_CHUNKS));
+
+   printf("%u records in %u blocks, last block at %ld.\n", records_to_add, tally.blocks, (long)tally.last);
+
+   size = sizeof(record);
+   if (htable.chead.block_last != tally.last
+       || htable.chead.block_penultimate != tally.penultimate
+       || htable.chead.chain_offset != tally.chain_offset)
+      fprintf(stderr, "Chain hints (%ld, %ld, %ld) don't match the chain (%ld, %ld, %ld).\n",
+              (long)htable.chead.block_last, (long)htable.chead.block_penultimate, (long)htable.chead.chain_offset,
+              (long)tally.last, (long)tally.penultimate, (long)tally.chain_offset);
+   else if (tally.blocks > max_blocks)
+      fprintf(stderr, "Appends made %u blocks, expected no more than %u.\n", tally.blocks, max_blocks);
+   else if ((err = flatrecs_read_record(handle, 0, 4321, record, &size)) || strcmp(record, "appended 4321"))
+      fprintf(stderr, "Record 4321 reads \"%s\".\n", record);
+   else if ((err = flatrecs_read_record(handle, 0, 17, record, &size)) || strcmp(record, "appended 17"))
+      fprintf(stderr, "Record 17 reads \"%s\".\n", record);
+   else
+   {
+      printf("Chain hints track the end of the chain.\n");
+      *passed = 1;
+   }
+}
+
+/** Supplies numbered 64-byte records to `rnd_bulk_load`. */
+struct bulk_source {
+   uint32_t next;
+   uint32_t last;
+};
+
+uint32_t read_bulk_records(void *records, uint32_t room, void *closure)
+{
+   struct bulk_source *source = (struct bulk_source*)closure;
+   char *record = (char*)records;
+   uint32_t count = 0;
+
+   // A few records per call, so blocks fill partway through a buffer:
+   if (room > 777)
+      room = 777;
+
+   while (count < room && source->next <= source->last)
+   {
+      memset(record, 0, 64);
+      snprintf(record, 64, "bulk %u", source->next++);
+      record += 64;
+      ++count;
+   }
+
+   return count;
+}
+
+/**
+ * Confirms that a bulk-loaded table reads, chains and appends like one
+ * filled by appends.
+ */
+void test_bulk_loaded(RNDH *handle, void *closure)
+{
+   struct bulk_source *source = (struct bulk_source*)closure;
+   RND_HEAD_TABLE htable;
+   struct chain_tally tally = { 0 };
+   uint32_t count, recno, size = 64, probes[4] = { 1, 2, source->last / 2, source->last };
+   char record[64], expected[64];
+   RND_ERROR err;
+   int i;
+
+   if ((err = blocks_read_at(handle, 0, &htable, sizeof(htable)))
+       || (err = chains_walk(handle, 0, tally_chain_viewer, &tally))
+       || (err = flatrecs_count_live(handle, 0, &count)))
+   {
+      fprintf(stderr, "Failed to read the loaded table (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   if (count != source->last || htable.thead.last_recno != source->last)
+   {
+      fprintf(stderr, "Loaded table has %u live records, last recno %u.\n", count, htable.thead.last_recno);
+      return;
+   }
+
+   if (tally.blocks > 1
+       && (htable.chead.block_last != tally.last
+           || htable.chead.block_penultimate != tally.penultimate
+           || htable.chead.chain_offset != tally.chain_offset))
+   {
+      fprintf(stderr, "Loaded chain hints don't match the chain.\n");
+      return;
+   }
+
+   for (i = 0; i < 4; ++i)
+   {
+      snprintf(expected, sizeof(expected), "bulk %u", probes[i]);
+      if ((err = flatrecs_read_record(handle, 0, probes[i], record, &size)) || strcmp(record, expected))
+      {
+         fprintf(stderr, "Loaded record %u reads \"%s\".\n", probes[i], err ? rnd_strerror(err, handle) : record);
+         return;
+      }
+   }
+
+   memset(record, 0, sizeof(record));
+   strcpy(record, "appended");
+   if ((err = flatrecs_append_record(handle, 0, record, sizeof(record), &recno)) || recno != source->last + 1)
+   {
+      fprintf(stderr, "Append after loading failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   printf("Loaded %u records in %u blocks.\n", count, tally.blocks);
+   source->next = 0;
+}
+
+/**
+ * Bulk-loads tables with exact, short and generous count hints.
+ */
+bool test_bulk_load(void)
+{
+   uint64_t hints[] = { 40000, 1000, 200000, 0 };
+   int i;
+
+   for (i = 0; i < 4; ++i)
+   {
+      struct bulk_source source = { 1, 40000 };
+      RND_RECNO loaded;
+      RND_ERROR err;
+
+      if ((err = rnd_bulk_load("bulk.db", 64, hints[i], read_bulk_records, &source, &loaded))
+          || loaded != source.last)
+      {
+         fprintf(stderr, "Bulk load with hint %lu failed (%s).\n", (unsigned long)hints[i], rnd_strerror(err, NULL));
+         return 0;
+      }
+
+      // The check clears source.next when it passes:
+      rnd_open("bulk.db", 0, 0, test_bulk_loaded, &source);
+      if (source.next != 0)
+         return 0;
+   }
+
+   return 1;
+}
+
 void run_info_test(void)
 {
    printf("Size of RND_HEAD_FILE is  %lu.\n"
@@ -131,6 +1492,128 @@ void run_info_test(void)
           sizeof(RND_HEAD_BLOCK));
 }
 
+/**
+ * Tries every call that writes through a read-only handle.
+ *
+ * @return the name of the first call not refused with
+ *         RND_READ_ONLY_HANDLE, with what it returned in *err*, or NULL
+ *         if every call was refused
+ */
+static const char *readonly_unrefused(RNDH *reader, RND_ERROR *err)
+{
+   char record[64] = "not written";
+   RND_DATA data = { record, sizeof(record) }, key = { "key", 3 };
+   RND_FIELD field = { 56, 8, RND_FIELD_UINT };
+   RND_RECNO append = 0, replace = 5;
+   RND_TXN *txn = NULL;
+   RND_SNAPSHOT *snapshot = NULL;
+   uint64_t value;
+   uint32_t compressed;
+   off_t btree;
+   size_t i;
+
+   struct { const char *call; RND_ERROR err; char pad[4]; } tries[] = {
+      { "rnd_put to append",       rnd_put(reader, &append, &data) },
+      { "rnd_put to replace",      rnd_put(reader, &replace, &data) },
+      { "rnd_delete",              rnd_delete(reader, 5) },
+      { "rnd_update_field",        rnd_update_field(reader, 5, 0, 4, "none") },
+      { "rnd_cas_field",           rnd_cas_field(reader, 5, 56, 8, 0, 1, &value) },
+      { "rnd_fetch_add_field",     rnd_fetch_add_field(reader, 5, 56, 8, 1, &value) },
+      { "rnd_txn_begin",           rnd_txn_begin(reader, &txn) },
+      { "rnd_snapshot_open",       rnd_snapshot_open(reader, &snapshot) },
+      { "rnd_changes_enable",      rnd_changes_enable(reader) },
+      { "rnd_compress_cold_blocks", rnd_compress_cold_blocks(reader, &compressed) },
+      { "rnd_reserve",             rnd_reserve(reader, 1000) },
+      { "rnd_index_put",           rnd_index_put(reader, &key, 5) },
+      { "rnd_index_delete",        rnd_index_delete(reader, &key) },
+      { "rnd_relation_add",        rnd_relation_add(reader, 1, 2) },
+      { "rnd_relation_remove",     rnd_relation_remove(reader, 1, 2) },
+      { "rnd_btree_create",        rnd_btree_create(reader, 0, &field, &btree) }
+   };
+
+   for (i = 0; i < sizeof(tries) / sizeof(tries[0]); ++i)
+   {
+      if ((*err = tries[i].err) != RND_READ_ONLY_HANDLE)
+         return tries[i].call;
+   }
+
+   return NULL;
+}
+
+/**
+ * Reads a file through a read-only handle while another handle rewrites
+ * and grows it, and confirms the reader sees the changes but can't write.
+ */
+bool test_readonly(void)
+{
+   RNDH writer, reader, refused;
+   RND_ERROR err;
+   RND_RECNO recno, count;
+   const char *call;
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   uint32_t i;
+   bool passed = 0;
+
+   if (rnd_open_raw(&writer, "readonly.db", 64, RND_CREATE))
+      return 0;
+
+   for (i = 1; i <= 100; ++i)
+   {
+      recno = 0;
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "record %u", i);
+      rnd_put(&writer, &recno, &data);
+   }
+   fflush(writer.file);
+
+   if ((err = rnd_open_raw(&reader, "readonly.db", 0, RND_READONLY)))
+   {
+      fprintf(stderr, "Opening read-only failed (%s).\n", rnd_strerror(err, &writer));
+      rnd_close_raw(&writer);
+      return 0;
+   }
+
+   // Rewrite a record the reader has mapped, and grow the file past its mapping:
+   recno = 3;
+   strcpy(record, "rewritten");
+   rnd_put(&writer, &recno, &data);
+
+   for (i = 101; i <= 5000; ++i)
+   {
+      recno = 0;
+      memset(record, 0, sizeof(record));
+      snprintf(record, sizeof(record), "record %u", i);
+      rnd_put(&writer, &recno, &data);
+   }
+   fflush(writer.file);
+
+   recno = 0;
+   if ((fcntl(fileno(reader.file), F_GETFL) & O_ACCMODE) != O_RDONLY)
+      fprintf(stderr, "The read-only handle's file isn't O_RDONLY.\n");
+   else if (rnd_open_raw(&refused, "readonly.db", 64, RND_CREATE | RND_READONLY) != RND_BAD_PARAMETER)
+      fprintf(stderr, "Creating a file read-only wasn't refused.\n");
+   else if ((err = rnd_get(&reader, 3, &data)) || strcmp(record, "rewritten"))
+      fprintf(stderr, "The reader sees record 3 as \"%s\" (%s).\n", record, rnd_strerror(err, &reader));
+   else if ((err = rnd_get(&reader, 4999, &data)) || strcmp(record, "record 4999"))
+      fprintf(stderr, "The reader sees record 4999 as \"%s\" (%s).\n", record, rnd_strerror(err, &reader));
+   else if ((err = rnd_count(&reader, &count)) || count != 5000)
+      fprintf(stderr, "The reader counts %u records.\n", count);
+   else if ((call = readonly_unrefused(&reader, &err)))
+      fprintf(stderr, "%s through a read-only handle returned %s.\n", call, rnd_strerror(err, &reader));
+   else if ((err = rnd_get(&writer, 5, &data)))
+      fprintf(stderr, "The read-only handle's delete went through.\n");
+   else
+   {
+      printf("A read-only handle follows a growing file and writes nothing.\n");
+      passed = 1;
+   }
+
+   rnd_close_raw(&reader);
+   rnd_close_raw(&writer);
+   return passed;
+}
+
 int main(int argc, const char **argv)
 {
    printf("In `test_flatrecs` application.\n");
@@ -141,5 +1624,50 @@ int main(int argc, const char **argv)
 
    rnd_open(g_filepath, 0, 0, run_test_user, NULL);
 
-   return 0;
+   bool passed = 0;
+   rnd_open("liveness.db", 64, RND_CREATE, test_record_liveness, &passed);
+
+   bool compression_passed = 0;
+   rnd_open("compression.db", 64, RND_CREATE, test_cold_compression, &compression_passed);
+
+   bool refs_passed = 0;
+   rnd_open("refs.db", 64, RND_CREATE, test_record_refs, &refs_passed);
+
+   bool fields_passed = 0;
+   rnd_open("fields.db", 64, RND_CREATE, test_field_updates, &fields_passed);
+
+   bool counter_passed = test_concurrent_counter() && test_counter_unlocked();
+
+   bool direct_passed = 0;
+   RND_ERROR err = rnd_open("direct.db", 64, RND_CREATE | RND_DIRECT, test_direct_io, &direct_passed);
+   if (err == RND_SYSTEM_ERROR)
+   {
+      // Some filesystems, tmpfs among them, refuse O_DIRECT
+      printf("Skipping direct I/O test, the filesystem refused O_DIRECT.\n");
+      direct_passed = 1;
+   }
+
+   bool neighbours_passed = test_direct_neighbours();
+
+   bool reserve_passed = 0;
+   rnd_open("reserve.db", 64, RND_CREATE, test_reserve, &reserve_passed);
+
+   bool append_passed = 0;
+   rnd_open("append.db", 64, RND_CREATE, test_append_hints, &append_passed);
+
+   bool bulk_passed = test_bulk_load();
+
+   bool errors_passed = test_append_errors();
+
+   bool races_passed = test_compression_races();
+
+   bool cut_short_passed = test_compression_cut_short() && test_compression_checks();
+
+   bool map_word_passed = 0;
+   rnd_open("mapword.db", 64, RND_CREATE, test_shared_map_word, &map_word_passed);
+
+   bool readonly_passed = test_readonly();
+
+   return readonly_passed && passed && compression_passed && refs_passed && fields_passed && counter_passed && direct_passed && neighbours_passed && reserve_passed && append_passed && bulk_passed
+          && errors_passed && map_word_passed && races_passed && cut_short_passed ? 0 : 1;
 }
@@ -0,0 +1,238 @@
+#include "hashindex.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/wait.h>   // for waitpid()
+
+#define KEY_COUNT 20000
+
+/**
+ * Makes keys of varying lengths, like external IDs.
+ */
+static uint32_t make_key(char *buffer, size_t size, int i)
+{
+   return snprintf(buffer, size, "customer-%d%.*s", i, i % 23, "-abcdefghijklmnopqrstuvw");
+}
+
+/**
+ * Puts enough keys to force many splits, then reads, replaces
+ * and deletes keys.
+ */
+void test_index_operations(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   char key[64];
+   uint32_t key_len, recno;
+   int i;
+
+   if (hashindex_get(handle, "missing", 7, &recno) != RND_KEY_NOT_FOUND)
+   {
+      fprintf(stderr, "Lookup in a file without an index didn't report a missing key.\n");
+      return;
+   }
+
+   for (i = 1; i <= KEY_COUNT; ++i)
+   {
+      key_len = make_key(key, sizeof(key), i);
+      if ((err = hashindex_put(handle, key, key_len, i)))
+      {
+         fprintf(stderr, "Put of key %d failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   for (i = 1; i <= KEY_COUNT; ++i)
+   {
+      key_len = make_key(key, sizeof(key), i);
+      if ((err = hashindex_get(handle, key, key_len, &recno)) || recno != (uint32_t)i)
+      {
+         fprintf(stderr, "Key %d returned recno %u (%s).\n", i, recno, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   // Replace every third key's recno, delete every seventh key
+   for (i = 3; i <= KEY_COUNT; i += 3)
+   {
+      key_len = make_key(key, sizeof(key), i);
+      if ((err = hashindex_put(handle, key, key_len, i + KEY_COUNT)))
+      {
+         fprintf(stderr, "Replacing key %d failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   for (i = 7; i <= KEY_COUNT; i += 7)
+   {
+      key_len = make_key(key, sizeof(key), i);
+      if ((err = hashindex_delete(handle, key, key_len)))
+      {
+         fprintf(stderr, "Deleting key %d failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   RND_HEAD_INDEX hi;
+   blocks_read_at(handle, handle->head_file.fhead.index_head, &hi, sizeof(hi));
+   printf("Index has %lu keys in %u buckets (level %u).\n",
+          (unsigned long)hi.ihead.key_count, hashindex_bucket_count(&hi.ihead), hi.ihead.level);
+
+   if (hi.ihead.key_count != KEY_COUNT - KEY_COUNT / 7)
+   {
+      fprintf(stderr, "Index counts %lu keys.\n", (unsigned long)hi.ihead.key_count);
+      return;
+   }
+
+   if (hashindex_delete(handle, "customer-7", 10) != RND_KEY_NOT_FOUND)
+   {
+      fprintf(stderr, "Deleting a deleted key didn't report a missing key.\n");
+      return;
+   }
+
+   *passed = 1;
+}
+
+/**
+ * Reopens the file to confirm that the index persists.
+ */
+void test_index_persists(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   char key[64];
+   uint32_t key_len, recno;
+   int i;
+
+   for (i = 1; i <= KEY_COUNT; ++i)
+   {
+      uint32_t expected = i % 3 ? (uint32_t)i : (uint32_t)i + KEY_COUNT;
+
+      key_len = make_key(key, sizeof(key), i);
+      err = hashindex_get(handle, key, key_len, &recno);
+
+      if (i % 7 == 0)
+      {
+         if (err != RND_KEY_NOT_FOUND)
+         {
+            fprintf(stderr, "Deleted key %d was found.\n", i);
+            return;
+         }
+      }
+      else if (err || recno != expected)
+      {
+         fprintf(stderr, "Key %d returned recno %u, expected %u (%s).\n",
+                 i, recno, expected, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   printf("Reopened index agrees with every put and delete.\n");
+   *passed = 1;
+}
+
+struct head_reader {
+   int  ready_fd;   /**< Written once the index head is held */
+   bool held;
+};
+
+/**
+ * Holds the index head as a lookup does, for a moment.
+ */
+void hold_index_head(RNDH *handle, void *closure)
+{
+   struct head_reader *reader = (struct head_reader*)closure;
+   BLOCK_LOC bl = { handle->head_file.fhead.index_head, sizeof(RND_HEAD_INDEX) };
+
+   if (rnd_lock_place_shared(handle, &bl, 0) || write(reader->ready_fd, "", 1) != 1)
+      return;
+
+   usleep(300000);
+   rnd_lock_remove(handle, &bl);
+   reader->held = 1;
+}
+
+/**
+ * Looks keys up while another process is in the middle of a lookup, and
+ * confirms that only a writer is kept out.
+ */
+void test_shared_lookups(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   int ready_pipe[2], status;
+   char key[64], ready;
+   uint32_t recno = 0;
+   RND_ERROR get_err, put_err;
+
+   if (pipe(ready_pipe))
+      return;
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      struct head_reader reader = { ready_pipe[1], 0 };
+      rnd_open("hashindex.db", 0, 0, hold_index_head, &reader);
+      _exit(reader.held ? 0 : 1);
+   }
+
+   if (child == -1 || read(ready_pipe[0], &ready, 1) != 1)
+   {
+      fprintf(stderr, "The index head holder did not start.\n");
+      return;
+   }
+
+   get_err = hashindex_get(handle, key, make_key(key, sizeof(key), 1), &recno);
+   put_err = hashindex_put(handle, key, make_key(key, sizeof(key), 1), 1);
+
+   close(ready_pipe[0]);
+   close(ready_pipe[1]);
+
+   if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+      fprintf(stderr, "The index head holder failed.\n");
+   else if (get_err || recno != 1)
+      fprintf(stderr, "A lookup beside another lookup returned %u (%s).\n", recno, rnd_strerror(get_err, handle));
+   else if (put_err != RND_LOCK_FAILED)
+      fprintf(stderr, "A put beside a lookup returned %s.\n", rnd_strerror(put_err, handle));
+   else
+   {
+      printf("Lookups run alongside each other and keep writers out.\n");
+      *passed = 1;
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   bool operations_passed = 0, persist_passed = 0, shared_passed = 0;
+
+   rnd_open("hashindex.db", 64, RND_CREATE, test_index_operations, &operations_passed);
+   if (operations_passed)
+   {
+      rnd_open("hashindex.db", 0, 0, test_index_persists, &persist_passed);
+      rnd_open("hashindex.db", 0, 0, test_shared_lookups, &shared_passed);
+   }
+
+   return operations_passed && persist_passed && shared_passed ? 0 : 1;
+}
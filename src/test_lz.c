@@ -0,0 +1,74 @@
+#include "lz.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lz.c"
+
+/**
+ * Compress and decompress *src*, confirming a faithful round trip.
+ */
+int test_round_trip(const char *label, const unsigned char *src, size_t len)
+{
+   unsigned char compressed[lz_compress_bound(len)];
+   unsigned char restored[len + 1];
+
+   size_t csize = lz_compress(src, len, compressed, sizeof(compressed));
+   if (csize == 0)
+   {
+      fprintf(stderr, "%s: compression failed.\n", label);
+      return 0;
+   }
+
+   size_t dsize = lz_decompress(compressed, csize, restored, sizeof(restored));
+   if (dsize != len || memcmp(src, restored, len))
+   {
+      fprintf(stderr, "%s: round trip failed (%lu of %lu bytes).\n", label, dsize, len);
+      return 0;
+   }
+
+   printf("%s: %lu bytes compressed to %lu.\n", label, len, csize);
+   return 1;
+}
+
+int main(int argc, const char **argv)
+{
+   unsigned char buffer[20000];
+   uint64_t seed = 88172645463325252ULL;
+   size_t i;
+
+   // Repetitive records, like a table of similar rows
+   for (i = 0; i < sizeof(buffer); ++i)
+      buffer[i] = "customer 00017 status=ACTIVE balance=000120\n"[i % 45];
+   if (!test_round_trip("records", buffer, sizeof(buffer)))
+      return 1;
+
+   // Zeros, which make long overlapping matches
+   memset(buffer, 0, sizeof(buffer));
+   if (!test_round_trip("zeros", buffer, sizeof(buffer)))
+      return 1;
+
+   // Random bytes, which must survive even though they don't shrink
+   for (i = 0; i < sizeof(buffer); ++i)
+   {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      buffer[i] = (unsigned char)seed;
+   }
+   if (!test_round_trip("random", buffer, sizeof(buffer))
+       || !test_round_trip("tiny", buffer, 3)
+       || !test_round_trip("empty", buffer, 0))
+      return 1;
+
+   // A stream that doesn't fit must be refused rather than overrun
+   unsigned char small[100];
+   if (lz_compress(buffer, sizeof(buffer), small, sizeof(small)) != 0)
+   {
+      fprintf(stderr, "Compression into a short buffer did not fail.\n");
+      return 1;
+   }
+
+   printf("All lz tests were successful.\n");
+   return 0;
+}
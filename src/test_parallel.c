@@ -0,0 +1,218 @@
+#include "parallel.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#define RECORD_COUNT 30000
+
+typedef struct measure {
+   uint64_t value;
+   uint32_t recno;
+   char     label[12];
+} MEASURE;
+
+/** Totals of the live records, added to by every worker. */
+struct tally {
+   uint64_t sum;
+   uint64_t records;
+   uint64_t blocks;
+   uint32_t mismatches;
+   uint32_t stop_after;   // blocks to view before stopping, 0 for all
+};
+
+bool tally_block(const uint64_t *map,
+                 const char     *records,
+                 uint32_t       nbits,
+                 uint32_t       first_recno,
+                 uint32_t       rec_size,
+                 void           *closure)
+{
+   struct tally *tally = (struct tally*)closure;
+   uint64_t sum = 0, live = 0;
+   uint32_t i;
+
+   for (i = 0; i < nbits; ++i)
+   {
+      if (!bitmap_test(map, i))
+         continue;
+
+      const MEASURE *m = (const MEASURE*)(records + (size_t)i * rec_size);
+      if (m->recno != first_recno + i)
+         __atomic_add_fetch(&tally->mismatches, 1, __ATOMIC_RELAXED);
+
+      sum += m->value;
+      ++live;
+   }
+
+   __atomic_add_fetch(&tally->sum, sum, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&tally->records, live, __ATOMIC_RELAXED);
+   uint64_t blocks = __atomic_add_fetch(&tally->blocks, 1, __ATOMIC_RELAXED);
+
+   return tally->stop_after == 0 || blocks < tally->stop_after;
+}
+
+/**
+ * Compares parallel scans, with several thread counts, against a
+ * single-threaded walk of the same table.
+ */
+void test_parallel_scan(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   struct tally serial = { 0 };
+   RND_ERROR err;
+   MEASURE m;
+   uint32_t i;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { &m, sizeof(m) };
+      memset(&m, 0, sizeof(m));
+      m.value = (uint64_t)i * 2654435761ULL % 1000003ULL;
+      m.recno = i;
+      snprintf(m.label, sizeof(m.label), "m%u", i % 97);
+
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Append of record %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   for (i = 5; i <= RECORD_COUNT; i += 5)
+      rnd_delete(handle, i);
+
+   // Compressed blocks must be read without the shared cache:
+   uint32_t compressed;
+   flatrecs_compress_cold(handle, 0, &compressed);
+
+   if ((err = flatrecs_walk_records(handle, 0, tally_block, &serial)))
+   {
+      fprintf(stderr, "Serial walk failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   if (serial.records != RECORD_COUNT - RECORD_COUNT / 5 || serial.mismatches)
+   {
+      fprintf(stderr, "Serial walk found %lu records.\n", (unsigned long)serial.records);
+      return;
+   }
+
+   uint32_t thread_counts[] = { 1, 3, 8, 0 };
+   for (i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i)
+   {
+      struct tally parallel = { 0 };
+
+      if ((err = parallel_scan(handle, 0, thread_counts[i], tally_block, &parallel)))
+      {
+         fprintf(stderr, "Parallel scan with %u threads failed (%s).\n", thread_counts[i], rnd_strerror(err, handle));
+         return;
+      }
+
+      if (parallel.sum != serial.sum
+          || parallel.records != serial.records
+          || parallel.blocks != serial.blocks
+          || parallel.mismatches)
+      {
+         fprintf(stderr, "Parallel scan with %u threads found %lu records in %lu blocks, expected %lu in %lu.\n",
+                 thread_counts[i],
+                 (unsigned long)parallel.records, (unsigned long)parallel.blocks,
+                 (unsigned long)serial.records, (unsigned long)serial.blocks);
+         return;
+      }
+   }
+
+   // A record appended just before a scan is still in the stream's buffer:
+   RND_RECNO recno = 0;
+   RND_DATA data = { &m, sizeof(m) };
+   m.value = 1;
+   m.recno = RECORD_COUNT + 1;
+   rnd_put(handle, &recno, &data);
+
+   struct tally appended = { 0 };
+   if ((err = parallel_scan(handle, 0, 4, tally_block, &appended))
+       || appended.sum != serial.sum + 1)
+   {
+      fprintf(stderr, "Parallel scan missed an appended record (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   // Once a viewer returns 0, no more blocks are started than workers running:
+   struct tally stopped = { 0 };
+   stopped.stop_after = 2;
+   if ((err = parallel_scan(handle, 0, 4, tally_block, &stopped))
+       || stopped.blocks < 2
+       || stopped.blocks >= serial.blocks)
+   {
+      fprintf(stderr, "Stopped scan viewed %lu of %lu blocks (%s).\n",
+              (unsigned long)stopped.blocks, (unsigned long)serial.blocks, rnd_strerror(err, handle));
+      return;
+   }
+
+   printf("Parallel scans of %lu blocks, %u compressed, agree with a serial walk.\n",
+          (unsigned long)serial.blocks, compressed);
+   *passed = 1;
+}
+
+/**
+ * Scans the table through an RND_DIRECT handle with more workers than
+ * the handle's pool has buffers, so some workers' reads can't borrow one.
+ */
+void test_direct_scan(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   struct tally serial = { 0 }, parallel = { 0 };
+   uint32_t nthreads = 4 * RND_BUFPOOL_BUFFERS;
+   RND_ERROR err;
+
+   if ((err = flatrecs_walk_records(handle, 0, tally_block, &serial)))
+      fprintf(stderr, "Serial direct walk failed (%s).\n", rnd_strerror(err, handle));
+   else if ((err = parallel_scan(handle, 0, nthreads, tally_block, &parallel)))
+      fprintf(stderr, "Direct scan with %u threads failed (%s).\n", nthreads, rnd_strerror(err, handle));
+   else if (parallel.sum != serial.sum || parallel.records != serial.records || parallel.blocks != serial.blocks)
+      fprintf(stderr, "Direct scan with %u threads found %lu records, expected %lu.\n",
+              nthreads, (unsigned long)parallel.records, (unsigned long)serial.records);
+   else
+   {
+      printf("A direct scan with %u threads shares %d pool buffers.\n", nthreads, RND_BUFPOOL_BUFFERS);
+      *passed = 1;
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   bool passed = 0, direct_passed = 0;
+
+   rnd_open("parallel.db", sizeof(MEASURE), RND_CREATE, test_parallel_scan, &passed);
+
+   if (rnd_open("parallel.db", 0, RND_DIRECT, test_direct_scan, &direct_passed) == RND_SYSTEM_ERROR)
+   {
+      // Some filesystems, tmpfs among them, refuse O_DIRECT
+      printf("Skipping direct scan test, the filesystem refused O_DIRECT.\n");
+      direct_passed = 1;
+   }
+
+   return passed && direct_passed ? 0 : 1;
+}
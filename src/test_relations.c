@@ -0,0 +1,335 @@
+#include "relations.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/wait.h>   // for waitpid()
+
+#define PARENT_COUNT  50
+#define CHILD_COUNT   6000
+
+/** Collects the children sent by `relations_walk`. */
+struct child_tally {
+   uint32_t children[CHILD_COUNT];
+   uint32_t count;
+   uint32_t runs;
+   bool     ordered;
+   char     pad[4];
+};
+
+bool tally_children(const uint32_t *children, uint32_t count, void *closure)
+{
+   struct child_tally *tally = (struct child_tally*)closure;
+   uint32_t i;
+
+   for (i = 0; i < count && tally->count < CHILD_COUNT; ++i)
+   {
+      if (tally->count && children[i] <= tally->children[tally->count - 1])
+         tally->ordered = 0;
+      tally->children[tally->count++] = children[i];
+   }
+
+   ++tally->runs;
+   return 1;
+}
+
+/**
+ * Parent of each child: children are handed out round-robin, so every
+ * parent's list grows interleaved with all the others.
+ */
+static uint32_t parent_of(uint32_t child)
+{
+   return child % PARENT_COUNT + 1;
+}
+
+/**
+ * Whether a child survives the removals in `test_relation_operations`.
+ */
+static bool is_kept(uint32_t child)
+{
+   return child % 5 != 0;
+}
+
+/**
+ * Confirms the children of each parent, returning FALSE if any differ.
+ */
+static bool check_children(RNDH *handle, struct child_tally *tally)
+{
+   uint32_t parent, child, count;
+   RND_ERROR err;
+
+   for (parent = 1; parent <= PARENT_COUNT; ++parent)
+   {
+      memset(tally, 0, sizeof(*tally));
+      tally->ordered = 1;
+
+      if ((err = relations_walk(handle, parent, tally_children, tally)))
+      {
+         fprintf(stderr, "Walking parent %u failed (%s).\n", parent, rnd_strerror(err, handle));
+         return 0;
+      }
+
+      if (!tally->ordered)
+      {
+         fprintf(stderr, "Children of parent %u are out of order.\n", parent);
+         return 0;
+      }
+
+      count = 0;
+      for (child = 1; child <= CHILD_COUNT; ++child)
+      {
+         if (parent_of(child) == parent && is_kept(child))
+         {
+            if (count >= tally->count || tally->children[count] != child)
+            {
+               fprintf(stderr, "Parent %u is missing child %u.\n", parent, child);
+               return 0;
+            }
+            ++count;
+         }
+      }
+
+      if (count != tally->count)
+      {
+         fprintf(stderr, "Parent %u has %u children, expected %u.\n", parent, tally->count, count);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+/**
+ * Adds children in descending and ascending order, removes some, and
+ * confirms that each parent's children are complete and in order.
+ */
+void test_relation_operations(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   static struct child_tally tally;
+   uint32_t child, count;
+   RND_ERROR err;
+
+   if ((err = relations_count(handle, 1, &count)) || count != 0)
+   {
+      fprintf(stderr, "File without relationships reports %u children (%s).\n",
+              count, rnd_strerror(err, handle));
+      return;
+   }
+
+   // Add the upper half in ascending order, the fast case...
+   for (child = CHILD_COUNT / 2 + 1; child <= CHILD_COUNT; ++child)
+   {
+      if ((err = relations_add(handle, parent_of(child), child)))
+      {
+         fprintf(stderr, "Adding child %u failed (%s).\n", child, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   // ...then the lower half in descending order, to insert and split segments:
+   for (child = CHILD_COUNT / 2; child >= 1; --child)
+   {
+      if ((err = relations_add(handle, parent_of(child), child)))
+      {
+         fprintf(stderr, "Inserting child %u failed (%s).\n", child, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   // Adding an existing child changes nothing:
+   if ((err = relations_add(handle, parent_of(7), 7))
+       || (err = relations_count(handle, parent_of(7), &count))
+       || count != CHILD_COUNT / PARENT_COUNT)
+   {
+      fprintf(stderr, "Re-adding a child made %u children (%s).\n", count, rnd_strerror(err, handle));
+      return;
+   }
+
+   for (child = 5; child <= CHILD_COUNT; child += 5)
+   {
+      if ((err = relations_remove(handle, parent_of(child), child)))
+      {
+         fprintf(stderr, "Removing child %u failed (%s).\n", child, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   if (relations_remove(handle, parent_of(5), 5) != RND_EXTINCT_RECORD
+       || relations_remove(handle, PARENT_COUNT + 10, 1) != RND_EXTINCT_RECORD)
+   {
+      fprintf(stderr, "Removing a missing child didn't report an extinct record.\n");
+      return;
+   }
+
+   if (!check_children(handle, &tally))
+      return;
+
+   RND_HEAD_RELATION hr;
+   blocks_read_at(handle, handle->head_file.fhead.relation_head, &hr, sizeof(hr));
+   printf("%lu children of %u parents, the last parent's in %u runs.\n",
+          (unsigned long)hr.rhead.children, PARENT_COUNT, tally.runs);
+
+   if (hr.rhead.children != CHILD_COUNT - CHILD_COUNT / 5)
+   {
+      fprintf(stderr, "Relationships count %lu children.\n", (unsigned long)hr.rhead.children);
+      return;
+   }
+
+   // Small deltas pack many children into each segment:
+   if (tally.runs > 4)
+   {
+      fprintf(stderr, "%u children took %u segments.\n", tally.count, tally.runs);
+      return;
+   }
+
+   // Wide deltas inserted in descending order split segments repeatedly:
+   uint32_t wide_parent = PARENT_COUNT + 1;
+   for (child = 1000; child >= 1; --child)
+   {
+      if ((err = relations_add(handle, wide_parent, child * 1000)))
+      {
+         fprintf(stderr, "Inserting wide child %u failed (%s).\n", child, rnd_strerror(err, handle));
+         return;
+      }
+   }
+
+   memset(&tally, 0, sizeof(tally));
+   tally.ordered = 1;
+   if ((err = relations_walk(handle, wide_parent, tally_children, &tally))
+       || tally.count != 1000 || !tally.ordered || tally.runs < 2
+       || tally.children[0] != 1000 || tally.children[999] != 1000000)
+   {
+      fprintf(stderr, "Walk of split segments found %u children in %u runs (%s).\n",
+              tally.count, tally.runs, rnd_strerror(err, handle));
+      return;
+   }
+   printf("1000 widely-spaced children split into %u runs.\n", tally.runs);
+
+   *passed = 1;
+}
+
+/**
+ * Reopens the file to confirm that the relationships persist.
+ */
+void test_relation_persists(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   static struct child_tally tally;
+
+   if (check_children(handle, &tally))
+   {
+      printf("Reopened relationships agree with every add and remove.\n");
+      *passed = 1;
+   }
+}
+
+struct head_reader {
+   int  ready_fd;   /**< Written once the relationship head is held */
+   bool held;
+};
+
+/**
+ * Holds the relationship head as a walk does, for a moment.
+ */
+void hold_relation_head(RNDH *handle, void *closure)
+{
+   struct head_reader *reader = (struct head_reader*)closure;
+   BLOCK_LOC bl = { handle->head_file.fhead.relation_head, sizeof(RND_HEAD_RELATION) };
+
+   if (rnd_lock_place_shared(handle, &bl, 0) || write(reader->ready_fd, "", 1) != 1)
+      return;
+
+   usleep(300000);
+   rnd_lock_remove(handle, &bl);
+   reader->held = 1;
+}
+
+/**
+ * Counts and walks children while another process is in the middle of a
+ * walk, and confirms that only a change is kept out.
+ */
+void test_shared_walks(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   struct child_tally tally;
+   uint32_t before = 0, count = 0;
+   int ready_pipe[2], status;
+   RND_ERROR count_err, walk_err, add_err;
+   char ready;
+
+   memset(&tally, 0, sizeof(tally));
+
+   if (relations_count(handle, 1, &before) || pipe(ready_pipe))
+      return;
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      struct head_reader reader = { ready_pipe[1], 0 };
+      rnd_open("relations.db", 0, 0, hold_relation_head, &reader);
+      _exit(reader.held ? 0 : 1);
+   }
+
+   if (child == -1 || read(ready_pipe[0], &ready, 1) != 1)
+   {
+      fprintf(stderr, "The relationship head holder did not start.\n");
+      return;
+   }
+
+   count_err = relations_count(handle, 1, &count);
+   walk_err = relations_walk(handle, 1, tally_children, &tally);
+   add_err = relations_add(handle, 1, CHILD_COUNT + PARENT_COUNT);
+
+   close(ready_pipe[0]);
+   close(ready_pipe[1]);
+
+   if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+      fprintf(stderr, "The relationship head holder failed.\n");
+   else if (count_err || walk_err || count != before || tally.count != before)
+      fprintf(stderr, "Beside another walk, parent 1 counts %u and walks %u children, expected %u (%s).\n",
+              count, tally.count, before, rnd_strerror(count_err ? count_err : walk_err, handle));
+   else if (add_err != RND_LOCK_FAILED)
+      fprintf(stderr, "Adding a child beside a walk returned %s.\n", rnd_strerror(add_err, handle));
+   else
+   {
+      printf("Walks run alongside each other and keep changes out.\n");
+      *passed = 1;
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   bool operations_passed = 0, persist_passed = 0, shared_passed = 0;
+
+   rnd_open("relations.db", 64, RND_CREATE, test_relation_operations, &operations_passed);
+   if (operations_passed)
+   {
+      rnd_open("relations.db", 0, 0, test_relation_persists, &persist_passed);
+      rnd_open("relations.db", 0, 0, test_shared_walks, &shared_passed);
+   }
+
+   return operations_passed && persist_passed && shared_passed ? 0 : 1;
+}
@@ -0,0 +1,430 @@
+#include "scan.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#define RECORD_COUNT 5000
+
+typedef struct sample {
+   uint64_t serial;
+   double   reading;
+   int32_t  offset;
+   float    ratio;
+   int16_t  delta;
+   uint8_t  flags;
+   char     pad[5];
+} SAMPLE;
+
+static SAMPLE samples[RECORD_COUNT + 1];
+static bool   live[RECORD_COUNT + 1];
+
+static void make_sample(SAMPLE *s, uint32_t i)
+{
+   memset(s, 0, sizeof(*s));
+   s->serial = (uint64_t)i * 2654435761ULL % 100000;
+   s->reading = ((double)(i % 401) - 200.0) / 8.0;
+   s->offset = (int32_t)(i * 7919 % 20001) - 10000;
+   s->ratio = (i % 5 == 0) ? -0.0f : (float)((int)(i % 81) - 40) / 16.0f;
+   s->delta = (int16_t)((int)(i % 1000) - 500);
+   s->flags = (uint8_t)(i * 13);
+}
+
+/**
+ * Value of a field of a sample as a double for the reference comparison,
+ * which is exact for every field of SAMPLE.
+ */
+static double field_value(const SAMPLE *s, const RND_FIELD *field)
+{
+   switch(field->offset)
+   {
+      case offsetof(SAMPLE, reading): return s->reading;
+      case offsetof(SAMPLE, offset):  return s->offset;
+      case offsetof(SAMPLE, ratio):   return s->ratio;
+      case offsetof(SAMPLE, delta):   return s->delta;
+      case offsetof(SAMPLE, flags):   return s->flags;
+      default:                        return (double)s->serial;
+   }
+}
+
+static bool reference_match(double x, RND_SCAN_OP op, double a, double b)
+{
+   switch(op)
+   {
+      case RND_OP_EQ: return x == a;
+      case RND_OP_NE: return x != a;
+      case RND_OP_LT: return x < a;
+      case RND_OP_LE: return x <= a;
+      case RND_OP_GT: return x > a;
+      case RND_OP_GE: return x >= a;
+      default:        return x >= a && x <= b;
+   }
+}
+
+/**
+ * Compares a filter's result with a comparison of every sample.
+ *
+ * @param value  one field value, or two for RND_OP_BETWEEN
+ * @param a      the first value as a double
+ * @param b      the second value as a double
+ */
+static bool check_filter(RNDH *handle, const RND_FIELD *field, RND_SCAN_OP op, const void *value, double a, double b)
+{
+   RND_BITMAP matches;
+   RND_ERROR err;
+   uint32_t i;
+
+   if ((err = scan_filter(handle, 0, field, op, value, &matches)))
+   {
+      fprintf(stderr, "Filter failed (%s).\n", rnd_strerror(err, handle));
+      return 0;
+   }
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      bool expected = live[i] && reference_match(field_value(&samples[i], field), op, a, b);
+      if (expected != bitmap_test(matches.words, i))
+      {
+         fprintf(stderr, "Field at %u, op %d, %g: record %u should%s match.\n",
+                 field->offset, op, a, i, expected ? "" : "n't");
+         free(matches.words);
+         return 0;
+      }
+   }
+
+   if (bitmap_test(matches.words, 0))
+   {
+      fprintf(stderr, "Filter matched recno 0.\n");
+      free(matches.words);
+      return 0;
+   }
+
+   free(matches.words);
+   return 1;
+}
+
+/**
+ * Runs every comparison against each field.
+ */
+void test_scan_filters(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_ERROR err;
+   RND_RECNO recno;
+   uint32_t i;
+   int op;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_DATA data = { &samples[i], sizeof(SAMPLE) };
+      make_sample(&samples[i], i);
+      recno = 0;
+
+      if ((err = rnd_put(handle, &recno, &data)))
+      {
+         fprintf(stderr, "Append of sample %u failed (%s).\n", i, rnd_strerror(err, handle));
+         return;
+      }
+      live[i] = 1;
+   }
+
+   for (i = 7; i <= RECORD_COUNT; i += 7)
+   {
+      rnd_delete(handle, i);
+      live[i] = 0;
+   }
+
+   // Compress the cold blocks so the scan also reads cached images:
+   uint32_t compressed;
+   flatrecs_compress_cold(handle, 0, &compressed);
+
+   RND_FIELD serial = { offsetof(SAMPLE, serial), 8, RND_FIELD_UINT };
+   RND_FIELD reading = { offsetof(SAMPLE, reading), 8, RND_FIELD_FLOAT };
+   RND_FIELD offset = { offsetof(SAMPLE, offset), 4, RND_FIELD_INT };
+   RND_FIELD ratio = { offsetof(SAMPLE, ratio), 4, RND_FIELD_FLOAT };
+   RND_FIELD delta = { offsetof(SAMPLE, delta), 2, RND_FIELD_INT };
+   RND_FIELD flags = { offsetof(SAMPLE, flags), 1, RND_FIELD_UINT };
+
+   for (op = RND_OP_EQ; op <= RND_OP_BETWEEN; ++op)
+   {
+      uint64_t serials[2] = { samples[100].serial, 60000 };
+      double readings[2] = { -3.5, 12.0 };
+      int32_t offsets[2] = { -2500, samples[42].offset };
+      float ratios[2] = { 0.0f, 1.5f };
+      int16_t deltas[2] = { -1, 250 };
+      uint8_t flag_values[2] = { 13, 200 };
+
+      if (!check_filter(handle, &serial, op, serials, (double)serials[0], (double)serials[1])
+          || !check_filter(handle, &reading, op, readings, readings[0], readings[1])
+          || !check_filter(handle, &offset, op, offsets, offsets[0], offsets[1])
+          || !check_filter(handle, &ratio, op, ratios, ratios[0], ratios[1])
+          || !check_filter(handle, &delta, op, deltas, deltas[0], deltas[1])
+          || !check_filter(handle, &flags, op, flag_values, flag_values[0], flag_values[1]))
+         return;
+   }
+
+   // The extremes of a type make empty ranges:
+   uint8_t zero = 0;
+   RND_BITMAP matches;
+   if ((err = scan_filter(handle, 0, &flags, RND_OP_LT, &zero, &matches))
+       || bitmap_popcount(matches.words, matches.nbits) != 0)
+   {
+      fprintf(stderr, "Nothing is less than unsigned 0 (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+   free(matches.words);
+
+   RND_FIELD outside = { sizeof(SAMPLE) - 2, 4, RND_FIELD_INT };
+   if (scan_filter(handle, 0, &outside, RND_OP_EQ, &zero, &matches) != RND_BAD_PARAMETER)
+   {
+      fprintf(stderr, "A field past the end of the record was accepted.\n");
+      return;
+   }
+
+   printf("Filters of %d records, %u compressed blocks, agree with the reference.\n",
+          RECORD_COUNT, compressed);
+   *passed = 1;
+}
+
+/**
+ * Compares aggregates of a field with those of the live samples.
+ */
+static bool check_aggregate(RNDH *handle, const RND_FIELD *field, uint32_t ops)
+{
+   RND_AGGREGATE agg;
+   RND_ERROR err;
+   uint64_t count = 0;
+   double sum = 0, min = 0, max = 0;
+   uint32_t i;
+
+   if ((err = scan_aggregate(handle, 0, field, ops, &agg)))
+   {
+      fprintf(stderr, "Aggregate failed (%s).\n", rnd_strerror(err, handle));
+      return 0;
+   }
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      if (!live[i])
+         continue;
+
+      double x = field_value(&samples[i], field);
+      if (!count || x < min)
+         min = x;
+      if (!count || x > max)
+         max = x;
+      sum += x;
+      ++count;
+   }
+
+   // Every field's values and sums are exact in a double:
+   double got_sum = field->type == RND_FIELD_FLOAT ? agg.sum.f
+      : field->type == RND_FIELD_INT ? (double)agg.sum.i : (double)agg.sum.u;
+   double got_min = field->type == RND_FIELD_FLOAT ? agg.min.f
+      : field->type == RND_FIELD_INT ? (double)agg.min.i : (double)agg.min.u;
+   double got_max = field->type == RND_FIELD_FLOAT ? agg.max.f
+      : field->type == RND_FIELD_INT ? (double)agg.max.i : (double)agg.max.u;
+
+   if (agg.count != count || got_sum != sum || got_min != min || got_max != max
+       || agg.mean != sum / (double)count)
+   {
+      fprintf(stderr, "Field at %u aggregates to %lu, %g, %g, %g, %g; expected %lu, %g, %g, %g.\n",
+              field->offset, (unsigned long)agg.count, got_sum, got_min, got_max, agg.mean,
+              (unsigned long)count, sum, min, max);
+      return 0;
+   }
+
+   return 1;
+}
+
+/**
+ * Aggregates each field with and without kept partials, then changes
+ * records to confirm the partials of the changed blocks are discarded.
+ */
+void test_scan_aggregates(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   const uint32_t all = RND_AGG_COUNT | RND_AGG_SUM | RND_AGG_MIN | RND_AGG_MAX | RND_AGG_MEAN;
+   RND_FIELD fields[] = {
+      { offsetof(SAMPLE, serial), 8, RND_FIELD_UINT },
+      { offsetof(SAMPLE, reading), 8, RND_FIELD_FLOAT },
+      { offsetof(SAMPLE, offset), 4, RND_FIELD_INT },
+      { offsetof(SAMPLE, ratio), 4, RND_FIELD_FLOAT },
+      { offsetof(SAMPLE, delta), 2, RND_FIELD_INT },
+      { offsetof(SAMPLE, flags), 1, RND_FIELD_UINT }
+   };
+   const int nfields = sizeof(fields) / sizeof(fields[0]);
+   int f, pass;
+
+   for (pass = 0; pass < 3; ++pass)
+   {
+      for (f = 0; f < nfields; ++f)
+         if (!check_aggregate(handle, &fields[f], pass ? all | RND_AGG_CACHE : all))
+            return;
+   }
+
+   if (!handle->cache || !handle->cache->partial_count)
+   {
+      fprintf(stderr, "No partials were kept.\n");
+      return;
+   }
+
+   // Change records in the middle and at the end, and delete one:
+   uint32_t changed[] = { 2, RECORD_COUNT / 2, RECORD_COUNT - 1 };
+   for (f = 0; f < (int)(sizeof(changed) / sizeof(changed[0])); ++f)
+   {
+      RND_RECNO recno = changed[f];
+      SAMPLE *s = &samples[recno];
+      RND_DATA data = { s, sizeof(SAMPLE) };
+
+      s->serial = 999999;
+      s->reading = -1000.0;
+      s->offset = 12345;
+      s->ratio = 77.5f;
+      s->delta = -32000;
+      s->flags = 255;
+      rnd_put(handle, &recno, &data);
+   }
+
+   rnd_delete(handle, 3);
+   live[3] = 0;
+
+   for (f = 0; f < nfields; ++f)
+      if (!check_aggregate(handle, &fields[f], all | RND_AGG_CACHE))
+         return;
+
+   RND_AGGREGATE agg;
+   RND_FIELD outside = { sizeof(SAMPLE) - 1, 2, RND_FIELD_INT };
+   if (scan_aggregate(handle, 0, &outside, RND_AGG_SUM, &agg) != RND_BAD_PARAMETER
+       || scan_aggregate(handle, 0, &fields[0], 1024, &agg) != RND_BAD_PARAMETER)
+   {
+      fprintf(stderr, "A bad field or operation was accepted.\n");
+      return;
+   }
+
+   printf("Aggregates, with and without kept partials, agree with the reference.\n");
+   *passed = 1;
+}
+
+/**
+ * Confirms that the vector aggregators agree with the portable one.
+ */
+static bool test_aggregators(void)
+{
+   static SAMPLE block[64];
+   uint64_t live = 0xf0f5a5a5c3c3ffeeULL;
+   uint32_t i, count;
+   int type;
+
+   for (i = 0; i < 64; ++i)
+      make_sample(&block[i], i * 41 + 3);
+
+   for (type = RND_FIELD_UINT; type <= RND_FIELD_FLOAT; ++type)
+   {
+      uint32_t widths[2] = { 4, 8 };
+      uint32_t offsets[2] = { offsetof(SAMPLE, offset), offsetof(SAMPLE, serial) };
+      int w;
+
+      for (w = 0; w < 2; ++w)
+      {
+         for (count = 1; count <= 64; count += 9)
+         {
+            SCAN_PART vector = { 0, { 0 }, ~(uint64_t)0, 0 };
+            SCAN_PART portable = vector;
+            const char *field = (char*)block + offsets[w];
+
+            // Floats from integer bits make NaNs, whose sums don't compare:
+            if (type == RND_FIELD_FLOAT)
+               field = (char*)block + (w ? offsetof(SAMPLE, reading) : offsetof(SAMPLE, ratio));
+
+            scan_aggregator_for(widths[w])(field, sizeof(SAMPLE), count, live, (RND_FIELD_TYPE)type, widths[w], &vector);
+            scan_aggregate_portable(field, sizeof(SAMPLE), count, live, (RND_FIELD_TYPE)type, widths[w], &portable);
+
+            if (vector.sum.u != portable.sum.u
+                || vector.min_key != portable.min_key
+                || vector.max_key != portable.max_key)
+            {
+               fprintf(stderr, "Aggregators disagree for type %d, width %u, over %u records.\n",
+                       type, widths[w], count);
+               return 0;
+            }
+         }
+      }
+   }
+
+   return 1;
+}
+
+/**
+ * Confirms that the vector kernels agree with the portable kernel.
+ */
+static bool test_kernels(void)
+{
+   static SAMPLE block[64];
+   uint32_t i, count;
+   int type;
+
+   for (i = 0; i < 64; ++i)
+      make_sample(&block[i], i * 37 + 5);
+
+   for (type = RND_FIELD_UINT; type <= RND_FIELD_FLOAT; ++type)
+   {
+      RND_FIELD f4 = { offsetof(SAMPLE, offset), 4, (RND_FIELD_TYPE)type };
+      RND_FIELD f8 = { offsetof(SAMPLE, reading), 8, (RND_FIELD_TYPE)type };
+      SCAN_PRED p4, p8;
+
+      scan_make_predicate(&f4, RND_OP_GE, &block[3].offset, &p4);
+      scan_make_predicate(&f8, RND_OP_LE, &block[9].reading, &p8);
+
+      for (count = 1; count <= 64; count += 7)
+      {
+         if (scan_kernel_for(4)((char*)block + f4.offset, sizeof(SAMPLE), count, &p4)
+             != scan_kernel_portable((char*)block + f4.offset, sizeof(SAMPLE), count, &p4)
+             || scan_kernel_for(8)((char*)block + f8.offset, sizeof(SAMPLE), count, &p8)
+             != scan_kernel_portable((char*)block + f8.offset, sizeof(SAMPLE), count, &p8))
+         {
+            fprintf(stderr, "Kernels disagree for type %d over %u records.\n", type, count);
+            return 0;
+         }
+      }
+   }
+
+   return 1;
+}
+
+int main(int argc, const char **argv)
+{
+   bool passed = 0;
+
+   bool aggregates_passed = 0;
+
+   if (!test_kernels() || !test_aggregators())
+      return 1;
+
+   rnd_open("scan.db", sizeof(SAMPLE), RND_CREATE, test_scan_filters, &passed);
+   if (passed)
+      rnd_open("scan.db", 0, 0, test_scan_aggregates, &aggregates_passed);
+
+   return passed && aggregates_passed ? 0 : 1;
+}
@@ -0,0 +1,368 @@
+#include "snapshot.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/wait.h>   // for waitpid()
+
+#define RECORD_COUNT 2000
+
+static void make_record(char *record, uint32_t recno, const char *state)
+{
+   memset(record, 0, 64);
+   snprintf(record, 64, "order %u %s", recno, state);
+}
+
+static RND_ERROR put_state(RNDH *handle, uint32_t recno, const char *state)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_RECNO rn = recno;
+
+   make_record(record, recno, state);
+   return rnd_put(handle, &rn, &data);
+}
+
+/**
+ * Confirms that a snapshot sees a record live with the given state, or
+ * not at all if *state* is NULL.
+ */
+static bool snapshot_is(RND_SNAPSHOT *snapshot, uint32_t recno, const char *state)
+{
+   char record[64], expected[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_ERROR err = rnd_snapshot_get(snapshot, recno, &data);
+
+   if (!state)
+   {
+      if (err == RND_EXTINCT_RECORD)
+         return 1;
+      fprintf(stderr, "Snapshot %lu sees record %u, which it shouldn't.\n", (unsigned long)snapshot->epoch, recno);
+      return 0;
+   }
+
+   make_record(expected, recno, state);
+   if (err || data.size != sizeof(record) || memcmp(record, expected, sizeof(record)))
+   {
+      fprintf(stderr, "Snapshot %lu reads record %u as \"%s\", expected \"%s\".\n",
+              (unsigned long)snapshot->epoch, recno, err ? rnd_strerror(err, snapshot->handle) : record, expected);
+      return 0;
+   }
+
+   return 1;
+}
+
+static bool snapshot_field_is(RND_SNAPSHOT *snapshot, uint32_t recno, uint64_t value)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   uint64_t field;
+
+   if (rnd_snapshot_get(snapshot, recno, &data))
+      return 0;
+
+   memcpy(&field, record + 56, sizeof(field));
+   if (field != value)
+   {
+      fprintf(stderr, "Snapshot reads record %u's counter as %lu, expected %lu.\n",
+              recno, (unsigned long)field, (unsigned long)value);
+      return 0;
+   }
+
+   return 1;
+}
+
+static uint64_t log_entries(RNDH *handle)
+{
+   RND_HEAD_SNAPSHOT hs;
+   off_t head;
+
+   fflush(handle->file);
+   if (snapshot_read_head(handle, &head, &hs) || !head)
+      return 0;
+
+   return hs.shead.entries;
+}
+
+void make_orders(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   uint32_t i;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { record, sizeof(record) };
+
+      make_record(record, i, "open");
+      if (rnd_put(handle, &recno, &data))
+         return;
+   }
+
+   *passed = 1;
+}
+
+/**
+ * Changes records in every way a record can change while two snapshots
+ * are open, and checks that each snapshot still sees the records as they
+ * were when it opened.
+ */
+void test_snapshot_views(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_SNAPSHOT *first, *second;
+   RND_TXN *txn;
+   RND_ERROR err;
+   uint32_t compressed;
+   uint64_t previous, found;
+   RND_RECNO appended = 0;
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+
+   if ((err = rnd_compress_cold_blocks(handle, &compressed)) || compressed == 0)
+   {
+      fprintf(stderr, "Compression failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   if ((err = rnd_snapshot_open(handle, &first)))
+   {
+      fprintf(stderr, "Opening a snapshot failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   make_record(record, RECORD_COUNT + 1, "new");
+
+   if ((err = put_state(handle, 10, "paid"))
+       || (err = rnd_delete(handle, 20))
+       || (err = rnd_update_field(handle, 30, 11, 4, "PAID"))
+       || (err = rnd_cas_field(handle, 40, 56, 8, 0, 7, &found))
+       || (err = rnd_fetch_add_field(handle, 50, 56, 8, 3, &previous))
+       || (err = put_state(handle, 1500, "paid"))
+       || (err = rnd_put(handle, &appended, &data)))
+   {
+      fprintf(stderr, "Changing records failed (%s).\n", rnd_strerror(err, handle));
+      rnd_snapshot_close(first);
+      return;
+   }
+
+   if ((err = rnd_txn_begin(handle, &txn))
+       || (err = txn_write(txn, 0, 60, "order 60 shipped", 17))
+       || (err = rnd_txn_delete(txn, 61))
+       || (err = rnd_txn_commit(txn)))
+   {
+      fprintf(stderr, "Committing failed (%s).\n", rnd_strerror(err, handle));
+      rnd_snapshot_close(first);
+      return;
+   }
+
+   if ((err = rnd_snapshot_open(handle, &second)))
+   {
+      fprintf(stderr, "Opening a second snapshot failed (%s).\n", rnd_strerror(err, handle));
+      rnd_snapshot_close(first);
+      return;
+   }
+
+   // Changes seen by the second snapshot only, and one it must not see:
+   put_state(handle, 10, "shipped");
+   put_state(handle, 20, "revived");
+   rnd_fetch_add_field(handle, 50, 56, 8, 3, &previous);
+   put_state(handle, 1999, "paid");
+   put_state(handle, appended, "changed");
+
+   bool first_ok = snapshot_is(first, 10, "open") && snapshot_is(first, 20, "open")
+      && snapshot_is(first, 30, "open") && snapshot_field_is(first, 40, 0)
+      && snapshot_field_is(first, 50, 0) && snapshot_is(first, 60, "open")
+      && snapshot_is(first, 61, "open") && snapshot_is(first, 1500, "open")
+      && snapshot_is(first, 1999, "open") && snapshot_is(first, 11, "open")
+      && snapshot_is(first, appended, NULL) && snapshot_is(first, 0, NULL);
+
+   bool second_ok = snapshot_is(second, 10, "paid") && snapshot_is(second, 20, NULL)
+      && snapshot_field_is(second, 40, 7) && snapshot_field_is(second, 50, 3)
+      && snapshot_is(second, 61, NULL) && snapshot_is(second, 1500, "paid")
+      && snapshot_is(second, 1999, "open") && snapshot_is(second, appended, "new");
+
+   // Each record is copied once per snapshot that needs it:
+   uint64_t entries = log_entries(handle);
+   put_state(handle, 10, "delivered");
+   bool copied_once = log_entries(handle) == entries;
+   if (!copied_once)
+      fprintf(stderr, "Rewriting a record copied it again.\n");
+
+   rnd_snapshot_close(first);
+   bool still_ok = snapshot_is(second, 10, "paid") && snapshot_is(second, 20, NULL);
+   rnd_snapshot_close(second);
+
+   if (first_ok && second_ok && copied_once && still_ok)
+   {
+      printf("Snapshots see the records as they were when they opened.\n");
+      *passed = 1;
+   }
+}
+
+void change_in_child(RNDH *handle, void *closure)
+{
+   put_state(handle, 70, "changed elsewhere");
+   rnd_delete(handle, 71);
+}
+
+/**
+ * Changes records from another process while a snapshot is open.
+ */
+void test_other_process(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_SNAPSHOT *snapshot;
+
+   if (rnd_snapshot_open(handle, &snapshot))
+      return;
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      rnd_open("snapshot.db", 0, 0, change_in_child, NULL);
+      _exit(0);
+   }
+   waitpid(child, NULL, 0);
+
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   bool changed = rnd_get(handle, 70, &data) == RND_SUCCESS && strstr(record, "elsewhere") != NULL;
+
+   if (!changed)
+      fprintf(stderr, "The other process's change didn't reach the table.\n");
+   else if (snapshot_is(snapshot, 70, "open") && snapshot_is(snapshot, 71, "open"))
+   {
+      printf("Snapshots see past changes made by other processes.\n");
+      *passed = 1;
+   }
+
+   rnd_snapshot_close(snapshot);
+}
+
+void change_in_other_handle(RNDH *handle, void *closure)
+{
+   put_state(handle, 72, "changed beside");
+}
+
+/**
+ * Changes a record through another handle of this process while a
+ * snapshot is open, as a thread with a handle of its own would.
+ */
+void test_other_handle(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_SNAPSHOT *snapshot;
+
+   if (rnd_snapshot_open(handle, &snapshot))
+      return;
+
+   rnd_open("snapshot.db", 0, 0, change_in_other_handle, NULL);
+
+   if (snapshot_is(snapshot, 72, "open"))
+   {
+      printf("Snapshots see past changes made through other handles.\n");
+      *passed = 1;
+   }
+
+   rnd_snapshot_close(snapshot);
+}
+
+/**
+ * Rewrites every record under a snapshot, twice, so the copies fill more
+ * than one block of the log and the second round reuses the blocks the
+ * first one added.
+ */
+void test_many_copies(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_SNAPSHOT *snapshot;
+   uint32_t i;
+   int round;
+
+   for (round = 0; round < 2; ++round)
+   {
+      if (rnd_snapshot_open(handle, &snapshot))
+         return;
+
+      for (i = 100; i <= RECORD_COUNT; ++i)
+      {
+         if (put_state(handle, i, round ? "round 2" : "round 1"))
+         {
+            rnd_snapshot_close(snapshot);
+            return;
+         }
+      }
+
+      for (i = 100; i <= RECORD_COUNT; ++i)
+      {
+         if (!snapshot_is(snapshot, i, round ? "round 1" : i == 1500 || i == 1999 ? "paid" : "open"))
+         {
+            rnd_snapshot_close(snapshot);
+            return;
+         }
+      }
+
+      rnd_snapshot_close(snapshot);
+   }
+
+   printf("A snapshot log spans blocks and is reused.\n");
+   *passed = 1;
+}
+
+/**
+ * With no snapshot open, the log is empty and writes add nothing to it.
+ */
+void test_no_snapshots(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+
+   put_state(handle, 80, "paid");
+   put_state(handle, 81, "paid");
+
+   *passed = log_entries(handle) == 0 && (!handle->snapshots || handle->snapshots->copied.count == 0);
+}
+
+int main(int argc, const char **argv)
+{
+   bool made = 0, views_passed = 0, process_passed = 0, handle_passed = 0, many_passed = 0, idle_passed = 0;
+
+   rnd_open("snapshot.db", 64, RND_CREATE, make_orders, &made);
+   if (!made)
+      return 1;
+
+   rnd_open("snapshot.db", 0, 0, test_snapshot_views, &views_passed);
+   rnd_open("snapshot.db", 0, 0, test_other_process, &process_passed);
+   rnd_open("snapshot.db", 0, 0, test_other_handle, &handle_passed);
+
+   rnd_open("snapshot.db", 0, 0, test_many_copies, &many_passed);
+
+   rnd_open("snapshot.db", 0, 0, test_no_snapshots, &idle_passed);
+   if (idle_passed)
+      printf("Writes copy nothing while no snapshot is open.\n");
+
+   return views_passed && process_passed && handle_passed && many_passed && idle_passed ? 0 : 1;
+}
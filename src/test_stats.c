@@ -0,0 +1,314 @@
+#include "stats.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#define RECORD_COUNT 20000
+#define THREADS 4
+#define THREAD_GETS 500
+
+static void make_record(char *record, uint32_t recno)
+{
+   memset(record, 0, 64);
+   snprintf(record, 64, "order %u", recno);
+}
+
+static bool count_records(const uint64_t *map,
+                          const char *records,
+                          uint32_t nbits,
+                          uint32_t first_recno,
+                          uint32_t rec_size,
+                          void *closure)
+{
+   return 1;
+}
+
+/**
+ * Fills a table, reads it back, and checks that the handle counted each
+ * kind of work it did.
+ */
+void test_handle_stats(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_STATS before, after;
+   uint32_t i, compressed;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      make_record(record, i);
+      if (rnd_put(handle, &recno, &data))
+         return;
+   }
+
+   for (i = 1; i <= 100; ++i)
+      if (rnd_get(handle, i * (RECORD_COUNT / 100), &data))
+         return;
+
+   rnd_stats(handle, &after);
+
+   if (after.calls[RND_CALL_PUT] != RECORD_COUNT || after.calls[RND_CALL_GET] != 100
+       || after.calls[RND_CALL_DELETE] != 0)
+      fprintf(stderr, "Counted %lu puts and %lu gets.\n",
+              (unsigned long)after.calls[RND_CALL_PUT], (unsigned long)after.calls[RND_CALL_GET]);
+   else if (after.bytes_written < (uint64_t)RECORD_COUNT * sizeof(record) || after.bytes_read < 100 * sizeof(record))
+      fprintf(stderr, "Counted %lu bytes written and %lu read.\n",
+              (unsigned long)after.bytes_written, (unsigned long)after.bytes_read);
+   else if (!after.seeks || !after.reads || !after.writes || !after.blocks_appended || !after.chain_blocks_walked)
+      fprintf(stderr, "Counted %lu seeks, %lu reads, %lu writes, %lu blocks appended, %lu blocks walked.\n",
+              (unsigned long)after.seeks, (unsigned long)after.reads, (unsigned long)after.writes,
+              (unsigned long)after.blocks_appended, (unsigned long)after.chain_blocks_walked);
+   else if (rnd_compress_cold_blocks(handle, &compressed) || !compressed)
+      fprintf(stderr, "No blocks were compressed.\n");
+   else
+   {
+      // The first look at a compressed block misses the cache, later ones hit:
+      rnd_stats(handle, &before);
+      rnd_get(handle, RECORD_COUNT / 2, &data);
+      rnd_get(handle, RECORD_COUNT / 2 + 1, &data);
+      rnd_stats(handle, &after);
+
+      if (after.cache_misses != before.cache_misses + 1 || after.cache_hits <= before.cache_hits)
+         fprintf(stderr, "Counted %lu cache misses and %lu hits for two reads.\n",
+                 (unsigned long)(after.cache_misses - before.cache_misses),
+                 (unsigned long)(after.cache_hits - before.cache_hits));
+      else
+      {
+         printf("A handle counts its calls, I/O, blocks and cache use.\n");
+         *passed = 1;
+      }
+   }
+}
+
+/**
+ * Checks that the reads of a parallel scan's workers are counted in the
+ * handle that started the scan.
+ */
+void test_parallel_stats(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_STATS before, after;
+
+   rnd_stats(handle, &before);
+   if (rnd_parallel_scan(handle, 0, THREADS, count_records, NULL))
+      return;
+   rnd_stats(handle, &after);
+
+   if (after.reads <= before.reads || after.calls[RND_CALL_PARALLEL_SCAN] != 1)
+   {
+      fprintf(stderr, "A parallel scan counted %lu reads.\n", (unsigned long)(after.reads - before.reads));
+      return;
+   }
+
+   printf("The workers of a parallel scan count their reads in the handle.\n");
+   *passed = 1;
+}
+
+void get_records(RNDH *handle, void *closure)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   uint32_t i;
+
+   for (i = 1; i <= THREAD_GETS; ++i)
+      rnd_get(handle, i, &data);
+}
+
+/** Threads of `test_process_stats` that have finished their gets. */
+static int threads_done;
+
+static void *get_in_thread(void *arg)
+{
+   rnd_open("stats.db", 0, 0, get_records, NULL);
+   __atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+/**
+ * Has threads read through handles of their own and exit, and checks
+ * that the counts of the process include theirs.  The counts are read
+ * over and over while the threads count, as a monitor would.
+ */
+bool test_process_stats(void)
+{
+   RND_STATS before, during, after;
+   pthread_t threads[THREADS];
+   int i;
+
+   rnd_stats(NULL, &before);
+
+   for (i = 0; i < THREADS; ++i)
+      if (pthread_create(&threads[i], NULL, get_in_thread, NULL))
+         return 0;
+
+   while (__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) < THREADS)
+      rnd_stats(NULL, &during);
+
+   for (i = 0; i < THREADS; ++i)
+      pthread_join(threads[i], NULL);
+
+   rnd_stats(NULL, &after);
+
+   if (after.calls[RND_CALL_GET] - before.calls[RND_CALL_GET] != THREADS * THREAD_GETS
+       || after.calls[RND_CALL_OPEN] - before.calls[RND_CALL_OPEN] != THREADS
+       || after.bytes_read <= before.bytes_read)
+   {
+      fprintf(stderr, "The process counted %lu gets from %d threads.\n",
+              (unsigned long)(after.calls[RND_CALL_GET] - before.calls[RND_CALL_GET]), THREADS);
+      return 0;
+   }
+
+   printf("The counts of the process include those of threads that have exited.\n");
+   return 1;
+}
+
+/**
+ * Times gets, puts and deletes, and checks that each is counted and its
+ * percentiles are in order, and that nothing is timed while timing is off.
+ */
+void test_latency(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_LATENCY latency[RND_LATENCY_LIMIT];
+   uint32_t i;
+   int op;
+
+   for (i = 1; i <= 100; ++i)
+      rnd_get(handle, i, &data);
+
+   rnd_latency(RND_LATENCY_GET, &latency[RND_LATENCY_GET]);
+   if (latency[RND_LATENCY_GET].count)
+   {
+      fprintf(stderr, "Timed %lu gets with timing off.\n", (unsigned long)latency[RND_LATENCY_GET].count);
+      return;
+   }
+
+   rnd_latency_enable(1);
+
+   for (i = 1; i <= 1000; ++i)
+   {
+      RND_RECNO recno = 0;
+      make_record(record, i);
+      data.size = sizeof(record);
+      rnd_put(handle, &recno, &data);
+      rnd_get(handle, recno, &data);
+      if (i % 4 == 0)
+         rnd_delete(handle, recno);
+   }
+
+   rnd_latency_enable(0);
+
+   for (op = 0; op < RND_LATENCY_LIMIT; ++op)
+   {
+      RND_LATENCY *l = &latency[op];
+      rnd_latency((RND_LATENCY_OP)op, l);
+
+      if (l->count && !(l->min <= l->p50 && l->p50 <= l->p90 && l->p90 <= l->p99
+                        && l->p99 <= l->p999 && l->p999 <= l->max && l->min <= l->mean && l->mean <= l->max))
+      {
+         fprintf(stderr, "Latencies of operation %d are out of order.\n", op);
+         return;
+      }
+   }
+
+   if (latency[RND_LATENCY_GET].count != 1000 || latency[RND_LATENCY_PUT].count != 1000
+       || latency[RND_LATENCY_DELETE].count != 250 || !latency[RND_LATENCY_LOCK].count
+       || !latency[RND_LATENCY_EXTEND].count)
+   {
+      fprintf(stderr, "Timed %lu gets, %lu puts, %lu deletes, %lu locks and %lu extensions.\n",
+              (unsigned long)latency[RND_LATENCY_GET].count, (unsigned long)latency[RND_LATENCY_PUT].count,
+              (unsigned long)latency[RND_LATENCY_DELETE].count, (unsigned long)latency[RND_LATENCY_LOCK].count,
+              (unsigned long)latency[RND_LATENCY_EXTEND].count);
+      return;
+   }
+
+   rnd_latency_print(stdout);
+   printf("Gets, puts, deletes, locks and extensions are timed only while timing is on.\n");
+   *passed = 1;
+}
+
+/**
+ * Checks that percentiles read from the buckets of a histogram are
+ * within the precision of its buckets.
+ */
+bool test_latency_buckets(void)
+{
+   static STATS_LATENCY histogram;
+   RND_LATENCY summary;
+   uint64_t ns;
+   uint32_t i;
+
+   for (i = 0; i < LATENCY_BUCKETS; ++i)
+      if (stats_latency_bucket(stats_latency_bucket_high(i)) != i
+          || (i + 1 < LATENCY_BUCKETS && stats_latency_bucket(stats_latency_bucket_high(i) + 1) != i + 1))
+      {
+         fprintf(stderr, "Bucket %u doesn't end where the next begins.\n", i);
+         return 0;
+      }
+
+   for (ns = 1; ns <= 100000; ++ns)
+   {
+      ++histogram.buckets[stats_latency_bucket(ns)];
+      histogram.total += ns;
+   }
+   histogram.min = 1;
+   histogram.max = 100000;
+
+   stats_summarize_latency(&histogram, &summary);
+
+   if (summary.count != 100000 || summary.mean != 50000
+       || summary.p50 < 50000 || summary.p50 > 50000 + 50000 / LATENCY_SUB
+       || summary.p99 < 99000 || summary.p99 > 99000 + 99000 / LATENCY_SUB
+       || summary.max != 100000)
+   {
+      fprintf(stderr, "Read p50 %lu and p99 %lu of 1 to 100000.\n",
+              (unsigned long)summary.p50, (unsigned long)summary.p99);
+      return 0;
+   }
+
+   printf("Percentiles are kept to within 1/%d.\n", LATENCY_SUB);
+   return 1;
+}
+
+int main(int argc, const char **argv)
+{
+   bool handle_passed = 0, parallel_passed = 0;
+
+   rnd_open("stats.db", 64, RND_CREATE, test_handle_stats, &handle_passed);
+   rnd_open("stats.db", 0, 0, test_parallel_stats, &parallel_passed);
+
+   bool process_passed = test_process_stats();
+
+   bool latency_passed = 0;
+   rnd_open("stats.db", 0, 0, test_latency, &latency_passed);
+
+   bool buckets_passed = test_latency_buckets();
+
+   return handle_passed && parallel_passed && process_passed && latency_passed && buckets_passed ? 0 : 1;
+}
@@ -0,0 +1,365 @@
+#include "txn.h"
+
+#include <assert.h>
+
+#include "recnodb.c"
+#include "blocks.c"
+#include "chains.c"
+#include "extra.c"
+#include "locks.c"
+#include "bitmap.c"
+#include "cache.c"
+#include "compress.c"
+#include "lz.c"
+#include "bufpool.c"
+#include "mapping.c"
+#include "flatrecs.c"
+#include "hashindex.c"
+#include "relations.c"
+#include "btree.c"
+#include "scan.c"
+#include "parallel.c"
+#include "txn.c"
+#include "snapshot.c"
+#include "backup.c"
+#include "changes.c"
+#include "stats.c"
+
+#include <sys/wait.h>   // for waitpid()
+#include <time.h>       // for clock_gettime()
+
+#define RECORD_COUNT 2000
+
+static void make_record(char *record, uint32_t recno, const char *state)
+{
+   memset(record, 0, 64);
+   snprintf(record, 64, "order %u %s", recno, state);
+}
+
+/**
+ * Confirms that a record is live with the given state, or deleted if
+ * *state* is NULL.
+ */
+static bool record_is(RNDH *handle, uint32_t recno, const char *state)
+{
+   char record[64], expected[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_ERROR err = rnd_get(handle, recno, &data);
+
+   if (!state)
+      return err == RND_EXTINCT_RECORD;
+
+   make_record(expected, recno, state);
+   if (err || memcmp(record, expected, sizeof(record)))
+   {
+      fprintf(stderr, "Record %u reads \"%s\", expected \"%s\".\n", recno, err ? "" : record, expected);
+      return 0;
+   }
+
+   return 1;
+}
+
+static RND_ERROR txn_put_state(RND_TXN *txn, uint32_t recno, const char *state)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+
+   make_record(record, recno, state);
+   return rnd_txn_put(txn, recno, &data);
+}
+
+void make_orders(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   char record[64];
+   uint32_t i;
+
+   for (i = 1; i <= RECORD_COUNT; ++i)
+   {
+      RND_RECNO recno = 0;
+      RND_DATA data = { record, sizeof(record) };
+
+      make_record(record, i, "open");
+      if (rnd_put(handle, &recno, &data))
+         return;
+   }
+
+   *passed = 1;
+}
+
+/**
+ * Commits and aborts transactions, including one over a compressed
+ * block, and checks that every write or none was made.
+ */
+void test_commit_and_abort(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_TXN *txn;
+   RND_ERROR err;
+   uint32_t compressed;
+
+   if ((err = rnd_compress_cold_blocks(handle, &compressed)) || compressed == 0)
+   {
+      fprintf(stderr, "Compression failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   // Writes in any order; the last write to a record wins:
+   if ((err = rnd_txn_begin(handle, &txn))
+       || (err = txn_put_state(txn, 1500, "shipped"))
+       || (err = txn_put_state(txn, 10, "paid"))
+       || (err = rnd_txn_delete(txn, 20))
+       || (err = txn_put_state(txn, 10, "shipped"))
+       || (err = txn_put_state(txn, 1999, "paid"))
+       || (err = rnd_txn_commit(txn)))
+   {
+      fprintf(stderr, "Commit failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+
+   if (!record_is(handle, 10, "shipped") || !record_is(handle, 20, NULL)
+       || !record_is(handle, 1500, "shipped") || !record_is(handle, 1999, "paid")
+       || !record_is(handle, 11, "open"))
+      return;
+
+   if ((err = rnd_txn_begin(handle, &txn))
+       || (err = txn_put_state(txn, 30, "cancelled"))
+       || (err = rnd_txn_delete(txn, 31)))
+   {
+      fprintf(stderr, "Building a transaction failed (%s).\n", rnd_strerror(err, handle));
+      return;
+   }
+   rnd_txn_abort(txn);
+
+   if (!record_is(handle, 30, "open") || !record_is(handle, 31, "open"))
+      return;
+
+   // A bad write stops the whole transaction:
+   rnd_txn_begin(handle, &txn);
+   txn_put_state(txn, 40, "cancelled");
+   txn_put_state(txn, RECORD_COUNT + 5, "cancelled");
+   if (rnd_txn_commit(txn) == RND_SUCCESS || !record_is(handle, 40, "open"))
+   {
+      fprintf(stderr, "A transaction with an unassigned record changed record 40.\n");
+      return;
+   }
+
+   printf("Transactions commit and abort whole.\n");
+   *passed = 1;
+}
+
+/**
+ * Callback for `rnd_lock_area` that tells the parent process the record
+ * is held, and holds it for a moment.
+ */
+bool hold_record(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   int *ready_fd = (int*)closure;
+   char byte = 0;
+
+   if (write(*ready_fd, &byte, 1) == 1)
+      usleep(300000);
+
+   return 0;
+}
+
+void hold_record_in_child(RNDH *handle, void *closure)
+{
+   char record[64];
+   RND_DATA data = { record, sizeof(record) };
+   RND_RECNO recno = 700;
+   FLATREC_LOC loc;
+
+   // Writing the record expands its block, as it would be for any writer holding it:
+   make_record(record, recno, "open");
+   if (rnd_put(handle, &recno, &data) == RND_SUCCESS
+       && flatrecs_locate_record(handle, 0, 700, &loc) == RND_SUCCESS)
+   {
+      BLOCK_LOC bl = { loc.record_offset, loc.rec_size };
+      rnd_lock_area(handle, &bl, 0, hold_record, closure);
+   }
+}
+
+/**
+ * Commits a transaction while another process holds one of its records
+ * for a moment, which must wait for the record and then go through.
+ */
+void test_lock_wait(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   int ready[2];
+   RND_TXN *txn;
+   RND_ERROR err;
+   char byte = 0;
+   struct timespec started, finished;
+
+   if (pipe(ready))
+      return;
+
+   pid_t child = fork();
+   if (child == 0)
+   {
+      close(ready[0]);
+      rnd_open("txn.db", 0, 0, hold_record_in_child, &ready[1]);
+      _exit(0);
+   }
+
+   close(ready[1]);
+   if (read(ready[0], &byte, 1) != 1)
+      return;
+   close(ready[0]);
+
+   rnd_txn_begin(handle, &txn);
+   txn_put_state(txn, 600, "held");
+   txn_put_state(txn, 700, "held");
+   txn_put_state(txn, 800, "held");
+
+   clock_gettime(CLOCK_MONOTONIC, &started);
+   err = rnd_txn_commit(txn);
+   clock_gettime(CLOCK_MONOTONIC, &finished);
+   waitpid(child, NULL, 0);
+
+   long waited_ms = (finished.tv_sec - started.tv_sec) * 1000 + (finished.tv_nsec - started.tv_nsec) / 1000000;
+
+   if (err)
+      fprintf(stderr, "Committing with a record held elsewhere failed (%s).\n", rnd_strerror(err, handle));
+   else if (waited_ms < 100)
+      fprintf(stderr, "The commit took %ld ms, too soon to have waited for the held record.\n", waited_ms);
+   else if (record_is(handle, 600, "held") && record_is(handle, 700, "held") && record_is(handle, 800, "held"))
+   {
+      printf("A commit waits for a held record, then goes through.\n");
+      *passed = 1;
+   }
+}
+
+/**
+ * Commits a transaction, then marks its undo log pending again, as if the
+ * process had died before emptying it.  With *torn*, the log's checksum
+ * is spoiled too, as if the process died while writing the log.
+ */
+static void commit_then_crash_records(RNDH *handle, uint32_t changed, uint32_t deleted, const bool *torn)
+{
+   RND_TXN *txn;
+   RND_HEAD_UNDO hu;
+   off_t undo_head;
+
+   rnd_txn_begin(handle, &txn);
+   txn_put_state(txn, changed, "crashed");
+   rnd_txn_delete(txn, deleted);
+   if (rnd_txn_commit(txn))
+      return;
+
+   blocks_read_at(handle, TXN_UNDO_HEAD_OFFSET, &undo_head, sizeof(undo_head));
+   blocks_read_at(handle, undo_head, &hu, sizeof(hu));
+   hu.uhead.state = RND_UNDO_PENDING;
+   if (*torn)
+      ++hu.uhead.checksum;
+   blocks_write_at(handle, undo_head, &hu, sizeof(hu));
+}
+
+void commit_then_crash(RNDH *handle, void *closure)
+{
+   commit_then_crash_records(handle, 900, 901, (bool*)closure);
+}
+
+void check_recovery(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_HEAD_UNDO hu;
+   off_t undo_head;
+
+   blocks_read_at(handle, TXN_UNDO_HEAD_OFFSET, &undo_head, sizeof(undo_head));
+   blocks_read_at(handle, undo_head, &hu, sizeof(hu));
+
+   if (hu.uhead.state != RND_UNDO_EMPTY)
+      fprintf(stderr, "The undo log is still pending after opening.\n");
+   else
+      *passed = record_is(handle, 900, "open") && record_is(handle, 901, "open");
+}
+
+void check_no_recovery(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   *passed = record_is(handle, 900, "crashed") && record_is(handle, 901, NULL);
+}
+
+/**
+ * Leaves an undo log pending, as a commit whose rollback failed does, and
+ * commits again on the same handle, which must roll the log back before
+ * reusing it.
+ */
+void commit_after_failed_rollback(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_TXN *txn;
+   RND_HEAD_UNDO hu;
+   off_t undo_head;
+   bool torn = 0;
+
+   commit_then_crash_records(handle, 910, 911, &torn);
+
+   rnd_txn_begin(handle, &txn);
+   txn_put_state(txn, 912, "after");
+   if (rnd_txn_commit(txn))
+      return;
+
+   blocks_read_at(handle, TXN_UNDO_HEAD_OFFSET, &undo_head, sizeof(undo_head));
+   blocks_read_at(handle, undo_head, &hu, sizeof(hu));
+
+   if (hu.uhead.state != RND_UNDO_EMPTY)
+      fprintf(stderr, "The undo log is still pending after a commit.\n");
+   else
+      *passed = record_is(handle, 910, "open") && record_is(handle, 911, "open") && record_is(handle, 912, "after");
+}
+
+/**
+ * Rejects a transaction on a table with an index, which it can't roll back.
+ */
+void test_indexed_table(RNDH *handle, void *closure)
+{
+   bool *passed = (bool*)closure;
+   RND_FIELD field = { 0, 8, RND_FIELD_UINT };
+   off_t index;
+   RND_TXN *txn;
+
+   if (btree_create(handle, 0, &field, &index))
+      return;
+
+   rnd_txn_begin(handle, &txn);
+   txn_put_state(txn, 5, "paid");
+   *passed = rnd_txn_commit(txn) == RND_BAD_PARAMETER && record_is(handle, 5, "open");
+}
+
+int main(int argc, const char **argv)
+{
+   bool made = 0, commit_passed = 0, wait_passed = 0, recovery_passed = 0, torn_passed = 0;
+   bool pending_passed = 0, indexed_passed = 0, torn = 0;
+
+   rnd_open("txn.db", 64, RND_CREATE, make_orders, &made);
+   if (!made)
+      return 1;
+
+   rnd_open("txn.db", 0, 0, test_commit_and_abort, &commit_passed);
+   rnd_open("txn.db", 0, 0, test_lock_wait, &wait_passed);
+
+   rnd_open("txn.db", 0, 0, commit_then_crash, &torn);
+   rnd_open("txn.db", 0, 0, check_recovery, &recovery_passed);
+   if (recovery_passed)
+      printf("Opening rolled back a commit cut short.\n");
+
+   torn = 1;
+   rnd_open("txn.db", 0, 0, commit_then_crash, &torn);
+   rnd_open("txn.db", 0, 0, check_no_recovery, &torn_passed);
+   if (torn_passed)
+      printf("Opening ignored a torn undo log.\n");
+
+   rnd_open("txn.db", 0, 0, commit_after_failed_rollback, &pending_passed);
+   if (pending_passed)
+      printf("A commit rolled back a pending undo log first.\n");
+
+   rnd_open("txn.db", 0, 0, test_indexed_table, &indexed_passed);
+   if (indexed_passed)
+      printf("Transactions refuse indexed tables.\n");
+
+   return commit_passed && wait_passed && recovery_passed && torn_passed && pending_passed && indexed_passed ? 0 : 1;
+}
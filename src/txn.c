@@ -0,0 +1,731 @@
+/** @file
+ *
+ * Transactions: writes to several records, of one or more tables, that
+ * are made all together or not at all.
+ *
+ * `txn_write` only collects writes in memory.  `txn_commit` then
+ *
+ * 1. locks every record it writes, in (table, recno) order, waiting for
+ *    any another process holds.  Every commit locks in that order, and
+ *    the commit lock is only taken once they are all held, so a commit
+ *    waiting for a record never holds what the record's holder may be
+ *    waiting for;
+ * 2. takes the commit lock, so one commit at a time uses the undo log;
+ * 3. copies the records' contents and liveness to the undo log, an
+ *    RBT_UNDO block named by INFO_FILE::undo_head, and syncs it;
+ * 4. writes the records and syncs them;
+ * 5. empties the log and syncs that, which is the commit point.
+ *
+ * If the process dies between 3 and 5, `txn_recover`, called as the
+ * database is opened, finds the log pending and writes the old contents
+ * back.  The log's checksum tells a log that was completely synced from
+ * one that was torn, in which case no record had been written yet.
+ *
+ * Tables with B+tree indexes can't yet be written in a transaction: an
+ * index changed before a crash would not be rolled back with the records.
+ */
+
+#include "txn.h"
+#include "extra.h"
+#include "locks.h"
+#include "flatrecs.h"
+#include "compress.h"
+#include "btree.h"
+#include "snapshot.h"
+#include "changes.h"
+
+#include <errno.h>
+#include <stddef.h>   // for offsetof()
+#include <stdlib.h>   // for malloc(), qsort()
+#include <string.h>
+#include <unistd.h>   // for fdatasync()
+
+/** Offset of INFO_FILE::undo_head in the file. */
+#define TXN_UNDO_HEAD_OFFSET (offsetof(RND_HEAD_FILE, fhead) + offsetof(INFO_FILE, undo_head))
+
+/**
+ * An entry in the undo log, followed by the record's old contents,
+ * padded to a multiple of 8 bytes.
+ */
+typedef struct txn_undo_entry {
+   off_t    block_offset;    /**< Block that holds the record                 */
+   off_t    record_offset;   /**< The record itself                           */
+   uint32_t map_index;       /**< Index of the record's bit in the block map  */
+   uint32_t rec_size;        /**< Bytes of old contents after the entry       */
+   uint32_t bytes_to_data;   /**< Of the block, to find the record's map word */
+   uint32_t was_live;        /**< Liveness before the commit, or TXN_UNDO_RAW */
+} TXN_UNDO;
+
+/** TXN_UNDO::was_live of an area saved by `txn_guard_begin`, restored with no liveness to set. */
+#define TXN_UNDO_RAW UINT32_MAX
+
+static size_t txn_undo_entry_size(uint32_t rec_size)
+{
+   return sizeof(TXN_UNDO) + ((rec_size + 7) & ~7u);
+}
+
+/**
+ * FNV-1a over the log entries.
+ */
+static uint64_t txn_checksum(const char *log, size_t bytes)
+{
+   uint64_t h = 14695981039346656037ULL;
+
+   while (bytes--)
+      h = (h ^ (unsigned char)*log++) * 1099511628211ULL;
+
+   return h;
+}
+
+/**
+ * Pushes buffered writes to the file and the file to the disk.
+ */
+static RND_ERROR txn_sync(RNDH *handle)
+{
+   if (fflush(handle->file) || fdatasync(fileno(handle->file)))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Starts a transaction on an open database.
+ *
+ * @param handle  handle to an open recno database
+ * @param txn     [out] the transaction, to pass to `txn_commit` or `txn_abort`
+ */
+RND_ERROR txn_begin(RNDH *handle, RND_TXN **txn)
+{
+   if (!(*txn = (RND_TXN*)calloc(1, sizeof(RND_TXN))))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   (*txn)->handle = handle;
+   return RND_SUCCESS;
+}
+
+/**
+ * Adds a write of an assigned record to a transaction.  Nothing is
+ * written until the transaction commits.
+ *
+ * @param txn         transaction from `txn_begin`
+ * @param table_head  offset to the head block of the record's table
+ * @param recno       record to write, which must already exist
+ * @param data        new contents, or NULL to delete the record
+ * @param size        bytes in *data*, up to the record size
+ */
+RND_ERROR txn_write(RND_TXN *txn, off_t table_head, uint32_t recno, const void *data, uint32_t size)
+{
+   if (recno == 0)
+      return RND_BAD_PARAMETER;
+
+   if (txn->count == txn->allocated)
+   {
+      uint32_t allocated = txn->allocated ? txn->allocated * 2 : 16;
+      TXN_WRITE *writes = (TXN_WRITE*)realloc(txn->writes, allocated * sizeof(TXN_WRITE));
+      if (!writes)
+         goto system_error;
+
+      txn->writes = writes;
+      txn->allocated = allocated;
+   }
+
+   TXN_WRITE *write = &txn->writes[txn->count];
+   memset(write, 0, sizeof(*write));
+   write->table_head = table_head;
+   write->recno = recno;
+   write->size = size;
+   write->sequence = txn->count;
+
+   if (data)
+   {
+      if (!(write->data = (char*)malloc(size ? size : 1)))
+         goto system_error;
+      memcpy(write->data, data, size);
+   }
+
+   ++txn->count;
+   return RND_SUCCESS;
+
+  system_error:
+   txn->handle->sys_errno = errno;
+   return RND_SYSTEM_ERROR;
+}
+
+/**
+ * Discards a transaction and the writes it collected.
+ */
+void txn_abort(RND_TXN *txn)
+{
+   if (txn)
+   {
+      for (uint32_t i = 0; i < txn->count; ++i)
+         free(txn->writes[i].data);
+
+      free(txn->writes);
+      free(txn);
+   }
+}
+
+/**
+ * `qsort` comparison that orders writes by table, recno, then sequence.
+ */
+static int txn_compare_writes(const void *left, const void *right)
+{
+   const TXN_WRITE *l = (const TXN_WRITE*)left, *r = (const TXN_WRITE*)right;
+
+   if (l->table_head != r->table_head)
+      return l->table_head < r->table_head ? -1 : 1;
+   else if (l->recno != r->recno)
+      return l->recno < r->recno ? -1 : 1;
+   else
+      return l->sequence < r->sequence ? -1 : l->sequence > r->sequence;
+}
+
+/**
+ * Puts the writes in lock order and drops all but the last write to each record.
+ */
+static void txn_order_writes(RND_TXN *txn)
+{
+   uint32_t i, kept = 0;
+
+   qsort(txn->writes, txn->count, sizeof(TXN_WRITE), txn_compare_writes);
+
+   for (i = 0; i < txn->count; ++i)
+   {
+      TXN_WRITE *write = &txn->writes[i];
+
+      if (i + 1 < txn->count
+          && write[1].table_head == write->table_head
+          && write[1].recno == write->recno)
+         free(write->data);
+      else
+         txn->writes[kept++] = *write;
+   }
+
+   txn->count = kept;
+}
+
+/**
+ * Locates the record of every write, expanding compressed blocks so the
+ * records can be written in place.
+ */
+static RND_ERROR txn_locate_records(RND_TXN *txn, FLATREC_LOC *locs)
+{
+   RNDH *handle = txn->handle;
+   RND_ERROR rval;
+   uint32_t i;
+   bool indexed = 0;
+
+   for (i = 0; i < txn->count; ++i)
+   {
+      TXN_WRITE *write = &txn->writes[i];
+
+      if (i == 0 || write->table_head != write[-1].table_head)
+      {
+         if ((rval = btree_table_indexed(handle, write->table_head, &indexed)))
+            return rval;
+      }
+
+      if (indexed)
+         return RND_BAD_PARAMETER;
+
+      if ((rval = flatrecs_locate_record(handle, write->table_head, write->recno, &locs[i])))
+         return rval;
+
+      if (write->size > locs[i].rec_size)
+         return RND_BAD_PARAMETER;
+
+      if (locs[i].block.block_flags & RBF_COMPRESSED)
+      {
+         if ((rval = compress_expand_block(handle, locs[i].block_offset))
+             || (rval = flatrecs_locate_record(handle, write->table_head, write->recno, &locs[i])))
+            return rval;
+      }
+   }
+
+   return RND_SUCCESS;
+}
+
+/**
+ * Writes the old contents in an undo log back to their records.
+ */
+static RND_ERROR txn_undo(RNDH *handle, const char *log, uint32_t entries)
+{
+   RND_ERROR rval = RND_SUCCESS, entry_rval;
+
+   while (entries--)
+   {
+      TXN_UNDO entry;
+      memcpy(&entry, log, sizeof(entry));
+
+      FLATREC_LOC loc;
+      memset(&loc, 0, sizeof(loc));
+      loc.block_offset = entry.block_offset;
+      loc.record_offset = entry.record_offset;
+      loc.map_index = entry.map_index;
+      loc.rec_size = entry.rec_size;
+      loc.block.bytes_to_data = (uint16_t)entry.bytes_to_data;
+
+      // Carry on past a failure, to restore as much as possible:
+      if ((entry_rval = blocks_write_at(handle, entry.record_offset, log + sizeof(entry), entry.rec_size))
+          || (entry.was_live != TXN_UNDO_RAW
+              && (entry_rval = flatrecs_set_liveness(handle, &loc, entry.was_live)))
+          || (entry_rval = blocks_stamp_block(handle, entry.block_offset, 0)))
+         rval = entry_rval;
+
+      log += txn_undo_entry_size(entry.rec_size);
+   }
+
+   return rval;
+}
+
+/**
+ * Callback for `rnd_lock_area`, called with the file head's INFO_FILE
+ * locked, that points INFO_FILE::undo_head at a new log block.
+ */
+bool txn_register_log_lock_callback(RNDH *handle, BLOCK_LOC *bloc, void *locked_buffer, void *closure)
+{
+   ((INFO_FILE*)locked_buffer)->undo_head = *(off_t*)closure;
+   return 1;
+}
+
+/**
+ * Gets an undo log block with room for *bytes* of entries, replacing the
+ * current one if it's too small.  A replaced block is left unused.
+ *
+ * Must be called with the commit lock held.
+ */
+static RND_ERROR txn_reserve_log(RNDH *handle, uint64_t bytes, off_t *undo_head)
+{
+   RND_HEAD_UNDO hu;
+   RND_ERROR rval;
+   uint64_t needed = sizeof(RND_HEAD_UNDO) + bytes, block_size = 0;
+
+   if ((rval = blocks_read_at(handle, TXN_UNDO_HEAD_OFFSET, undo_head, sizeof(*undo_head))))
+      return rval;
+
+   if (*undo_head)
+   {
+      if ((rval = blocks_read_at(handle, *undo_head, &hu, sizeof(hu))))
+         return rval;
+
+      if (hu.bhead.block_size >= needed)
+         return RND_SUCCESS;
+
+      block_size = hu.bhead.block_size;
+   }
+
+   uint32_t chunk_size = handle->head_file.fhead.chunk_size;
+   block_size = block_size * 2 > needed ? block_size * 2 : needed;
+   block_size = (block_size + chunk_size - 1) / chunk_size * chunk_size;
+
+   if (block_size > UINT32_MAX)
+      return RND_INVALID_BLOCK_SIZE;
+
+   RND_BLOCK_DEF bdef = { RBT_UNDO, (unsigned)block_size };
+   if ((rval = blocks_append_block(handle, &bdef)))
+      return rval;
+
+   *undo_head = bdef.new_block.offset;
+   handle->head_file.fhead.undo_head = *undo_head;
+
+   BLOCK_LOC bl = { offsetof(RND_HEAD_FILE, fhead), sizeof(INFO_FILE) };
+   return rnd_lock_area(handle, &bl, 1, txn_register_log_lock_callback, undo_head);
+}
+
+/**
+ * Sets the state of the undo log and syncs it.
+ */
+static RND_ERROR txn_mark_log(RNDH *handle, off_t undo_head, const INFO_UNDO *uhead)
+{
+   RND_ERROR rval = blocks_write_at(handle, undo_head + offsetof(RND_HEAD_UNDO, uhead), uhead, sizeof(*uhead));
+   return rval ? rval : txn_sync(handle);
+}
+
+/**
+ * Rolls back the commit an undo log shows pending, if any.
+ *
+ * Must be called with the commit lock held.
+ */
+static RND_ERROR txn_roll_back(RNDH *handle)
+{
+   RND_ERROR rval;
+   RND_HEAD_UNDO hu;
+   off_t undo_head;
+   char *log = NULL;
+
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      return RND_SYSTEM_ERROR;
+   }
+
+   if ((rval = blocks_read_at(handle, TXN_UNDO_HEAD_OFFSET, &undo_head, sizeof(undo_head)))
+       || !undo_head
+       || (rval = blocks_read_at(handle, undo_head, &hu, sizeof(hu)))
+       || hu.uhead.state == RND_UNDO_EMPTY)
+      goto free_log;
+
+   if (hu.uhead.bytes > hu.bhead.block_size - sizeof(hu))
+   {
+      rval = RND_INVALID_BLOCK_SIZE;
+      goto free_log;
+   }
+
+   if (!(log = (char*)malloc(hu.uhead.bytes ? hu.uhead.bytes : 1)))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto free_log;
+   }
+
+   // A torn log was never complete, so no record was written after it:
+   if ((rval = blocks_read_at(handle, undo_head + sizeof(hu), log, hu.uhead.bytes)))
+      goto free_log;
+
+   if (txn_checksum(log, hu.uhead.bytes) == hu.uhead.checksum
+       && ((rval = txn_undo(handle, log, hu.uhead.entries)) || (rval = txn_sync(handle))))
+      goto free_log;
+
+   hu.uhead.state = RND_UNDO_EMPTY;
+   rval = txn_mark_log(handle, undo_head, &hu.uhead);
+
+  free_log:
+   free(log);
+   return rval;
+}
+
+/**
+ * Saves areas of the file to the undo log before a change made outside
+ * any transaction overwrites them, so that a change cut short is rolled
+ * back as a commit is.  Finish the change with `txn_guard_end`.
+ *
+ * Takes the commit lock, which `txn_guard_end` lets go, so the log isn't
+ * shared with a commit.
+ *
+ * @param handle  handle to an open recno database
+ * @param ranges  the areas to be overwritten, as they are now
+ * @param count   number of *ranges*
+ */
+RND_ERROR txn_guard_begin(RNDH *handle, const TXN_RANGE *ranges, uint32_t count)
+{
+   BLOCK_LOC commit_lock = { TXN_COMMIT_LOCK_OFFSET, 1 };
+   RND_ERROR rval;
+   char *log = NULL;
+   uint64_t bytes = 0;
+   uint32_t i;
+
+   for (i = 0; i < count; ++i)
+      bytes += txn_undo_entry_size(ranges[i].size);
+
+   if ((rval = rnd_lock_place(handle, &commit_lock, 1)))
+      return rval;
+
+   // A log left pending by a change that failed is rolled back before
+   // it's reused:
+   if ((rval = txn_roll_back(handle)))
+      goto release_lock;
+
+   if (!(log = (char*)calloc(1, bytes)))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_lock;
+   }
+
+   char *entry_at = log;
+   for (i = 0; i < count; ++i)
+   {
+      TXN_UNDO entry = { ranges[i].block_offset, ranges[i].offset, 0, ranges[i].size, 0, TXN_UNDO_RAW };
+      memcpy(entry_at, &entry, sizeof(entry));
+      memcpy(entry_at + sizeof(entry), ranges[i].contents, ranges[i].size);
+      entry_at += txn_undo_entry_size(ranges[i].size);
+   }
+
+   off_t undo_head;
+   INFO_UNDO uhead = { RND_UNDO_PENDING, count, bytes, txn_checksum(log, bytes) };
+
+   // The log must be on disk before anything is overwritten:
+   if (!(rval = txn_reserve_log(handle, bytes, &undo_head))
+       && !(rval = blocks_write_at(handle, undo_head + sizeof(RND_HEAD_UNDO), log, bytes)))
+      rval = txn_mark_log(handle, undo_head, &uhead);
+
+  release_lock:
+   if (rval)
+      rnd_lock_remove(handle, &commit_lock);
+
+   free(log);
+   return rval;
+}
+
+/**
+ * Finishes a change begun with `txn_guard_begin`: empties the undo log if
+ * the change was made, rolls the change back if it failed, and lets go of
+ * the commit lock.  If the rollback fails too, the log stays pending for
+ * `txn_roll_back` to finish.
+ *
+ * @param handle  handle to an open recno database
+ * @param result  result of the change
+ *
+ * @return *result* if the change failed, else the result of emptying the log
+ */
+RND_ERROR txn_guard_end(RNDH *handle, RND_ERROR result)
+{
+   BLOCK_LOC commit_lock = { TXN_COMMIT_LOCK_OFFSET, 1 };
+   RND_HEAD_UNDO hu;
+   off_t undo_head;
+   RND_ERROR rval;
+
+   if (result)
+      txn_roll_back(handle);
+   else if (!(rval = txn_sync(handle))
+            && !(rval = blocks_read_at(handle, TXN_UNDO_HEAD_OFFSET, &undo_head, sizeof(undo_head)))
+            && !(rval = blocks_read_at(handle, undo_head, &hu, sizeof(hu))))
+   {
+      hu.uhead.state = RND_UNDO_EMPTY;
+      rval = txn_mark_log(handle, undo_head, &hu.uhead);
+   }
+
+   rnd_lock_remove(handle, &commit_lock);
+   return result ? result : rval;
+}
+
+/**
+ * Makes the writes of a transaction: locks their records, waiting for
+ * them in order, then takes the commit lock and makes the writes.
+ *
+ * @param txn    the transaction, its writes in lock order
+ * @param locs   location of the record of each write
+ * @param moved  [out] a block was compressed before its records were
+ *               locked, so they must be located again
+ */
+static RND_ERROR txn_commit_locked(RND_TXN *txn, const FLATREC_LOC *locs, bool *moved)
+{
+   RNDH *handle = txn->handle;
+   BLOCK_LOC commit_lock = { TXN_COMMIT_LOCK_OFFSET, 1 };
+   RND_ERROR rval = RND_SUCCESS;
+   uint32_t placed, i;
+   char *log = NULL;
+   uint64_t bytes = 0;
+   bool committing = 0;
+
+   for (placed = 0; placed < txn->count; ++placed)
+   {
+      BLOCK_LOC bl = { locs[placed].record_offset, locs[placed].rec_size };
+      if ((rval = rnd_lock_place(handle, &bl, 1)))
+         goto release_locks;
+   }
+
+   // Drop buffered reads that may predate the locks:
+   if (fflush(handle->file))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_locks;
+   }
+
+   // Compressing a block takes a lock on the whole block, so blocks that
+   // are uncompressed now stay that way:
+   for (i = 0; i < txn->count; ++i)
+   {
+      INFO_BLOCK ib;
+      if ((rval = blocks_read_block_head(handle, locs[i].block_offset, &ib, sizeof(ib))))
+         goto release_locks;
+
+      if (ib.block_flags & RBF_COMPRESSED)
+      {
+         *moved = 1;
+         rval = RND_LOCK_FAILED;
+         goto release_locks;
+      }
+
+      bytes += txn_undo_entry_size(locs[i].rec_size);
+   }
+
+   if ((rval = rnd_lock_place(handle, &commit_lock, 1)))
+      goto release_locks;
+
+   committing = 1;
+
+   // A log left pending by a commit that failed is rolled back before
+   // it's reused:
+   if ((rval = txn_roll_back(handle)))
+      goto release_locks;
+
+   // Open snapshots need the records as they are now:
+   for (i = 0; i < txn->count; ++i)
+   {
+      if ((rval = snapshot_preserve(handle, txn->writes[i].table_head, txn->writes[i].recno, &locs[i])))
+         goto release_locks;
+   }
+
+   if (!(log = (char*)calloc(1, bytes)))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto release_locks;
+   }
+
+   char *entry_at = log;
+   for (i = 0; i < txn->count; ++i)
+   {
+      const FLATREC_LOC *loc = &locs[i];
+      TXN_UNDO entry = { loc->block_offset, loc->record_offset, loc->map_index, loc->rec_size,
+                         loc->block.bytes_to_data, 0 };
+      bool live;
+
+      if ((rval = flatrecs_record_is_live(handle, loc, &live))
+          || (rval = blocks_read_at(handle, loc->record_offset, entry_at + sizeof(entry), loc->rec_size)))
+         goto release_locks;
+
+      entry.was_live = (uint32_t)live;
+      memcpy(entry_at, &entry, sizeof(entry));
+      entry_at += txn_undo_entry_size(loc->rec_size);
+   }
+
+   off_t undo_head;
+   INFO_UNDO uhead = { RND_UNDO_PENDING, txn->count, bytes, txn_checksum(log, bytes) };
+
+   // The log must be on disk before any record changes:
+   if ((rval = txn_reserve_log(handle, bytes, &undo_head))
+       || (rval = blocks_write_at(handle, undo_head + sizeof(RND_HEAD_UNDO), log, bytes))
+       || (rval = txn_mark_log(handle, undo_head, &uhead)))
+      goto release_locks;
+
+   for (i = 0; i < txn->count && !rval; ++i)
+   {
+      const TXN_WRITE *write = &txn->writes[i];
+      uint32_t rec_size = locs[i].rec_size;
+
+      if (write->data)
+      {
+         char slot[rec_size];
+         memcpy(slot, write->data, write->size);
+         memset(slot + write->size, 0, rec_size - write->size);
+
+         if ((rval = blocks_write_at(handle, locs[i].record_offset, slot, rec_size)))
+            break;
+      }
+
+      if (!(rval = flatrecs_set_liveness(handle, &locs[i], write->data != NULL)))
+         rval = blocks_stamp_block(handle, locs[i].block_offset, locs[i].block.generation);
+   }
+
+   if (!rval)
+      rval = txn_sync(handle);
+
+   // A failed write rolls back the ones before it.  If that fails too,
+   // the log stays pending, for `txn_roll_back` to finish:
+   if (rval && (txn_undo(handle, log, txn->count) || txn_sync(handle)))
+      goto release_locks;
+
+   uhead.state = RND_UNDO_EMPTY;
+   RND_ERROR mark_rval = txn_mark_log(handle, undo_head, &uhead);
+   if (!rval)
+      rval = mark_rval;
+
+   // The feed hears of the writes once they can no longer be undone:
+   for (i = 0; i < txn->count && !rval; ++i)
+      rval = changes_note(handle, txn->writes[i].table_head, txn->writes[i].recno,
+                          txn->writes[i].data ? RND_CHANGE_PUT : RND_CHANGE_DELETE);
+
+  release_locks:
+   fflush(handle->file);
+
+   if (committing)
+      rnd_lock_remove(handle, &commit_lock);
+
+   while (placed--)
+   {
+      BLOCK_LOC bl = { locs[placed].record_offset, locs[placed].rec_size };
+      rnd_lock_remove(handle, &bl);
+   }
+
+   free(log);
+   return rval;
+}
+
+/**
+ * Makes every write of a transaction, or none of them.
+ *
+ * Records another process holds are waited for.  The transaction is
+ * finished unless this returns RND_LOCK_FAILED, which means the blocks
+ * of its records kept being compressed as the commit tried to lock
+ * them.  The transaction is then left open, to commit again or abort.
+ *
+ * @param txn  transaction from `txn_begin`
+ */
+RND_ERROR txn_commit(RND_TXN *txn)
+{
+   RNDH *handle = txn->handle;
+   RND_ERROR rval = RND_SUCCESS;
+   FLATREC_LOC *locs = NULL;
+   int tries = 3;
+
+   prime_handle(handle);
+
+   if (txn->count == 0)
+      goto finish_txn;
+
+   txn_order_writes(txn);
+
+   if (!(locs = (FLATREC_LOC*)malloc(txn->count * sizeof(FLATREC_LOC))))
+   {
+      handle->sys_errno = errno;
+      rval = RND_SYSTEM_ERROR;
+      goto finish_txn;
+   }
+
+   while (tries--)
+   {
+      bool moved = 0;
+
+      if ((rval = txn_locate_records(txn, locs)))
+         break;
+
+      rval = txn_commit_locked(txn, locs, &moved);
+
+      if (!moved)
+         break;
+   }
+
+   free(locs);
+
+   if (rval == RND_LOCK_FAILED)
+      return rval;
+
+  finish_txn:
+   txn_abort(txn);
+   return rval;
+}
+
+/**
+ * Rolls back a commit that was cut short, if the undo log shows one.
+ * Called as a database is opened.
+ *
+ * @param handle  handle to an open recno database
+ */
+RND_ERROR txn_recover(RNDH *handle)
+{
+   RND_ERROR rval;
+
+   // A read-only handle can't roll back; the next writer to open the file will:
+   if (handle->head_file.fhead.undo_head == 0 || handle->readonly)
+      return RND_SUCCESS;
+
+   // Wait out a commit in progress in another process:
+   BLOCK_LOC commit_lock = { TXN_COMMIT_LOCK_OFFSET, 1 };
+   if ((rval = rnd_lock_place(handle, &commit_lock, 1)))
+      return rval;
+
+   rval = txn_roll_back(handle);
+
+   rnd_lock_remove(handle, &commit_lock);
+   return rval;
+}
@@ -0,0 +1,48 @@
+#ifndef RECNODB_TXN_H
+#define RECNODB_TXN_H
+
+#include "recnodb.h"
+
+/**
+ * Offset of the byte locked while a transaction commits.  Like the lock
+ * that serializes file extension, it's far past any data.
+ */
+#define TXN_COMMIT_LOCK_OFFSET (INT64_MAX - 2)
+
+/** A write collected by `txn_write`, made at commit. */
+typedef struct txn_write {
+   off_t    table_head;   /**< Table of the record                                    */
+   char     *data;        /**< Copy of the new contents, NULL to delete the record    */
+   uint32_t recno;
+   uint32_t size;         /**< Bytes in *data*                                        */
+   uint32_t sequence;     /**< Order of the write, so a record's last write wins      */
+   char     pad[4];
+} TXN_WRITE;
+
+/** An area of the file saved by `txn_guard_begin` before it's overwritten. */
+typedef struct txn_range {
+   off_t      block_offset;   /**< Block that holds the area, stamped if it's restored */
+   off_t      offset;
+   const void *contents;      /**< The area as it is before the change                 */
+   uint32_t   size;
+   char       pad[4];
+} TXN_RANGE;
+
+struct rnd_txn {
+   RNDH      *handle;
+   TXN_WRITE *writes;
+   uint32_t  count;
+   uint32_t  allocated;
+};
+
+RND_ERROR txn_begin(RNDH *handle, RND_TXN **txn);
+RND_ERROR txn_write(RND_TXN *txn, off_t table_head, uint32_t recno, const void *data, uint32_t size);
+RND_ERROR txn_commit(RND_TXN *txn);
+void txn_abort(RND_TXN *txn);
+
+RND_ERROR txn_guard_begin(RNDH *handle, const TXN_RANGE *ranges, uint32_t count);
+RND_ERROR txn_guard_end(RNDH *handle, RND_ERROR result);
+
+RND_ERROR txn_recover(RNDH *handle);
+
+#endif
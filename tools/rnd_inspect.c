@@ -0,0 +1,434 @@
+/** @file
+ *
+ * Reports how the chains of a recnodb file are laid out, to tell why a
+ * table reads slowly without reading the file by hand.
+ *
+ *    rnd_inspect database
+ *
+ * The file is opened RND_READONLY, so it can be inspected while others
+ * use it, and each chain is walked once with `chains_walk`, reading only
+ * block heads and, for the table, the liveness maps.  For every chain:
+ *
+ * - its length, in blocks and bytes, and how many blocks there are of
+ *   each power-of-two size;
+ * - in file order, the gaps between its blocks, which hold other chains
+ *   or unused space, and how many links lead back to an earlier offset.
+ *
+ * For the table, also:
+ *
+ * - the records each block holds, and how much of its capacity they use;
+ * - how many records are live and how many have been deleted;
+ * - the estimated read amplification: the bytes the library reads for a
+ *   record over the size of the record, on average for a random `rnd_get`
+ *   with a cold cache, and for a sequential scan of every live record.
+ *   A random read walks the chain from the head to the record's block,
+ *   unless the record is in the last block, and reads all of a
+ *   compressed block.
+ */
+
+#include "recnodb.h"
+#include "extra.h"
+#include "blocks.h"
+#include "chains.h"
+#include "flatrecs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/** Block sizes are counted by highest set bit. */
+#define SIZE_CLASSES 64
+
+typedef struct inspect_extent {
+   off_t offset;
+   off_t size;
+} EXTENT;
+
+/** What the walk of one chain learns. */
+struct chain_stats {
+   RNDH           *handle;
+   off_t          file_size;
+   uint64_t       max_blocks;   // more than the file could hold means the chain loops
+   RND_ERROR      rval;         // of reading a map, which stops the walk
+   bool           table;        // the chain holds records, so count them too
+   bool           looped;
+   bool           in_order;     // no link so far leads backward
+
+   uint64_t       blocks;
+   uint64_t       bytes;
+   uint64_t       sizes[SIZE_CLASSES];
+
+   EXTENT         *extents;
+   uint64_t       allocated;
+   uint64_t       backward;     // links to an earlier offset
+
+   // The table's records:
+   RND_HEAD_TABLE head;
+   uint32_t       rec_size;
+   uint32_t       next_recno;   // first record of the next block
+   uint64_t       assigned;
+   uint64_t       capacity;
+   uint64_t       live;
+   uint64_t       compressed;
+   uint32_t       min_per_block;
+   uint32_t       max_per_block;
+
+   // Bytes read for all the live records, at random and in a scan:
+   double         random_bytes;
+   double         scan_bytes;
+   uint64_t       last_live;    // live records of the last block so far
+   uint64_t       last_walked;  // headers walked to reach it
+
+   char           *buffer;      // for decompressed blocks
+   size_t         buffer_size;
+};
+
+static void print_size(double bytes)
+{
+   static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+   int unit = 0;
+
+   while (bytes >= 1024 && unit < 4)
+   {
+      bytes /= 1024;
+      ++unit;
+   }
+
+   printf(unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+}
+
+static uint32_t count_live(const uint64_t *map, uint32_t nbits)
+{
+   uint32_t live = 0, word;
+
+   for (word = 0; word < nbits / 64; ++word)
+      live += (uint32_t)__builtin_popcountll(map[word]);
+
+   if (nbits % 64)
+      live += (uint32_t)__builtin_popcountll(map[word] & ((UINT64_C(1) << (nbits % 64)) - 1));
+
+   return live;
+}
+
+/**
+ * Counts the records of a block of the table, reading its liveness map.
+ */
+static bool inspect_records(struct chain_stats *stats, INFO_BLOCK *ib, off_t offset_to_ib)
+{
+   uint32_t capacity = flatrecs_get_record_capacity(&stats->head, ib);
+   uint32_t last_recno = stats->head.thead.last_recno;
+   uint32_t nbits = 0, live = 0;
+
+   if (stats->next_recno <= last_recno)
+   {
+      nbits = last_recno - stats->next_recno + 1;
+      if (nbits > capacity)
+         nbits = capacity;
+   }
+
+   if (nbits)
+   {
+      const uint64_t *map;
+      uint64_t words[256];
+
+      if (ib->block_flags & RBF_COMPRESSED)
+      {
+         FLATREC_BLOCK fb = { offset_to_ib, *ib, stats->next_recno, nbits };
+         const char *image;
+
+         if ((stats->rval = flatrecs_read_block(stats->handle, &fb, stats->rec_size,
+                                                &stats->buffer, &stats->buffer_size, &image)))
+            return 0;
+
+         map = (const uint64_t*)image;
+         live = count_live(map, nbits);
+      }
+      else
+      {
+         // Read in pieces, so a block of any size needs no more memory:
+         off_t at = offset_to_ib + ib->bytes_to_data;
+         uint32_t done = 0;
+
+         map = words;
+         while (done < nbits)
+         {
+            uint32_t bits = nbits - done;
+            if (bits > 64 * 256)
+               bits = 64 * 256;
+
+            if ((stats->rval = blocks_read_at(stats->handle, at, words, (bits + 63) / 64 * sizeof(uint64_t))))
+               return 0;
+
+            live += count_live(map, bits);
+            at += bits / 64 * sizeof(uint64_t);
+            done += bits;
+         }
+      }
+   }
+
+   if (stats->blocks == 1 || nbits < stats->min_per_block)
+      stats->min_per_block = nbits;
+   if (nbits > stats->max_per_block)
+      stats->max_per_block = nbits;
+
+   stats->assigned += nbits;
+   stats->capacity += capacity;
+   stats->live += live;
+
+   // A random read takes the table head, the hint to the last block and
+   // every header from the head to the record's block, then a map word
+   // and the record, or all of a compressed block:
+   double record_bytes = (ib->block_flags & RBF_COMPRESSED)
+      ? ib->stored_size
+      : sizeof(uint64_t) + stats->rec_size;
+   uint64_t walked = stats->blocks - 1;
+
+   stats->random_bytes += live * (sizeof(RND_HEAD_TABLE) + sizeof(INFO_BLOCK)
+                                  + walked * sizeof(INFO_BLOCK) + record_bytes);
+   stats->last_live = live;
+   stats->last_walked = walked;
+
+   // A scan reads each header, then the map and records, or all of a compressed block:
+   stats->scan_bytes += sizeof(RND_HEAD_FILE) + ((ib->block_flags & RBF_COMPRESSED)
+                                                 ? ib->stored_size
+                                                 : ib->bytes_to_records - ib->bytes_to_data
+                                                   + (double)nbits * stats->rec_size);
+
+   if (ib->block_flags & RBF_COMPRESSED)
+      ++stats->compressed;
+
+   stats->next_recno += capacity;
+   return 1;
+}
+
+static bool inspect_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   struct chain_stats *stats = (struct chain_stats*)closure;
+
+   if (++stats->blocks > stats->max_blocks
+       || offset_to_ib + (off_t)ib->block_size > stats->file_size)
+   {
+      stats->looped = 1;
+      return 0;
+   }
+
+   stats->bytes += ib->block_size;
+   stats->sizes[ib->block_size ? 63 - __builtin_clzll(ib->block_size) : 0]++;
+
+   if (stats->blocks > 1 && offset_to_ib < stats->extents[stats->blocks - 2].offset)
+   {
+      ++stats->backward;
+      stats->in_order = 0;
+   }
+
+   if (stats->blocks > stats->allocated)
+   {
+      uint64_t allocated = stats->allocated ? stats->allocated * 2 : 1024;
+      EXTENT *extents = (EXTENT*)realloc(stats->extents, allocated * sizeof(EXTENT));
+      if (!extents)
+      {
+         stats->handle->sys_errno = errno;
+         stats->rval = RND_SYSTEM_ERROR;
+         return 0;
+      }
+
+      stats->extents = extents;
+      stats->allocated = allocated;
+   }
+
+   stats->extents[stats->blocks - 1] = (EXTENT){ offset_to_ib, ib->block_size };
+
+   if (stats->table)
+   {
+      if (stats->blocks == 1)
+      {
+         memcpy(&stats->head, ib, sizeof(stats->head));
+         stats->rec_size = flatrecs_full_recsize(&stats->head);
+         stats->next_recno = 1;
+      }
+
+      return inspect_records(stats, ib, offset_to_ib);
+   }
+
+   return 1;
+}
+
+static int compare_extents(const void *left, const void *right)
+{
+   off_t l = ((const EXTENT*)left)->offset, r = ((const EXTENT*)right)->offset;
+   return (l > r) - (l < r);
+}
+
+/**
+ * Prints the gaps between the blocks of a chain, taken in file order.
+ */
+static void print_gaps(struct chain_stats *stats)
+{
+   uint64_t gaps = 0, overlaps = 0, i;
+   off_t total = 0, largest = 0;
+
+   if (!stats->in_order)
+      qsort(stats->extents, stats->blocks, sizeof(EXTENT), compare_extents);
+
+   for (i = 1; i < stats->blocks; ++i)
+   {
+      off_t gap = stats->extents[i].offset - (stats->extents[i - 1].offset + stats->extents[i - 1].size);
+      if (gap < 0)
+         ++overlaps;
+      else if (gap > 0)
+      {
+         ++gaps;
+         total += gap;
+         if (gap > largest)
+            largest = gap;
+      }
+   }
+
+   printf("  file order   %lu gaps, ", (unsigned long)gaps);
+   print_size((double)total);
+   printf(" in all, largest ");
+   print_size((double)largest);
+   printf("; %lu links lead backward\n", (unsigned long)stats->backward);
+
+   if (overlaps)
+      printf("  BROKEN       %lu blocks overlap the block before them\n", (unsigned long)overlaps);
+}
+
+static void print_table(struct chain_stats *stats)
+{
+   // The last block was counted as if reached by walking, but it is found
+   // from the hint, which a table of only its head doesn't have:
+   stats->random_bytes -= (double)stats->last_live * stats->last_walked * sizeof(INFO_BLOCK);
+   if (stats->blocks == 1)
+      stats->random_bytes -= (double)stats->last_live * sizeof(INFO_BLOCK);
+
+   printf("  records      %u of %u bytes, ", stats->head.thead.last_recno, stats->head.thead.rec_size);
+   printf("%u to %u per block, mean %.1f, %.1f%% of capacity\n",
+          stats->min_per_block, stats->max_per_block,
+          stats->blocks ? (double)stats->assigned / stats->blocks : 0.0,
+          stats->capacity ? 100.0 * stats->assigned / stats->capacity : 0.0);
+
+   printf("  live         %lu live, %lu deleted",
+          (unsigned long)stats->live, (unsigned long)(stats->assigned - stats->live));
+   if (stats->assigned)
+      printf(" (%.1f%% live)", 100.0 * stats->live / stats->assigned);
+   if (stats->compressed)
+      printf(", %lu blocks compressed", (unsigned long)stats->compressed);
+   printf("\n");
+
+   if (stats->live && stats->rec_size)
+   {
+      double wanted = (double)stats->live * stats->rec_size;
+      printf("  read amp.    random %.2fx, sequential %.2fx\n",
+             stats->random_bytes / wanted, stats->scan_bytes / wanted);
+   }
+}
+
+/**
+ * Walks one chain and prints what it found.
+ *
+ * @return 0 if the chain could be walked to its end
+ */
+static int inspect_chain(RNDH *handle, off_t file_size, const char *name, off_t head, bool table)
+{
+   struct chain_stats stats;
+   RND_ERROR rval;
+   int i;
+
+   memset(&stats, 0, sizeof(stats));
+   stats.handle = handle;
+   stats.file_size = file_size;
+   stats.max_blocks = (uint64_t)file_size / handle->head_file.fhead.chunk_size + 1;
+   stats.table = table;
+   stats.in_order = 1;
+
+   if (!(rval = chains_walk(handle, head, inspect_viewer, &stats)))
+      rval = stats.rval;
+
+   printf("\n%s at %ld\n", name, (long)head);
+
+   if (rval || stats.looped)
+   {
+      if (rval)
+         printf("  BROKEN       walking the chain failed (%s)\n", rnd_strerror(rval, handle));
+      else
+         printf("  BROKEN       block %lu of the chain is past the end of the file, or the chain loops\n",
+                (unsigned long)stats.blocks);
+
+      free(stats.extents);
+      free(stats.buffer);
+      return 1;
+   }
+
+   printf("  chain        %lu blocks, ", (unsigned long)stats.blocks);
+   print_size((double)stats.bytes);
+   printf("\n  block sizes  ");
+   const char *separator = "";
+   for (i = 0; i < SIZE_CLASSES; ++i)
+   {
+      if (stats.sizes[i])
+      {
+         printf("%s%lu of ", separator, (unsigned long)stats.sizes[i]);
+         print_size((double)(UINT64_C(1) << i));
+         separator = ", ";
+      }
+   }
+   printf("\n");
+
+   print_gaps(&stats);
+
+   if (table)
+      print_table(&stats);
+
+   free(stats.extents);
+   free(stats.buffer);
+   return 0;
+}
+
+int main(int argc, const char **argv)
+{
+   RNDH handle;
+   RND_ERROR err;
+   struct stat st;
+
+   if (argc != 2)
+   {
+      fprintf(stderr, "Usage: %s database\n", argv[0]);
+      return 2;
+   }
+
+   if (stat(argv[1], &st))
+   {
+      fprintf(stderr, "Can't find %s (%s).\n", argv[1], strerror(errno));
+      return 1;
+   }
+
+   rnd_init(&handle);
+   if ((err = rnd_open_raw(&handle, argv[1], 0, RND_READONLY)))
+   {
+      fprintf(stderr, "Can't open %s (%s).\n", argv[1], rnd_strerror(err, &handle));
+      return 1;
+   }
+
+   const INFO_FILE *fhead = &handle.head_file.fhead;
+
+   printf("%s: ", argv[1]);
+   print_size((double)st.st_size);
+   printf(" in chunks of %u bytes, generation %lu\n", fhead->chunk_size, (unsigned long)fhead->generation);
+
+   int broken = inspect_chain(&handle, st.st_size, "table", 0, 1);
+
+   if (fhead->index_head)
+      broken |= inspect_chain(&handle, st.st_size, "key index", fhead->index_head, 0);
+   if (fhead->relation_head)
+      broken |= inspect_chain(&handle, st.st_size, "relationships", fhead->relation_head, 0);
+   if (fhead->snapshot_head)
+      broken |= inspect_chain(&handle, st.st_size, "snapshot log", fhead->snapshot_head, 0);
+   if (fhead->changes_head)
+      broken |= inspect_chain(&handle, st.st_size, "change log", fhead->changes_head, 0);
+
+   rnd_close_raw(&handle);
+   return broken;
+}
@@ -0,0 +1,105 @@
+/** @file
+ *
+ * Command-line wrapper of `rnd_bulk_load`: builds a recnodb file from a
+ * stream of fixed-length binary records.
+ *
+ *    rnd_load [-n count_hint] database rec_size [input]
+ *
+ * Records are read from *input*, or from stdin without it, *rec_size*
+ * bytes apart.  Any existing *database* is replaced.
+ */
+
+#include "recnodb.h"
+#include "extra.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct load_source {
+   FILE     *input;
+   uint32_t rec_size;
+   int      read_errno;   // errno of a failed read, 0 if none
+   size_t   leftover;     // bytes of an incomplete last record
+};
+
+uint32_t read_records(void *records, uint32_t room, void *closure)
+{
+   struct load_source *source = (struct load_source*)closure;
+   size_t want = (size_t)room * source->rec_size;
+   size_t got = fread(records, 1, want, source->input);
+
+   if (got < want)
+   {
+      if (ferror(source->input))
+         source->read_errno = errno ? errno : EIO;
+      if (got % source->rec_size)
+         source->leftover = got % source->rec_size;
+   }
+
+   return (uint32_t)(got / source->rec_size);
+}
+
+static void usage(const char *name)
+{
+   fprintf(stderr, "Usage: %s [-n count_hint] database rec_size [input]\n", name);
+}
+
+int main(int argc, const char **argv)
+{
+   struct load_source source = { stdin };
+   uint64_t count_hint = 0;
+   int arg = 1;
+
+   if (arg + 1 < argc && strcmp(argv[arg], "-n") == 0)
+   {
+      count_hint = strtoull(argv[arg + 1], NULL, 10);
+      arg += 2;
+   }
+
+   if (argc - arg < 2 || argc - arg > 3)
+   {
+      usage(argv[0]);
+      return 2;
+   }
+
+   const char *database = argv[arg];
+   long rec_size = strtol(argv[arg + 1], NULL, 10);
+   if (rec_size <= 0)
+   {
+      fprintf(stderr, "The record size must be a positive number of bytes.\n");
+      return 2;
+   }
+   source.rec_size = (uint32_t)rec_size;
+
+   if (argc - arg == 3 && !(source.input = fopen(argv[arg + 2], "rb")))
+   {
+      fprintf(stderr, "Can't open %s (%s).\n", argv[arg + 2], strerror(errno));
+      return 1;
+   }
+
+   RND_RECNO loaded;
+   RND_ERROR err = rnd_bulk_load(database, source.rec_size, count_hint, read_records, &source, &loaded);
+
+   if (source.input != stdin)
+      fclose(source.input);
+
+   if (err)
+   {
+      fprintf(stderr, "Loading %s failed (%s).\n", database, rnd_strerror(err, NULL));
+      return 1;
+   }
+   else if (source.read_errno)
+   {
+      fprintf(stderr, "Reading the records failed (%s), %u loaded.\n", strerror(source.read_errno), loaded);
+      return 1;
+   }
+   else if (source.leftover)
+   {
+      fprintf(stderr, "Ignored %lu bytes of an incomplete last record.\n", (unsigned long)source.leftover);
+   }
+
+   printf("Loaded %u records into %s.\n", loaded, database);
+   return 0;
+}
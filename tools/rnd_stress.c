@@ -0,0 +1,651 @@
+/** @file
+ *
+ * Stress and scaling harness for concurrent appends: forks writers that
+ * append, update and read the same file at once, checks the file they
+ * leave, and reports how throughput changes as writers are added.
+ *
+ *    rnd_stress [-p processes] [-t threads] [-n appends] [-r rec_size] [-l] database
+ *
+ * Each round starts a new *database* and forks 1, 2, 4, ... up to
+ * *processes* processes, each running *threads* threads with handles of
+ * their own.  Every writer appends *appends* records stamped with who
+ * wrote them, writes each record's number into it with `rnd_update_field`,
+ * and reads back an earlier record, which must be whole unless deleted.
+ * Every REPLACE_EVERY appends it also replaces one of its own earlier
+ * records, and every DELETE_EVERY appends it deletes one, reading each
+ * back to see the change took.
+ *
+ * After each round, every live record must carry a stamp no other record
+ * carries, and the record number each writer was given must be the one it
+ * wrote into the record.  The records that aren't live must be the ones
+ * the writers deleted, so every stamp not deleted is found, and
+ * `rnd_count` must count the rest.  The table's chain must reach every
+ * record, each block starting with the record number that follows the
+ * last one of the block before it.  The exit status is 1 if any round
+ * fails these checks.
+ *
+ * With -l, the first process of each round times its operations and
+ * its latencies are printed under the round, see `rnd_latency_print`.
+ */
+
+#include "recnodb.h"
+#include "extra.h"
+#include "blocks.h"
+#include "chains.h"
+#include "flatrecs.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STAMP_MAGIC 0x53545253   // "STRS"
+
+#define REPLACE_EVERY 8    // appends per replacement of an earlier record
+#define DELETE_EVERY  16   // appends per deletion of an earlier record
+
+/** What a writer puts at the start of each record it appends. */
+struct stamp {
+   uint32_t magic;
+   uint32_t process;
+   uint32_t thread;
+   uint32_t seq;
+   uint32_t recno;    // 0 until the writer updates the record with its number
+   uint32_t version;  // times the writer has replaced the record
+};
+
+struct stress_plan {
+   const char *database;
+   uint32_t   processes;   // in this round
+   uint32_t   threads;     // per process
+   uint32_t   appends;     // per writer
+   uint32_t   rec_size;
+};
+
+struct stress_writer {
+   const struct stress_plan *plan;
+   uint64_t  retries;    // times a lock was busy
+   uint32_t  process;
+   uint32_t  thread;
+   uint32_t  failures;   // operations that failed or read a broken record
+   uint32_t  deletes;    // records the writer deleted
+};
+
+/** What each process of a round reports to the round through a pipe. */
+struct process_report {
+   uint64_t retries;
+   uint64_t deletes;
+};
+
+/**
+ * Repeats an operation while another writer holds the lock it needs,
+ * since `rnd_lock_area` doesn't wait, counting each retry.
+ */
+#define RETRY_BUSY(writer, rval, operation)        \
+   while (((rval) = (operation)) == RND_LOCK_FAILED) \
+   {                                               \
+      ++(writer)->retries;                         \
+      sched_yield();                               \
+   }
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks a record read back while others write: it must be stamped, by a
+ * writer of the round, and hold its own number once it has been updated.
+ */
+static bool stamp_is_whole(const struct stamp *stamp, const struct stress_plan *plan, RND_RECNO recno)
+{
+   return stamp->magic == STAMP_MAGIC
+      && stamp->process < plan->processes
+      && stamp->thread < plan->threads
+      && stamp->seq < plan->appends
+      && (stamp->recno == 0 || stamp->recno == recno);
+}
+
+/**
+ * Replaces or deletes one of the writer's earlier records, picked at
+ * random, and reads it back to confirm the change.  Only its writer
+ * changes a record after it is appended, so what it reads back must be
+ * exactly what it wrote.
+ *
+ * @param mine     the record number of each of the writer's appends so
+ *                 far, 0 for those it deleted
+ * @param appended number of entries in *mine*
+ */
+static void change_earlier(struct stress_writer *writer,
+                           RNDH *handle,
+                           RND_RECNO *mine,
+                           uint32_t appended,
+                           bool deleting,
+                           unsigned *seed)
+{
+   const struct stress_plan *plan = writer->plan;
+   char record[plan->rec_size], readback[plan->rec_size];
+   struct stamp *stamp = (struct stamp*)record;
+   RND_DATA data = { readback, plan->rec_size };
+   uint32_t seq = (uint32_t)(rand_r(seed) % appended);
+   RND_RECNO recno = mine[seq];
+   RND_ERROR rval;
+
+   if (!recno)
+      return;
+
+   if (deleting)
+   {
+      RETRY_BUSY(writer, rval, rnd_delete(handle, recno));
+      if (!rval)
+      {
+         mine[seq] = 0;
+         ++writer->deletes;
+         RETRY_BUSY(writer, rval, rnd_get(handle, recno, &data));
+      }
+
+      if (rval != RND_EXTINCT_RECORD)
+         ++writer->failures;
+      return;
+   }
+
+   RETRY_BUSY(writer, rval, rnd_get(handle, recno, &data));
+   if (rval || !stamp_is_whole((struct stamp*)readback, plan, recno))
+   {
+      ++writer->failures;
+      return;
+   }
+
+   memcpy(record, readback, sizeof(record));
+   ++stamp->version;
+   memset(record + sizeof(struct stamp), (int)stamp->version, sizeof(record) - sizeof(struct stamp));
+
+   RND_DATA replacement = { record, plan->rec_size };
+   RETRY_BUSY(writer, rval, rnd_put(handle, &recno, &replacement));
+   if (!rval)
+      RETRY_BUSY(writer, rval, rnd_get(handle, recno, &data));
+
+   if (rval || recno != mine[seq] || memcmp(readback, record, sizeof(record)))
+      ++writer->failures;
+}
+
+static void *run_writer(void *arg)
+{
+   struct stress_writer *writer = (struct stress_writer*)arg;
+   const struct stress_plan *plan = writer->plan;
+   char record[plan->rec_size], readback[plan->rec_size];
+   struct stamp *stamp = (struct stamp*)record;
+   RND_DATA data = { record, plan->rec_size };
+   unsigned seed = writer->process * 7919 + writer->thread + 1;
+   RND_RECNO *mine = (RND_RECNO*)calloc(plan->appends, sizeof(RND_RECNO));
+   RNDH handle;
+   RND_ERROR rval;
+   uint32_t seq;
+
+   rnd_init(&handle);
+   if (!mine || rnd_open_raw(&handle, plan->database, 0, 0))
+   {
+      writer->failures = plan->appends;
+      free(mine);
+      return NULL;
+   }
+
+   memset(record, 0, sizeof(record));
+   stamp->magic = STAMP_MAGIC;
+   stamp->process = writer->process;
+   stamp->thread = writer->thread;
+
+   for (seq = 0; seq < plan->appends; ++seq)
+   {
+      RND_RECNO recno = 0;
+      stamp->seq = seq;
+      stamp->recno = 0;
+      data.data = record;
+      data.size = plan->rec_size;
+
+      RETRY_BUSY(writer, rval, rnd_put(&handle, &recno, &data));
+      if (!rval)
+         RETRY_BUSY(writer, rval, rnd_update_field(&handle, recno, offsetof(struct stamp, recno),
+                                                   sizeof(uint32_t), &recno));
+      if (rval)
+      {
+         ++writer->failures;
+         continue;
+      }
+
+      mine[seq] = recno;
+
+      // Any record up to ours was appended before ours, so must be whole
+      // unless its writer has deleted it:
+      RND_RECNO earlier = 1 + (RND_RECNO)(rand_r(&seed) % recno);
+      data.data = readback;
+      data.size = plan->rec_size;
+      RETRY_BUSY(writer, rval, rnd_get(&handle, earlier, &data));
+      if (rval == RND_EXTINCT_RECORD)
+         rval = RND_SUCCESS;
+      else if (!rval && !stamp_is_whole((struct stamp*)readback, plan, earlier))
+         rval = RND_INVALID_RECNODB_FILE;
+
+      if (rval)
+         ++writer->failures;
+
+      if ((seq + 1) % REPLACE_EVERY == 0)
+         change_earlier(writer, &handle, mine, seq + 1, 0, &seed);
+
+      if ((seq + 1) % DELETE_EVERY == 0)
+         change_earlier(writer, &handle, mine, seq + 1, 1, &seed);
+   }
+
+   free(mine);
+   rnd_close_raw(&handle);
+   return NULL;
+}
+
+/**
+ * Runs the threads of one process of a round, and writes the number of
+ * times they found a lock busy, and of records they deleted, to
+ * *report_fd*.
+ *
+ * @param latency_fd  where to print latencies, or -1 not to time them
+ *
+ * @return the process's exit status, 0 if every operation succeeded
+ */
+static int run_process(const struct stress_plan *plan, uint32_t process, int report_fd, int latency_fd)
+{
+   struct stress_writer writers[plan->threads];
+   pthread_t threads[plan->threads];
+   struct process_report report = { 0, 0 };
+   uint32_t i, failures = 0;
+
+   if (latency_fd >= 0)
+      rnd_latency_enable(1);
+
+   for (i = 0; i < plan->threads; ++i)
+   {
+      writers[i] = (struct stress_writer){ plan, 0, process, i, 0, 0 };
+      if (pthread_create(&threads[i], NULL, run_writer, &writers[i]))
+         return 1;
+   }
+
+   for (i = 0; i < plan->threads; ++i)
+   {
+      pthread_join(threads[i], NULL);
+      failures += writers[i].failures;
+      report.retries += writers[i].retries;
+      report.deletes += writers[i].deletes;
+   }
+
+   // Smaller than PIPE_BUF, so never mixed with another process's report:
+   if (write(report_fd, &report, sizeof(report)) != sizeof(report))
+      ++failures;
+
+   if (failures)
+      fprintf(stderr, "Process %u had %u failed or broken operations.\n", process, failures);
+
+   if (latency_fd >= 0)
+   {
+      FILE *out = fdopen(latency_fd, "w");
+      if (out)
+      {
+         rnd_latency_print(out);
+         fclose(out);
+      }
+   }
+
+   return failures ? 1 : 0;
+}
+
+struct chain_check {
+   off_t      file_size;
+   off_t      last_block;
+   uint64_t   blocks;
+   uint64_t   max_blocks;   // more than the file could hold means the chain loops
+   uint32_t   rec_size;
+   uint32_t   next_recno;   // first record number the next block should hold
+   uint32_t   last_recno;
+   uint32_t   broken;
+};
+
+static bool check_chain_viewer(INFO_BLOCK *ib, off_t offset_to_ib, void *closure)
+{
+   struct chain_check *check = (struct chain_check*)closure;
+   RND_HEAD_TABLE *htable = (RND_HEAD_TABLE*)ib;
+
+   if (++check->blocks > check->max_blocks
+       || offset_to_ib + (off_t)ib->block_size > check->file_size)
+   {
+      fprintf(stderr, "Block %lu of the chain, at %ld, is past the end of the file.\n",
+              (unsigned long)check->blocks, (long)offset_to_ib);
+      check->broken = 1;
+      return 0;
+   }
+
+   if (check->blocks == 1)
+   {
+      check->rec_size = htable->thead.rec_size;
+      check->last_recno = htable->thead.last_recno;
+      check->next_recno = 1;
+   }
+   else if (ib->block_type != RBT_DATA || ib->first_recno != check->next_recno)
+   {
+      fprintf(stderr, "Block at %ld has type %u and first record %lu, expected %u.\n",
+              (long)offset_to_ib, ib->block_type, (unsigned long)ib->first_recno, check->next_recno);
+      check->broken = 1;
+      return 0;
+   }
+
+   static const RND_HEAD_TABLE table_of_rec_size;
+   RND_HEAD_TABLE sized = table_of_rec_size;
+   sized.thead.rec_size = check->rec_size;
+
+   check->next_recno += flatrecs_get_record_capacity(&sized, ib);
+   check->last_block = offset_to_ib;
+   return 1;
+}
+
+/**
+ * Checks the file a round left: the chain, every live record's stamp,
+ * and that the writers' *deletes* are all the records that aren't live.
+ *
+ * @return 1 if the file is intact
+ */
+static bool check_file(const struct stress_plan *plan, uint64_t deletes)
+{
+   uint32_t writers = plan->processes * plan->threads;
+   uint64_t total = (uint64_t)writers * plan->appends;
+   struct chain_check check = { 0 };
+   struct stat st;
+   RNDH handle;
+   RND_ERROR err;
+   bool intact = 0;
+
+   rnd_init(&handle);
+   if ((err = rnd_open_raw(&handle, plan->database, 0, 0)))
+   {
+      fprintf(stderr, "Can't reopen %s (%s).\n", plan->database, rnd_strerror(err, &handle));
+      return 0;
+   }
+
+   uint8_t *seen = (uint8_t*)calloc(total ? total : 1, 1);
+   char record[plan->rec_size];
+   const struct stamp *stamp = (const struct stamp*)record;
+   RND_RECNO recno, count;
+   uint64_t extinct = 0;
+
+   if (!seen || stat(plan->database, &st))
+      goto abandon_function;
+
+   check.file_size = st.st_size;
+   check.max_blocks = st.st_size / handle.head_file.fhead.chunk_size + 1;
+
+   if ((err = chains_walk(&handle, 0, check_chain_viewer, &check)) || check.broken)
+   {
+      if (err)
+         fprintf(stderr, "Walking the chain failed (%s).\n", rnd_strerror(err, &handle));
+      goto abandon_function;
+   }
+
+   if (check.last_recno != total || check.next_recno <= check.last_recno)
+   {
+      fprintf(stderr, "The table holds %u records and its chain reaches %u, expected %lu.\n",
+              check.last_recno, check.next_recno - 1, (unsigned long)total);
+      goto abandon_function;
+   }
+
+   for (recno = 1; recno <= check.last_recno; ++recno)
+   {
+      RND_DATA data = { record, plan->rec_size };
+      if ((err = rnd_get(&handle, recno, &data)) == RND_EXTINCT_RECORD)
+      {
+         ++extinct;
+         continue;
+      }
+      else if (err)
+      {
+         fprintf(stderr, "Reading record %u failed (%s).\n", recno, rnd_strerror(err, &handle));
+         goto abandon_function;
+      }
+
+      bool whole = stamp_is_whole(stamp, plan, recno);
+      uint64_t index = whole
+         ? ((uint64_t)stamp->process * plan->threads + stamp->thread) * plan->appends + stamp->seq
+         : 0;
+
+      if (!whole || stamp->recno != recno || seen[index])
+      {
+         fprintf(stderr, "Record %u holds append %u of thread %u of process %u, numbered %u%s.\n",
+                 recno, stamp->seq, stamp->thread, stamp->process, stamp->recno,
+                 whole && seen[index] ? ", which another record holds" : "");
+         goto abandon_function;
+      }
+
+      seen[index] = 1;
+   }
+
+   if (extinct != deletes)
+   {
+      fprintf(stderr, "%lu records aren't live, the writers deleted %lu.\n",
+              (unsigned long)extinct, (unsigned long)deletes);
+      goto abandon_function;
+   }
+
+   if ((err = rnd_count(&handle, &count)) || count != total - deletes)
+   {
+      fprintf(stderr, "rnd_count counts %u records, expected %lu (%s).\n",
+              count, (unsigned long)(total - deletes), rnd_strerror(err, &handle));
+      goto abandon_function;
+   }
+
+   // As many records as appends, each live one holding a different one and
+   // the rest deleted by their writers, leave out only the deleted ones.
+   intact = 1;
+
+  abandon_function:
+   free(seen);
+   rnd_close_raw(&handle);
+   return intact;
+}
+
+/**
+ * Runs one round: makes the file, forks the writers, times them and
+ * checks what they left.
+ *
+ * @return 1 if every writer succeeded and the file is intact
+ */
+static bool run_round(const struct stress_plan *plan, bool latency, double *base_rate)
+{
+   pid_t pids[plan->processes];
+   int report_pipe[2], latency_pipe[2] = { -1, -1 };
+   uint32_t i, started = 0;
+   bool passed = 1;
+   RNDH handle;
+   RND_ERROR err;
+
+   unlink(plan->database);
+   rnd_init(&handle);
+   if ((err = rnd_open_raw(&handle, plan->database, plan->rec_size, RND_CREATE)))
+   {
+      fprintf(stderr, "Can't create %s (%s).\n", plan->database, rnd_strerror(err, &handle));
+      return 0;
+   }
+   rnd_close_raw(&handle);
+
+   if (pipe(report_pipe))
+   {
+      fprintf(stderr, "Can't make a pipe (%s).\n", strerror(errno));
+      return 0;
+   }
+
+   if (latency && pipe(latency_pipe))
+      latency = 0;
+
+   // Flushed so that the children don't write our buffered output again:
+   fflush(stdout);
+
+   double start = seconds_now();
+
+   for (i = 0; i < plan->processes; ++i)
+   {
+      if ((pids[i] = fork()) == 0)
+      {
+         close(report_pipe[0]);
+         if (latency_pipe[0] >= 0)
+            close(latency_pipe[0]);
+         _exit(run_process(plan, i, report_pipe[1], i == 0 ? latency_pipe[1] : -1));
+      }
+      else if (pids[i] < 0)
+      {
+         fprintf(stderr, "Can't fork (%s).\n", strerror(errno));
+         passed = 0;
+         break;
+      }
+      ++started;
+   }
+
+   close(report_pipe[1]);
+   if (latency_pipe[1] >= 0)
+      close(latency_pipe[1]);
+
+   for (i = 0; i < started; ++i)
+   {
+      int status;
+      if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+         passed = 0;
+   }
+
+   double elapsed = seconds_now() - start;
+
+   uint64_t retries = 0, deletes = 0;
+   struct process_report report;
+   while (read(report_pipe[0], &report, sizeof(report)) == sizeof(report))
+   {
+      retries += report.retries;
+      deletes += report.deletes;
+   }
+   close(report_pipe[0]);
+
+   double rate = plan->processes * plan->threads * (double)plan->appends / elapsed;
+   if (*base_rate == 0)
+      *base_rate = rate;
+
+   if (passed && !check_file(plan, deletes))
+      passed = 0;
+
+   // Each append is followed by an update and a read, and some by a
+   // replacement or a deletion, each with a read of its own:
+   double ops = 3 + 3.0 / REPLACE_EVERY + 2.0 / DELETE_EVERY;
+   printf("%9u %8u %8u %12.0f %12.0f %8.2fx %14.2f %7s\n",
+          plan->processes, plan->threads, plan->processes * plan->threads,
+          rate, ops * rate, rate / *base_rate,
+          retries / ((double)plan->processes * plan->threads * plan->appends),
+          passed ? "ok" : "FAILED");
+
+   if (latency_pipe[0] >= 0)
+   {
+      char buffer[4096];
+      ssize_t got;
+      while ((got = read(latency_pipe[0], buffer, sizeof(buffer))) > 0)
+         fwrite(buffer, 1, (size_t)got, stdout);
+      close(latency_pipe[0]);
+      printf("\n");
+   }
+
+   return passed;
+}
+
+static void usage(const char *name)
+{
+   fprintf(stderr, "Usage: %s [-p processes] [-t threads] [-n appends] [-r rec_size] [-l] database\n", name);
+}
+
+int main(int argc, const char **argv)
+{
+   struct stress_plan plan = { NULL, 0, 1, 10000, 64 };
+   uint32_t max_processes = 8;
+   bool latency = 0;
+   int arg = 1;
+
+   while (arg < argc && argv[arg][0] == '-')
+   {
+      const char *flag = argv[arg];
+
+      if (strcmp(flag, "-l") == 0)
+      {
+         latency = 1;
+         ++arg;
+         continue;
+      }
+
+      if (arg + 1 >= argc)
+      {
+         usage(argv[0]);
+         return 2;
+      }
+
+      long value = strtol(argv[arg + 1], NULL, 10);
+      if (value <= 0)
+      {
+         fprintf(stderr, "%s needs a positive number.\n", flag);
+         return 2;
+      }
+
+      if (strcmp(flag, "-p") == 0)
+         max_processes = (uint32_t)value;
+      else if (strcmp(flag, "-t") == 0)
+         plan.threads = (uint32_t)value;
+      else if (strcmp(flag, "-n") == 0)
+         plan.appends = (uint32_t)value;
+      else if (strcmp(flag, "-r") == 0)
+         plan.rec_size = (uint32_t)value;
+      else
+      {
+         usage(argv[0]);
+         return 2;
+      }
+
+      arg += 2;
+   }
+
+   if (argc - arg != 1)
+   {
+      usage(argv[0]);
+      return 2;
+   }
+
+   if (plan.rec_size < sizeof(struct stamp))
+   {
+      fprintf(stderr, "Records must have room for a %lu-byte stamp.\n", (unsigned long)sizeof(struct stamp));
+      return 2;
+   }
+
+   plan.database = argv[arg];
+
+   printf("%9s %8s %8s %12s %12s %9s %14s %7s\n",
+          "processes", "threads", "writers", "appends/s", "ops/s", "speedup", "busy/append", "check");
+
+   bool passed = 1;
+   double base_rate = 0;
+
+   for (plan.processes = 1; ; plan.processes *= 2)
+   {
+      if (plan.processes > max_processes)
+         plan.processes = max_processes;
+
+      if (!run_round(&plan, latency, &base_rate))
+         passed = 0;
+
+      if (plan.processes == max_processes)
+         break;
+   }
+
+   return passed ? 0 : 1;
+}